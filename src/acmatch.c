@@ -0,0 +1,195 @@
+/*  acmatch.c
+ *
+ *
+ *  Copyright (C) 2014 toxbot All Rights Reserved.
+ *
+ *  This file is part of toxbot.
+ *
+ *  toxbot is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  toxbot is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with toxbot. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "acmatch.h"
+
+#define AC_NONE UINT16_MAX
+
+/*
+ * The failure links are folded into a dense transition table so that matching costs one
+ * lookup per byte. Bytes are mapped to classes first; every byte that occurs in no pattern
+ * shares class 0, which keeps the table small.
+ */
+struct AC_Matcher {
+    uint8_t classes[256];
+    uint32_t num_classes;
+    uint32_t num_states;
+    uint16_t *delta;       /* num_states * num_classes */
+    uint16_t *match;       /* pattern that ends at each state, or AC_NONE */
+    uint16_t *out_link;    /* nearest state on the failure path that has a match, or 0 */
+};
+
+static uint8_t lower(uint8_t c)
+{
+    return c >= 'A' && c <= 'Z' ? c + ('a' - 'A') : c;
+}
+
+struct AC_Matcher *ac_build(const struct AC_Pattern *patterns, uint16_t num_patterns)
+{
+    struct AC_Matcher *ac = calloc(1, sizeof(struct AC_Matcher));
+
+    if (ac == NULL) {
+        exit(EXIT_FAILURE);
+    }
+
+    size_t max_states = 1;
+    uint16_t i;
+
+    for (i = 0; i < num_patterns; ++i) {
+        size_t j;
+
+        for (j = 0; j < patterns[i].length; ++j) {
+            uint8_t c = lower(patterns[i].text[j]);
+
+            if (ac->classes[c] == 0) {
+                ac->classes[c] = ++ac->num_classes;
+            }
+        }
+
+        max_states += patterns[i].length;
+    }
+
+    ++ac->num_classes;    /* class 0 */
+
+    if (max_states > AC_MAX_STATES) {
+        ac_free(ac);
+        return NULL;
+    }
+
+    /* the upper case letters share the class of their lower case ones */
+    int c;
+
+    for (c = 'A'; c <= 'Z'; ++c) {
+        ac->classes[c] = ac->classes[lower(c)];
+    }
+
+    size_t num_classes = ac->num_classes;
+    ac->delta = calloc(max_states * num_classes, sizeof(uint16_t));
+    ac->match = malloc(max_states * sizeof(uint16_t));
+    ac->out_link = calloc(max_states, sizeof(uint16_t));
+    uint16_t *fail = calloc(max_states, sizeof(uint16_t));
+    uint16_t *queue = malloc(max_states * sizeof(uint16_t));
+
+    if (ac->delta == NULL || ac->match == NULL || ac->out_link == NULL || fail == NULL || queue == NULL) {
+        exit(EXIT_FAILURE);
+    }
+
+    memset(ac->match, 0xff, max_states * sizeof(uint16_t));
+    ac->num_states = 1;
+
+    /* the trie; the root is never a child, so 0 marks a missing edge */
+    for (i = 0; i < num_patterns; ++i) {
+        uint16_t state = 0;
+        size_t j;
+
+        for (j = 0; j < patterns[i].length; ++j) {
+            uint16_t *next = &ac->delta[state * num_classes + ac->classes[(uint8_t) patterns[i].text[j]]];
+
+            if (*next == 0) {
+                *next = ac->num_states++;
+            }
+
+            state = *next;
+        }
+
+        if (ac->match[state] == AC_NONE) {
+            ac->match[state] = i;
+        }
+    }
+
+    /* breadth first, so the failure target of every state is complete before its children */
+    size_t head = 0, tail = 0;
+    queue[tail++] = 0;
+
+    while (head < tail) {
+        uint16_t state = queue[head++];
+        uint16_t *row = &ac->delta[state * num_classes];
+        const uint16_t *fail_row = &ac->delta[fail[state] * num_classes];
+        size_t k;
+
+        for (k = 0; k < num_classes; ++k) {
+            if (row[k] == 0) {
+                row[k] = state == 0 ? 0 : fail_row[k];
+                continue;
+            }
+
+            uint16_t child = row[k];
+            uint16_t child_fail = state == 0 ? 0 : fail_row[k];
+            fail[child] = child_fail;
+            ac->out_link[child] = ac->match[child_fail] != AC_NONE ? child_fail : ac->out_link[child_fail];
+            queue[tail++] = child;
+        }
+    }
+
+    free(fail);
+    free(queue);
+    return ac;
+}
+
+size_t ac_match(const struct AC_Matcher *ac, const uint8_t *text, size_t length, uint16_t *hits, size_t max_hits)
+{
+    size_t num_hits = 0;
+    uint16_t state = 0;
+    size_t i;
+
+    for (i = 0; i < length && num_hits < max_hits; ++i) {
+        state = ac->delta[state * ac->num_classes + ac->classes[text[i]]];
+
+        uint16_t out = ac->match[state] != AC_NONE ? state : ac->out_link[state];
+
+        while (out != 0 && num_hits < max_hits) {
+            uint16_t idx = ac->match[out];
+            size_t j;
+
+            for (j = 0; j < num_hits && hits[j] != idx; ++j);
+
+            if (j == num_hits) {
+                hits[num_hits++] = idx;
+            }
+
+            out = ac->out_link[out];
+        }
+    }
+
+    return num_hits;
+}
+
+uint32_t ac_num_states(const struct AC_Matcher *ac)
+{
+    return ac->num_states;
+}
+
+void ac_free(struct AC_Matcher *ac)
+{
+    if (ac == NULL) {
+        return;
+    }
+
+    free(ac->delta);
+    free(ac->match);
+    free(ac->out_link);
+    free(ac);
+}
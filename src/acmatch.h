@@ -0,0 +1,62 @@
+/*  acmatch.h
+ *
+ *
+ *  Copyright (C) 2014 toxbot All Rights Reserved.
+ *
+ *  This file is part of toxbot.
+ *
+ *  toxbot is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  toxbot is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with toxbot. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef ACMATCH_H
+#define ACMATCH_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define AC_MAX_STATES  UINT16_MAX    /* bounds the total length of all patterns */
+
+/*
+ * An Aho-Corasick automaton over a set of patterns. Matching ignores ASCII case and costs
+ * one table lookup per byte of text, whatever the number of patterns.
+ */
+struct AC_Matcher;
+
+struct AC_Pattern {
+    const char *text;
+    size_t length;
+};
+
+/*
+ * Builds the automaton for patterns. Pattern i is reported as i by ac_match; of several
+ * identical patterns only the first one is reported.
+ *
+ * Returns NULL if the patterns need more than AC_MAX_STATES states.
+ */
+struct AC_Matcher *ac_build(const struct AC_Pattern *patterns, uint16_t num_patterns);
+
+/*
+ * Scans text and puts the index of every distinct pattern found into hits, in the order
+ * they end, stopping once max_hits are found.
+ *
+ * Returns the number of hits.
+ */
+size_t ac_match(const struct AC_Matcher *ac, const uint8_t *text, size_t length, uint16_t *hits, size_t max_hits);
+
+uint32_t ac_num_states(const struct AC_Matcher *ac);
+
+void ac_free(struct AC_Matcher *ac);
+
+#endif /* ACMATCH_H */
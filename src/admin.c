@@ -0,0 +1,456 @@
+/*  admin.c
+ *
+ *
+ *  Copyright (C) 2014 toxbot All Rights Reserved.
+ *
+ *  This file is part of toxbot.
+ *
+ *  toxbot is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  toxbot is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with toxbot. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include <tox/tox.h>
+
+#include "admin.h"
+#include "commands.h"
+#include "reply.h"
+#include "metrics.h"
+#include "misc.h"
+#include "log.h"
+
+struct Admin_Client {
+    int fd;
+    bool closing;    /* peer hung up; close once the output is flushed */
+
+    char in[ADMIN_MAX_REQUEST];
+    size_t in_len;
+    bool discarding;    /* skipping the rest of an overlong request */
+
+    char *out;
+    size_t out_len;
+    size_t out_sent;
+    size_t out_size;
+};
+
+static __thread int Listen_Fd = -1;
+static __thread char Socket_Path[sizeof(((struct sockaddr_un *) 0)->sun_path)];
+static __thread struct Admin_Client *Clients[ADMIN_MAX_CLIENTS];
+
+static int set_nonblocking(int fd)
+{
+    int flags = fcntl(fd, F_GETFL);
+
+    if (flags == -1 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1) {
+        return -1;
+    }
+
+    return fcntl(fd, F_SETFD, FD_CLOEXEC);
+}
+
+/* Returns true if another process is accepting connections on path. */
+static bool socket_in_use(const struct sockaddr_un *addr)
+{
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+
+    if (fd == -1) {
+        return false;
+    }
+
+    bool in_use = connect(fd, (const struct sockaddr *) addr, sizeof(struct sockaddr_un)) == 0;
+    close(fd);
+    return in_use;
+}
+
+int admin_init(const char *path)
+{
+    if (path[0] == '\0') {
+        return 0;
+    }
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        log_write(LOG_LEVEL_ERROR, "Admin socket path is too long: %s\n", path);
+        return -1;
+    }
+
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
+
+    if (socket_in_use(&addr)) {
+        log_write(LOG_LEVEL_ERROR, "Admin socket %s is in use by another process\n", path);
+        return -1;
+    }
+
+    unlink(path);    /* left behind by an unclean exit */
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+
+    if (fd == -1) {
+        log_write(LOG_LEVEL_ERROR, "Failed to create admin socket: %s\n", strerror(errno));
+        return -1;
+    }
+
+    /*
+     * Only the bot's own user may connect; access is controlled by the socket's permissions.
+     * main's umask already withholds write access, which connecting needs, until the chmod.
+     * The umask is process-wide, so shards must not change it here.
+     */
+    int ret = bind(fd, (struct sockaddr *) &addr, sizeof(addr));
+
+    if (ret == -1 || chmod(path, S_IRUSR | S_IWUSR) == -1 || listen(fd, ADMIN_MAX_CLIENTS) == -1
+            || set_nonblocking(fd) == -1) {
+        log_write(LOG_LEVEL_ERROR, "Failed to set up admin socket %s: %s\n", path, strerror(errno));
+        close(fd);
+        unlink(path);
+        return -1;
+    }
+
+    Listen_Fd = fd;
+    snprintf(Socket_Path, sizeof(Socket_Path), "%s", path);
+    log_write(LOG_LEVEL_INFO, "Admin socket listening on %s\n", path);
+    return 0;
+}
+
+static void client_close(int idx)
+{
+    struct Admin_Client *c = Clients[idx];
+
+    close(c->fd);
+    free(c->out);
+    free(c);
+    Clients[idx] = NULL;
+}
+
+static size_t client_pending_output(const struct Admin_Client *c)
+{
+    return c->out_len - c->out_sent;
+}
+
+/* Queues data on c. Returns -1 if the client has let too much output pile up. */
+static int client_queue(struct Admin_Client *c, const char *data, size_t length)
+{
+    if (client_pending_output(c) + length > ADMIN_OUTPUT_MAX) {
+        return -1;
+    }
+
+    /* reclaim the space of output that has already been written */
+    if (c->out_sent > 0) {
+        memmove(c->out, c->out + c->out_sent, c->out_len - c->out_sent);
+        c->out_len -= c->out_sent;
+        c->out_sent = 0;
+    }
+
+    if (c->out_len + length > c->out_size) {
+        size_t size = MAX(c->out_len + length, c->out_size * 2);
+        char *tmp = realloc(c->out, size);
+
+        if (tmp == NULL) {
+            exit(EXIT_FAILURE);
+        }
+
+        c->out = tmp;
+        c->out_size = size;
+    }
+
+    memcpy(c->out + c->out_len, data, length);
+    c->out_len += length;
+    return 0;
+}
+
+static int client_send_frame(struct Admin_Client *c, const char *status, const char *body, size_t length)
+{
+    char header[64];
+    int header_len = snprintf(header, sizeof(header), "%s %zu\n", status, length);
+
+    if (client_queue(c, header, header_len) == -1 || client_queue(c, body, length) == -1) {
+        return -1;
+    }
+
+    return client_queue(c, "\n", 1);
+}
+
+/* Writes as much pending output as the socket takes. Returns -1 if the connection is dead. */
+static int client_flush(struct Admin_Client *c)
+{
+    while (client_pending_output(c) > 0) {
+        /* a client that hung up must not take the bot down with SIGPIPE; EPIPE closes it instead */
+        ssize_t ret = send(c->fd, c->out + c->out_sent, client_pending_output(c), MSG_NOSIGNAL);
+
+        if (ret == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+        }
+
+        c->out_sent += ret;
+    }
+
+    c->out_sent = 0;
+    c->out_len = 0;
+    return 0;
+}
+
+static int client_run_request(Tox *m, struct Admin_Client *c, char *line, size_t length)
+{
+    while (length > 0 && (line[length - 1] == '\r' || line[length - 1] == ' ')) {
+        --length;
+    }
+
+    if (length == 0) {
+        return 0;
+    }
+
+    line[length] = '\0';
+    metrics_inc(METRIC_ADMIN_REQUESTS);
+
+    struct Reply_Sink sink;
+    int ret = execute_into_sink(m, ADMIN_FRIENDNUM, line, length, &sink);
+    ret = client_send_frame(c, ret == -1 ? "error" : "ok", sink.buf ? sink.buf : "", sink.len);
+    reply_sink_free(&sink);
+
+    return ret;
+}
+
+/*
+ * Runs the complete request lines in c's input buffer, up to ADMIN_MAX_REQUESTS_PER_RUN.
+ * Returns -1 if the client must be disconnected.
+ */
+static int client_process_input(Tox *m, struct Admin_Client *c)
+{
+    size_t start = 0;
+    int num_run = 0;
+
+    while (num_run < ADMIN_MAX_REQUESTS_PER_RUN && client_pending_output(c) < ADMIN_OUTPUT_HIGH_WATER) {
+        char *nl = memchr(c->in + start, '\n', c->in_len - start);
+
+        if (nl == NULL) {
+            break;
+        }
+
+        size_t length = nl - (c->in + start);
+
+        if (c->discarding) {
+            c->discarding = false;
+        } else if (client_run_request(m, c, c->in + start, length) == -1) {
+            return -1;
+        }
+
+        start += length + 1;
+        ++num_run;
+    }
+
+    memmove(c->in, c->in + start, c->in_len - start);
+    c->in_len -= start;
+
+    /* a full buffer without a newline can never become a valid request */
+    if (c->in_len == sizeof(c->in)) {
+        const char *msg = "Error: Request too long";
+
+        if (!c->discarding && client_send_frame(c, "error", msg, strlen(msg)) == -1) {
+            return -1;
+        }
+
+        c->discarding = true;
+        c->in_len = 0;
+    }
+
+    return 0;
+}
+
+/* Returns true if c has a complete request buffered that it has room to answer. */
+static bool client_has_backlog(const struct Admin_Client *c)
+{
+    return client_pending_output(c) < ADMIN_OUTPUT_HIGH_WATER && memchr(c->in, '\n', c->in_len) != NULL;
+}
+
+/* Reads what the socket has into c's input buffer. Returns -1 if the connection is dead. */
+static int client_read(struct Admin_Client *c)
+{
+    while (c->in_len < sizeof(c->in)) {
+        ssize_t ret = read(c->fd, c->in + c->in_len, sizeof(c->in) - c->in_len);
+
+        if (ret == 0) {
+            c->closing = true;
+            return 0;
+        }
+
+        if (ret == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+        }
+
+        c->in_len += ret;
+    }
+
+    return 0;
+}
+
+static void accept_clients(void)
+{
+    while (true) {
+        int fd = accept(Listen_Fd, NULL, NULL);
+
+        if (fd == -1) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                log_write(LOG_LEVEL_WARNING, "Admin socket accept failed: %s\n", strerror(errno));
+            }
+
+            return;
+        }
+
+        int i;
+
+        for (i = 0; i < ADMIN_MAX_CLIENTS; ++i) {
+            if (Clients[i] == NULL) {
+                break;
+            }
+        }
+
+        if (i == ADMIN_MAX_CLIENTS || set_nonblocking(fd) == -1) {
+            close(fd);
+            continue;
+        }
+
+        struct Admin_Client *c = calloc(1, sizeof(struct Admin_Client));
+
+        if (c == NULL) {
+            exit(EXIT_FAILURE);
+        }
+
+        c->fd = fd;
+        Clients[i] = c;
+    }
+}
+
+void admin_wait(Tox *m, int timeout_ms)
+{
+    if (Listen_Fd == -1) {
+        usleep(timeout_ms * 1000);
+        return;
+    }
+
+    struct pollfd fds[ADMIN_MAX_CLIENTS + 1];
+    int owner[ADMIN_MAX_CLIENTS + 1];
+    int num_fds = 0;
+    int i;
+
+    fds[num_fds].fd = Listen_Fd;
+    fds[num_fds].events = POLLIN;
+    owner[num_fds++] = -1;
+
+    for (i = 0; i < ADMIN_MAX_CLIENTS; ++i) {
+        struct Admin_Client *c = Clients[i];
+
+        if (c == NULL) {
+            continue;
+        }
+
+        /* requests left over from the last run are served without waiting */
+        if (client_has_backlog(c)) {
+            timeout_ms = 0;
+        }
+
+        fds[num_fds].fd = c->fd;
+        fds[num_fds].events = 0;
+
+        if (!c->closing && client_pending_output(c) < ADMIN_OUTPUT_HIGH_WATER) {
+            fds[num_fds].events |= POLLIN;
+        }
+
+        if (client_pending_output(c) > 0) {
+            fds[num_fds].events |= POLLOUT;
+        }
+
+        owner[num_fds++] = i;
+    }
+
+    if (poll(fds, num_fds, timeout_ms) == -1 && errno != EINTR) {
+        log_write(LOG_LEVEL_WARNING, "Admin socket poll failed: %s\n", strerror(errno));
+        return;
+    }
+
+    for (i = 1; i < num_fds; ++i) {
+        struct Admin_Client *c = Clients[owner[i]];
+
+        if ((fds[i].revents & POLLIN) && client_read(c) == -1) {
+            client_close(owner[i]);
+            continue;
+        }
+
+        if ((fds[i].revents & (POLLERR | POLLNVAL))
+                || client_process_input(m, c) == -1 || client_flush(c) == -1) {
+            client_close(owner[i]);
+            continue;
+        }
+
+        if ((c->closing || (fds[i].revents & POLLHUP)) && client_pending_output(c) == 0
+                && !client_has_backlog(c)) {
+            client_close(owner[i]);
+        }
+    }
+
+    if (fds[0].revents & POLLIN) {
+        accept_clients();
+    }
+}
+
+void admin_async_reply(const char *message, size_t length)
+{
+    int i;
+
+    for (i = 0; i < ADMIN_MAX_CLIENTS; ++i) {
+        if (Clients[i] != NULL && client_send_frame(Clients[i], "async", message, length) == -1) {
+            client_close(i);
+        }
+    }
+}
+
+void admin_free(void)
+{
+    int i;
+
+    for (i = 0; i < ADMIN_MAX_CLIENTS; ++i) {
+        if (Clients[i] != NULL) {
+            client_flush(Clients[i]);
+            client_close(i);
+        }
+    }
+
+    if (Listen_Fd != -1) {
+        close(Listen_Fd);
+        unlink(Socket_Path);
+        Listen_Fd = -1;
+    }
+}
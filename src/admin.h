@@ -0,0 +1,67 @@
+/*  admin.h
+ *
+ *
+ *  Copyright (C) 2014 toxbot All Rights Reserved.
+ *
+ *  This file is part of toxbot.
+ *
+ *  toxbot is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  toxbot is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with toxbot. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef ADMIN_H
+#define ADMIN_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <tox/tox.h>
+
+/* friend number that commands from the admin socket run as; it counts as a master */
+#define ADMIN_FRIENDNUM UINT32_MAX
+
+#define ADMIN_MAX_CLIENTS          16
+#define ADMIN_MAX_REQUEST          8192     /* longest request line, including the newline */
+#define ADMIN_MAX_REQUESTS_PER_RUN 32       /* per client, before the loop goes back to tox_iterate() */
+#define ADMIN_OUTPUT_HIGH_WATER    (256 * 1024)     /* stop reading requests from a client above this */
+#define ADMIN_OUTPUT_MAX           (1024 * 1024)    /* disconnect a client that lets this much pile up */
+
+/*
+ * Listens for admin connections on the unix socket at path, which is created with mode 0600.
+ * An empty path disables the socket.
+ *
+ * Returns 0 on success.
+ * Returns -1 on failure, in which case the bot runs without the socket.
+ */
+int admin_init(const char *path);
+
+/*
+ * Waits up to timeout_ms for admin socket activity, serving any requests that arrive, and
+ * returns. Call once per loop iteration in place of sleeping.
+ *
+ * Every request is one line holding the same commands a master can send as a message.
+ * Responses are sent in request order, each as a header line "<ok|error> <length>"
+ * followed by length bytes of reply text and a newline.
+ */
+void admin_wait(Tox *m, int timeout_ms);
+
+/*
+ * Sends a reply that arrived after its command returned (e.g. a history query finishing on
+ * a worker) to every admin client, framed like a response with the status "async".
+ */
+void admin_async_reply(const char *message, size_t length);
+
+/* Disconnects every client and removes the socket. */
+void admin_free(void);
+
+#endif /* ADMIN_H */
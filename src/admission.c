@@ -0,0 +1,310 @@
+/*  admission.c
+ *
+ *
+ *  Copyright (C) 2014 toxbot All Rights Reserved.
+ *
+ *  This file is part of toxbot.
+ *
+ *  toxbot is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  toxbot is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with toxbot. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+
+#include <tox/tox.h>
+
+#include "admission.h"
+#include "toxbot.h"
+#include "keylist.h"
+#include "metrics.h"
+#include "ratelimit.h"
+#include "friends.h"
+#include "misc.h"
+#include "log.h"
+
+#define PENDING_HASH_SIZE (FRIEND_REQUEST_MAX_PENDING * 2)    /* must be a power of two */
+#define PENDING_HASH_EMPTY UINT16_MAX
+#define MAX_RULE_LENGTH 256
+
+extern struct Key_List Blocked_Keys;
+
+typedef enum {
+    RULE_DENY,
+    RULE_REQUIRE,
+} Rule_Type;
+
+struct Request_Rule {
+    Rule_Type type;
+    char text[MAX_RULE_LENGTH];
+};
+
+static struct Request_Rule *Rules;
+static int Num_Rules;
+static int Num_Require_Rules;
+
+/* Pending requests live in a ring; a hash of ring indices keyed by public key finds duplicates. */
+struct Admission_Queue {
+    uint8_t keys[FRIEND_REQUEST_MAX_PENDING][TOX_PUBLIC_KEY_SIZE];
+    uint16_t head;
+    uint16_t count;
+    uint16_t hash[PENDING_HASH_SIZE];
+
+    uint64_t last_refill;    /* milliseconds */
+    uint32_t tokens;         /* thousandths of an accept */
+    bool initialized;
+};
+
+static __thread struct Admission_Queue Queue;
+
+int admission_load_rules(const char *path)
+{
+    FILE *fp = fopen(path, "r");
+
+    if (fp == NULL) {
+        return 0;
+    }
+
+    char line[MAX_RULE_LENGTH + 16];
+
+    while (fgets(line, sizeof(line), fp)) {
+        size_t len = strlen(line);
+
+        while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r')) {
+            line[--len] = '\0';
+        }
+
+        if (len == 0 || line[0] == '#') {
+            continue;
+        }
+
+        struct Request_Rule rule;
+        const char *text;
+
+        if (strncmp(line, "deny ", 5) == 0) {
+            rule.type = RULE_DENY;
+            text = line + 5;
+        } else if (strncmp(line, "require ", 8) == 0) {
+            rule.type = RULE_REQUIRE;
+            text = line + 8;
+        } else {
+            log_write(LOG_LEVEL_WARNING, "Warning: ignoring invalid rule in '%s': %s", path, line);
+            continue;
+        }
+
+        if (*text == '\0') {
+            continue;
+        }
+
+        snprintf(rule.text, sizeof(rule.text), "%s", text);
+
+        struct Request_Rule *tmp = realloc(Rules, (Num_Rules + 1) * sizeof(struct Request_Rule));
+
+        if (tmp == NULL) {
+            exit(EXIT_FAILURE);
+        }
+
+        Rules = tmp;
+        Rules[Num_Rules++] = rule;
+
+        if (rule.type == RULE_REQUIRE) {
+            ++Num_Require_Rules;
+        }
+    }
+
+    fclose(fp);
+    return Num_Rules;
+}
+
+void admission_free_rules(void)
+{
+    free(Rules);
+    Rules = NULL;
+    Num_Rules = 0;
+    Num_Require_Rules = 0;
+}
+
+/* Returns true if the request message passes the rules. */
+static bool request_passes_rules(const uint8_t *data, size_t length)
+{
+    if (Num_Rules == 0) {
+        return true;
+    }
+
+    char message[TOX_MAX_FRIEND_REQUEST_DATA_SIZE + 1];
+    copy_tox_str(message, sizeof(message), (const char *) data, MIN(length, TOX_MAX_FRIEND_REQUEST_DATA_SIZE));
+
+    bool required_found = false;
+    int i;
+
+    for (i = 0; i < Num_Rules; ++i) {
+        bool found = strstr(message, Rules[i].text) != NULL;
+
+        if (Rules[i].type == RULE_DENY && found) {
+            return false;
+        }
+
+        if (Rules[i].type == RULE_REQUIRE && found) {
+            required_found = true;
+        }
+    }
+
+    return Num_Require_Rules == 0 || required_found;
+}
+
+static uint32_t key_hash(const uint8_t *public_key)
+{
+    /* public keys are uniformly random, so any four bytes make a good hash */
+    return unpack_u32(public_key) & (PENDING_HASH_SIZE - 1);
+}
+
+static void queue_init_once(void)
+{
+    if (Queue.initialized) {
+        return;
+    }
+
+    memset(Queue.hash, 0xff, sizeof(Queue.hash));
+    Queue.tokens = FRIEND_ACCEPT_BURST * 1000;
+    Queue.initialized = true;
+}
+
+/* Returns the hash slot holding public_key, or the empty slot where it would go. */
+static uint32_t hash_find(const uint8_t *public_key)
+{
+    uint32_t slot = key_hash(public_key);
+
+    while (Queue.hash[slot] != PENDING_HASH_EMPTY
+            && memcmp(Queue.keys[Queue.hash[slot]], public_key, TOX_PUBLIC_KEY_SIZE) != 0) {
+        slot = (slot + 1) & (PENDING_HASH_SIZE - 1);
+    }
+
+    return slot;
+}
+
+/* Removes the entry in slot, shifting back later entries of the same probe run. */
+static void hash_remove(uint32_t slot)
+{
+    uint32_t next = slot;
+
+    for (;;) {
+        next = (next + 1) & (PENDING_HASH_SIZE - 1);
+
+        if (Queue.hash[next] == PENDING_HASH_EMPTY) {
+            break;
+        }
+
+        uint32_t home = key_hash(Queue.keys[Queue.hash[next]]);
+
+        /* move the entry back if its home slot is not cyclically in (slot, next] */
+        if (((next - home) & (PENDING_HASH_SIZE - 1)) >= ((next - slot) & (PENDING_HASH_SIZE - 1))) {
+            Queue.hash[slot] = Queue.hash[next];
+            slot = next;
+        }
+    }
+
+    Queue.hash[slot] = PENDING_HASH_EMPTY;
+}
+
+void admission_enqueue(Tox *m, const uint8_t *public_key, const uint8_t *data, size_t length)
+{
+    queue_init_once();
+
+    if (keylist_contains(&Blocked_Keys, public_key) || !request_passes_rules(data, length)) {
+        metrics_inc(METRIC_FRIEND_REQUESTS_REJECTED);
+        return;
+    }
+
+    TOX_ERR_FRIEND_BY_PUBLIC_KEY err;
+    tox_friend_by_public_key(m, public_key, &err);
+
+    if (err == TOX_ERR_FRIEND_BY_PUBLIC_KEY_OK) {
+        metrics_inc(METRIC_FRIEND_REQUESTS_REJECTED);
+        return;
+    }
+
+    uint32_t slot = hash_find(public_key);
+
+    if (Queue.hash[slot] != PENDING_HASH_EMPTY || Queue.count == FRIEND_REQUEST_MAX_PENDING) {
+        metrics_inc(METRIC_FRIEND_REQUESTS_DROPPED);
+        return;
+    }
+
+    uint16_t idx = (Queue.head + Queue.count) % FRIEND_REQUEST_MAX_PENDING;
+    memcpy(Queue.keys[idx], public_key, TOX_PUBLIC_KEY_SIZE);
+    Queue.hash[slot] = idx;
+    ++Queue.count;
+
+    metrics_inc(METRIC_FRIEND_REQUEST_QUEUE_DEPTH);
+}
+
+static uint64_t get_time_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+void admission_process(Tox *m)
+{
+    if (Queue.count == 0) {
+        return;
+    }
+
+    uint64_t now = get_time_ms();
+
+    if (Queue.last_refill != 0) {
+        uint64_t refill = (now - Queue.last_refill) * FRIEND_ACCEPT_RATE;
+        Queue.tokens = (uint32_t) MIN((uint64_t) Queue.tokens + refill, FRIEND_ACCEPT_BURST * 1000);
+    }
+
+    Queue.last_refill = now;
+
+    int batch = 0;
+
+    while (Queue.count > 0 && Queue.tokens >= 1000 && batch < FRIEND_ACCEPT_MAX_BATCH) {
+        const uint8_t *public_key = Queue.keys[Queue.head];
+
+        hash_remove(hash_find(public_key));
+        Queue.head = (Queue.head + 1) % FRIEND_REQUEST_MAX_PENDING;
+        --Queue.count;
+        ++batch;
+        metrics_add(METRIC_FRIEND_REQUEST_QUEUE_DEPTH, (uint64_t) -1);
+
+        /* the key may have been blocked while it waited */
+        if (keylist_contains(&Blocked_Keys, public_key)) {
+            metrics_inc(METRIC_FRIEND_REQUESTS_REJECTED);
+            continue;
+        }
+
+        Queue.tokens -= 1000;
+
+        TOX_ERR_FRIEND_ADD err;
+        uint32_t friendnumber = tox_friend_add_norequest(m, public_key, &err);
+
+        if (err != TOX_ERR_FRIEND_ADD_OK) {
+            log_write(LOG_LEVEL_WARNING, "tox_friend_add_norequest failed (error %d)", err);
+            metrics_inc(METRIC_FRIEND_REQUESTS_REJECTED);
+            continue;
+        }
+
+        rate_limit_reset(friendnumber);
+        friends_add(m, friendnumber);
+        metrics_inc(METRIC_FRIENDS_ADDED);
+    }
+}
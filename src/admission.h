@@ -0,0 +1,59 @@
+/*  admission.h
+ *
+ *
+ *  Copyright (C) 2014 toxbot All Rights Reserved.
+ *
+ *  This file is part of toxbot.
+ *
+ *  toxbot is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  toxbot is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with toxbot. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef ADMISSION_H
+#define ADMISSION_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <tox/tox.h>
+
+#define FRIEND_REQUEST_MAX_PENDING 256
+#define FRIEND_ACCEPT_RATE         5     /* accepts per second */
+#define FRIEND_ACCEPT_BURST        20
+#define FRIEND_ACCEPT_MAX_BATCH    32    /* accepts per loop iteration */
+
+/*
+ * Loads the friend request rules in path. Each line is either "deny <text>", which rejects
+ * requests whose message contains text, or "require <text>", which rejects requests whose
+ * message contains none of the required texts. Empty lines and lines starting with '#' are
+ * ignored. A missing file means no rules. The rules are shared by every shard.
+ *
+ * Returns the number of rules loaded.
+ */
+int admission_load_rules(const char *path);
+void admission_free_rules(void);
+
+/*
+ * Queues a friend request for admission. Requests that break a rule, come from a blocked
+ * key or an existing friend are rejected. Requests are dropped if the key is already
+ * queued or the queue is full.
+ */
+void admission_enqueue(Tox *m, const uint8_t *public_key, const uint8_t *data, size_t length);
+
+/*
+ * Accepts as many queued requests as the accept rate allows, saving once if any friend
+ * was added. Call once per loop iteration.
+ */
+void admission_process(Tox *m);
+
+#endif /* ADMISSION_H */
@@ -0,0 +1,250 @@
+/*  blockdb.c
+ *
+ *
+ *  Copyright (C) 2014 toxbot All Rights Reserved.
+ *
+ *  This file is part of toxbot.
+ *
+ *  toxbot is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  toxbot is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with toxbot. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include <tox/tox.h>
+
+#include "blockdb.h"
+#include "misc.h"
+
+static int key_cmp(const void *a, const void *b)
+{
+    return memcmp(a, b, TOX_PUBLIC_KEY_SIZE);
+}
+
+/* Public keys are uniformly random, so their bytes serve as the hash functions. */
+static void bloom_hashes(const uint8_t *public_key, uint64_t *h1, uint64_t *h2)
+{
+    *h1 = unpack_u64(public_key + 8);
+    *h2 = unpack_u64(public_key + 16) | 1;
+}
+
+static uint32_t key_bucket(const uint8_t *public_key, uint32_t bucket_bits)
+{
+    return (uint32_t) (((uint64_t) public_key[0] << 24 | public_key[1] << 16 | public_key[2] << 8
+                        | public_key[3]) >> (32 - bucket_bits));
+}
+
+int blockdb_open(struct Block_DB *db, const char *path)
+{
+    memset(db, 0, sizeof(struct Block_DB));
+
+    int fd = open(path, O_RDONLY);
+
+    if (fd == -1) {
+        return -1;
+    }
+
+    struct stat st;
+
+    if (fstat(fd, &st) == -1 || st.st_size < BLOCKDB_HEADER_SIZE) {
+        close(fd);
+        return -1;
+    }
+
+    uint8_t *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if (map == MAP_FAILED) {
+        return -1;
+    }
+
+    /* lookups jump around the file; don't let the kernel read ahead */
+    posix_madvise(map, st.st_size, POSIX_MADV_RANDOM);
+
+    uint16_t version = unpack_u16(map + 4);
+    uint32_t num_hashes = unpack_u16(map + 6);
+    uint32_t bucket_bits = unpack_u32(map + 8);
+    uint64_t num_keys = unpack_u64(map + 12);
+    uint64_t bloom_size = unpack_u64(map + 20);
+    uint64_t bloom_offset = unpack_u64(map + 28);
+    uint64_t buckets_offset = unpack_u64(map + 36);
+    uint64_t keys_offset = unpack_u64(map + 44);
+    uint64_t size = st.st_size;
+
+    if (memcmp(map, BLOCKDB_MAGIC, 4) != 0 || version != BLOCKDB_VERSION || bucket_bits == 0 || bucket_bits > 24
+            || bloom_size < 8 || (bloom_size & (bloom_size - 1)) != 0 || num_hashes == 0
+            || bloom_offset > size || bloom_size > size - bloom_offset
+            || buckets_offset > size || (((uint64_t) 1 << bucket_bits) + 1) * 4 > size - buckets_offset
+            || keys_offset > size || num_keys > (size - keys_offset) / TOX_PUBLIC_KEY_SIZE) {
+        munmap(map, st.st_size);
+        return -1;
+    }
+
+    db->map = map;
+    db->map_size = st.st_size;
+    db->mtime = st.st_mtime;
+    db->num_keys = num_keys;
+    db->num_hashes = num_hashes;
+    db->bucket_bits = bucket_bits;
+    db->bloom_mask = bloom_size * 8 - 1;
+    db->bloom = map + bloom_offset;
+    db->buckets = map + buckets_offset;
+    db->keys = map + keys_offset;
+    return 0;
+}
+
+void blockdb_close(struct Block_DB *db)
+{
+    if (db->map) {
+        munmap(db->map, db->map_size);
+    }
+
+    memset(db, 0, sizeof(struct Block_DB));
+}
+
+bool blockdb_contains(const struct Block_DB *db, const uint8_t *public_key)
+{
+    if (db->num_keys == 0) {
+        return false;
+    }
+
+    uint64_t h1, h2;
+    bloom_hashes(public_key, &h1, &h2);
+
+    uint32_t i;
+
+    for (i = 0; i < db->num_hashes; ++i) {
+        uint64_t bit = (h1 + i * h2) & db->bloom_mask;
+
+        if (!(db->bloom[bit / 8] & (1 << (bit % 8)))) {
+            return false;
+        }
+    }
+
+    uint32_t bucket = key_bucket(public_key, db->bucket_bits);
+    uint64_t lo = unpack_u32(db->buckets + bucket * 4);
+    uint64_t hi = MIN(unpack_u32(db->buckets + (bucket + 1) * 4), db->num_keys);
+
+    while (lo < hi) {
+        uint64_t mid = lo + (hi - lo) / 2;
+        int cmp = memcmp(db->keys + mid * TOX_PUBLIC_KEY_SIZE, public_key, TOX_PUBLIC_KEY_SIZE);
+
+        if (cmp == 0) {
+            return true;
+        }
+
+        if (cmp < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    return false;
+}
+
+int64_t blockdb_write(const char *path, uint8_t *keys, size_t num_keys)
+{
+    size_t i, unique = 0;
+
+    if (num_keys > UINT32_MAX) {
+        return -1;
+    }
+
+    if (num_keys > 0) {
+        qsort(keys, num_keys, TOX_PUBLIC_KEY_SIZE, key_cmp);
+        unique = 1;
+
+        for (i = 1; i < num_keys; ++i) {
+            if (memcmp(keys + i * TOX_PUBLIC_KEY_SIZE, keys + (unique - 1) * TOX_PUBLIC_KEY_SIZE,
+                       TOX_PUBLIC_KEY_SIZE) != 0) {
+                memmove(keys + unique * TOX_PUBLIC_KEY_SIZE, keys + i * TOX_PUBLIC_KEY_SIZE, TOX_PUBLIC_KEY_SIZE);
+                ++unique;
+            }
+        }
+    }
+
+    uint64_t bloom_bits = 64;
+
+    while (bloom_bits < (uint64_t) unique * BLOCKDB_BITS_PER_KEY) {
+        bloom_bits *= 2;
+    }
+
+    uint64_t num_buckets = (uint64_t) 1 << BLOCKDB_BUCKET_BITS;
+    uint64_t bloom_offset = BLOCKDB_HEADER_SIZE;
+    uint64_t buckets_offset = bloom_offset + bloom_bits / 8;
+    uint64_t keys_offset = buckets_offset + (num_buckets + 1) * 4;
+    size_t size = keys_offset + unique * TOX_PUBLIC_KEY_SIZE;
+
+    uint8_t *data = calloc(1, size);
+
+    if (data == NULL) {
+        return -1;
+    }
+
+    memcpy(data, BLOCKDB_MAGIC, 4);
+    pack_u16(data + 4, BLOCKDB_VERSION);
+    pack_u16(data + 6, BLOCKDB_BLOOM_HASHES);
+    pack_u32(data + 8, BLOCKDB_BUCKET_BITS);
+    pack_u64(data + 12, unique);
+    pack_u64(data + 20, bloom_bits / 8);
+    pack_u64(data + 28, bloom_offset);
+    pack_u64(data + 36, buckets_offset);
+    pack_u64(data + 44, keys_offset);
+
+    uint8_t *bloom = data + bloom_offset;
+    uint64_t bucket = 0;
+
+    for (i = 0; i < unique; ++i) {
+        const uint8_t *key = keys + i * TOX_PUBLIC_KEY_SIZE;
+        uint64_t h1, h2;
+        uint32_t k;
+
+        bloom_hashes(key, &h1, &h2);
+
+        for (k = 0; k < BLOCKDB_BLOOM_HASHES; ++k) {
+            uint64_t bit = (h1 + k * h2) & (bloom_bits - 1);
+            bloom[bit / 8] |= 1 << (bit % 8);
+        }
+
+        /* every bucket up to and including this key's starts at i if it has not started yet */
+        uint32_t b = key_bucket(key, BLOCKDB_BUCKET_BITS);
+
+        while (bucket <= b) {
+            pack_u32(data + buckets_offset + bucket * 4, i);
+            ++bucket;
+        }
+    }
+
+    while (bucket <= num_buckets) {
+        pack_u32(data + buckets_offset + bucket * 4, unique);
+        ++bucket;
+    }
+
+    memcpy(data + keys_offset, keys, unique * TOX_PUBLIC_KEY_SIZE);
+
+    int ret = write_file_atomic(path, data, size);
+    free(data);
+
+    return ret == -1 ? -1 : (int64_t) unique;
+}
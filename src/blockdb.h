@@ -0,0 +1,88 @@
+/*  blockdb.h
+ *
+ *
+ *  Copyright (C) 2014 toxbot All Rights Reserved.
+ *
+ *  This file is part of toxbot.
+ *
+ *  toxbot is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  toxbot is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with toxbot. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef BLOCKDB_H
+#define BLOCKDB_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <time.h>
+
+/*
+ * Compiled blocklist: a read-only file of sorted public keys behind a Bloom filter and a
+ * bucket index on the leading key bits, used through mmap so that only the pages a lookup
+ * touches are ever read. Built by toxbot-keytool.
+ *
+ * Layout (integers little-endian):
+ *   header (BLOCKDB_HEADER_SIZE bytes):
+ *     "TBKD" | u16 version | u16 bloom hashes | u32 bucket bits | u64 num keys |
+ *     u64 bloom size in bytes | u64 bloom offset | u64 bucket offset | u64 key offset | padding
+ *   bloom filter bits
+ *   (1 << bucket bits) + 1 u32 bucket starts; keys with leading bits b are keys[start[b], start[b + 1])
+ *   num keys * TOX_PUBLIC_KEY_SIZE sorted keys
+ */
+
+#define BLOCKDB_MAGIC           "TBKD"
+#define BLOCKDB_VERSION         1
+#define BLOCKDB_HEADER_SIZE     64
+#define BLOCKDB_BUCKET_BITS     16
+#define BLOCKDB_BLOOM_HASHES    7
+#define BLOCKDB_BITS_PER_KEY    10     /* about 1% false positives with 7 hashes */
+
+struct Block_DB {
+    uint8_t *map;
+    size_t map_size;
+    time_t mtime;
+
+    uint64_t num_keys;
+    uint32_t num_hashes;
+    uint32_t bucket_bits;
+    uint64_t bloom_mask;    /* number of bloom bits - 1 */
+    const uint8_t *bloom;
+    const uint8_t *buckets;
+    const uint8_t *keys;
+};
+
+/*
+ * Maps the compiled blocklist at path.
+ *
+ * Returns 0 on success.
+ * Returns -1 if the file does not exist or is invalid; db is then empty.
+ */
+int blockdb_open(struct Block_DB *db, const char *path);
+
+void blockdb_close(struct Block_DB *db);
+
+/* Returns true if the binary public_key is in db. An empty db contains nothing. */
+bool blockdb_contains(const struct Block_DB *db, const uint8_t *public_key);
+
+/*
+ * Sorts and deduplicates keys in place, then atomically writes them to path as a
+ * compiled blocklist.
+ *
+ * Returns the number of unique keys written on success.
+ * Returns -1 on failure.
+ */
+int64_t blockdb_write(const char *path, uint8_t *keys, size_t num_keys);
+
+#endif /* BLOCKDB_H */
@@ -0,0 +1,366 @@
+/*  bridge.c
+ *
+ *
+ *  Copyright (C) 2014 toxbot All Rights Reserved.
+ *
+ *  This file is part of toxbot.
+ *
+ *  toxbot is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  toxbot is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with toxbot. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+
+#include <tox/tox.h>
+
+#include "bridge.h"
+#include "groupchats.h"
+#include "metrics.h"
+#include "misc.h"
+#include "log.h"
+
+/* Relayed messages start with a zero width space so that no bridge relays them again. */
+#define BRIDGE_MARKER "\xE2\x80\x8B"
+#define BRIDGE_MARKER_LEN 3
+
+struct Relay {
+    uint64_t queued_at;    /* microseconds */
+    uint16_t length;
+    char text[TOX_MAX_MESSAGE_LENGTH];
+};
+
+struct Bridge_Dest {
+    uint32_t groupnum;
+    struct Relay *queue;    /* ring of BRIDGE_QUEUE_SIZE */
+    uint16_t head;
+    uint16_t count;
+
+    uint64_t last_refill;    /* microseconds */
+    uint32_t tokens;         /* thousandths of a message */
+
+    uint64_t relayed;
+    uint64_t dropped;
+    uint64_t total_latency;    /* microseconds */
+};
+
+struct Bridge_Link {
+    uint32_t a;
+    uint32_t b;
+};
+
+static __thread struct Bridge_Link Links[MAX_BRIDGE_LINKS];
+static __thread int Num_Links;
+static __thread struct Bridge_Dest *Dests;
+static __thread int Num_Dests;
+
+static uint64_t get_time_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static struct Bridge_Dest *get_dest(uint32_t groupnum, bool create)
+{
+    int i;
+
+    for (i = 0; i < Num_Dests; ++i) {
+        if (Dests[i].groupnum == groupnum) {
+            return &Dests[i];
+        }
+    }
+
+    if (!create) {
+        return NULL;
+    }
+
+    struct Bridge_Dest *tmp = realloc(Dests, (Num_Dests + 1) * sizeof(struct Bridge_Dest));
+
+    if (tmp == NULL) {
+        exit(EXIT_FAILURE);
+    }
+
+    Dests = tmp;
+
+    struct Bridge_Dest *dest = &Dests[Num_Dests++];
+    memset(dest, 0, sizeof(struct Bridge_Dest));
+    dest->groupnum = groupnum;
+    dest->tokens = BRIDGE_BURST * 1000;
+    dest->queue = malloc(BRIDGE_QUEUE_SIZE * sizeof(struct Relay));
+
+    if (dest->queue == NULL) {
+        exit(EXIT_FAILURE);
+    }
+
+    return dest;
+}
+
+/* Frees dest if no link uses it as a destination any more. */
+static void release_dest(uint32_t groupnum)
+{
+    int i;
+
+    for (i = 0; i < Num_Links; ++i) {
+        if (Links[i].a == groupnum || Links[i].b == groupnum) {
+            return;
+        }
+    }
+
+    for (i = 0; i < Num_Dests; ++i) {
+        if (Dests[i].groupnum == groupnum) {
+            metrics_add(METRIC_BRIDGE_QUEUE_DEPTH, (uint64_t) - Dests[i].count);
+            free(Dests[i].queue);
+            Dests[i] = Dests[--Num_Dests];
+            return;
+        }
+    }
+}
+
+static int find_link(uint32_t a, uint32_t b)
+{
+    int i;
+
+    for (i = 0; i < Num_Links; ++i) {
+        if ((Links[i].a == a && Links[i].b == b) || (Links[i].a == b && Links[i].b == a)) {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+int bridge_link(uint32_t a, uint32_t b)
+{
+    if (a == b) {
+        return -1;
+    }
+
+    if (find_link(a, b) != -1) {
+        return 0;
+    }
+
+    if (Num_Links == MAX_BRIDGE_LINKS) {
+        return -1;
+    }
+
+    Links[Num_Links].a = a;
+    Links[Num_Links].b = b;
+    ++Num_Links;
+
+    get_dest(a, true);
+    get_dest(b, true);
+    return 0;
+}
+
+int bridge_unlink(uint32_t a, uint32_t b)
+{
+    int idx = find_link(a, b);
+
+    if (idx == -1) {
+        return -1;
+    }
+
+    Links[idx] = Links[--Num_Links];
+    release_dest(a);
+    release_dest(b);
+    return 0;
+}
+
+void bridge_group_removed(uint32_t groupnum)
+{
+    int i = 0;
+
+    while (i < Num_Links) {
+        if (Links[i].a == groupnum || Links[i].b == groupnum) {
+            uint32_t other = Links[i].a == groupnum ? Links[i].b : Links[i].a;
+            Links[i] = Links[--Num_Links];
+            release_dest(other);
+            continue;
+        }
+
+        ++i;
+    }
+
+    release_dest(groupnum);
+}
+
+static void enqueue_relay(struct Bridge_Dest *dest, const char *text, size_t length, uint64_t now)
+{
+    if (dest->count == BRIDGE_QUEUE_SIZE) {
+        ++dest->dropped;
+        metrics_inc(METRIC_BRIDGE_DROPPED);
+        return;
+    }
+
+    struct Relay *relay = &dest->queue[(dest->head + dest->count) % BRIDGE_QUEUE_SIZE];
+    memcpy(relay->text, text, length);
+    relay->length = length;
+    relay->queued_at = now;
+    ++dest->count;
+
+    metrics_inc(METRIC_BRIDGE_QUEUE_DEPTH);
+}
+
+bool bridge_is_relayed(const uint8_t *message, size_t length)
+{
+    return length >= BRIDGE_MARKER_LEN && memcmp(message, BRIDGE_MARKER, BRIDGE_MARKER_LEN) == 0;
+}
+
+void bridge_on_message(Tox *m, uint32_t groupnum, uint32_t peernum, const uint8_t *message, size_t length)
+{
+    if (Num_Links == 0) {
+        return;
+    }
+
+    /* never relay our own messages or anything another bridge already relayed */
+    if (tox_conference_peer_number_is_ours(m, groupnum, peernum, NULL)) {
+        return;
+    }
+
+    if (bridge_is_relayed(message, length)) {
+        return;
+    }
+
+    const struct Group_Peer *peer = group_peer(groupnum, peernum);
+    const char *name = peer && peer->name_len ? peer->name : "???";
+
+    char text[TOX_MAX_MESSAGE_LENGTH];
+    int prefix_len = snprintf(text, sizeof(text), BRIDGE_MARKER "<%s> ", name);
+
+    if (prefix_len < 0 || prefix_len >= sizeof(text)) {
+        return;
+    }
+
+    size_t text_len = prefix_len + utf8_cut((const char *) message, length, sizeof(text) - prefix_len);
+    memcpy(text + prefix_len, message, text_len - prefix_len);
+
+    uint64_t now = get_time_us();
+    int i;
+
+    for (i = 0; i < Num_Links; ++i) {
+        uint32_t dst;
+
+        if (Links[i].a == groupnum) {
+            dst = Links[i].b;
+        } else if (Links[i].b == groupnum) {
+            dst = Links[i].a;
+        } else {
+            continue;
+        }
+
+        struct Bridge_Dest *dest = get_dest(dst, false);
+
+        if (dest) {
+            enqueue_relay(dest, text, text_len, now);
+        }
+    }
+}
+
+void bridge_do(Tox *m)
+{
+    if (Num_Dests == 0) {
+        return;
+    }
+
+    uint64_t now = get_time_us();
+    int i;
+
+    for (i = 0; i < Num_Dests; ++i) {
+        struct Bridge_Dest *dest = &Dests[i];
+
+        /* every bucket is refilled on every pass, so idle time never arrives as one lump of credit */
+        uint64_t refill = (now - dest->last_refill) * BRIDGE_RATE / 1000;    /* us * msgs/s / 1000 == thousandths */
+        dest->tokens = (uint32_t) MIN((uint64_t) dest->tokens + refill, BRIDGE_BURST * 1000);
+        dest->last_refill = now;
+
+        if (dest->count == 0) {
+            continue;
+        }
+
+        while (dest->count > 0 && dest->tokens >= 1000) {
+            struct Relay *relay = &dest->queue[dest->head];
+            dest->head = (dest->head + 1) % BRIDGE_QUEUE_SIZE;
+            --dest->count;
+            dest->tokens -= 1000;
+            metrics_add(METRIC_BRIDGE_QUEUE_DEPTH, (uint64_t) -1);
+
+            TOX_ERR_CONFERENCE_SEND_MESSAGE err;
+
+            if (!tox_conference_send_message(m, dest->groupnum, TOX_MESSAGE_TYPE_NORMAL, (uint8_t *) relay->text,
+                                             relay->length, &err)) {
+                ++dest->dropped;
+                metrics_inc(METRIC_BRIDGE_DROPPED);
+                continue;
+            }
+
+            uint64_t latency = now - relay->queued_at;
+            ++dest->relayed;
+            dest->total_latency += latency;
+            metrics_inc(METRIC_BRIDGE_RELAYED);
+            metrics_add(METRIC_BRIDGE_LATENCY_US, latency);
+        }
+    }
+}
+
+int bridge_report(char *buf, size_t size)
+{
+    size_t len = 0;
+    int i;
+
+    buf[0] = '\0';
+
+    for (i = 0; i < Num_Links && len < size; ++i) {
+        struct Bridge_Dest *a = get_dest(Links[i].a, false);
+        struct Bridge_Dest *b = get_dest(Links[i].b, false);
+
+        if (a == NULL || b == NULL) {
+            continue;
+        }
+
+        uint64_t relayed = a->relayed + b->relayed;
+        uint64_t avg_latency = relayed ? (a->total_latency + b->total_latency) / relayed : 0;
+
+        int ret = snprintf(buf + len, size - len, "%s%u <-> %u | queued: %u/%u | relayed: %llu | dropped: %llu | "
+                           "avg latency: %llu ms", len ? "\n" : "", Links[i].a, Links[i].b, a->count, b->count,
+                           (unsigned long long) relayed, (unsigned long long) (a->dropped + b->dropped),
+                           (unsigned long long) avg_latency / 1000);
+
+        if (ret < 0) {
+            break;
+        }
+
+        len += ret;
+    }
+
+    return Num_Links;
+}
+
+void bridge_free(void)
+{
+    int i;
+
+    for (i = 0; i < Num_Dests; ++i) {
+        free(Dests[i].queue);
+    }
+
+    free(Dests);
+    Dests = NULL;
+    Num_Dests = 0;
+    Num_Links = 0;
+}
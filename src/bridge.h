@@ -0,0 +1,61 @@
+/*  bridge.h
+ *
+ *
+ *  Copyright (C) 2014 toxbot All Rights Reserved.
+ *
+ *  This file is part of toxbot.
+ *
+ *  toxbot is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  toxbot is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with toxbot. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef BRIDGE_H
+#define BRIDGE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <tox/tox.h>
+
+#define MAX_BRIDGE_LINKS     64
+#define BRIDGE_QUEUE_SIZE    64      /* pending relays per destination group */
+#define BRIDGE_RATE          5       /* relayed messages per second per destination */
+#define BRIDGE_BURST         10
+
+/* Links groups a and b in both directions. Returns 0 on success, -1 if the link table is full. */
+int bridge_link(uint32_t a, uint32_t b);
+
+/* Removes the link between a and b. Returns 0 on success, -1 if they were not linked. */
+int bridge_unlink(uint32_t a, uint32_t b);
+
+/* Drops every link and pending relay involving groupnum. Call when the bot leaves a group. */
+void bridge_group_removed(uint32_t groupnum);
+
+/* Queues a conference message for relay to every group linked to groupnum. */
+void bridge_on_message(Tox *m, uint32_t groupnum, uint32_t peernum, const uint8_t *message, size_t length);
+
+/* Returns true if message was relayed by a bridge. */
+bool bridge_is_relayed(const uint8_t *message, size_t length);
+
+/* Sends queued relays within each destination's rate limit. Call once per loop iteration. */
+void bridge_do(Tox *m);
+
+/*
+ * Writes one line per link with queue depth and average relay latency to buf.
+ * Returns the number of links.
+ */
+int bridge_report(char *buf, size_t size);
+
+void bridge_free(void);
+
+#endif /* BRIDGE_H */
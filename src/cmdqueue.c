@@ -0,0 +1,312 @@
+/*  cmdqueue.c
+ *
+ *
+ *  Copyright (C) 2014 toxbot All Rights Reserved.
+ *
+ *  This file is part of toxbot.
+ *
+ *  toxbot is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  toxbot is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with toxbot. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+
+#include <tox/tox.h>
+
+#include "cmdqueue.h"
+#include "commands.h"
+#include "mapi.h"
+#include "friends.h"
+#include "metrics.h"
+#include "misc.h"
+
+enum {
+    LANE_MASTER,
+    LANE_NORMAL,
+    NUM_LANES
+};
+
+struct Command {
+    struct Command *next;
+    uint64_t queued_at;    /* microseconds */
+    uint8_t public_key[TOX_PUBLIC_KEY_SIZE];    /* guards against the friend number being reused */
+    bool is_packet;    /* a machine API packet rather than a text command */
+    uint16_t length;
+    char text[MAX_COMMAND_LENGTH];
+};
+
+/* per friend FIFO, indexed by friend number */
+struct Friend_Commands {
+    struct Command *head;
+    struct Command *tail;
+    uint16_t count;
+    uint8_t lane;
+    bool scheduled;    /* friend is in its lane's ring */
+};
+
+/* ring of friend numbers with pending commands, served round-robin */
+struct Lane {
+    uint32_t *ring;
+    uint32_t size;
+    uint32_t head;
+    uint32_t count;
+};
+
+static __thread struct Friend_Commands *Pending;
+static __thread uint32_t Num_Pending_Slots;
+static __thread struct Lane Lanes[NUM_LANES];
+static __thread uint32_t Total_Pending;
+
+static uint64_t get_time_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void pending_ensure(uint32_t friendnumber)
+{
+    if (friendnumber < Num_Pending_Slots) {
+        return;
+    }
+
+    uint32_t n = MAX(friendnumber + 1, Num_Pending_Slots * 2);
+    struct Friend_Commands *tmp = realloc(Pending, n * sizeof(struct Friend_Commands));
+
+    if (tmp == NULL) {
+        exit(EXIT_FAILURE);
+    }
+
+    memset(&tmp[Num_Pending_Slots], 0, (n - Num_Pending_Slots) * sizeof(struct Friend_Commands));
+    Pending = tmp;
+    Num_Pending_Slots = n;
+}
+
+static void lane_push(struct Lane *lane, uint32_t friendnumber)
+{
+    if (lane->count == lane->size) {
+        uint32_t size = lane->size ? lane->size * 2 : 16;
+        uint32_t *ring = malloc(size * sizeof(uint32_t));
+        uint32_t i;
+
+        if (ring == NULL) {
+            exit(EXIT_FAILURE);
+        }
+
+        for (i = 0; i < lane->count; ++i) {
+            ring[i] = lane->ring[(lane->head + i) % lane->size];
+        }
+
+        free(lane->ring);
+        lane->ring = ring;
+        lane->size = size;
+        lane->head = 0;
+    }
+
+    lane->ring[(lane->head + lane->count) % lane->size] = friendnumber;
+    ++lane->count;
+}
+
+static uint32_t lane_pop(struct Lane *lane)
+{
+    uint32_t friendnumber = lane->ring[lane->head];
+    lane->head = (lane->head + 1) % lane->size;
+    --lane->count;
+    return friendnumber;
+}
+
+static int push(Tox *m, uint32_t friendnumber, bool is_master, bool is_packet, const char *data, uint16_t length)
+{
+    const struct Friend_Info *f = friends_get(m, friendnumber);
+
+    if (f == NULL) {
+        return -1;
+    }
+
+    pending_ensure(friendnumber);
+
+    struct Friend_Commands *fc = &Pending[friendnumber];
+
+    if (fc->count >= CMDQUEUE_MAX_PER_FRIEND || Total_Pending >= CMDQUEUE_MAX_PENDING) {
+        metrics_inc(METRIC_COMMAND_QUEUE_DROPPED);
+        return -1;
+    }
+
+    struct Command *cmd = malloc(sizeof(struct Command));
+
+    if (cmd == NULL) {
+        return -1;
+    }
+
+    cmd->next = NULL;
+    cmd->queued_at = get_time_us();
+    memcpy(cmd->public_key, f->public_key, TOX_PUBLIC_KEY_SIZE);
+    cmd->is_packet = is_packet;
+    memcpy(cmd->text, data, length);
+    cmd->length = length;
+
+    if (!is_packet) {
+        cmd->text[length] = '\0';
+    }
+
+    if (fc->tail) {
+        fc->tail->next = cmd;
+    } else {
+        fc->head = cmd;
+    }
+
+    fc->tail = cmd;
+    ++fc->count;
+    ++Total_Pending;
+    metrics_inc(METRIC_COMMAND_QUEUE_DEPTH);
+
+    /* a friend promoted to master mid-queue moves lanes only once it has drained */
+    if (!fc->scheduled) {
+        fc->lane = is_master ? LANE_MASTER : LANE_NORMAL;
+        fc->scheduled = true;
+        lane_push(&Lanes[fc->lane], friendnumber);
+    }
+
+    return 0;
+}
+
+int cmdqueue_push(Tox *m, uint32_t friendnumber, bool is_master, const char *command, uint16_t length)
+{
+    if (length >= MAX_COMMAND_LENGTH) {
+        return -1;
+    }
+
+    return push(m, friendnumber, is_master, false, command, length);
+}
+
+int cmdqueue_push_packet(Tox *m, uint32_t friendnumber, bool is_master, const uint8_t *data, uint16_t length)
+{
+    if (length > MAX_COMMAND_LENGTH) {
+        return -1;
+    }
+
+    return push(m, friendnumber, is_master, true, (const char *) data, length);
+}
+
+static struct Command *pop_command(uint32_t friendnumber)
+{
+    struct Friend_Commands *fc = &Pending[friendnumber];
+    struct Command *cmd = fc->head;
+
+    fc->head = cmd->next;
+
+    if (fc->head == NULL) {
+        fc->tail = NULL;
+    }
+
+    --fc->count;
+    --Total_Pending;
+    metrics_add(METRIC_COMMAND_QUEUE_DEPTH, (uint64_t) -1);
+    return cmd;
+}
+
+static void run_command(Tox *m, uint32_t friendnumber, struct Command *cmd, uint64_t now)
+{
+    metrics_inc(METRIC_COMMAND_QUEUE_RUN);
+    metrics_add(METRIC_COMMAND_QUEUE_LATENCY_US, now - cmd->queued_at);
+
+    const struct Friend_Info *f = friends_get(m, friendnumber);
+
+    /* the friend was deleted, or its number reused, while the command waited */
+    if (f == NULL || memcmp(f->public_key, cmd->public_key, TOX_PUBLIC_KEY_SIZE) != 0) {
+        return;
+    }
+
+    if (cmd->is_packet) {
+        mapi_handle_packet(m, friendnumber, (const uint8_t *) cmd->text, cmd->length);
+        return;
+    }
+
+    if (execute_batch(m, friendnumber, cmd->text, cmd->length) == -1) {
+        metrics_inc(METRIC_INVALID_COMMANDS);
+        const char *outmsg = "命令无效。 请发送help以获取命令列表";
+        tox_friend_send_message(m, friendnumber, TOX_MESSAGE_TYPE_NORMAL, (uint8_t *) outmsg, strlen(outmsg), NULL);
+    }
+}
+
+/* Runs the next command of the friend at the front of lane. Returns false if the lane is empty. */
+static bool lane_run_one(Tox *m, int lane_idx)
+{
+    struct Lane *lane = &Lanes[lane_idx];
+
+    if (lane->count == 0) {
+        return false;
+    }
+
+    uint32_t friendnumber = lane_pop(lane);
+    struct Command *cmd = pop_command(friendnumber);
+
+    /* back of the line; the friend's next command waits for everyone else's */
+    if (Pending[friendnumber].count > 0) {
+        lane_push(lane, friendnumber);
+    } else {
+        Pending[friendnumber].scheduled = false;
+    }
+
+    run_command(m, friendnumber, cmd, get_time_us());
+    free(cmd);
+    return true;
+}
+
+void cmdqueue_do(Tox *m)
+{
+    if (Total_Pending == 0) {
+        return;
+    }
+
+    uint64_t start = get_time_us();
+
+    /* guarantee progress for both lanes, then masters first until the budget runs out */
+    lane_run_one(m, LANE_MASTER);
+    lane_run_one(m, LANE_NORMAL);
+
+    while (get_time_us() - start < CMDQUEUE_BUDGET_US) {
+        if (!lane_run_one(m, LANE_MASTER) && !lane_run_one(m, LANE_NORMAL)) {
+            return;
+        }
+    }
+
+    if (Total_Pending > 0) {
+        metrics_inc(METRIC_COMMAND_QUEUE_OVER_BUDGET);
+    }
+}
+
+void cmdqueue_free(void)
+{
+    uint32_t i;
+
+    for (i = 0; i < Num_Pending_Slots; ++i) {
+        while (Pending[i].head) {
+            free(pop_command(i));
+        }
+    }
+
+    for (i = 0; i < NUM_LANES; ++i) {
+        free(Lanes[i].ring);
+        memset(&Lanes[i], 0, sizeof(struct Lane));
+    }
+
+    free(Pending);
+    Pending = NULL;
+    Num_Pending_Slots = 0;
+}
@@ -0,0 +1,56 @@
+/*  cmdqueue.h
+ *
+ *
+ *  Copyright (C) 2014 toxbot All Rights Reserved.
+ *
+ *  This file is part of toxbot.
+ *
+ *  toxbot is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  toxbot is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with toxbot. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef CMDQUEUE_H
+#define CMDQUEUE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <tox/tox.h>
+
+#define CMDQUEUE_BUDGET_US          5000    /* time spent running commands per loop iteration */
+#define CMDQUEUE_MAX_PER_FRIEND     8
+#define CMDQUEUE_MAX_PENDING        1024
+
+/*
+ * Queues a command from friendnumber to be run by cmdqueue_do(). Commands from masters
+ * go in a priority lane.
+ *
+ * Returns 0 on success.
+ * Returns -1 if the friend's queue or the whole queue is full; the command is dropped.
+ */
+int cmdqueue_push(Tox *m, uint32_t friendnumber, bool is_master, const char *command, uint16_t length);
+
+/* Like cmdqueue_push(), for a machine API packet (see mapi.h) without its packet id byte. */
+int cmdqueue_push_packet(Tox *m, uint32_t friendnumber, bool is_master, const uint8_t *data, uint16_t length);
+
+/*
+ * Runs queued commands, one per friend in turn, until both lanes are empty or
+ * CMDQUEUE_BUDGET_US has passed. At least one command of each lane runs per call.
+ * Call once per loop iteration, after tox_iterate().
+ */
+void cmdqueue_do(Tox *m);
+
+/* Drops every queued command. */
+void cmdqueue_free(void);
+
+#endif /* CMDQUEUE_H */
@@ -25,9 +25,12 @@
 #include <stdint.h>
 #include <string.h>
 #include <strings.h>
+#include <ctype.h>
 #include <stdbool.h>
 #include <time.h>
 #include <inttypes.h>
+#include <limits.h>
+#include <sys/stat.h>
 
 #include <tox/tox.h>
 #include <tox/toxav.h>
@@ -35,25 +38,59 @@
 #include "toxbot.h"
 #include "misc.h"
 #include "groupchats.h"
+#include "commands.h"
+#include "metrics.h"
+#include "keylist.h"
+#include "log.h"
+#include "bridge.h"
+#include "history.h"
+#include "reply.h"
+#include "events.h"
+#include "friends.h"
+#include "pool.h"
+#include "friendlist.h"
+#include "invitequeue.h"
+#include "journal.h"
 
-#define MAX_COMMAND_LENGTH TOX_MAX_MESSAGE_LENGTH
 #define MAX_NUM_ARGS 4
 
-extern char *DATA_FILE;
-extern char *MASTERLIST_FILE;
-extern struct Tox_Bot Tox_Bot;
+extern __thread char *DATA_FILE;
+extern __thread struct Tox_Bot Tox_Bot;
+extern struct Key_List Master_Keys;
+extern struct Key_List Blocked_Keys;
+
+/* Returns friendnum's public key for event records, or NULL for the admin socket. */
+static const uint8_t *friend_event_key(Tox *m, uint32_t friendnum)
+{
+    const struct Friend_Info *f = friends_get(m, friendnum);
+    return f ? f->public_key : NULL;
+}
 
 static void authent_failed(Tox *m, uint32_t friendnum)
 {
     const char *outmsg = "您无权使用此命令。";
-    tox_friend_send_message(m, friendnum, TOX_MESSAGE_TYPE_NORMAL, (uint8_t *) outmsg, strlen(outmsg), NULL);
+    reply_error(m, friendnum, outmsg, strlen(outmsg));
 }
 
 static void send_error(Tox *m, uint32_t friendnum, const char *message, int err)
 {
     char outmsg[TOX_MAX_MESSAGE_LENGTH];
     snprintf(outmsg, sizeof(outmsg), "%s (error %d)", message, err);
-    tox_friend_send_message(m, friendnum, TOX_MESSAGE_TYPE_NORMAL, (uint8_t *) outmsg, strlen(outmsg), NULL);
+    reply_error(m, friendnum, outmsg, strlen(outmsg));
+}
+
+/*
+ * File arguments name a file in FRIENDLIST_DIR; paths are refused. Returns false if name
+ * is not a plain file name.
+ */
+static bool friend_file_path(const char *name, char *path, size_t size)
+{
+    if (name[0] == '\0' || name[0] == '.' || strchr(name, '/') != NULL) {
+        return false;
+    }
+
+    snprintf(path, size, "%s/%s", FRIENDLIST_DIR, name);
+    return true;
 }
 
 static void cmd_default(Tox *m, uint32_t friendnum, int argc, char (*argv)[MAX_COMMAND_LENGTH])
@@ -67,7 +104,7 @@ static void cmd_default(Tox *m, uint32_t friendnum, int argc, char (*argv)[MAX_C
 
     if (argc < 1) {
         outmsg = "错误：需要房间号码";
-        tox_friend_send_message(m, friendnum, TOX_MESSAGE_TYPE_NORMAL, (uint8_t *) outmsg, strlen(outmsg), NULL);
+        reply_error(m, friendnum, outmsg, strlen(outmsg));
         return;
     }
 
@@ -75,7 +112,7 @@ static void cmd_default(Tox *m, uint32_t friendnum, int argc, char (*argv)[MAX_C
 
     if ((groupnum == 0 && strcmp(argv[1], "0")) || groupnum < 0) {
         outmsg = "错误：需要房间号码";
-        tox_friend_send_message(m, friendnum, TOX_MESSAGE_TYPE_NORMAL, (uint8_t *) outmsg, strlen(outmsg), NULL);
+        reply_error(m, friendnum, outmsg, strlen(outmsg));
         return;
     }
 
@@ -83,14 +120,43 @@ static void cmd_default(Tox *m, uint32_t friendnum, int argc, char (*argv)[MAX_C
 
     char msg[MAX_COMMAND_LENGTH];
     snprintf(msg, sizeof(msg), "默认房间号设置为 %d", groupnum);
-    tox_friend_send_message(m, friendnum, TOX_MESSAGE_TYPE_NORMAL, (uint8_t *) msg, strlen(msg), NULL);
+    reply(m, friendnum, msg, strlen(msg));
 
     char name[TOX_MAX_NAME_LENGTH];
-    tox_friend_get_name(m, friendnum, (uint8_t *) name, NULL);
-    size_t len = tox_friend_get_name_size(m, friendnum, NULL);
-    name[len] = '\0';
+    get_friend_log_name(m, friendnum, name, LOG_LEVEL_INFO);
+
+    log_write(LOG_LEVEL_INFO, "默认房间号设置为 %d by %s", groupnum, name);
+    save_data(m, DATA_FILE);
+}
+
+static void cmd_export(Tox *m, uint32_t friendnum, int argc, char (*argv)[MAX_COMMAND_LENGTH])
+{
+    const char *outmsg = NULL;
+
+    if (!friend_is_master(m, friendnum)) {
+        authent_failed(m, friendnum);
+        return;
+    }
+
+    char path[PATH_MAX];
+
+    if (argc < 1 || !friend_file_path(argv[1], path, sizeof(path))) {
+        outmsg = "Error: File name required";
+        reply_error(m, friendnum, outmsg, strlen(outmsg));
+        return;
+    }
+
+    mkdir(FRIENDLIST_DIR, 0700);
+
+    if (friendlist_export(m, friendnum, path) == -1) {
+        outmsg = "Error: Export failed";
+        reply_error(m, friendnum, outmsg, strlen(outmsg));
+        return;
+    }
 
-    printf("默认房间号设置为 %d by %s", groupnum, name);
+    char name[TOX_MAX_NAME_LENGTH];
+    get_friend_log_name(m, friendnum, name, LOG_LEVEL_INFO);
+    log_write(LOG_LEVEL_INFO, "%s exported the friend list to %s\n", name, path);
 }
 
 static void cmd_gmessage(Tox *m, uint32_t friendnum, int argc, char (*argv)[MAX_COMMAND_LENGTH])
@@ -104,13 +170,13 @@ static void cmd_gmessage(Tox *m, uint32_t friendnum, int argc, char (*argv)[MAX_
 
     if (argc < 1) {
         outmsg = "错误：需要群编号";
-        tox_friend_send_message(m, friendnum, TOX_MESSAGE_TYPE_NORMAL, (uint8_t *) outmsg, strlen(outmsg), NULL);
+        reply_error(m, friendnum, outmsg, strlen(outmsg));
         return;
     }
 
     if (argc < 2) {
         outmsg = "错误：需要消息";
-        tox_friend_send_message(m, friendnum, TOX_MESSAGE_TYPE_NORMAL, (uint8_t *) outmsg, strlen(outmsg), NULL);
+        reply_error(m, friendnum, outmsg, strlen(outmsg));
         return;
     }
 
@@ -118,19 +184,19 @@ static void cmd_gmessage(Tox *m, uint32_t friendnum, int argc, char (*argv)[MAX_
 
     if (groupnum == 0 && strcmp(argv[1], "0")) {
         outmsg = "错误：需要群编号";
-        tox_friend_send_message(m, friendnum, TOX_MESSAGE_TYPE_NORMAL, (uint8_t *) outmsg, strlen(outmsg), NULL);
+        reply_error(m, friendnum, outmsg, strlen(outmsg));
         return;
     }
 
     if (group_index(groupnum) == -1) {
         outmsg = "错误：需要群编号";
-        tox_friend_send_message(m, friendnum, TOX_MESSAGE_TYPE_NORMAL, (uint8_t *) outmsg, strlen(outmsg), NULL);
+        reply_error(m, friendnum, outmsg, strlen(outmsg));
         return;
     }
 
     if (argv[2][0] != '\"') {
         outmsg = "错误：消息必须用引号括起来";
-        tox_friend_send_message(m, friendnum, TOX_MESSAGE_TYPE_NORMAL, (uint8_t *) outmsg, strlen(outmsg), NULL);
+        reply_error(m, friendnum, outmsg, strlen(outmsg));
         return;
     }
 
@@ -149,31 +215,27 @@ static void cmd_gmessage(Tox *m, uint32_t friendnum, int argc, char (*argv)[MAX_
     }
 
     char name[TOX_MAX_NAME_LENGTH];
-    tox_friend_get_name(m, friendnum, (uint8_t *) name, NULL);
-    size_t nlen = tox_friend_get_name_size(m, friendnum, NULL);
-    name[nlen] = '\0';
+    get_friend_log_name(m, friendnum, name, LOG_LEVEL_INFO);
 
     outmsg = "消息发送.";
-    tox_friend_send_message(m, friendnum, TOX_MESSAGE_TYPE_NORMAL, (uint8_t *) outmsg, strlen(outmsg), NULL);
-    printf("<%s> 消息到群 %d: %s\n", name, groupnum, msg);
+    reply(m, friendnum, outmsg, strlen(outmsg));
+    log_write(LOG_LEVEL_INFO, "<%s> 消息到群 %d: %s\n", name, groupnum, msg);
 }
 
-void cmd_group(Tox *m, uint32_t friendnum, int argc, char (*argv)[MAX_COMMAND_LENGTH])
+static void cmd_group(Tox *m, uint32_t friendnum, int argc, char (*argv)[MAX_COMMAND_LENGTH])
 {
     const char *outmsg = NULL;
 
     if (argc < 1) {
         outmsg = "请指定组类型: audio 或 text";
-        tox_friend_send_message(m, friendnum, TOX_MESSAGE_TYPE_NORMAL, (uint8_t *) outmsg, strlen(outmsg), NULL);
+        reply_error(m, friendnum, outmsg, strlen(outmsg));
         return;
     }
 
     uint8_t type = TOX_CONFERENCE_TYPE_AV ? !strcasecmp(argv[1], "audio") : TOX_CONFERENCE_TYPE_TEXT;
 
     char name[TOX_MAX_NAME_LENGTH];
-    tox_friend_get_name(m, friendnum, (uint8_t *) name, NULL);
-    size_t len = tox_friend_get_name_size(m, friendnum, NULL);
-    name[len] = '\0';
+    get_friend_log_name(m, friendnum, name, LOG_LEVEL_INFO);
 
     int groupnum = -1;
 
@@ -182,18 +244,18 @@ void cmd_group(Tox *m, uint32_t friendnum, int argc, char (*argv)[MAX_COMMAND_LE
         groupnum = tox_conference_new(m, &err);
 
         if (err != TOX_ERR_CONFERENCE_NEW_OK) {
-            printf("创建群聊 %s 初始化失败\n", name);
+            log_write(LOG_LEVEL_INFO, "创建群聊 %s 初始化失败\n", name);
             outmsg = "群聊实例无法初始化。";
-            tox_friend_send_message(m, friendnum, TOX_MESSAGE_TYPE_NORMAL, (uint8_t *) outmsg, strlen(outmsg), NULL);
+            reply_error(m, friendnum, outmsg, strlen(outmsg));
             return;
         }
     } else if (type == TOX_CONFERENCE_TYPE_AV) {
         groupnum = toxav_add_av_groupchat(m, NULL, NULL);
 
         if (groupnum == -1) {
-            printf("创建群聊 %s 初始化失败\n", name);
+            log_write(LOG_LEVEL_INFO, "创建群聊 %s 初始化失败\n", name);
             outmsg = "群聊实例无法初始化。";
-            tox_friend_send_message(m, friendnum, TOX_MESSAGE_TYPE_NORMAL, (uint8_t *) outmsg, strlen(outmsg), NULL);
+            reply_error(m, friendnum, outmsg, strlen(outmsg));
             return;
         }
     }
@@ -201,26 +263,29 @@ void cmd_group(Tox *m, uint32_t friendnum, int argc, char (*argv)[MAX_COMMAND_LE
     const char *password = argc >= 2 ? argv[2] : NULL;
 
     if (password && strlen(argv[2]) >= MAX_PASSWORD_SIZE) {
-        printf("创建群聊 %s 失败: 密码太长\n", name);
+        log_write(LOG_LEVEL_INFO, "创建群聊 %s 失败: 密码太长\n", name);
         outmsg = "创建群聊失败，密码太长";
-        tox_friend_send_message(m, friendnum, TOX_MESSAGE_TYPE_NORMAL, (uint8_t *) outmsg, strlen(outmsg), NULL);
+        reply_error(m, friendnum, outmsg, strlen(outmsg));
         return;
     }
 
     if (group_add(groupnum, type, password) == -1) {
-        printf("创建群聊 %s 失败\n", name);
+        log_write(LOG_LEVEL_INFO, "创建群聊 %s 失败\n", name);
         outmsg = "创建群聊失败";
-        tox_friend_send_message(m, friendnum, TOX_MESSAGE_TYPE_NORMAL, (uint8_t *) outmsg, strlen(outmsg), NULL);
+        reply_error(m, friendnum, outmsg, strlen(outmsg));
         tox_conference_delete(m, groupnum, NULL);
         return;
     }
 
     const char *pw = password ? " ( 密码保护 )" : "";
-    printf("群聊 %d 创建成功 %s%s\n", groupnum, name, pw);
+    log_write(LOG_LEVEL_INFO, "群聊 %d 创建成功 %s%s\n", groupnum, name, pw);
 
     char msg[MAX_COMMAND_LENGTH];
     snprintf(msg, sizeof(msg), "群聊 %d 创建%s", groupnum, pw);
-    tox_friend_send_message(m, friendnum, TOX_MESSAGE_TYPE_NORMAL, (uint8_t *) msg, strlen(msg), NULL);
+    reply(m, friendnum, msg, strlen(msg));
+    group_roster_update(m, groupnum);
+    events_publish(EVENT_GROUP_JOIN, groupnum, friend_event_key(m, friendnum), NULL, 0);
+    save_data(m, DATA_FILE);
 }
 
 static void cmd_help(Tox *m, uint32_t friendnum, int argc, char (*argv)[MAX_COMMAND_LENGTH])
@@ -228,23 +293,68 @@ static void cmd_help(Tox *m, uint32_t friendnum, int argc, char (*argv)[MAX_COMM
     const char *outmsg = NULL;
 
     outmsg = "info : 反馈当前状态并列出活跃群聊";
-    tox_friend_send_message(m, friendnum, TOX_MESSAGE_TYPE_NORMAL, (uint8_t *) outmsg, strlen(outmsg), NULL);
+    reply(m, friendnum, outmsg, strlen(outmsg));
 
     outmsg = "id : 反馈当前机器人ID";
-    tox_friend_send_message(m, friendnum, TOX_MESSAGE_TYPE_NORMAL, (uint8_t *) outmsg, strlen(outmsg), NULL);
+    reply(m, friendnum, outmsg, strlen(outmsg));
 
     outmsg = "invite : 加入默认群聊";
-    tox_friend_send_message(m, friendnum, TOX_MESSAGE_TYPE_NORMAL, (uint8_t *) outmsg, strlen(outmsg), NULL);
+    reply(m, friendnum, outmsg, strlen(outmsg));
 
     outmsg = "invite <n> <p> : 请求加入群聊天，n为群聊ID，p为密码(如果有密码)";
-    tox_friend_send_message(m, friendnum, TOX_MESSAGE_TYPE_NORMAL, (uint8_t *) outmsg, strlen(outmsg), NULL);
+    reply(m, friendnum, outmsg, strlen(outmsg));
+
+    outmsg = "history <n> <count> : 显示群聊n最近的count条消息";
+    reply(m, friendnum, outmsg, strlen(outmsg));
+
+    outmsg = "who <n> : 列出群聊n的成员";
+    reply(m, friendnum, outmsg, strlen(outmsg));
 
     outmsg = "group <type> <pass> : 创建一个群聊，type为类型，默认为文本text，可以选择“audio”带语音功能，pass为密码。";
-    tox_friend_send_message(m, friendnum, TOX_MESSAGE_TYPE_NORMAL, (uint8_t *) outmsg, strlen(outmsg), NULL);
+    reply(m, friendnum, outmsg, strlen(outmsg));
 
     if (friend_is_master(m, friendnum)) {
         outmsg = "管理员命令默认不允许执行";
-        tox_friend_send_message(m, friendnum, TOX_MESSAGE_TYPE_NORMAL, (uint8_t *) outmsg, strlen(outmsg), NULL);
+        reply(m, friendnum, outmsg, strlen(outmsg));
+    }
+}
+
+static void cmd_history(Tox *m, uint32_t friendnum, int argc, char (*argv)[MAX_COMMAND_LENGTH])
+{
+    const char *outmsg = NULL;
+
+    if (argc < 1) {
+        outmsg = "Error: Group number required";
+        reply_error(m, friendnum, outmsg, strlen(outmsg));
+        return;
+    }
+
+    int groupnum = atoi(argv[1]);
+    int idx = group_index(groupnum);
+
+    if ((groupnum == 0 && strcmp(argv[1], "0")) || idx == -1) {
+        outmsg = "Error: Invalid group number";
+        reply_error(m, friendnum, outmsg, strlen(outmsg));
+        return;
+    }
+
+    /* the history of a password protected group is only for masters */
+    if (Tox_Bot.g_chats[idx].has_pass && !friend_is_master(m, friendnum)) {
+        authent_failed(m, friendnum);
+        return;
+    }
+
+    int count = argc >= 2 ? atoi(argv[2]) : HISTORY_DEFAULT_COUNT;
+
+    if (count <= 0) {
+        outmsg = "Error: Invalid count";
+        reply_error(m, friendnum, outmsg, strlen(outmsg));
+        return;
+    }
+
+    if (history_query(m, friendnum, groupnum, count) == -1) {
+        outmsg = "Error: History is unavailable right now";
+        reply_error(m, friendnum, outmsg, strlen(outmsg));
     }
 }
 
@@ -252,9 +362,15 @@ static void cmd_id(Tox *m, uint32_t friendnum, int argc, char (*argv)[MAX_COMMAN
 {
     char outmsg[TOX_ADDRESS_SIZE * 2 + 1];
     char address[TOX_ADDRESS_SIZE];
-    tox_self_get_address(m, (uint8_t *) address);
     int i;
 
+    /* steer new friends towards the least loaded identity */
+    if (Num_Shards > 1) {
+        shard_get_address(least_loaded_shard(), (uint8_t *) address);
+    } else {
+        tox_self_get_address(m, (uint8_t *) address);
+    }
+
     for (i = 0; i < TOX_ADDRESS_SIZE; ++i) {
         char d[3];
         sprintf(d, "%02X", address[i] & 0xff);
@@ -262,7 +378,39 @@ static void cmd_id(Tox *m, uint32_t friendnum, int argc, char (*argv)[MAX_COMMAN
     }
 
     outmsg[TOX_ADDRESS_SIZE * 2] = '\0';
-    tox_friend_send_message(m, friendnum, TOX_MESSAGE_TYPE_NORMAL, (uint8_t *) outmsg, strlen(outmsg), NULL);
+    reply(m, friendnum, outmsg, strlen(outmsg));
+}
+
+static void cmd_import(Tox *m, uint32_t friendnum, int argc, char (*argv)[MAX_COMMAND_LENGTH])
+{
+    const char *outmsg = NULL;
+
+    if (!friend_is_master(m, friendnum)) {
+        authent_failed(m, friendnum);
+        return;
+    }
+
+    char path[PATH_MAX];
+
+    if (argc < 1 || !friend_file_path(argv[1], path, sizeof(path))) {
+        outmsg = "Error: File name required";
+        reply_error(m, friendnum, outmsg, strlen(outmsg));
+        return;
+    }
+
+    if (friendlist_import(m, friendnum, path) == -1) {
+        outmsg = "Error: An import is already running";
+        reply_error(m, friendnum, outmsg, strlen(outmsg));
+        return;
+    }
+
+    char name[TOX_MAX_NAME_LENGTH];
+    get_friend_log_name(m, friendnum, name, LOG_LEVEL_INFO);
+    log_write(LOG_LEVEL_INFO, "%s started importing friends from %s\n", name, path);
+
+    char msg[MAX_COMMAND_LENGTH];
+    snprintf(msg, sizeof(msg), "Importing %s; a summary follows when it is done", argv[1]);
+    reply(m, friendnum, msg, strlen(msg));
 }
 
 static void cmd_info(Tox *m, uint32_t friendnum, int argc, char (*argv)[MAX_COMMAND_LENGTH])
@@ -273,46 +421,122 @@ static void cmd_info(Tox *m, uint32_t friendnum, int argc, char (*argv)[MAX_COMM
     uint64_t curtime = (uint64_t) time(NULL);
     get_elapsed_time_str(timestr, sizeof(timestr), curtime - Tox_Bot.start_time);
     snprintf(outmsg, sizeof(outmsg), "启动时间: %s", timestr);
-    tox_friend_send_message(m, friendnum, TOX_MESSAGE_TYPE_NORMAL, (uint8_t *) outmsg, strlen(outmsg), NULL);
+    reply(m, friendnum, outmsg, strlen(outmsg));
 
     uint32_t numfriends = tox_self_get_friend_list_size(m);
     snprintf(outmsg, sizeof(outmsg), "好友数量: %d (%d online)", numfriends, Tox_Bot.num_online_friends);
-    tox_friend_send_message(m, friendnum, TOX_MESSAGE_TYPE_NORMAL, (uint8_t *) outmsg, strlen(outmsg), NULL);
+    reply(m, friendnum, outmsg, strlen(outmsg));
+
+    if (invite_queue_count() > 0) {
+        snprintf(outmsg, sizeof(outmsg), "Pending invites: %u", invite_queue_count());
+        reply(m, friendnum, outmsg, strlen(outmsg));
+    }
 
     snprintf(outmsg, sizeof(outmsg), "不活跃好友清除 %"PRIu64" 天",
              Tox_Bot.inactive_limit / SECONDS_IN_DAY);
-    tox_friend_send_message(m, friendnum, TOX_MESSAGE_TYPE_NORMAL, (uint8_t *) outmsg, strlen(outmsg), NULL);
+    reply(m, friendnum, outmsg, strlen(outmsg));
+
+    if (Num_Shards > 1) {
+        uint32_t total_friends = 0, total_online = 0, total_groups = 0;
+        int s;
+
+        for (s = 0; s < Num_Shards; ++s) {
+            uint32_t shard_friends = __atomic_load_n(&Shards[s].num_friends, __ATOMIC_RELAXED);
+            uint32_t shard_online = __atomic_load_n(&Shards[s].num_online, __ATOMIC_RELAXED);
+            uint32_t shard_groups = __atomic_load_n(&Shards[s].num_groups, __ATOMIC_RELAXED);
+
+            snprintf(outmsg, sizeof(outmsg), "分片 %d: 好友数量: %u (%u online) | 群: %u", s, shard_friends,
+                     shard_online, shard_groups);
+            reply(m, friendnum, outmsg, strlen(outmsg));
+
+            total_friends += shard_friends;
+            total_online += shard_online;
+            total_groups += shard_groups;
+        }
+
+        snprintf(outmsg, sizeof(outmsg), "全部 %d 分片: 好友数量: %u (%u online) | 群: %u", Num_Shards,
+                 total_friends, total_online, total_groups);
+        reply(m, friendnum, outmsg, strlen(outmsg));
+    }
 
     /* List active group chats and number of peers in each */
-    size_t num_chats = tox_conference_get_chatlist_size(m);
+    int i, num_listed = 0;
 
-    if (num_chats == 0) {
-        tox_friend_send_message(m, friendnum, TOX_MESSAGE_TYPE_NORMAL, (uint8_t *) "机器人没有群聊",
-                                strlen("机器人没有群聊"), NULL);
-        return;
+    for (i = 0; i < Tox_Bot.chats_idx; ++i) {
+        const struct Group_Chat *chat = &Tox_Bot.g_chats[i];
+
+        if (!chat->active) {
+            continue;
+        }
+
+        /* a pool is listed once, at its first shard */
+        if (chat->pool) {
+            int j;
+
+            for (j = 0; j < i; ++j) {
+                if (Tox_Bot.g_chats[j].active && Tox_Bot.g_chats[j].pool == chat->pool) {
+                    break;
+                }
+            }
+
+            if (j == i) {
+                pool_describe(chat->pool, outmsg, sizeof(outmsg));
+                reply(m, friendnum, outmsg, strlen(outmsg));
+                ++num_listed;
+            }
+
+            continue;
+        }
+
+        const char *title = chat->title_len ? chat->title : "未设置群名称";
+        const char *type = chat->type == TOX_CONFERENCE_TYPE_AV ? "Audio" : "Text";
+        snprintf(outmsg, sizeof(outmsg), "群ID： %d | %s | 在线人数: %u | 群名称: %s", chat->groupnum, type,
+                 chat->num_peers, title);
+        reply(m, friendnum, outmsg, strlen(outmsg));
+        ++num_listed;
     }
 
-    uint32_t groupchat_list[num_chats];
+    if (num_listed == 0) {
+        reply(m, friendnum, "机器人没有群聊", strlen("机器人没有群聊"));
+    }
+}
 
-    tox_conference_get_chatlist(m, groupchat_list);
+Invite_Result invite_friend(Tox *m, uint32_t friendnum, uint32_t groupnum, const char *password,
+                            TOX_ERR_CONFERENCE_INVITE *err)
+{
+    int idx = group_index(groupnum);
 
-    uint32_t i;
+    if (idx == -1) {
+        return INVITE_NO_GROUP;
+    }
+
+    char name[TOX_MAX_NAME_LENGTH];
+    get_friend_log_name(m, friendnum, name, LOG_LEVEL_WARNING);
 
-    for (i = 0; i < num_chats; ++i) {
-        TOX_ERR_CONFERENCE_PEER_QUERY err;
-        uint32_t groupnum = groupchat_list[i];
-        uint32_t num_peers = tox_conference_peer_count(m, groupnum, &err);
-
-        if (err == TOX_ERR_CONFERENCE_PEER_QUERY_OK) {
-            int idx = group_index(groupnum);
-            const char *title = Tox_Bot.g_chats[idx].title_len
-                                ? Tox_Bot.g_chats[idx].title : "未设置群名称";
-            const char *type = tox_conference_get_type(m, groupnum, NULL) == TOX_CONFERENCE_TYPE_AV ? "Audio" : "Text";
-            snprintf(outmsg, sizeof(outmsg), "群ID： %d | %s | 在线人数: %d | 群名称: %s", groupnum, type,
-                     num_peers, title);
-            tox_friend_send_message(m, friendnum, TOX_MESSAGE_TYPE_NORMAL, (uint8_t *) outmsg, strlen(outmsg), NULL);
+    if (Tox_Bot.g_chats[idx].has_pass && (!password || strcmp(password, Tox_Bot.g_chats[idx].password) != 0)) {
+        log_write(LOG_LEVEL_WARNING, "无法邀请 %s 到群 %d (密码错误)\n", name, groupnum);
+        return INVITE_BAD_PASSWORD;
+    }
+
+    /* a pooled group sends the friend to its least loaded shard */
+    groupnum = pool_route(m, friendnum, groupnum);
+
+    if (!tox_conference_invite(m, friendnum, groupnum, err)) {
+        if ((*err == TOX_ERR_CONFERENCE_INVITE_FAIL_SEND || *err == TOX_ERR_CONFERENCE_INVITE_NO_CONNECTION)
+                && invite_queue_add(m, friendnum, groupnum) == 0) {
+            log_write(LOG_LEVEL_INFO, "Deferred invite of %s to group %d (error %d)\n", name, groupnum, *err);
+            return INVITE_DEFERRED;
         }
+
+        log_write(LOG_LEVEL_WARNING, "无法邀请 %s 到群 %d\n", name, groupnum);
+        return INVITE_FAILED;
     }
+
+    invite_queue_remove(friendnum, groupnum);
+
+    metrics_inc(METRIC_INVITES_SENT);
+    log_write(LOG_LEVEL_INFO, "邀请 %s 到群 %d\n", name, groupnum);
+    return INVITE_OK;
 }
 
 static void cmd_invite(Tox *m, uint32_t friendnum, int argc, char (*argv)[MAX_COMMAND_LENGTH])
@@ -325,49 +549,116 @@ static void cmd_invite(Tox *m, uint32_t friendnum, int argc, char (*argv)[MAX_CO
 
         if (groupnum == 0 && strcmp(argv[1], "0")) {
             outmsg = "错误：群ID无效，请重新输入";
-            tox_friend_send_message(m, friendnum, TOX_MESSAGE_TYPE_NORMAL, (uint8_t *) outmsg, strlen(outmsg), NULL);
+            reply_error(m, friendnum, outmsg, strlen(outmsg));
             return;
         }
     }
 
-    int idx = group_index(groupnum);
+    TOX_ERR_CONFERENCE_INVITE err;
 
-    if (idx == -1) {
-        outmsg = "这个群不存在";
-        tox_friend_send_message(m, friendnum, TOX_MESSAGE_TYPE_NORMAL, (uint8_t *) outmsg, strlen(outmsg), NULL);
+    switch (invite_friend(m, friendnum, groupnum, argc >= 2 ? argv[2] : NULL, &err)) {
+        case INVITE_OK:
+            break;
+
+        case INVITE_NO_GROUP:
+            outmsg = "这个群不存在";
+            reply_error(m, friendnum, outmsg, strlen(outmsg));
+            break;
+
+        case INVITE_BAD_PASSWORD:
+            outmsg = "密码错误";
+            reply_error(m, friendnum, outmsg, strlen(outmsg));
+            break;
+
+        case INVITE_FAILED:
+            outmsg = "邀请失败";
+            send_error(m, friendnum, outmsg, err);
+            break;
+
+        case INVITE_DEFERRED:
+            outmsg = "Invite queued; it will be sent as soon as it can be delivered";
+            reply(m, friendnum, outmsg, strlen(outmsg));
+            break;
+    }
+}
+
+static void cmd_bridge(Tox *m, uint32_t friendnum, int argc, char (*argv)[MAX_COMMAND_LENGTH])
+{
+    if (!friend_is_master(m, friendnum)) {
+        authent_failed(m, friendnum);
         return;
     }
 
-    int has_pass = Tox_Bot.g_chats[idx].has_pass;
+    char outmsg[MAX_COMMAND_LENGTH];
 
-    char name[TOX_MAX_NAME_LENGTH];
-    tox_friend_get_name(m, friendnum, (uint8_t *) name, NULL);
-    size_t len = tox_friend_get_name_size(m, friendnum, NULL);
-    name[len] = '\0';
+    if (bridge_report(outmsg, sizeof(outmsg)) == 0) {
+        snprintf(outmsg, sizeof(outmsg), "No linked groups");
+    }
 
-    const char *passwd = NULL;
+    reply(m, friendnum, outmsg, strlen(outmsg));
+}
+
+/* Shared by link and unlink. */
+static void link_groups(Tox *m, uint32_t friendnum, int argc, char (*argv)[MAX_COMMAND_LENGTH], bool unlink)
+{
+    const char *outmsg = NULL;
 
-    if (argc >= 2) {
-        passwd = argv[2];
+    if (!friend_is_master(m, friendnum)) {
+        authent_failed(m, friendnum);
+        return;
     }
 
-    if (has_pass && (!passwd || strcmp(argv[2], Tox_Bot.g_chats[idx].password) != 0)) {
-        fprintf(stderr, "无法邀请 %s 到群 %d (密码错误)\n", name, groupnum);
-        outmsg = "密码错误";
-        tox_friend_send_message(m, friendnum, TOX_MESSAGE_TYPE_NORMAL, (uint8_t *) outmsg, strlen(outmsg), NULL);
+    if (argc < 2) {
+        outmsg = "Error: Two group numbers are required";
+        reply_error(m, friendnum, outmsg, strlen(outmsg));
         return;
     }
 
-    TOX_ERR_CONFERENCE_INVITE err;
+    int a = atoi(argv[1]);
+    int b = atoi(argv[2]);
 
-    if (!tox_conference_invite(m, friendnum, groupnum, &err)) {
-        fprintf(stderr, "无法邀请 %s 到群 %d\n", name, groupnum);
-        outmsg = "邀请失败";
-        send_error(m, friendnum, outmsg, err);
+    if (a == b || group_index(a) == -1 || group_index(b) == -1
+            || (a == 0 && strcmp(argv[1], "0")) || (b == 0 && strcmp(argv[2], "0"))) {
+        outmsg = "Error: Invalid group number";
+        reply_error(m, friendnum, outmsg, strlen(outmsg));
         return;
     }
 
-    printf("邀请 %s 到群 %d\n", name, groupnum);
+    char msg[MAX_COMMAND_LENGTH];
+
+    if (unlink) {
+        if (bridge_unlink(a, b) == -1) {
+            outmsg = "Error: Groups are not linked";
+            reply_error(m, friendnum, outmsg, strlen(outmsg));
+            return;
+        }
+
+        snprintf(msg, sizeof(msg), "Unlinked groups %d and %d", a, b);
+    } else {
+        if (bridge_link(a, b) == -1) {
+            outmsg = "Error: Too many links";
+            reply_error(m, friendnum, outmsg, strlen(outmsg));
+            return;
+        }
+
+        snprintf(msg, sizeof(msg), "Linked groups %d and %d", a, b);
+    }
+
+    char name[TOX_MAX_NAME_LENGTH];
+    get_friend_log_name(m, friendnum, name, LOG_LEVEL_INFO);
+    log_write(LOG_LEVEL_INFO, "%s (%s)\n", msg, name);
+
+    reply(m, friendnum, msg, strlen(msg));
+}
+
+static void cmd_link(Tox *m, uint32_t friendnum, int argc, char (*argv)[MAX_COMMAND_LENGTH])
+{
+    link_groups(m, friendnum, argc, argv, false);
+}
+
+static void cmd_unlink(Tox *m, uint32_t friendnum, int argc, char (*argv)[MAX_COMMAND_LENGTH])
+{
+    link_groups(m, friendnum, argc, argv, true);
 }
 
 static void cmd_leave(Tox *m, uint32_t friendnum, int argc, char (*argv)[MAX_COMMAND_LENGTH])
@@ -381,7 +672,7 @@ static void cmd_leave(Tox *m, uint32_t friendnum, int argc, char (*argv)[MAX_COM
 
     if (argc < 1) {
         outmsg = "错误：需要群ID";
-        tox_friend_send_message(m, friendnum, TOX_MESSAGE_TYPE_NORMAL, (uint8_t *) outmsg, strlen(outmsg), NULL);
+        reply_error(m, friendnum, outmsg, strlen(outmsg));
         return;
     }
 
@@ -389,28 +680,51 @@ static void cmd_leave(Tox *m, uint32_t friendnum, int argc, char (*argv)[MAX_COM
 
     if (groupnum == 0 && strcmp(argv[1], "0")) {
         outmsg = "错误：群ID无效";
-        tox_friend_send_message(m, friendnum, TOX_MESSAGE_TYPE_NORMAL, (uint8_t *) outmsg, strlen(outmsg), NULL);
+        reply_error(m, friendnum, outmsg, strlen(outmsg));
         return;
     }
 
     if (!tox_conference_delete(m, groupnum, NULL)) {
         outmsg = "错误：群ID无效";
-        tox_friend_send_message(m, friendnum, TOX_MESSAGE_TYPE_NORMAL, (uint8_t *) outmsg, strlen(outmsg), NULL);
+        reply_error(m, friendnum, outmsg, strlen(outmsg));
         return;
     }
 
     char msg[MAX_COMMAND_LENGTH];
 
     char name[TOX_MAX_NAME_LENGTH];
-    tox_friend_get_name(m, friendnum, (uint8_t *) name, NULL);
-    size_t len = tox_friend_get_name_size(m, friendnum, NULL);
-    name[len] = '\0';
+    get_friend_log_name(m, friendnum, name, LOG_LEVEL_INFO);
 
     group_leave(groupnum);
 
-    printf("退出群 %d (%s)\n", groupnum, name);
+    log_write(LOG_LEVEL_INFO, "退出群 %d (%s)\n", groupnum, name);
     snprintf(msg, sizeof(msg), "退出群 %d", groupnum);
-    tox_friend_send_message(m, friendnum, TOX_MESSAGE_TYPE_NORMAL, (uint8_t *) msg, strlen(msg), NULL);
+    reply(m, friendnum, msg, strlen(msg));
+    save_data(m, DATA_FILE);
+}
+
+static void cmd_loglevel(Tox *m, uint32_t friendnum, int argc, char (*argv)[MAX_COMMAND_LENGTH])
+{
+    const char *outmsg = NULL;
+
+    if (!friend_is_master(m, friendnum)) {
+        authent_failed(m, friendnum);
+        return;
+    }
+
+    int level = argc >= 1 ? log_level_from_name(argv[1]) : -1;
+
+    if (level == -1) {
+        outmsg = "Error: level must be one of debug, info, warning, error";
+        reply_error(m, friendnum, outmsg, strlen(outmsg));
+        return;
+    }
+
+    log_set_level(level);
+
+    char msg[MAX_COMMAND_LENGTH];
+    snprintf(msg, sizeof(msg), "Log level set to %s", argv[1]);
+    reply(m, friendnum, msg, strlen(msg));
 }
 
 static void cmd_master(Tox *m, uint32_t friendnum, int argc, char (*argv)[MAX_COMMAND_LENGTH])
@@ -422,39 +736,193 @@ static void cmd_master(Tox *m, uint32_t friendnum, int argc, char (*argv)[MAX_CO
         return;
     }
 
-    if (argc < 1) {
+    uint8_t public_key[TOX_PUBLIC_KEY_SIZE];
+
+    if (argc < 1 || parse_public_key(argv[1], public_key) == -1) {
         outmsg = "错误：需要Tox ID";
-        tox_friend_send_message(m, friendnum, TOX_MESSAGE_TYPE_NORMAL, (uint8_t *) outmsg, strlen(outmsg), NULL);
+        reply_error(m, friendnum, outmsg, strlen(outmsg));
         return;
     }
 
-    const char *id = argv[1];
+    if (!keylist_insert(&Master_Keys, public_key)) {
+        outmsg = "ID已在管理员列表中";
+        reply(m, friendnum, outmsg, strlen(outmsg));
+        return;
+    }
 
-    if (strlen(id) != TOX_ADDRESS_SIZE * 2) {
-        outmsg = "错误：需要Tox ID";
-        tox_friend_send_message(m, friendnum, TOX_MESSAGE_TYPE_NORMAL, (uint8_t *) outmsg, strlen(outmsg), NULL);
+    keylist_persist(&Master_Keys);
+
+    char name[TOX_MAX_NAME_LENGTH];
+    get_friend_log_name(m, friendnum, name, LOG_LEVEL_INFO);
+    log_write(LOG_LEVEL_INFO, "%s 添加管理员: %s\n", name, argv[1]);
+
+    outmsg = "ID已添加到管理员列表中";
+    reply(m, friendnum, outmsg, strlen(outmsg));
+}
+
+static void cmd_unmaster(Tox *m, uint32_t friendnum, int argc, char (*argv)[MAX_COMMAND_LENGTH])
+{
+    const char *outmsg = NULL;
+
+    if (!friend_is_master(m, friendnum)) {
+        authent_failed(m, friendnum);
         return;
     }
 
-    FILE *fp = fopen(MASTERLIST_FILE, "a");
+    uint8_t public_key[TOX_PUBLIC_KEY_SIZE];
 
-    if (fp == NULL) {
-        outmsg = "错误：找不到masterkeys文件";
-        tox_friend_send_message(m, friendnum, TOX_MESSAGE_TYPE_NORMAL, (uint8_t *) outmsg, strlen(outmsg), NULL);
+    if (argc < 1 || parse_public_key(argv[1], public_key) == -1) {
+        outmsg = "Error: Public key or Tox ID required";
+        reply_error(m, friendnum, outmsg, strlen(outmsg));
         return;
     }
 
-    fprintf(fp, "%s\n", id);
-    fclose(fp);
+    if (!keylist_remove(&Master_Keys, public_key)) {
+        outmsg = "Error: Key is not a master";
+        reply_error(m, friendnum, outmsg, strlen(outmsg));
+        return;
+    }
+
+    keylist_persist(&Master_Keys);
 
     char name[TOX_MAX_NAME_LENGTH];
-    tox_friend_get_name(m, friendnum, (uint8_t *) name, NULL);
-    size_t len = tox_friend_get_name_size(m, friendnum, NULL);
-    name[len] = '\0';
+    get_friend_log_name(m, friendnum, name, LOG_LEVEL_INFO);
+    log_write(LOG_LEVEL_INFO, "%s removed master %s\n", name, argv[1]);
 
-    printf("%s 添加管理员: %s\n", name, id);
-    outmsg = "ID已添加到管理员列表中";
-    tox_friend_send_message(m, friendnum, TOX_MESSAGE_TYPE_NORMAL, (uint8_t *) outmsg, strlen(outmsg), NULL);
+    outmsg = "Master removed";
+    reply(m, friendnum, outmsg, strlen(outmsg));
+}
+
+static void cmd_block(Tox *m, uint32_t friendnum, int argc, char (*argv)[MAX_COMMAND_LENGTH])
+{
+    const char *outmsg = NULL;
+
+    if (!friend_is_master(m, friendnum)) {
+        authent_failed(m, friendnum);
+        return;
+    }
+
+    uint8_t public_key[TOX_PUBLIC_KEY_SIZE];
+
+    if (argc < 1 || parse_public_key(argv[1], public_key) == -1) {
+        outmsg = "Error: Public key or Tox ID required";
+        reply_error(m, friendnum, outmsg, strlen(outmsg));
+        return;
+    }
+
+    if (keylist_contains(&Master_Keys, public_key)) {
+        outmsg = "Error: Key is a master; use unmaster first";
+        reply_error(m, friendnum, outmsg, strlen(outmsg));
+        return;
+    }
+
+    bool was_friend = friends_find(public_key) != UINT32_MAX;
+    bool added = block_key(m, public_key);
+
+    char name[TOX_MAX_NAME_LENGTH];
+    get_friend_log_name(m, friendnum, name, LOG_LEVEL_INFO);
+    log_write(LOG_LEVEL_INFO, "%s blocked %s\n", name, argv[1]);
+
+    char msg[MAX_COMMAND_LENGTH];
+    snprintf(msg, sizeof(msg), "%s%s", added ? "Key blocked" : "Key was already blocked",
+             was_friend ? "; friend removed" : "");
+    reply(m, friendnum, msg, strlen(msg));
+}
+
+static void cmd_unblock(Tox *m, uint32_t friendnum, int argc, char (*argv)[MAX_COMMAND_LENGTH])
+{
+    const char *outmsg = NULL;
+
+    if (!friend_is_master(m, friendnum)) {
+        authent_failed(m, friendnum);
+        return;
+    }
+
+    uint8_t public_key[TOX_PUBLIC_KEY_SIZE];
+
+    if (argc < 1 || parse_public_key(argv[1], public_key) == -1) {
+        outmsg = "Error: Public key or Tox ID required";
+        reply_error(m, friendnum, outmsg, strlen(outmsg));
+        return;
+    }
+
+    /* the key would stay blocked anyway, so leave the runtime list as it is */
+    if (keylist_db_contains(&Blocked_Keys, public_key)) {
+        outmsg = "Error: Key is in the compiled blocklist and can't be unblocked at runtime";
+        reply_error(m, friendnum, outmsg, strlen(outmsg));
+        return;
+    }
+
+    if (!keylist_remove(&Blocked_Keys, public_key)) {
+        outmsg = "Error: Key is not blocked";
+        reply_error(m, friendnum, outmsg, strlen(outmsg));
+        return;
+    }
+
+    keylist_persist(&Blocked_Keys);
+
+    char name[TOX_MAX_NAME_LENGTH];
+    get_friend_log_name(m, friendnum, name, LOG_LEVEL_INFO);
+    log_write(LOG_LEVEL_INFO, "%s unblocked %s\n", name, argv[1]);
+
+    outmsg = "Key unblocked";
+    reply(m, friendnum, outmsg, strlen(outmsg));
+}
+
+static void cmd_kick(Tox *m, uint32_t friendnum, int argc, char (*argv)[MAX_COMMAND_LENGTH])
+{
+    const char *outmsg = NULL;
+
+    if (!friend_is_master(m, friendnum)) {
+        authent_failed(m, friendnum);
+        return;
+    }
+
+    if (argc < 1) {
+        outmsg = "Error: Public key, Tox ID or friend number required";
+        reply_error(m, friendnum, outmsg, strlen(outmsg));
+        return;
+    }
+
+    uint8_t public_key[TOX_PUBLIC_KEY_SIZE];
+    uint32_t target = UINT32_MAX;
+    bool by_key = parse_public_key(argv[1], public_key) == 0;
+
+    /* friend numbers are per shard, but a key can be a friend of every shard */
+    if (by_key) {
+        target = friends_find(public_key);
+        shard_kick_key(public_key);
+    } else {
+        char *end;
+        unsigned long n = strtoul(argv[1], &end, 10);
+
+        if (*end == '\0' && end != argv[1] && n < UINT32_MAX && friends_get(m, n) != NULL) {
+            target = n;
+        }
+    }
+
+    if (target == UINT32_MAX && by_key && Num_Shards > 1) {
+        outmsg = "Not a friend of this identity; the other shards will remove it";
+        reply(m, friendnum, outmsg, strlen(outmsg));
+        return;
+    }
+
+    if (target == UINT32_MAX) {
+        outmsg = "Error: No such friend";
+        reply_error(m, friendnum, outmsg, strlen(outmsg));
+        return;
+    }
+
+    char name[TOX_MAX_NAME_LENGTH];
+    char target_name[TOX_MAX_NAME_LENGTH];
+    get_friend_log_name(m, friendnum, name, LOG_LEVEL_INFO);
+    get_friend_log_name(m, target, target_name, LOG_LEVEL_INFO);
+    log_write(LOG_LEVEL_INFO, "%s removed friend %u (%s)\n", name, target, target_name);
+
+    friends_delete(m, target);
+
+    outmsg = "Friend removed";
+    reply(m, friendnum, outmsg, strlen(outmsg));
 }
 
 static void cmd_name(Tox *m, uint32_t friendnum, int argc, char (*argv)[MAX_COMMAND_LENGTH])
@@ -468,7 +936,7 @@ static void cmd_name(Tox *m, uint32_t friendnum, int argc, char (*argv)[MAX_COMM
 
     if (argc < 1) {
         outmsg = "错误：需要名称";
-        tox_friend_send_message(m, friendnum, TOX_MESSAGE_TYPE_NORMAL, (uint8_t *) outmsg, strlen(outmsg), NULL);
+        reply_error(m, friendnum, outmsg, strlen(outmsg));
         return;
     }
 
@@ -487,11 +955,9 @@ static void cmd_name(Tox *m, uint32_t friendnum, int argc, char (*argv)[MAX_COMM
     tox_self_set_name(m, (uint8_t *) name, (uint16_t) len, NULL);
 
     char m_name[TOX_MAX_NAME_LENGTH];
-    tox_friend_get_name(m, friendnum, (uint8_t *) m_name, NULL);
-    size_t nlen = tox_friend_get_name_size(m, friendnum, NULL);
-    m_name[nlen] = '\0';
+    get_friend_log_name(m, friendnum, m_name, LOG_LEVEL_INFO);
 
-    printf("%s 设置名字 %s\n", m_name, name);
+    log_write(LOG_LEVEL_INFO, "%s 设置名字 %s\n", m_name, name);
     save_data(m, DATA_FILE);
 }
 
@@ -506,7 +972,7 @@ static void cmd_passwd(Tox *m, uint32_t friendnum, int argc, char (*argv)[MAX_CO
 
     if (argc < 1) {
         outmsg = "错误：群ID是必须输入的";
-        tox_friend_send_message(m, friendnum, TOX_MESSAGE_TYPE_NORMAL, (uint8_t *) outmsg, strlen(outmsg), NULL);
+        reply_error(m, friendnum, outmsg, strlen(outmsg));
         return;
     }
 
@@ -514,7 +980,7 @@ static void cmd_passwd(Tox *m, uint32_t friendnum, int argc, char (*argv)[MAX_CO
 
     if (groupnum == 0 && strcmp(argv[1], "0")) {
         outmsg = "错误：群ID无效";
-        tox_friend_send_message(m, friendnum, TOX_MESSAGE_TYPE_NORMAL, (uint8_t *) outmsg, strlen(outmsg), NULL);
+        reply_error(m, friendnum, outmsg, strlen(outmsg));
         return;
     }
 
@@ -522,14 +988,12 @@ static void cmd_passwd(Tox *m, uint32_t friendnum, int argc, char (*argv)[MAX_CO
 
     if (idx == -1) {
         outmsg = "错误：群ID无效";
-        tox_friend_send_message(m, friendnum, TOX_MESSAGE_TYPE_NORMAL, (uint8_t *) outmsg, strlen(outmsg), NULL);
+        reply_error(m, friendnum, outmsg, strlen(outmsg));
         return;
     }
 
     char name[TOX_MAX_NAME_LENGTH];
-    tox_friend_get_name(m, friendnum, (uint8_t *) name, NULL);
-    size_t nlen = tox_friend_get_name_size(m, friendnum, NULL);
-    name[nlen] = '\0';
+    get_friend_log_name(m, friendnum, name, LOG_LEVEL_INFO);
 
 
     /* no password */
@@ -538,14 +1002,15 @@ static void cmd_passwd(Tox *m, uint32_t friendnum, int argc, char (*argv)[MAX_CO
         memset(Tox_Bot.g_chats[idx].password, 0, MAX_PASSWORD_SIZE);
 
         outmsg = "没有设置密码";
-        tox_friend_send_message(m, friendnum, TOX_MESSAGE_TYPE_NORMAL, (uint8_t *) outmsg, strlen(outmsg), NULL);
-        printf("没有为群聊设置密码 %d by %s\n", groupnum, name);
+        reply(m, friendnum, outmsg, strlen(outmsg));
+        log_write(LOG_LEVEL_INFO, "没有为群聊设置密码 %d by %s\n", groupnum, name);
+        journal_log_group(m, JOURNAL_GROUP_PASSWORD, groupnum, "", 0);
         return;
     }
 
     if (strlen(argv[2]) >= MAX_PASSWORD_SIZE) {
         outmsg = "密码太长";
-        tox_friend_send_message(m, friendnum, TOX_MESSAGE_TYPE_NORMAL, (uint8_t *) outmsg, strlen(outmsg), NULL);
+        reply_error(m, friendnum, outmsg, strlen(outmsg));
         return;
     }
 
@@ -553,9 +1018,73 @@ static void cmd_passwd(Tox *m, uint32_t friendnum, int argc, char (*argv)[MAX_CO
     snprintf(Tox_Bot.g_chats[idx].password, sizeof(Tox_Bot.g_chats[idx].password), "%s", argv[2]);
 
     outmsg = "设置密码";
-    tox_friend_send_message(m, friendnum, TOX_MESSAGE_TYPE_NORMAL, (uint8_t *) outmsg, strlen(outmsg), NULL);
-    printf("群聊 %d 密码设置 %s\n", groupnum, name);
+    reply(m, friendnum, outmsg, strlen(outmsg));
+    log_write(LOG_LEVEL_INFO, "群聊 %d 密码设置 %s\n", groupnum, name);
+    journal_log_group(m, JOURNAL_GROUP_PASSWORD, groupnum, Tox_Bot.g_chats[idx].password,
+                      strlen(Tox_Bot.g_chats[idx].password));
+}
+
+static void cmd_pool(Tox *m, uint32_t friendnum, int argc, char (*argv)[MAX_COMMAND_LENGTH])
+{
+    const char *outmsg = NULL;
+
+    if (!friend_is_master(m, friendnum)) {
+        authent_failed(m, friendnum);
+        return;
+    }
+
+    if (argc < 2) {
+        outmsg = "Error: Group number and peer limit (or off) required";
+        reply_error(m, friendnum, outmsg, strlen(outmsg));
+        return;
+    }
+
+    int groupnum = atoi(argv[1]);
+
+    if ((groupnum == 0 && strcmp(argv[1], "0")) || group_index(groupnum) == -1) {
+        outmsg = "Error: Invalid group number";
+        reply_error(m, friendnum, outmsg, strlen(outmsg));
+        return;
+    }
+
+    char name[TOX_MAX_NAME_LENGTH];
+    get_friend_log_name(m, friendnum, name, LOG_LEVEL_INFO);
+
+    char msg[MAX_COMMAND_LENGTH];
 
+    if (!strcasecmp(argv[2], "off")) {
+        if (pool_dissolve(groupnum) == -1) {
+            outmsg = "Error: Group is not in a pool";
+            reply_error(m, friendnum, outmsg, strlen(outmsg));
+            return;
+        }
+
+        snprintf(msg, sizeof(msg), "Pool of group %d dissolved", groupnum);
+    } else {
+        int max_peers = atoi(argv[2]);
+        bool relay = argc >= 3 && !strcasecmp(argv[3], "relay");
+
+        if (max_peers < 2 || max_peers > UINT16_MAX) {
+            outmsg = "Error: Peer limit must be between 2 and 65535";
+            reply_error(m, friendnum, outmsg, strlen(outmsg));
+            return;
+        }
+
+        int pool = pool_configure(m, groupnum, max_peers, relay);
+
+        if (pool == -1) {
+            outmsg = "Error: Too many pools";
+            reply_error(m, friendnum, outmsg, strlen(outmsg));
+            return;
+        }
+
+        snprintf(msg, sizeof(msg), "Pool %d: new shard above %d peers%s", pool, max_peers,
+                 relay ? ", relaying between shards" : "");
+    }
+
+    log_write(LOG_LEVEL_INFO, "%s (%s)\n", msg, name);
+    reply(m, friendnum, msg, strlen(msg));
+    save_data(m, DATA_FILE);
 }
 
 static void cmd_purge(Tox *m, uint32_t friendnum, int argc, char (*argv)[MAX_COMMAND_LENGTH])
@@ -569,7 +1098,7 @@ static void cmd_purge(Tox *m, uint32_t friendnum, int argc, char (*argv)[MAX_COM
 
     if (argc < 1) {
         outmsg = "Error: number > 0 required";
-        tox_friend_send_message(m, friendnum, TOX_MESSAGE_TYPE_NORMAL, (uint8_t *) outmsg, strlen(outmsg), NULL);
+        reply_error(m, friendnum, outmsg, strlen(outmsg));
         return;
     }
 
@@ -577,7 +1106,7 @@ static void cmd_purge(Tox *m, uint32_t friendnum, int argc, char (*argv)[MAX_COM
 
     if (days <= 0) {
         outmsg = "Error: number > 0 required";
-        tox_friend_send_message(m, friendnum, TOX_MESSAGE_TYPE_NORMAL, (uint8_t *) outmsg, strlen(outmsg), NULL);
+        reply_error(m, friendnum, outmsg, strlen(outmsg));
         return;
     }
 
@@ -585,15 +1114,41 @@ static void cmd_purge(Tox *m, uint32_t friendnum, int argc, char (*argv)[MAX_COM
     Tox_Bot.inactive_limit = seconds;
 
     char name[TOX_MAX_NAME_LENGTH];
-    tox_friend_get_name(m, friendnum, (uint8_t *) name, NULL);
-    size_t nlen = tox_friend_get_name_size(m, friendnum, NULL);
-    name[nlen] = '\0';
+    get_friend_log_name(m, friendnum, name, LOG_LEVEL_INFO);
 
     char msg[MAX_COMMAND_LENGTH];
     snprintf(msg, sizeof(msg), "Purge time set to %"PRIu64" days", days);
-    tox_friend_send_message(m, friendnum, TOX_MESSAGE_TYPE_NORMAL, (uint8_t *) msg, strlen(msg), NULL);
+    reply(m, friendnum, msg, strlen(msg));
+
+    log_write(LOG_LEVEL_INFO, "Purge time set to %"PRIu64" days by %s\n", days, name);
+    save_data(m, DATA_FILE);
+}
+
+static void cmd_stats(Tox *m, uint32_t friendnum, int argc, char (*argv)[MAX_COMMAND_LENGTH])
+{
+    if (!friend_is_master(m, friendnum)) {
+        authent_failed(m, friendnum);
+        return;
+    }
+
+    char outmsg[MAX_COMMAND_LENGTH];
+    int len = 0;
+    int i;
+
+    /* counters are process-wide, so this covers every shard */
+    for (i = 0; i < NUM_METRICS; ++i) {
+        int ret = snprintf(outmsg + len, sizeof(outmsg) - len, "%s%s: %"PRIu64, i ? " | " : "",
+                           metrics_name(i), metrics_get(i));
+
+        if (ret < 0 || ret >= sizeof(outmsg) - len) {
+            break;
+        }
+
+        len += ret;
+    }
 
-    printf("Purge time set to %"PRIu64" days by %s\n", days, name);
+    snprintf(outmsg + len, sizeof(outmsg) - len, " | log_dropped: %llu", log_dropped());
+    reply(m, friendnum, outmsg, strlen(outmsg));
 }
 
 static void cmd_status(Tox *m, uint32_t friendnum, int argc, char (*argv)[MAX_COMMAND_LENGTH])
@@ -607,7 +1162,7 @@ static void cmd_status(Tox *m, uint32_t friendnum, int argc, char (*argv)[MAX_CO
 
     if (argc < 1) {
         outmsg = "Error: status required";
-        tox_friend_send_message(m, friendnum, TOX_MESSAGE_TYPE_NORMAL, (uint8_t *) outmsg, strlen(outmsg), NULL);
+        reply_error(m, friendnum, outmsg, strlen(outmsg));
         return;
     }
 
@@ -622,18 +1177,16 @@ static void cmd_status(Tox *m, uint32_t friendnum, int argc, char (*argv)[MAX_CO
         type = TOX_USER_STATUS_BUSY;
     } else {
         outmsg = "Invalid status. Valid statuses are: online, busy and away.";
-        tox_friend_send_message(m, friendnum, TOX_MESSAGE_TYPE_NORMAL, (uint8_t *) outmsg, strlen(outmsg), NULL);
+        reply_error(m, friendnum, outmsg, strlen(outmsg));
         return;
     }
 
     tox_self_set_status(m, type);
 
     char name[TOX_MAX_NAME_LENGTH];
-    tox_friend_get_name(m, friendnum, (uint8_t *) name, NULL);
-    size_t nlen = tox_friend_get_name_size(m, friendnum, NULL);
-    name[nlen] = '\0';
+    get_friend_log_name(m, friendnum, name, LOG_LEVEL_INFO);
 
-    printf("%s set status to %s\n", name, status);
+    log_write(LOG_LEVEL_INFO, "%s set status to %s\n", name, status);
     save_data(m, DATA_FILE);
 }
 
@@ -648,13 +1201,13 @@ static void cmd_statusmessage(Tox *m, uint32_t friendnum, int argc, char (*argv)
 
     if (argc < 1) {
         outmsg = "Error: message required";
-        tox_friend_send_message(m, friendnum, TOX_MESSAGE_TYPE_NORMAL, (uint8_t *) outmsg, strlen(outmsg), NULL);
+        reply_error(m, friendnum, outmsg, strlen(outmsg));
         return;
     }
 
     if (argv[1][0] != '\"') {
         outmsg = "错误：消息必须用引号括起来";
-        tox_friend_send_message(m, friendnum, TOX_MESSAGE_TYPE_NORMAL, (uint8_t *) outmsg, strlen(outmsg), NULL);
+        reply_error(m, friendnum, outmsg, strlen(outmsg));
         return;
     }
 
@@ -667,15 +1220,13 @@ static void cmd_statusmessage(Tox *m, uint32_t friendnum, int argc, char (*argv)
     tox_self_set_status_message(m, (uint8_t *) msg, len, NULL);
 
     char name[TOX_MAX_NAME_LENGTH];
-    tox_friend_get_name(m, friendnum, (uint8_t *) name, NULL);
-    size_t nlen = tox_friend_get_name_size(m, friendnum, NULL);
-    name[nlen] = '\0';
+    get_friend_log_name(m, friendnum, name, LOG_LEVEL_INFO);
 
-    printf("%s set status message to \"%s\"\n", name, msg);
+    log_write(LOG_LEVEL_INFO, "%s set status message to \"%s\"\n", name, msg);
     save_data(m, DATA_FILE);
 }
 
-void cmd_title_set(Tox *m, uint32_t friendnum, int argc, char (*argv)[MAX_COMMAND_LENGTH])
+static void cmd_title_set(Tox *m, uint32_t friendnum, int argc, char (*argv)[MAX_COMMAND_LENGTH])
 {
     const char *outmsg = NULL;
 
@@ -686,13 +1237,13 @@ void cmd_title_set(Tox *m, uint32_t friendnum, int argc, char (*argv)[MAX_COMMAN
 
     if (argc < 2) {
         outmsg = "Error: Two arguments are required";
-        tox_friend_send_message(m, friendnum, TOX_MESSAGE_TYPE_NORMAL, (uint8_t *) outmsg, strlen(outmsg), NULL);
+        reply_error(m, friendnum, outmsg, strlen(outmsg));
         return;
     }
 
     if (argv[2][0] != '\"') {
         outmsg = "Error: title must be enclosed in quotes";
-        tox_friend_send_message(m, friendnum, TOX_MESSAGE_TYPE_NORMAL, (uint8_t *) outmsg, strlen(outmsg), NULL);
+        reply_error(m, friendnum, outmsg, strlen(outmsg));
         return;
     }
 
@@ -700,7 +1251,7 @@ void cmd_title_set(Tox *m, uint32_t friendnum, int argc, char (*argv)[MAX_COMMAN
 
     if (groupnum == 0 && strcmp(argv[1], "0")) {
         outmsg = "Error: Invalid group number";
-        tox_friend_send_message(m, friendnum, TOX_MESSAGE_TYPE_NORMAL, (uint8_t *) outmsg, strlen(outmsg), NULL);
+        reply_error(m, friendnum, outmsg, strlen(outmsg));
         return;
     }
 
@@ -711,14 +1262,12 @@ void cmd_title_set(Tox *m, uint32_t friendnum, int argc, char (*argv)[MAX_COMMAN
     title[len] = '\0';
 
     char name[TOX_MAX_NAME_LENGTH];
-    tox_friend_get_name(m, friendnum, (uint8_t *) name, NULL);
-    size_t nlen = tox_friend_get_name_size(m, friendnum, NULL);
-    name[nlen] = '\0';
+    get_friend_log_name(m, friendnum, name, LOG_LEVEL_INFO);
 
     TOX_ERR_CONFERENCE_TITLE err;
 
     if (!tox_conference_set_title(m, groupnum, (uint8_t *) title, len, &err)) {
-        printf("%s failed to set the title '%s' for group %d\n", name, title, groupnum);
+        log_write(LOG_LEVEL_INFO, "%s failed to set the title '%s' for group %d\n", name, title, groupnum);
         outmsg = "Failed to set title. This may be caused by an invalid group number or an empty room";
         send_error(m, friendnum, outmsg, err);
         return;
@@ -728,9 +1277,12 @@ void cmd_title_set(Tox *m, uint32_t friendnum, int argc, char (*argv)[MAX_COMMAN
     memcpy(Tox_Bot.g_chats[idx].title, title, len + 1);
     Tox_Bot.g_chats[idx].title_len = len;
 
+    events_publish(EVENT_GROUP_TITLE, groupnum, NULL, title, len);
+
     outmsg = "Group title set";
-    tox_friend_send_message(m, friendnum, TOX_MESSAGE_TYPE_NORMAL, (uint8_t *) outmsg, strlen(outmsg), NULL);
-    printf("%s set group %d title to %s\n", name, groupnum, title);
+    reply(m, friendnum, outmsg, strlen(outmsg));
+    log_write(LOG_LEVEL_INFO, "%s set group %d title to %s\n", name, groupnum, title);
+    journal_log_group(m, JOURNAL_GROUP_TITLE, groupnum, title, len);
 }
 
 /* Parses input command and puts args into arg array.
@@ -778,25 +1330,91 @@ static int parse_command(const char *input, char (*args)[MAX_COMMAND_LENGTH])
     return num_args;
 }
 
+static void cmd_who(Tox *m, uint32_t friendnum, int argc, char (*argv)[MAX_COMMAND_LENGTH])
+{
+    const char *outmsg = NULL;
+
+    if (argc < 1) {
+        outmsg = "Error: Group number required";
+        reply_error(m, friendnum, outmsg, strlen(outmsg));
+        return;
+    }
+
+    int groupnum = atoi(argv[1]);
+    int idx = group_index(groupnum);
+
+    if ((groupnum == 0 && strcmp(argv[1], "0")) || idx == -1) {
+        outmsg = "Error: Invalid group number";
+        reply_error(m, friendnum, outmsg, strlen(outmsg));
+        return;
+    }
+
+    const struct Group_Chat *chat = &Tox_Bot.g_chats[idx];
+
+    if (chat->has_pass && !friend_is_master(m, friendnum)) {
+        authent_failed(m, friendnum);
+        return;
+    }
+
+    char msg[MAX_COMMAND_LENGTH];
+    int len = snprintf(msg, sizeof(msg), "群 %d: %u peers", groupnum, chat->num_peers);
+    uint32_t i;
+
+    /* one line per peer, packed into as few messages as possible */
+    for (i = 0; i < chat->num_peers; ++i) {
+        const struct Group_Peer *peer = &chat->peers[i];
+        char key[TOX_PUBLIC_KEY_SIZE * 2 + 1];
+        char line[TOX_MAX_NAME_LENGTH + 32];
+
+        bin_to_hex_string(peer->public_key, TOX_PUBLIC_KEY_SIZE, key);
+        int line_len = snprintf(line, sizeof(line), "\n%.8s %s", key, peer->name_len ? peer->name : "???");
+
+        if (len + line_len >= sizeof(msg)) {
+            reply(m, friendnum, msg, len);
+            len = snprintf(msg, sizeof(msg), "%s", line + 1);
+            continue;
+        }
+
+        memcpy(msg + len, line, line_len + 1);
+        len += line_len;
+    }
+
+    reply(m, friendnum, msg, len);
+}
+
 static struct {
     const char *name;
     void (*func)(Tox *m, uint32_t friendnum, int argc, char (*argv)[MAX_COMMAND_LENGTH]);
 } commands[] = {
+    { "block",            cmd_block         },
+    { "bridge",           cmd_bridge        },
     { "default",          cmd_default       },
+    { "export",           cmd_export        },
     { "group",            cmd_group         },
     { "gmessage",         cmd_gmessage      },
     { "help",             cmd_help          },
+    { "history",          cmd_history       },
     { "id",               cmd_id            },
+    { "import",           cmd_import        },
     { "info",             cmd_info          },
     { "invite",           cmd_invite        },
+    { "kick",             cmd_kick          },
     { "leave",            cmd_leave         },
+    { "link",             cmd_link          },
+    { "loglevel",         cmd_loglevel      },
     { "master",           cmd_master        },
     { "name",             cmd_name          },
     { "passwd",           cmd_passwd        },
+    { "pool",             cmd_pool          },
     { "purge",            cmd_purge         },
+    { "stats",            cmd_stats         },
     { "status",           cmd_status        },
     { "statusmessage",    cmd_statusmessage },
     { "title",            cmd_title_set     },
+    { "unblock",          cmd_unblock       },
+    { "unlink",           cmd_unlink        },
+    { "unmaster",         cmd_unmaster      },
+    { "who",              cmd_who           },
     { NULL,               NULL              },
 };
 
@@ -806,6 +1424,8 @@ static int do_command(Tox *m, uint32_t friendnum, int num_args, char (*args)[MAX
 
     for (i = 0; commands[i].name; ++i) {
         if (strcmp(args[0], commands[i].name) == 0) {
+            metrics_inc(METRIC_COMMANDS_EXECUTED);
+            events_publish(EVENT_COMMAND, friendnum, friend_event_key(m, friendnum), args[0], strlen(args[0]));
             (commands[i].func)(m, friendnum, num_args - 1, args);
             return 0;
         }
@@ -829,3 +1449,143 @@ int execute(Tox *m, uint32_t friendnum, const char *input, int length)
 
     return do_command(m, friendnum, num_args, args);
 }
+
+/* Returns the length of the next command in input, which ends at an unquoted newline or semicolon. */
+static int batch_command_length(const char *input, int length)
+{
+    bool quoted = false;
+    int i;
+
+    for (i = 0; i < length; ++i) {
+        if (input[i] == '\"') {
+            quoted = !quoted;
+        } else if (!quoted && (input[i] == '\n' || input[i] == ';')) {
+            break;
+        }
+    }
+
+    return i;
+}
+
+static bool is_batch_space(char c)
+{
+    return c == ' ' || c == '\t' || c == '\r';
+}
+
+/* Splits input into at most MAX_BATCH_COMMANDS commands. Sets truncated if there were more. */
+static int split_batch(const char *input, int length, char (*cmds)[MAX_COMMAND_LENGTH], bool *truncated)
+{
+    int num_cmds = 0;
+    int pos = 0;
+
+    while (pos < length && num_cmds < MAX_BATCH_COMMANDS) {
+        int start = pos;
+        int end = pos + batch_command_length(input + pos, length - pos);
+        pos = end + 1;
+
+        while (start < end && is_batch_space(input[start])) {
+            ++start;
+        }
+
+        while (end > start && is_batch_space(input[end - 1])) {
+            --end;
+        }
+
+        if (start == end) {
+            continue;
+        }
+
+        int len = utf8_cut(input + start, end - start, MAX_COMMAND_LENGTH - 1);
+        snprintf(cmds[num_cmds++], MAX_COMMAND_LENGTH, "%.*s", len, input + start);
+    }
+
+    *truncated = pos < length;
+    return num_cmds;
+}
+
+/* Runs cmds in order. The replies must be going into a sink, which is used to detect failures. */
+static void run_batch(Tox *m, uint32_t friendnum, char (*cmds)[MAX_COMMAND_LENGTH], int num_cmds,
+                      bool truncated, bool stop_on_error, const struct Reply_Sink *sink)
+{
+    int i;
+
+    for (i = 0; i < num_cmds; ++i) {
+        if (execute(m, friendnum, cmds[i], strlen(cmds[i])) == -1) {
+            metrics_inc(METRIC_INVALID_COMMANDS);
+
+            char outmsg[MAX_COMMAND_LENGTH];
+            int len = utf8_cut(cmds[i], strlen(cmds[i]), 64);
+            snprintf(outmsg, sizeof(outmsg), "命令无效: %.*s", len, cmds[i]);
+            reply_error(m, friendnum, outmsg, strlen(outmsg));
+        }
+
+        if (stop_on_error && sink->failed) {
+            break;
+        }
+    }
+
+    if (i < num_cmds) {
+        char outmsg[MAX_COMMAND_LENGTH];
+        snprintf(outmsg, sizeof(outmsg), "Batch stopped after command %d of %d", i + 1, num_cmds);
+        reply(m, friendnum, outmsg, strlen(outmsg));
+    }
+
+    if (truncated) {
+        char outmsg[MAX_COMMAND_LENGTH];
+        snprintf(outmsg, sizeof(outmsg), "Only the first %d commands of a batch are run", MAX_BATCH_COMMANDS);
+        reply(m, friendnum, outmsg, strlen(outmsg));
+    }
+}
+
+static bool batch_stop_on_error(const char **input, int *length)
+{
+    if (*length > 0 && (*input)[0] == '!') {
+        ++*input;
+        --*length;
+        return true;
+    }
+
+    return false;
+}
+
+int execute_batch(Tox *m, uint32_t friendnum, const char *input, int length)
+{
+    bool stop_on_error = batch_stop_on_error(&input, &length);
+    bool truncated;
+
+    char cmds[MAX_BATCH_COMMANDS][MAX_COMMAND_LENGTH];
+    int num_cmds = split_batch(input, length, cmds, &truncated);
+
+    if (num_cmds == 0) {
+        return -1;
+    }
+
+    if (num_cmds == 1 && !truncated) {
+        return execute(m, friendnum, cmds[0], strlen(cmds[0]));
+    }
+
+    struct Reply_Sink sink;
+    reply_sink_begin(&sink);
+    run_batch(m, friendnum, cmds, num_cmds, truncated, stop_on_error, &sink);
+    reply_sink_end();
+
+    reply_send_packed(m, friendnum, sink.buf, sink.len);
+    reply_sink_free(&sink);
+
+    return 0;
+}
+
+int execute_into_sink(Tox *m, uint32_t friendnum, const char *input, int length, struct Reply_Sink *sink)
+{
+    bool stop_on_error = batch_stop_on_error(&input, &length);
+    bool truncated;
+
+    char cmds[MAX_BATCH_COMMANDS][MAX_COMMAND_LENGTH];
+    int num_cmds = split_batch(input, length, cmds, &truncated);
+
+    reply_sink_begin(sink);
+    run_batch(m, friendnum, cmds, num_cmds, truncated, stop_on_error, sink);
+    reply_sink_end();
+
+    return sink->failed ? -1 : 0;
+}
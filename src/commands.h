@@ -23,8 +23,45 @@
 #ifndef COMMANDS_H
 #define COMMANDS_H
 
-int execute(Tox *m, int friendnumber, const char *input, int length);
-void cmd_group(Tox *m, uint32_t friendnum, int argc, char (*argv)[MAX_COMMAND_LENGTH]);
-void cmd_title_set(Tox *m, uint32_t friendnum, int argc, char (*argv)[MAX_COMMAND_LENGTH]);
+#define MAX_COMMAND_LENGTH TOX_MAX_MESSAGE_LENGTH
+
+/* Commands in one message are separated by newlines or semicolons; at most this many are run. */
+#define MAX_BATCH_COMMANDS 16
+
+typedef enum {
+    INVITE_OK,
+    INVITE_NO_GROUP,
+    INVITE_BAD_PASSWORD,
+    INVITE_FAILED,      /* toxcore refused; see err */
+    INVITE_DEFERRED,    /* the friend can't be reached right now; queued for retry */
+} Invite_Result;
+
+/*
+ * Invites friendnum to groupnum, applying the same checks as the invite command: the
+ * password must match if the group has one. An invite that toxcore can't send because
+ * the friend is offline or its send queue is full is queued for retry (see invitequeue.h).
+ */
+Invite_Result invite_friend(Tox *m, uint32_t friendnum, uint32_t groupnum, const char *password,
+                            TOX_ERR_CONFERENCE_INVITE *err);
+
+int execute(Tox *m, uint32_t friendnumber, const char *input, int length);
+
+/*
+ * Runs every command in input in order and sends their replies packed into as few messages
+ * as possible. A leading '!' stops the batch at the first command that fails.
+ *
+ * Returns -1 if input holds a single command and it is invalid, 0 otherwise.
+ */
+int execute_batch(Tox *m, uint32_t friendnumber, const char *input, int length);
+
+struct Reply_Sink;
+
+/*
+ * Like execute_batch(), but collects every reply into sink instead of sending it. The caller
+ * must free sink with reply_sink_free().
+ *
+ * Returns -1 if any of the commands failed or was invalid, 0 otherwise.
+ */
+int execute_into_sink(Tox *m, uint32_t friendnumber, const char *input, int length, struct Reply_Sink *sink);
 
 #endif    /* COMMANDS_H */
@@ -0,0 +1,151 @@
+/*  events.c
+ *
+ *
+ *  Copyright (C) 2014 toxbot All Rights Reserved.
+ *
+ *  This file is part of toxbot.
+ *
+ *  toxbot is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  toxbot is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with toxbot. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include <tox/tox.h>
+
+#include "events.h"
+#include "metrics.h"
+#include "misc.h"
+#include "log.h"
+
+static __thread struct Event_Ring_Header *Ring;
+static __thread struct Event_Record *Slots;
+static __thread size_t Ring_Size;
+static __thread uint64_t Next_Seq;
+
+int events_init(const char *path)
+{
+    if (path[0] == '\0') {
+        return 0;
+    }
+
+    /* build the new ring beside the old one so that readers never map a half-made file */
+    char tmp_path[PATH_MAX];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+
+    size_t size = EVENT_RING_HEADER_SIZE + (size_t) EVENT_RING_SLOTS * sizeof(struct Event_Record);
+    int fd = open(tmp_path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+
+    if (fd == -1) {
+        log_write(LOG_LEVEL_ERROR, "Failed to create event ring %s: %s\n", tmp_path, strerror(errno));
+        return -1;
+    }
+
+    if (ftruncate(fd, size) == -1) {
+        log_write(LOG_LEVEL_ERROR, "Failed to size event ring %s: %s\n", tmp_path, strerror(errno));
+        close(fd);
+        unlink(tmp_path);
+        return -1;
+    }
+
+    void *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if (map == MAP_FAILED) {
+        log_write(LOG_LEVEL_ERROR, "Failed to map event ring %s: %s\n", tmp_path, strerror(errno));
+        unlink(tmp_path);
+        return -1;
+    }
+
+    struct Event_Ring_Header *hdr = map;
+    hdr->magic = EVENT_RING_MAGIC;
+    hdr->version = EVENT_RING_VERSION;
+    hdr->num_slots = EVENT_RING_SLOTS;
+    hdr->record_size = sizeof(struct Event_Record);
+    hdr->created = (uint64_t) time(NULL);
+    hdr->last_seq = 0;
+
+    if (rename(tmp_path, path) == -1) {
+        log_write(LOG_LEVEL_ERROR, "Failed to install event ring %s: %s\n", path, strerror(errno));
+        munmap(map, size);
+        unlink(tmp_path);
+        return -1;
+    }
+
+    Ring = hdr;
+    Slots = (struct Event_Record *) ((char *) map + EVENT_RING_HEADER_SIZE);
+    Ring_Size = size;
+    Next_Seq = 1;
+    return 0;
+}
+
+void events_publish(Event_Type type, uint32_t number, const uint8_t *public_key, const char *data, size_t length)
+{
+    if (Ring == NULL) {
+        return;
+    }
+
+    uint64_t seq = Next_Seq++;
+    struct Event_Record *rec = &Slots[seq & (EVENT_RING_SLOTS - 1)];
+
+    /* a reader that sees seq change across its copy knows the record was torn */
+    __atomic_store_n(&rec->seq, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+
+    rec->time_us = (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+    rec->type = type;
+    rec->number = number;
+    rec->length = data ? MIN(length, EVENT_DATA_SIZE) : 0;
+
+    if (public_key) {
+        memcpy(rec->public_key, public_key, TOX_PUBLIC_KEY_SIZE);
+    } else {
+        memset(rec->public_key, 0, TOX_PUBLIC_KEY_SIZE);
+    }
+
+    if (data) {
+        memcpy(rec->data, data, rec->length);
+    }
+
+    __atomic_store_n(&rec->seq, seq, __ATOMIC_RELEASE);
+    __atomic_store_n(&Ring->last_seq, seq, __ATOMIC_RELEASE);
+
+    metrics_inc(METRIC_EVENTS_PUBLISHED);
+}
+
+void events_free(void)
+{
+    if (Ring == NULL) {
+        return;
+    }
+
+    munmap(Ring, Ring_Size);
+    Ring = NULL;
+    Slots = NULL;
+}
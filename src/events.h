@@ -0,0 +1,91 @@
+/*  events.h
+ *
+ *
+ *  Copyright (C) 2014 toxbot All Rights Reserved.
+ *
+ *  This file is part of toxbot.
+ *
+ *  toxbot is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  toxbot is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with toxbot. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef EVENTS_H
+#define EVENTS_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <tox/tox.h>
+
+/*
+ * Bot events are published into a ring of fixed-size records in a shared memory file
+ * (by default /dev/shm/toxbot_events) that any number of processes can map and read
+ * without system calls. The bot is the only writer and never waits for readers: a reader
+ * that falls more than EVENT_RING_SLOTS records behind loses the oldest ones and sees a gap
+ * in the sequence numbers. See evreader.h for the reading side.
+ *
+ * File layout: an Event_Ring_Header padded to EVENT_RING_HEADER_SIZE bytes, followed by
+ * num_slots records. Record seq goes in slot seq % num_slots.
+ */
+
+#define EVENT_RING_MAGIC       0x56454254    /* "TBEV" */
+#define EVENT_RING_VERSION     1
+#define EVENT_RING_SLOTS       4096          /* must be a power of two */
+#define EVENT_RING_HEADER_SIZE 256
+#define EVENT_DATA_SIZE        200
+
+typedef enum {
+    EVENT_FRIEND_REQUEST = 1,    /* public_key: sender, data: request message */
+    EVENT_FRIEND_ONLINE,         /* number: friend, public_key: friend */
+    EVENT_FRIEND_OFFLINE,        /* number: friend, public_key: friend */
+    EVENT_COMMAND,               /* number: friend, public_key: friend, data: command name */
+    EVENT_GROUP_JOIN,            /* number: group, public_key: friend that sent the invite or group command */
+    EVENT_GROUP_LEAVE,           /* number: group */
+    EVENT_GROUP_TITLE,           /* number: group, data: new title */
+} Event_Type;
+
+struct Event_Record {
+    uint64_t seq;        /* starts at 1; 0 while the slot is being rewritten */
+    uint64_t time_us;    /* unix time in microseconds */
+    uint16_t type;
+    uint16_t length;     /* bytes used in data; longer texts are truncated */
+    uint32_t number;
+    uint8_t public_key[TOX_PUBLIC_KEY_SIZE];
+    char data[EVENT_DATA_SIZE];
+};
+
+struct Event_Ring_Header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t num_slots;
+    uint32_t record_size;
+    uint64_t created;      /* unix time the writer created the ring */
+    uint64_t last_seq;     /* sequence number of the newest complete record; 0 if none */
+};
+
+/*
+ * Creates a new ring at path for this thread to publish into, replacing any old one.
+ * An empty path disables publishing.
+ *
+ * Returns 0 on success.
+ * Returns -1 on failure, in which case events are discarded.
+ */
+int events_init(const char *path);
+
+/* Publishes an event. public_key and data may be NULL. */
+void events_publish(Event_Type type, uint32_t number, const uint8_t *public_key, const char *data, size_t length);
+
+/* Unmaps the ring. The file is left in place so that readers can finish the tail. */
+void events_free(void);
+
+#endif /* EVENTS_H */
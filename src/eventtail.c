@@ -0,0 +1,141 @@
+/*  eventtail.c
+ *
+ *
+ *  Copyright (C) 2014 toxbot All Rights Reserved.
+ *
+ *  This file is part of toxbot.
+ *
+ *  toxbot is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  toxbot is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with toxbot. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * toxbot-events: prints the events published by toxbot (see events.h), one per line:
+ *
+ *     <seq> <unix time> <type> <number> <public key> <data>
+ *
+ * Fields are tab separated; control characters in data are replaced with spaces.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <inttypes.h>
+#include <unistd.h>
+
+#include <tox/tox.h>
+
+#include "evreader.h"
+#include "misc.h"
+
+#define DEFAULT_EVENTS_FILE "/dev/shm/toxbot_events"
+#define IDLE_SLEEP_US 10000
+
+static void print_usage(const char *name)
+{
+    fprintf(stderr, "usage: %s [-a] [-1] [ring file]\n"
+                    "  -a  start with the oldest event still in the ring\n"
+                    "  -1  exit once every published event has been printed\n", name);
+}
+
+static void print_record(const struct Event_Record *rec)
+{
+    char key[TOX_PUBLIC_KEY_SIZE * 2 + 1];
+    char data[EVENT_DATA_SIZE + 1];
+    int i;
+
+    bin_to_hex_string(rec->public_key, TOX_PUBLIC_KEY_SIZE, key);
+
+    for (i = 0; i < rec->length; ++i) {
+        data[i] = (unsigned char) rec->data[i] < 0x20 ? ' ' : rec->data[i];
+    }
+
+    data[rec->length] = '\0';
+
+    printf("%"PRIu64"\t%"PRIu64".%06"PRIu64"\t%s\t%"PRIu32"\t%s\t%s\n", rec->seq, rec->time_us / 1000000,
+           rec->time_us % 1000000, event_type_name(rec->type), rec->number, key, data);
+}
+
+int main(int argc, char **argv)
+{
+    bool from_start = false;
+    bool follow = true;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "a1")) != -1) {
+        switch (opt) {
+            case 'a':
+                from_start = true;
+                break;
+
+            case '1':
+                follow = false;
+                break;
+
+            default:
+                print_usage(argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+
+    const char *path = optind < argc ? argv[optind] : DEFAULT_EVENTS_FILE;
+    struct Event_Reader reader;
+
+    if (evreader_open(&reader, path, from_start) == -1) {
+        fprintf(stderr, "Failed to open event ring %s\n", path);
+        return EXIT_FAILURE;
+    }
+
+    uint64_t reported_lost = 0;
+    int idle = 0;
+
+    while (true) {
+        struct Event_Record rec;
+
+        if (evreader_next(&reader, &rec) == 1) {
+            if (reader.lost != reported_lost) {
+                printf("# lost %"PRIu64" events\n", reader.lost - reported_lost);
+                reported_lost = reader.lost;
+            }
+
+            print_record(&rec);
+            idle = 0;
+            continue;
+        }
+
+        if (!follow) {
+            break;
+        }
+
+        fflush(stdout);
+        usleep(IDLE_SLEEP_US);
+
+        /* about once a second, check whether the bot has restarted with a new ring */
+        if (++idle % 100 == 0 && evreader_replaced(&reader, path)) {
+            evreader_close(&reader);
+
+            while (evreader_open(&reader, path, true) == -1) {
+                sleep(1);
+            }
+
+            printf("# event ring replaced\n");
+            reported_lost = 0;
+        }
+    }
+
+    evreader_close(&reader);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,180 @@
+/*  evreader.c
+ *
+ *
+ *  Copyright (C) 2014 toxbot All Rights Reserved.
+ *
+ *  This file is part of toxbot.
+ *
+ *  toxbot is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  toxbot is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with toxbot. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "evreader.h"
+
+int evreader_open(struct Event_Reader *reader, const char *path, bool from_start)
+{
+    memset(reader, 0, sizeof(struct Event_Reader));
+
+    int fd = open(path, O_RDONLY);
+
+    if (fd == -1) {
+        return -1;
+    }
+
+    struct stat st;
+
+    if (fstat(fd, &st) == -1 || st.st_size < EVENT_RING_HEADER_SIZE) {
+        close(fd);
+        return -1;
+    }
+
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if (map == MAP_FAILED) {
+        return -1;
+    }
+
+    const struct Event_Ring_Header *hdr = map;
+    size_t needed = EVENT_RING_HEADER_SIZE + (size_t) hdr->num_slots * sizeof(struct Event_Record);
+
+    if (hdr->magic != EVENT_RING_MAGIC || hdr->version != EVENT_RING_VERSION
+            || hdr->record_size != sizeof(struct Event_Record) || hdr->num_slots == 0
+            || (hdr->num_slots & (hdr->num_slots - 1)) != 0 || (size_t) st.st_size < needed) {
+        munmap(map, st.st_size);
+        return -1;
+    }
+
+    reader->map = map;
+    reader->size = st.st_size;
+    reader->dev = st.st_dev;
+    reader->ino = st.st_ino;
+    reader->hdr = hdr;
+    reader->slots = (const struct Event_Record *) ((const char *) map + EVENT_RING_HEADER_SIZE);
+
+    uint64_t last = __atomic_load_n(&hdr->last_seq, __ATOMIC_ACQUIRE);
+
+    if (from_start) {
+        /* the slot after last may be mid-rewrite, so the oldest readable record is one later */
+        reader->next_seq = last >= hdr->num_slots - 1 ? last - hdr->num_slots + 2 : 1;
+    } else {
+        reader->next_seq = last + 1;
+    }
+
+    return 0;
+}
+
+int evreader_next(struct Event_Reader *reader, struct Event_Record *rec)
+{
+    const struct Event_Ring_Header *hdr = reader->hdr;
+
+    while (true) {
+        uint64_t last = __atomic_load_n(&hdr->last_seq, __ATOMIC_ACQUIRE);
+        uint64_t seq = reader->next_seq;
+
+        if (seq > last) {
+            return 0;
+        }
+
+        /* the writer has lapped us; skip to the oldest record it can't be rewriting */
+        if (last - seq >= hdr->num_slots - 1) {
+            uint64_t oldest = last - hdr->num_slots + 2;
+            reader->lost += oldest - seq;
+            reader->next_seq = oldest;
+            continue;
+        }
+
+        const struct Event_Record *slot = &reader->slots[seq & (hdr->num_slots - 1)];
+
+        if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != seq) {
+            /* overwritten since we loaded last_seq; recheck against the new head */
+            reader->lost += 1;
+            reader->next_seq = seq + 1;
+            continue;
+        }
+
+        memcpy(rec, slot, sizeof(struct Event_Record));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+        if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) != seq) {
+            reader->lost += 1;
+            reader->next_seq = seq + 1;
+            continue;
+        }
+
+        rec->seq = seq;
+        rec->length = rec->length > EVENT_DATA_SIZE ? EVENT_DATA_SIZE : rec->length;
+        reader->next_seq = seq + 1;
+        return 1;
+    }
+}
+
+bool evreader_replaced(const struct Event_Reader *reader, const char *path)
+{
+    struct stat st;
+
+    if (stat(path, &st) == -1) {
+        return false;
+    }
+
+    return st.st_dev != reader->dev || st.st_ino != reader->ino;
+}
+
+void evreader_close(struct Event_Reader *reader)
+{
+    if (reader->map) {
+        munmap(reader->map, reader->size);
+    }
+
+    memset(reader, 0, sizeof(struct Event_Reader));
+}
+
+const char *event_type_name(uint16_t type)
+{
+    switch (type) {
+        case EVENT_FRIEND_REQUEST:
+            return "friend_request";
+
+        case EVENT_FRIEND_ONLINE:
+            return "friend_online";
+
+        case EVENT_FRIEND_OFFLINE:
+            return "friend_offline";
+
+        case EVENT_COMMAND:
+            return "command";
+
+        case EVENT_GROUP_JOIN:
+            return "group_join";
+
+        case EVENT_GROUP_LEAVE:
+            return "group_leave";
+
+        case EVENT_GROUP_TITLE:
+            return "group_title";
+
+        default:
+            return "unknown";
+    }
+}
@@ -0,0 +1,69 @@
+/*  evreader.h
+ *
+ *
+ *  Copyright (C) 2014 toxbot All Rights Reserved.
+ *
+ *  This file is part of toxbot.
+ *
+ *  toxbot is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  toxbot is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with toxbot. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef EVREADER_H
+#define EVREADER_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/types.h>
+
+#include "events.h"
+
+/* Reads the event ring published by toxbot (see events.h). Reading never blocks the bot. */
+struct Event_Reader {
+    void *map;
+    size_t size;
+    dev_t dev;
+    ino_t ino;
+    const struct Event_Ring_Header *hdr;
+    const struct Event_Record *slots;
+    uint64_t next_seq;
+    uint64_t lost;    /* records overwritten before this reader got to them */
+};
+
+/*
+ * Maps the ring at path. Reading starts with the oldest record still in the ring if
+ * from_start is true, and with the next record published otherwise.
+ *
+ * Returns 0 on success.
+ * Returns -1 if the file can't be mapped or is not an event ring.
+ */
+int evreader_open(struct Event_Reader *reader, const char *path, bool from_start);
+
+/*
+ * Copies the next record into rec. If records were overwritten before they could be read,
+ * they are skipped and counted in reader->lost.
+ *
+ * Returns 1 if a record was read, 0 if there are no new records.
+ */
+int evreader_next(struct Event_Reader *reader, struct Event_Record *rec);
+
+/* Returns true if the file at path is no longer the ring that reader has mapped, e.g. because the bot restarted. */
+bool evreader_replaced(const struct Event_Reader *reader, const char *path);
+
+void evreader_close(struct Event_Reader *reader);
+
+/* Returns a short name for an event type, or "unknown". */
+const char *event_type_name(uint16_t type);
+
+#endif /* EVREADER_H */
@@ -0,0 +1,425 @@
+/*  friendlist.c
+ *
+ *
+ *  Copyright (C) 2014 toxbot All Rights Reserved.
+ *
+ *  This file is part of toxbot.
+ *
+ *  toxbot is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  toxbot is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with toxbot. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <limits.h>
+#include <inttypes.h>
+#include <time.h>
+
+#include <tox/tox.h>
+
+#include "toxbot.h"
+#include "friendlist.h"
+#include "friends.h"
+#include "keylist.h"
+#include "ratelimit.h"
+#include "reply.h"
+#include "worker.h"
+#include "metrics.h"
+#include "misc.h"
+#include "log.h"
+
+extern __thread char *DATA_FILE;
+extern struct Key_List Blocked_Keys;
+
+#define EXPORT_LINE_SIZE (TOX_PUBLIC_KEY_SIZE * 2 + 1 + 20 + 1 + TOX_MAX_NAME_LENGTH + 1)
+
+struct Import_Summary {
+    uint32_t added;
+    uint32_t existing;
+    uint32_t blocked;
+    uint32_t invalid;
+    uint32_t failed;
+};
+
+struct Import_State {
+    bool active;           /* from friendlist_import() until the summary is sent */
+    uint32_t friendnum;
+    char path[PATH_MAX];
+
+    bool loaded;           /* false while the file is being read */
+    uint8_t *keys;
+    size_t count;
+    size_t pos;
+    struct Import_Summary summary;
+
+    uint64_t last_refill;    /* milliseconds */
+    uint32_t tokens;         /* thousandths of a friend */
+};
+
+struct Read_Job {
+    char path[PATH_MAX];
+    uint8_t *keys;
+    size_t count;
+    uint32_t invalid;
+    int ret;
+};
+
+struct Export_Job {
+    char path[PATH_MAX];
+    uint32_t friendnum;
+    uint8_t *data;
+    size_t length;
+    uint32_t count;
+    int ret;
+};
+
+static __thread struct Import_State Import;
+
+static uint64_t get_time_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* Writes one line per friend to a new buffer and puts the number of friends in count. */
+static uint8_t *export_pack(Tox *m, size_t *length, uint32_t *count)
+{
+    size_t i, numfriends = tox_self_get_friend_list_size(m);
+    uint8_t *data = malloc(numfriends * EXPORT_LINE_SIZE + 1);
+
+    if (data == NULL) {
+        return NULL;
+    }
+
+    size_t len = 0;
+    *count = 0;
+
+    if (numfriends > 0) {
+        uint32_t friend_list[numfriends];
+        tox_self_get_friend_list(m, friend_list);
+
+        for (i = 0; i < numfriends; ++i) {
+            const struct Friend_Info *f = friends_get(m, friend_list[i]);
+
+            if (f == NULL) {
+                continue;
+            }
+
+            uint64_t last_online = tox_friend_get_last_online(m, friend_list[i], NULL);
+            char hex[TOX_PUBLIC_KEY_SIZE * 2 + 1];
+            char name[TOX_MAX_NAME_LENGTH + 1];
+            size_t j;
+
+            bin_to_hex_string(f->public_key, TOX_PUBLIC_KEY_SIZE, hex);
+            snprintf(name, sizeof(name), "%s", f->name);
+
+            /* keep every friend on one line */
+            for (j = 0; name[j]; ++j) {
+                if ((unsigned char) name[j] < 0x20) {
+                    name[j] = ' ';
+                }
+            }
+
+            len += snprintf((char *) data + len, EXPORT_LINE_SIZE + 1, "%s\t%"PRIu64"\t%s\n", hex,
+                            last_online == UINT64_MAX ? 0 : last_online, name);
+            ++*count;
+        }
+    }
+
+    *length = len;
+    return data;
+}
+
+static void export_run(void *arg)
+{
+    struct Export_Job *job = arg;
+    job->ret = write_file_atomic(job->path, job->data, job->length);
+}
+
+static void export_done(Tox *m, void *arg)
+{
+    struct Export_Job *job = arg;
+    char msg[TOX_MAX_MESSAGE_LENGTH];
+
+    if (job->ret == 0) {
+        snprintf(msg, sizeof(msg), "Exported %u friends to %.255s", job->count, job->path);
+        reply(m, job->friendnum, msg, strlen(msg));
+        log_write(LOG_LEVEL_INFO, "%s\n", msg);
+    } else {
+        snprintf(msg, sizeof(msg), "Error: Failed to write %.255s", job->path);
+        reply_error(m, job->friendnum, msg, strlen(msg));
+    }
+
+    free(job->data);
+    free(job);
+}
+
+int friendlist_export(Tox *m, uint32_t friendnum, const char *path)
+{
+    struct Export_Job *job = calloc(1, sizeof(struct Export_Job));
+
+    if (job == NULL) {
+        return -1;
+    }
+
+    job->data = export_pack(m, &job->length, &job->count);
+
+    if (job->data == NULL) {
+        free(job);
+        return -1;
+    }
+
+    snprintf(job->path, sizeof(job->path), "%s", path);
+    job->friendnum = friendnum;
+
+    if (worker_submit(export_run, export_done, job) == -1) {
+        export_run(job);
+        export_done(m, job);
+    }
+
+    return 0;
+}
+
+int friendlist_export_now(Tox *m, const char *path)
+{
+    size_t length;
+    uint32_t count;
+    uint8_t *data = export_pack(m, &length, &count);
+
+    if (data == NULL) {
+        return -1;
+    }
+
+    int ret = write_file_atomic(path, data, length);
+    free(data);
+    return ret == 0 ? (int) count : -1;
+}
+
+/* Reads the first word of every line of path as a key. Returns -1 if path can't be opened. */
+static int read_keys(const char *path, uint8_t **keys, size_t *count, uint32_t *invalid)
+{
+    FILE *fp = fopen(path, "r");
+
+    if (fp == NULL) {
+        return -1;
+    }
+
+    uint8_t *list = NULL;
+    size_t num_keys = 0, cap = 0;
+    char line[EXPORT_LINE_SIZE + 1];
+
+    *invalid = 0;
+
+    while (fgets(line, sizeof(line), fp) && num_keys < FRIEND_IMPORT_MAX_KEYS) {
+        size_t len = strlen(line);
+
+        /* skip the rest of an overlong line; only its first word matters */
+        if (len > 0 && line[len - 1] != '\n') {
+            int c;
+
+            while ((c = fgetc(fp)) != EOF && c != '\n');
+        }
+
+        line[strcspn(line, " \t\r\n")] = '\0';
+
+        if (line[0] == '\0' || line[0] == '#') {
+            continue;
+        }
+
+        if (num_keys == cap) {
+            cap = cap ? cap * 2 : 256;
+            uint8_t *tmp = realloc(list, cap * TOX_PUBLIC_KEY_SIZE);
+
+            if (tmp == NULL) {
+                exit(EXIT_FAILURE);
+            }
+
+            list = tmp;
+        }
+
+        if (parse_public_key(line, list + num_keys * TOX_PUBLIC_KEY_SIZE) == -1) {
+            ++*invalid;
+            continue;
+        }
+
+        ++num_keys;
+    }
+
+    fclose(fp);
+
+    *keys = list;
+    *count = num_keys;
+    return 0;
+}
+
+static void add_key(Tox *m, const uint8_t *public_key, struct Import_Summary *summary)
+{
+    if (friends_find(public_key) != UINT32_MAX) {
+        ++summary->existing;
+        return;
+    }
+
+    if (keylist_contains(&Blocked_Keys, public_key)) {
+        ++summary->blocked;
+        return;
+    }
+
+    TOX_ERR_FRIEND_ADD err;
+    uint32_t friendnumber = tox_friend_add_norequest(m, public_key, &err);
+
+    if (err != TOX_ERR_FRIEND_ADD_OK) {
+        if (err == TOX_ERR_FRIEND_ADD_ALREADY_SENT) {
+            ++summary->existing;
+        } else {
+            ++summary->failed;
+        }
+
+        return;
+    }
+
+    rate_limit_reset(friendnumber);
+    friends_add(m, friendnumber);
+    metrics_inc(METRIC_FRIENDS_ADDED);
+    metrics_inc(METRIC_FRIENDS_IMPORTED);
+    ++summary->added;
+}
+
+static void summary_str(const char *path, const struct Import_Summary *summary, char *buf, size_t size)
+{
+    snprintf(buf, size, "Imported %s: %u added, %u already friends, %u blocked, %u invalid, %u failed", path,
+             summary->added, summary->existing, summary->blocked, summary->invalid, summary->failed);
+}
+
+int friendlist_import_now(Tox *m, const char *path, char *summary, size_t size)
+{
+    struct Import_Summary sum;
+    uint8_t *keys;
+    size_t count, i;
+
+    memset(&sum, 0, sizeof(sum));
+
+    if (read_keys(path, &keys, &count, &sum.invalid) == -1) {
+        return -1;
+    }
+
+    for (i = 0; i < count; ++i) {
+        add_key(m, keys + i * TOX_PUBLIC_KEY_SIZE, &sum);
+    }
+
+    free(keys);
+    summary_str(path, &sum, summary, size);
+    return 0;
+}
+
+static void read_run(void *arg)
+{
+    struct Read_Job *job = arg;
+    job->ret = read_keys(job->path, &job->keys, &job->count, &job->invalid);
+}
+
+static void read_done(Tox *m, void *arg)
+{
+    struct Read_Job *job = arg;
+
+    if (job->ret == -1) {
+        char msg[TOX_MAX_MESSAGE_LENGTH];
+        snprintf(msg, sizeof(msg), "Error: Can't read %.255s", job->path);
+        reply_error(m, Import.friendnum, msg, strlen(msg));
+        memset(&Import, 0, sizeof(Import));
+        free(job);
+        return;
+    }
+
+    Import.summary.invalid = job->invalid;
+    Import.loaded = true;
+    Import.keys = job->keys;
+    Import.count = job->count;
+    Import.tokens = FRIEND_IMPORT_BURST * 1000;
+    Import.last_refill = get_time_ms();
+    free(job);
+
+    log_write(LOG_LEVEL_INFO, "Importing %zu keys from %s\n", Import.count, Import.path);
+}
+
+int friendlist_import(Tox *m, uint32_t friendnum, const char *path)
+{
+    if (Import.active) {
+        return -1;
+    }
+
+    struct Read_Job *job = calloc(1, sizeof(struct Read_Job));
+
+    if (job == NULL) {
+        return -1;
+    }
+
+    snprintf(job->path, sizeof(job->path), "%s", path);
+
+    memset(&Import, 0, sizeof(Import));
+    Import.active = true;
+    Import.friendnum = friendnum;
+    snprintf(Import.path, sizeof(Import.path), "%s", path);
+
+    if (worker_submit(read_run, read_done, job) == -1) {
+        read_run(job);
+        read_done(m, job);
+    }
+
+    return 0;
+}
+
+void friendlist_do(Tox *m)
+{
+    if (!Import.active || !Import.loaded) {
+        return;
+    }
+
+    uint64_t now = get_time_ms();
+    uint64_t refill = (now - Import.last_refill) * FRIEND_IMPORT_RATE;    /* ms * friends/s == thousandths */
+    Import.tokens = (uint32_t) MIN((uint64_t) Import.tokens + refill, FRIEND_IMPORT_BURST * 1000);
+    Import.last_refill = now;
+
+    while (Import.pos < Import.count && Import.tokens >= 1000) {
+        add_key(m, Import.keys + Import.pos * TOX_PUBLIC_KEY_SIZE, &Import.summary);
+        ++Import.pos;
+        Import.tokens -= 1000;
+    }
+
+    if (Import.pos < Import.count) {
+        return;
+    }
+
+    /* one save for the whole import */
+    if (Import.summary.added > 0) {
+        save_data(m, DATA_FILE);
+    }
+
+    char msg[TOX_MAX_MESSAGE_LENGTH];
+    summary_str(Import.path, &Import.summary, msg, sizeof(msg));
+    reply(m, Import.friendnum, msg, strlen(msg));
+    log_write(LOG_LEVEL_INFO, "%s\n", msg);
+
+    free(Import.keys);
+    memset(&Import, 0, sizeof(Import));
+}
+
+void friendlist_free(void)
+{
+    free(Import.keys);
+    memset(&Import, 0, sizeof(Import));
+}
@@ -0,0 +1,84 @@
+/*  friendlist.h
+ *
+ *
+ *  Copyright (C) 2014 toxbot All Rights Reserved.
+ *
+ *  This file is part of toxbot.
+ *
+ *  toxbot is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  toxbot is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with toxbot. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef FRIENDLIST_H
+#define FRIENDLIST_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <tox/tox.h>
+
+#define FRIEND_IMPORT_RATE      200       /* friends added per second */
+#define FRIEND_IMPORT_BURST     50
+#define FRIEND_IMPORT_MAX_KEYS  250000
+
+/* export and import commands only touch files in here, never the bot's own state files */
+#define FRIENDLIST_DIR "toxbot_friends"
+
+/*
+ * Export files have one friend per line: the public key in hex, the unix time the friend
+ * was last online (0 if never) and the friend's name, separated by tabs. Import reads
+ * the first word of every line as a public key or Tox ID, so it accepts export files as
+ * well as plain key lists. Lines starting with # are ignored.
+ */
+
+/*
+ * Writes the friend list to path on a worker thread and tells friendnum when it is done.
+ *
+ * Returns 0 if the export was started.
+ * Returns -1 on failure.
+ */
+int friendlist_export(Tox *m, uint32_t friendnum, const char *path);
+
+/*
+ * Reads the keys in path on a worker thread, then adds them as friends a few at a time
+ * from friendlist_do(), skipping blocked keys and existing friends. The savedata is saved
+ * once at the end and friendnum gets a summary.
+ *
+ * Returns 0 if the import was started.
+ * Returns -1 if an import is already running or the job could not be queued.
+ */
+int friendlist_import(Tox *m, uint32_t friendnum, const char *path);
+
+/* Adds the next batch of imported friends within the import rate. Call once per loop iteration. */
+void friendlist_do(Tox *m);
+
+/*
+ * Like friendlist_export(), but writes the file before returning. For offline use.
+ *
+ * Returns the number of friends written on success.
+ * Returns -1 on failure.
+ */
+int friendlist_export_now(Tox *m, const char *path);
+
+/*
+ * Like friendlist_import(), but adds every key before returning and puts the summary in
+ * summary. The caller must save the savedata. For offline use.
+ *
+ * Returns 0 on success.
+ * Returns -1 if path can't be read.
+ */
+int friendlist_import_now(Tox *m, const char *path, char *summary, size_t size);
+
+void friendlist_free(void);
+
+#endif /* FRIENDLIST_H */
@@ -0,0 +1,462 @@
+/*  friends.c
+ *
+ *
+ *  Copyright (C) 2014 toxbot All Rights Reserved.
+ *
+ *  This file is part of toxbot.
+ *
+ *  toxbot is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  toxbot is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with toxbot. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+
+#include <tox/tox.h>
+
+#include "friends.h"
+#include "keylist.h"
+#include "misc.h"
+#include "events.h"
+#include "journal.h"
+
+#define FLAG_WORD_BITS 64
+
+extern struct Key_List Master_Keys;
+extern struct Key_List Blocked_Keys;
+
+static __thread struct Friend_Info *Friends;
+static __thread uint32_t Num_Friend_Slots;
+static __thread uint32_t Num_Online;
+
+/* one bitset per Friend_Flag, indexed by friend number */
+static __thread uint64_t *Flags[NUM_FRIEND_FLAGS];
+static __thread uint32_t Master_Generation;
+static __thread uint32_t Blocked_Generation;
+
+/*
+ * Open addressing index from public key to friend number, with linear probing. Slots hold
+ * friend number + 1 so that 0 means empty. The size is a power of two and at most half full.
+ */
+static __thread uint32_t *Key_Index;
+static __thread uint32_t Key_Index_Size;
+static __thread uint32_t Key_Index_Count;
+static __thread uint64_t Key_Index_Seed;
+
+#define KEY_INDEX_MIN_SIZE 64
+
+static uint32_t flag_words(uint32_t num_slots)
+{
+    return (num_slots + FLAG_WORD_BITS - 1) / FLAG_WORD_BITS;
+}
+
+static void set_bit(Friend_Flag flag, uint32_t friendnumber, bool value)
+{
+    uint64_t mask = 1ULL << (friendnumber % FLAG_WORD_BITS);
+
+    if (value) {
+        Flags[flag][friendnumber / FLAG_WORD_BITS] |= mask;
+    } else {
+        Flags[flag][friendnumber / FLAG_WORD_BITS] &= ~mask;
+    }
+}
+
+static void update_key_flags(uint32_t friendnumber)
+{
+    const uint8_t *public_key = Friends[friendnumber].public_key;
+    set_bit(FRIEND_FLAG_MASTER, friendnumber, keylist_contains(&Master_Keys, public_key));
+    set_bit(FRIEND_FLAG_BLOCKED, friendnumber, keylist_contains(&Blocked_Keys, public_key));
+}
+
+/* Keys are chosen by peers, so mix in a per-thread seed to keep them from forcing collisions. */
+static uint32_t key_slot(const uint8_t *public_key)
+{
+    uint64_t h;
+    memcpy(&h, public_key, sizeof(h));
+    h ^= Key_Index_Seed;
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return (uint32_t) h & (Key_Index_Size - 1);
+}
+
+static void index_place(uint32_t friendnumber)
+{
+    uint32_t i = key_slot(Friends[friendnumber].public_key);
+
+    while (Key_Index[i] != 0) {
+        i = (i + 1) & (Key_Index_Size - 1);
+    }
+
+    Key_Index[i] = friendnumber + 1;
+}
+
+static void index_resize(uint32_t size)
+{
+    uint32_t *old = Key_Index;
+    uint32_t old_size = Key_Index_Size;
+
+    Key_Index = calloc(size, sizeof(uint32_t));
+
+    if (Key_Index == NULL) {
+        exit(EXIT_FAILURE);
+    }
+
+    Key_Index_Size = size;
+
+    if (Key_Index_Seed == 0) {
+        Key_Index_Seed = ((uint64_t) time(NULL) << 32) ^ (uint64_t) (uintptr_t) Key_Index ^ 0x9e3779b97f4a7c15ULL;
+    }
+
+    uint32_t i;
+
+    for (i = 0; i < old_size; ++i) {
+        if (old[i] != 0) {
+            index_place(old[i] - 1);
+        }
+    }
+
+    free(old);
+}
+
+static void index_insert(uint32_t friendnumber)
+{
+    if ((Key_Index_Count + 1) * 2 > Key_Index_Size) {
+        index_resize(MAX(KEY_INDEX_MIN_SIZE, Key_Index_Size * 2));
+    }
+
+    index_place(friendnumber);
+    ++Key_Index_Count;
+}
+
+static void index_remove(uint32_t friendnumber)
+{
+    if (Key_Index_Size == 0) {
+        return;
+    }
+
+    uint32_t mask = Key_Index_Size - 1;
+    uint32_t i = key_slot(Friends[friendnumber].public_key);
+
+    while (Key_Index[i] != friendnumber + 1) {
+        if (Key_Index[i] == 0) {
+            return;
+        }
+
+        i = (i + 1) & mask;
+    }
+
+    /* shift later entries of the probe run back so that lookups never stop at the hole */
+    uint32_t hole = i;
+    uint32_t j = (i + 1) & mask;
+
+    while (Key_Index[j] != 0) {
+        uint32_t home = key_slot(Friends[Key_Index[j] - 1].public_key);
+
+        if (((j - home) & mask) >= ((j - hole) & mask)) {
+            Key_Index[hole] = Key_Index[j];
+            hole = j;
+        }
+
+        j = (j + 1) & mask;
+    }
+
+    Key_Index[hole] = 0;
+    --Key_Index_Count;
+}
+
+uint32_t friends_find(const uint8_t *public_key)
+{
+    if (Key_Index_Count == 0) {
+        return UINT32_MAX;
+    }
+
+    uint32_t i = key_slot(public_key);
+
+    while (Key_Index[i] != 0) {
+        uint32_t friendnumber = Key_Index[i] - 1;
+
+        if (memcmp(Friends[friendnumber].public_key, public_key, TOX_PUBLIC_KEY_SIZE) == 0) {
+            return friendnumber;
+        }
+
+        i = (i + 1) & (Key_Index_Size - 1);
+    }
+
+    return UINT32_MAX;
+}
+
+static void friends_ensure(uint32_t friendnumber)
+{
+    if (friendnumber < Num_Friend_Slots) {
+        return;
+    }
+
+    uint32_t n = MAX(friendnumber + 1, Num_Friend_Slots * 2);
+    struct Friend_Info *tmp = realloc(Friends, n * sizeof(struct Friend_Info));
+
+    if (tmp == NULL) {
+        exit(EXIT_FAILURE);
+    }
+
+    memset(&tmp[Num_Friend_Slots], 0, (n - Num_Friend_Slots) * sizeof(struct Friend_Info));
+    Friends = tmp;
+
+    uint32_t old_words = flag_words(Num_Friend_Slots);
+    uint32_t new_words = flag_words(n);
+    int i;
+
+    for (i = 0; i < NUM_FRIEND_FLAGS; ++i) {
+        uint64_t *bits = realloc(Flags[i], new_words * sizeof(uint64_t));
+
+        if (bits == NULL) {
+            exit(EXIT_FAILURE);
+        }
+
+        memset(&bits[old_words], 0, (new_words - old_words) * sizeof(uint64_t));
+        Flags[i] = bits;
+    }
+
+    Num_Friend_Slots = n;
+}
+
+static void clear_entry(uint32_t friendnumber)
+{
+    if (Friends[friendnumber].exists) {
+        index_remove(friendnumber);
+
+        if (Friends[friendnumber].connection != TOX_CONNECTION_NONE) {
+            --Num_Online;
+        }
+    }
+
+    memset(&Friends[friendnumber], 0, sizeof(struct Friend_Info));
+
+    int i;
+
+    for (i = 0; i < NUM_FRIEND_FLAGS; ++i) {
+        set_bit(i, friendnumber, false);
+    }
+}
+
+/* Loads friendnumber's entry from toxcore. Returns -1 if the friend does not exist. */
+static int load_entry(Tox *m, uint32_t friendnumber)
+{
+    friends_ensure(friendnumber);
+    clear_entry(friendnumber);
+
+    struct Friend_Info *f = &Friends[friendnumber];
+
+    if (!tox_friend_get_public_key(m, friendnumber, f->public_key, NULL)) {
+        return -1;
+    }
+
+    size_t len = tox_friend_get_name_size(m, friendnumber, NULL);
+
+    if (len > TOX_MAX_NAME_LENGTH || !tox_friend_get_name(m, friendnumber, (uint8_t *) f->name, NULL)) {
+        len = 0;
+    }
+
+    f->name[len] = '\0';
+    f->name_len = len;
+    f->connection = tox_friend_get_connection_status(m, friendnumber, NULL);
+    f->first_seen = (uint64_t) time(NULL);
+    f->exists = true;
+    index_insert(friendnumber);
+
+    if (f->connection != TOX_CONNECTION_NONE) {
+        set_bit(FRIEND_FLAG_ONLINE, friendnumber, true);
+        ++Num_Online;
+    }
+
+    update_key_flags(friendnumber);
+
+    return 0;
+}
+
+void friends_init(Tox *m)
+{
+    Master_Generation = keylist_generation(&Master_Keys);
+    Blocked_Generation = keylist_generation(&Blocked_Keys);
+
+    size_t i, numfriends = tox_self_get_friend_list_size(m);
+
+    if (numfriends == 0) {
+        return;
+    }
+
+    uint32_t friend_list[numfriends];
+    tox_self_get_friend_list(m, friend_list);
+
+    for (i = 0; i < numfriends; ++i) {
+        load_entry(m, friend_list[i]);
+    }
+}
+
+void friends_add(Tox *m, uint32_t friendnumber)
+{
+    uint8_t public_key[TOX_PUBLIC_KEY_SIZE];
+
+    if (tox_friend_get_public_key(m, friendnumber, public_key, NULL)) {
+        journal_log_key(JOURNAL_FRIEND_ADD, public_key);
+    }
+
+    load_entry(m, friendnumber);
+}
+
+void friends_delete(Tox *m, uint32_t friendnumber)
+{
+    uint8_t public_key[TOX_PUBLIC_KEY_SIZE];
+
+    if (tox_friend_get_public_key(m, friendnumber, public_key, NULL)) {
+        journal_log_key(JOURNAL_FRIEND_REMOVE, public_key);
+    }
+
+    tox_friend_delete(m, friendnumber, NULL);
+
+    if (friendnumber < Num_Friend_Slots) {
+        clear_entry(friendnumber);
+    }
+}
+
+const struct Friend_Info *friends_get(Tox *m, uint32_t friendnumber)
+{
+    if (friendnumber < Num_Friend_Slots && Friends[friendnumber].exists) {
+        return &Friends[friendnumber];
+    }
+
+    /* don't grow the tables for numbers toxcore has never handed out */
+    if (!tox_friend_exists(m, friendnumber)) {
+        return NULL;
+    }
+
+    if (load_entry(m, friendnumber) == -1) {
+        return NULL;
+    }
+
+    return &Friends[friendnumber];
+}
+
+bool friends_flag(uint32_t friendnumber, Friend_Flag flag)
+{
+    if (friendnumber >= Num_Friend_Slots) {
+        return false;
+    }
+
+    return (Flags[flag][friendnumber / FLAG_WORD_BITS] >> (friendnumber % FLAG_WORD_BITS)) & 1;
+}
+
+void friends_set_flag(uint32_t friendnumber, Friend_Flag flag, bool value)
+{
+    if (friendnumber < Num_Friend_Slots && Friends[friendnumber].exists) {
+        set_bit(flag, friendnumber, value);
+    }
+}
+
+void friends_sync_keylists(Tox *m)
+{
+    uint32_t master_gen = keylist_generation(&Master_Keys);
+    uint32_t blocked_gen = keylist_generation(&Blocked_Keys);
+
+    if (master_gen == Master_Generation && blocked_gen == Blocked_Generation) {
+        return;
+    }
+
+    Master_Generation = master_gen;
+    Blocked_Generation = blocked_gen;
+
+    uint32_t i;
+
+    for (i = 0; i < Num_Friend_Slots; ++i) {
+        if (!Friends[i].exists) {
+            continue;
+        }
+
+        update_key_flags(i);
+
+        if (friends_flag(i, FRIEND_FLAG_BLOCKED) && !friends_flag(i, FRIEND_FLAG_MASTER)) {
+            friends_delete(m, i);
+        }
+    }
+}
+
+void friends_touch(uint32_t friendnumber)
+{
+    if (friendnumber < Num_Friend_Slots) {
+        Friends[friendnumber].last_command = (uint64_t) time(NULL);
+    }
+}
+
+void friends_set_name(uint32_t friendnumber, const uint8_t *name, size_t length)
+{
+    if (friendnumber >= Num_Friend_Slots || !Friends[friendnumber].exists) {
+        return;
+    }
+
+    struct Friend_Info *f = &Friends[friendnumber];
+    length = copy_tox_str(f->name, sizeof(f->name), (const char *) name, length);
+    f->name_len = length;
+}
+
+void friends_set_connection(uint32_t friendnumber, TOX_CONNECTION connection)
+{
+    if (friendnumber >= Num_Friend_Slots || !Friends[friendnumber].exists) {
+        return;
+    }
+
+    struct Friend_Info *f = &Friends[friendnumber];
+    bool was_online = f->connection != TOX_CONNECTION_NONE;
+    bool is_online = connection != TOX_CONNECTION_NONE;
+
+    f->connection = connection;
+    set_bit(FRIEND_FLAG_ONLINE, friendnumber, is_online);
+
+    if (was_online && !is_online) {
+        --Num_Online;
+        events_publish(EVENT_FRIEND_OFFLINE, friendnumber, f->public_key, NULL, 0);
+    } else if (!was_online && is_online) {
+        ++Num_Online;
+        events_publish(EVENT_FRIEND_ONLINE, friendnumber, f->public_key, NULL, 0);
+    }
+}
+
+uint32_t friends_num_online(void)
+{
+    return Num_Online;
+}
+
+void friends_free(void)
+{
+    int i;
+
+    for (i = 0; i < NUM_FRIEND_FLAGS; ++i) {
+        free(Flags[i]);
+        Flags[i] = NULL;
+    }
+
+    free(Friends);
+    Friends = NULL;
+    Num_Friend_Slots = 0;
+
+    free(Key_Index);
+    Key_Index = NULL;
+    Key_Index_Size = 0;
+    Key_Index_Count = 0;
+    Num_Online = 0;
+}
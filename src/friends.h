@@ -0,0 +1,96 @@
+/*  friends.h
+ *
+ *
+ *  Copyright (C) 2014 toxbot All Rights Reserved.
+ *
+ *  This file is part of toxbot.
+ *
+ *  toxbot is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  toxbot is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with toxbot. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef FRIENDS_H
+#define FRIENDS_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <tox/tox.h>
+
+typedef enum {
+    FRIEND_FLAG_MASTER,
+    FRIEND_FLAG_BLOCKED,
+    FRIEND_FLAG_ONLINE,
+    FRIEND_FLAG_MUTED,
+    NUM_FRIEND_FLAGS
+} Friend_Flag;
+
+/* Per-shard cache of friend metadata, indexed by friend number. */
+struct Friend_Info {
+    bool exists;
+    uint8_t connection;    /* TOX_CONNECTION */
+    uint8_t name_len;
+    char name[TOX_MAX_NAME_LENGTH + 1];
+    uint8_t public_key[TOX_PUBLIC_KEY_SIZE];
+    uint64_t first_seen;      /* unix time the friend was added, or the time the bot started */
+    uint64_t last_command;    /* unix time of the friend's last command, 0 if none */
+};
+
+/* Fills the table from the friend list restored from savedata. */
+void friends_init(Tox *m);
+
+/* Starts tracking a newly added friend and records the addition in the journal. */
+void friends_add(Tox *m, uint32_t friendnumber);
+
+/* Deletes friendnumber from toxcore and from the table, and records the removal in the journal. */
+void friends_delete(Tox *m, uint32_t friendnumber);
+
+/*
+ * Returns the cached metadata for friendnumber, loading it from toxcore if the friend is
+ * not in the table yet. Returns NULL if the friend does not exist.
+ */
+const struct Friend_Info *friends_get(Tox *m, uint32_t friendnumber);
+
+/*
+ * Returns the friend number of the friend with public_key in O(1), or UINT32_MAX if no
+ * friend has it.
+ */
+uint32_t friends_find(const uint8_t *public_key);
+
+/*
+ * Returns the value of flag for friendnumber. The master and blocked flags follow the key
+ * lists (see friends_sync_keylists); unknown friends have no flags set.
+ */
+bool friends_flag(uint32_t friendnumber, Friend_Flag flag);
+
+void friends_set_flag(uint32_t friendnumber, Friend_Flag flag, bool value);
+
+/*
+ * Recomputes the master and blocked flags of every friend if a key list has changed since the
+ * last call, and deletes friends whose key has been blocked, whichever shard blocked it.
+ */
+void friends_sync_keylists(Tox *m);
+
+/* Records the time of a command from friendnumber. */
+void friends_touch(uint32_t friendnumber);
+
+/* Keep the table current; called from the friend_name and friend_connection_status callbacks. */
+void friends_set_name(uint32_t friendnumber, const uint8_t *name, size_t length);
+void friends_set_connection(uint32_t friendnumber, TOX_CONNECTION connection);
+
+/* Returns the number of friends that are online. */
+uint32_t friends_num_online(void);
+
+void friends_free(void);
+
+#endif /* FRIENDS_H */
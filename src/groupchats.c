@@ -24,11 +24,25 @@
 #include <stdlib.h>
 #include <stdbool.h>
 #include <string.h>
+#include <time.h>
 
 #include "toxbot.h"
 #include "groupchats.h"
+#include "misc.h"
+#include "log.h"
+#include "bridge.h"
+#include "history.h"
+#include "events.h"
+#include "pool.h"
+#include "invitequeue.h"
 
-extern struct Tox_Bot Tox_Bot;
+#define GROUPS_FILE_MAGIC "TBGM"
+#define GROUPS_FILE_VERSION 2
+#define GROUPS_HEADER_SIZE (4 + 2 + 2 + 8 + 4)
+#define GROUPS_ENTRY_SIZE_V1 (TOX_CONFERENCE_ID_SIZE + 4 + 1 + 1 + 2)
+#define GROUPS_ENTRY_SIZE (GROUPS_ENTRY_SIZE_V1 + 1)    /* version 2 added the pool id */
+
+extern __thread struct Tox_Bot Tox_Bot;
 
 void realloc_groupchats(int n)
 {
@@ -63,6 +77,7 @@ int group_add(uint32_t groupnum, uint8_t type, const char *password)
         Tox_Bot.g_chats[i].groupnum = groupnum;
         Tox_Bot.g_chats[i].active = true;
         Tox_Bot.g_chats[i].type = type;
+        Tox_Bot.g_chats[i].added_time = (uint64_t) time(NULL);
 
         if (password) {
             Tox_Bot.g_chats[i].has_pass = true;
@@ -85,7 +100,14 @@ void group_leave(uint32_t groupnum)
 
     for (i = 0; i < Tox_Bot.chats_idx; ++i) {
         if (Tox_Bot.g_chats[i].active && Tox_Bot.g_chats[i].groupnum == groupnum) {
+            uint8_t pool = Tox_Bot.g_chats[i].pool;
+            free(Tox_Bot.g_chats[i].peers);
             memset(&Tox_Bot.g_chats[i], 0, sizeof(struct Group_Chat));
+            pool_shard_removed(pool);
+            bridge_group_removed(groupnum);
+            history_group_removed(groupnum);
+            invite_queue_group_removed(groupnum);
+            events_publish(EVENT_GROUP_LEAVE, groupnum, NULL, NULL, 0);
             break;
         }
     }
@@ -100,6 +122,98 @@ void group_leave(uint32_t groupnum)
     realloc_groupchats(i);
 }
 
+void groups_free(void)
+{
+    int i;
+
+    for (i = 0; i < Tox_Bot.chats_idx; ++i) {
+        free(Tox_Bot.g_chats[i].peers);
+    }
+
+    memset(Tox_Bot.g_chats, 0, Tox_Bot.chats_idx * sizeof(struct Group_Chat));
+    Tox_Bot.chats_idx = 0;
+    realloc_groupchats(0);
+}
+
+void group_roster_update(Tox *m, uint32_t groupnum)
+{
+    int idx = group_index(groupnum);
+
+    if (idx == -1) {
+        return;
+    }
+
+    struct Group_Chat *chat = &Tox_Bot.g_chats[idx];
+    TOX_ERR_CONFERENCE_PEER_QUERY err;
+    uint32_t num_peers = tox_conference_peer_count(m, groupnum, &err);
+
+    if (err != TOX_ERR_CONFERENCE_PEER_QUERY_OK) {
+        num_peers = 0;
+    }
+
+    /* peers who joined a shard answer the invites that were routed to it */
+    if (num_peers > chat->num_peers && chat->pool_pending) {
+        chat->pool_pending -= MIN(chat->pool_pending, num_peers - chat->num_peers);
+    }
+
+    if (num_peers == 0) {
+        free(chat->peers);
+        chat->peers = NULL;
+        chat->num_peers = 0;
+        return;
+    }
+
+    struct Group_Peer *peers = realloc(chat->peers, num_peers * sizeof(struct Group_Peer));
+
+    if (peers == NULL) {
+        exit(EXIT_FAILURE);
+    }
+
+    uint32_t i;
+
+    for (i = 0; i < num_peers; ++i) {
+        struct Group_Peer *peer = &peers[i];
+        size_t len = tox_conference_peer_get_name_size(m, groupnum, i, NULL);
+
+        if (len > TOX_MAX_NAME_LENGTH || !tox_conference_peer_get_name(m, groupnum, i, (uint8_t *) peer->name, NULL)) {
+            len = 0;
+        }
+
+        peer->name[len] = '\0';
+        peer->name_len = len;
+
+        if (!tox_conference_peer_get_public_key(m, groupnum, i, peer->public_key, NULL)) {
+            memset(peer->public_key, 0, TOX_PUBLIC_KEY_SIZE);
+        }
+    }
+
+    chat->peers = peers;
+    chat->num_peers = num_peers;
+}
+
+const struct Group_Peer *group_peer(uint32_t groupnum, uint32_t peernum)
+{
+    int idx = group_index(groupnum);
+
+    if (idx == -1 || peernum >= Tox_Bot.g_chats[idx].num_peers) {
+        return NULL;
+    }
+
+    return &Tox_Bot.g_chats[idx].peers[peernum];
+}
+
+void group_peer_name_update(uint32_t groupnum, uint32_t peernum, const uint8_t *name, size_t length)
+{
+    int idx = group_index(groupnum);
+
+    if (idx == -1 || peernum >= Tox_Bot.g_chats[idx].num_peers) {
+        return;
+    }
+
+    struct Group_Peer *peer = &Tox_Bot.g_chats[idx].peers[peernum];
+    peer->name_len = copy_tox_str(peer->name, sizeof(peer->name), (const char *) name, length);
+}
+
 int group_index(uint32_t groupnum)
 {
     int i;
@@ -112,3 +226,238 @@ int group_index(uint32_t groupnum)
 
     return -1;
 }
+
+uint8_t *groups_pack(Tox *m, size_t *length)
+{
+    size_t size = GROUPS_HEADER_SIZE + pools_packed_size();
+    uint16_t count = 0;
+    int i;
+
+    for (i = 0; i < Tox_Bot.chats_idx; ++i) {
+        if (Tox_Bot.g_chats[i].active) {
+            size += GROUPS_ENTRY_SIZE + Tox_Bot.g_chats[i].title_len + strlen(Tox_Bot.g_chats[i].password);
+            ++count;
+        }
+    }
+
+    uint8_t *data = malloc(size);
+
+    if (data == NULL) {
+        return NULL;
+    }
+
+    memcpy(data, GROUPS_FILE_MAGIC, 4);
+    pack_u16(data + 4, GROUPS_FILE_VERSION);
+    pack_u16(data + 6, count);
+    pack_u64(data + 8, Tox_Bot.inactive_limit);
+    pack_u32(data + 16, (uint32_t) Tox_Bot.default_groupnum);
+
+    uint8_t *p = data + GROUPS_HEADER_SIZE;
+
+    for (i = 0; i < Tox_Bot.chats_idx; ++i) {
+        struct Group_Chat *chat = &Tox_Bot.g_chats[i];
+
+        if (!chat->active) {
+            continue;
+        }
+
+        size_t pass_len = strlen(chat->password);
+
+        memset(p, 0, TOX_CONFERENCE_ID_SIZE);
+        tox_conference_get_id(m, chat->groupnum, p);
+        p += TOX_CONFERENCE_ID_SIZE;
+        pack_u32(p, chat->groupnum);
+        p[4] = chat->type;
+        p[5] = (uint8_t) pass_len;
+        pack_u16(p + 6, (uint16_t) chat->title_len);
+        p[8] = chat->pool;
+        p += 9;
+        memcpy(p, chat->title, chat->title_len);
+        p += chat->title_len;
+        memcpy(p, chat->password, pass_len);
+        p += pass_len;
+    }
+
+    pools_pack(p);
+
+    *length = size;
+    return data;
+}
+
+int groups_save(Tox *m, const char *path)
+{
+    size_t length;
+    uint8_t *data = groups_pack(m, &length);
+
+    if (data == NULL) {
+        return -1;
+    }
+
+    int ret = write_file_atomic(path, data, length);
+    free(data);
+    return ret;
+}
+
+/*
+ * Adds the groups saved in path that toxcore restored, with their saved settings.
+ *
+ * Returns 0 on success.
+ * Returns -1 if the file does not exist or is invalid.
+ */
+static int groups_load_file(Tox *m, const char *path)
+{
+    off_t size = file_size(path);
+
+    if (size < GROUPS_HEADER_SIZE) {
+        return -1;
+    }
+
+    FILE *fp = fopen(path, "rb");
+
+    if (fp == NULL) {
+        return -1;
+    }
+
+    uint8_t *data = malloc(size);
+
+    if (data == NULL) {
+        fclose(fp);
+        return -1;
+    }
+
+    if (fread(data, size, 1, fp) != 1) {
+        free(data);
+        fclose(fp);
+        return -1;
+    }
+
+    fclose(fp);
+
+    uint16_t version = unpack_u16(data + 4);
+
+    if (memcmp(data, GROUPS_FILE_MAGIC, 4) != 0 || version < 1 || version > GROUPS_FILE_VERSION) {
+        log_write(LOG_LEVEL_WARNING, "Warning: '%s' has an unknown format; ignoring\n", path);
+        free(data);
+        return -1;
+    }
+
+    size_t entry_size = version >= 2 ? GROUPS_ENTRY_SIZE : GROUPS_ENTRY_SIZE_V1;
+
+    uint16_t count = unpack_u16(data + 6);
+    uint32_t old_default = unpack_u32(data + 16);
+    Tox_Bot.inactive_limit = unpack_u64(data + 8);
+
+    const uint8_t *p = data + GROUPS_HEADER_SIZE;
+    const uint8_t *end = data + size;
+    uint16_t i;
+
+    for (i = 0; i < count; ++i) {
+        if (end - p < entry_size) {
+            break;
+        }
+
+        const uint8_t *id = p;
+        uint32_t old_groupnum = unpack_u32(p + TOX_CONFERENCE_ID_SIZE);
+        uint8_t type = p[TOX_CONFERENCE_ID_SIZE + 4];
+        size_t pass_len = p[TOX_CONFERENCE_ID_SIZE + 5];
+        size_t title_len = unpack_u16(p + TOX_CONFERENCE_ID_SIZE + 6);
+        uint8_t pool = version >= 2 ? p[TOX_CONFERENCE_ID_SIZE + 8] : 0;
+        p += entry_size;
+
+        if (end - p < title_len + pass_len || title_len >= TOX_MAX_NAME_LENGTH || pass_len >= MAX_PASSWORD_SIZE) {
+            break;
+        }
+
+        const uint8_t *title = p;
+        const uint8_t *pass = p + title_len;
+        p += title_len + pass_len;
+
+        TOX_ERR_CONFERENCE_BY_ID err;
+        uint32_t groupnum = tox_conference_by_id(m, id, &err);
+
+        if (err != TOX_ERR_CONFERENCE_BY_ID_OK) {
+            log_write(LOG_LEVEL_WARNING, "Saved group %u was not restored by toxcore; dropping it\n", old_groupnum);
+            continue;
+        }
+
+        char password[MAX_PASSWORD_SIZE];
+        memcpy(password, pass, pass_len);
+        password[pass_len] = '\0';
+
+        if (group_index(groupnum) != -1 || group_add(groupnum, type, pass_len ? password : NULL) == -1) {
+            continue;
+        }
+
+        int idx = group_index(groupnum);
+        memcpy(Tox_Bot.g_chats[idx].title, title, title_len);
+        Tox_Bot.g_chats[idx].title[title_len] = '\0';
+        Tox_Bot.g_chats[idx].title_len = title_len;
+        Tox_Bot.g_chats[idx].pool = pool;
+
+        if (old_groupnum == old_default) {
+            Tox_Bot.default_groupnum = groupnum;
+        }
+    }
+
+    /* the pool table follows the last entry; version 1 files have none */
+    if (pools_unpack(m, p, version >= 2 && i == count ? end - p : 0) == -1) {
+        log_write(LOG_LEVEL_WARNING, "Warning: '%s' has a truncated pool table\n", path);
+    }
+
+    free(data);
+    return 0;
+}
+
+int groups_load(Tox *m, const char *path)
+{
+    /* a missing file is normal on the first start after an upgrade; the chatlist below still counts */
+    bool loaded = groups_load_file(m, path) == 0;
+
+    /* conferences toxcore restored that we have no record of */
+    size_t num_chats = tox_conference_get_chatlist_size(m);
+
+    if (num_chats > 0) {
+        uint32_t chatlist[num_chats];
+        tox_conference_get_chatlist(m, chatlist);
+
+        size_t j;
+
+        for (j = 0; j < num_chats; ++j) {
+            if (group_index(chatlist[j]) != -1) {
+                continue;
+            }
+
+            uint8_t type = tox_conference_get_type(m, chatlist[j], NULL);
+
+            if (group_add(chatlist[j], type, NULL) == -1) {
+                continue;
+            }
+
+            int idx = group_index(chatlist[j]);
+            size_t title_len = tox_conference_get_title_size(m, chatlist[j], NULL);
+
+            if (title_len > 0 && title_len < TOX_MAX_NAME_LENGTH
+                    && tox_conference_get_title(m, chatlist[j], (uint8_t *) Tox_Bot.g_chats[idx].title, NULL)) {
+                Tox_Bot.g_chats[idx].title[title_len] = '\0';
+                Tox_Bot.g_chats[idx].title_len = title_len;
+            }
+        }
+
+        /* without a file the default stays conference 0, as it always was, if toxcore restored it */
+        if (!loaded && group_index(Tox_Bot.default_groupnum) == -1) {
+            Tox_Bot.default_groupnum = chatlist[0];
+        }
+    }
+
+    int num_groups = 0;
+    int i;
+
+    for (i = 0; i < Tox_Bot.chats_idx; ++i) {
+        if (Tox_Bot.g_chats[i].active) {
+            group_roster_update(m, Tox_Bot.g_chats[i].groupnum);
+            ++num_groups;
+        }
+    }
+
+    return num_groups;
+}
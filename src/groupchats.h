@@ -26,6 +26,12 @@
 #define SECONDS_IN_DAY 86400UL
 #define MAX_PASSWORD_SIZE 64
 
+struct Group_Peer {
+    uint8_t public_key[TOX_PUBLIC_KEY_SIZE];
+    uint8_t name_len;
+    char name[TOX_MAX_NAME_LENGTH + 1];
+};
+
 struct Group_Chat {
     uint32_t groupnum;
     bool active;
@@ -34,6 +40,20 @@ struct Group_Chat {
     char title[TOX_MAX_NAME_LENGTH];
     int title_len;
     char password[MAX_PASSWORD_SIZE];
+    uint64_t added_time;    /* unix time the group was created, joined or restored */
+
+    /* roster, kept current by the peer list and peer name callbacks */
+    uint32_t num_peers;
+    struct Group_Peer *peers;
+
+    /* pool id (see pool.h), 0 if the group is not part of a pool */
+    uint8_t pool;
+    uint16_t pool_pending;    /* invites routed to this shard that have not been answered yet */
+    uint64_t pool_pending_since;
+
+    /* trigger responses (see trigger.h); tokens are thousandths of a response */
+    uint32_t trigger_tokens;
+    uint64_t trigger_refill;    /* milliseconds, 0 until the first response */
 };
 
 int group_add(uint32_t groupnum, uint8_t type, const char *password);
@@ -41,4 +61,43 @@ void group_leave(uint32_t groupnum);
 int group_index(uint32_t groupnum);
 void realloc_groupchats(int n);
 
+/* Frees every group entry and its roster. */
+void groups_free(void);
+
+/* Reloads the roster of groupnum from toxcore. */
+void group_roster_update(Tox *m, uint32_t groupnum);
+
+/* Returns the cached roster entry of peernum in groupnum, or NULL if there is none. */
+const struct Group_Peer *group_peer(uint32_t groupnum, uint32_t peernum);
+
+/* Updates the cached name of one peer of groupnum. */
+void group_peer_name_update(uint32_t groupnum, uint32_t peernum, const uint8_t *name, size_t length);
+
+/*
+ * Serializes the bot-side group table (see groups_save) into a newly allocated buffer
+ * and puts its size in length. The caller must free the buffer.
+ *
+ * Returns NULL on allocation failure.
+ */
+uint8_t *groups_pack(Tox *m, size_t *length);
+
+/*
+ * Writes the bot-side group table (titles, passwords, types, pools, default group) and the
+ * inactive friend limit to path in a compact versioned binary format.
+ *
+ * Returns 0 on success.
+ * Returns -1 on failure.
+ */
+int groups_save(Tox *m, const char *path);
+
+/*
+ * Loads the group table saved by groups_save() and reconciles it with the conferences
+ * restored by toxcore. Saved groups that toxcore no longer knows about are dropped and
+ * restored conferences missing from the file, or all of them if the file is missing or
+ * invalid, are added with default settings.
+ *
+ * Returns the number of groups in the table.
+ */
+int groups_load(Tox *m, const char *path);
+
 #endif  /* GROUPCHATS_H */
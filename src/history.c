@@ -0,0 +1,888 @@
+/*  history.c
+ *
+ *
+ *  Copyright (C) 2014 toxbot All Rights Reserved.
+ *
+ *  This file is part of toxbot.
+ *
+ *  toxbot is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  toxbot is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with toxbot. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Each group is logged to HISTORY_DIR/<conference id>/ as a series of append-only segments
+ * named after the sequence number of their first record. Next to every segment is a sparse
+ * index with one entry per HISTORY_INDEX_INTERVAL records.
+ *
+ * Record:      u16 length of the rest | u64 timestamp | u8 message type | u8 name length | name | message
+ * Index entry: u64 sequence number | u64 timestamp | u64 segment offset
+ *
+ * The Tox thread only encodes records into a pending buffer. Writing, rotation and
+ * retention run on the worker pool, with at most one flush in flight per group so that
+ * records stay in order. Queries map the segments read-only, so they never wait on the writer.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include <tox/tox.h>
+
+#include "history.h"
+#include "groupchats.h"
+#include "worker.h"
+#include "metrics.h"
+#include "misc.h"
+#include "log.h"
+#include "reply.h"
+
+#define HISTORY_INDEX_INTERVAL  32
+#define HISTORY_MAX_PENDING     (64 * 1024)
+#define RECORD_HEADER_SIZE      12
+#define INDEX_ENTRY_SIZE        24
+
+struct History_Log {
+    uint32_t groupnum;
+    char dir[PATH_MAX];
+    bool closed;
+    bool flush_in_flight;
+
+    /* filled by the Tox thread */
+    uint8_t *pending;
+    size_t pending_len;
+
+    /* owned by the flush job while flush_in_flight is set */
+    uint8_t *batch;
+    size_t batch_len;
+    int seg_fd;
+    int idx_fd;
+    uint64_t seg_size;
+    uint64_t next_seq;
+};
+
+struct History_Query {
+    uint32_t friendnum;
+    uint32_t groupnum;
+    uint32_t count;
+    char dir[PATH_MAX];
+
+    char *out;
+    size_t out_len;
+    size_t out_size;
+    uint32_t found;
+};
+
+struct Mapped_File {
+    uint8_t *data;
+    size_t size;
+};
+
+static uint64_t History_Max_Bytes = HISTORY_DEFAULT_MAX_BYTES;
+static uint64_t History_Max_Age;
+
+static __thread struct History_Log **Logs;
+static __thread int Num_Logs;
+
+void history_set_retention(uint64_t max_bytes, uint64_t max_age)
+{
+    History_Max_Bytes = max_bytes;
+    History_Max_Age = max_age;
+}
+
+/* Returns -1 if the path does not fit in buf. */
+static int segment_path(char *buf, size_t size, const char *dir, uint64_t base, const char *ext)
+{
+    int ret = snprintf(buf, size, "%s/%020"PRIu64".%s", dir, base, ext);
+    return ret < 0 || (size_t) ret >= size ? -1 : 0;
+}
+
+static int group_dir(Tox *m, uint32_t groupnum, char *buf, size_t size)
+{
+    uint8_t id[TOX_CONFERENCE_ID_SIZE];
+    char hex[TOX_CONFERENCE_ID_SIZE * 2 + 1];
+
+    if (!tox_conference_get_id(m, groupnum, id)) {
+        return -1;
+    }
+
+    bin_to_hex_string(id, sizeof(id), hex);
+    snprintf(buf, size, "%s/%s", HISTORY_DIR, hex);
+    return 0;
+}
+
+static int compare_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *) a;
+    uint64_t y = *(const uint64_t *) b;
+    return x < y ? -1 : x > y;
+}
+
+/*
+ * Puts the base sequence numbers of the segments in dir, sorted, in a newly allocated *bases.
+ *
+ * Returns the number of segments.
+ * Returns -1 if dir cannot be read.
+ */
+static int list_segments(const char *dir, uint64_t **bases)
+{
+    DIR *d = opendir(dir);
+
+    if (d == NULL) {
+        return -1;
+    }
+
+    uint64_t *list = NULL;
+    int count = 0;
+    struct dirent *ent;
+
+    while ((ent = readdir(d)) != NULL) {
+        uint64_t base;
+        int end = 0;
+
+        if (sscanf(ent->d_name, "%20"SCNu64".seg%n", &base, &end) != 1 || end == 0 || ent->d_name[end] != '\0') {
+            continue;
+        }
+
+        uint64_t *tmp = realloc(list, (count + 1) * sizeof(uint64_t));
+
+        if (tmp == NULL) {
+            exit(EXIT_FAILURE);
+        }
+
+        list = tmp;
+        list[count++] = base;
+    }
+
+    closedir(d);
+
+    if (count > 0) {
+        qsort(list, count, sizeof(uint64_t), compare_u64);
+    }
+
+    *bases = list;
+    return count;
+}
+
+/* Maps path read-only. An empty file gives a NULL mapping. Returns -1 if path cannot be mapped. */
+static int map_file(const char *path, struct Mapped_File *map)
+{
+    map->data = NULL;
+    map->size = 0;
+
+    int fd = open(path, O_RDONLY);
+
+    if (fd == -1) {
+        return -1;
+    }
+
+    struct stat st;
+
+    if (fstat(fd, &st) == -1) {
+        close(fd);
+        return -1;
+    }
+
+    if (st.st_size > 0) {
+        void *data = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+
+        if (data == MAP_FAILED) {
+            close(fd);
+            return -1;
+        }
+
+        map->data = data;
+        map->size = st.st_size;
+    }
+
+    close(fd);
+    return 0;
+}
+
+static void unmap_file(struct Mapped_File *map)
+{
+    if (map->data) {
+        munmap(map->data, map->size);
+    }
+}
+
+/*
+ * Finds the last index entry of segment base whose sequence number is at most seq and puts
+ * that sequence number in *entry_seq. Falls back to the start of the segment.
+ *
+ * Returns the segment offset of the entry.
+ */
+static uint64_t index_lookup(const char *dir, uint64_t base, uint64_t seq, uint64_t *entry_seq)
+{
+    char path[PATH_MAX];
+    struct Mapped_File idx;
+
+    *entry_seq = base;
+
+    if (segment_path(path, sizeof(path), dir, base, "idx") == -1 || map_file(path, &idx) == -1) {
+        return 0;
+    }
+
+    size_t lo = 0;
+    size_t hi = idx.size / INDEX_ENTRY_SIZE;
+    uint64_t offset = 0;
+
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        uint64_t mid_seq = unpack_u64(idx.data + mid * INDEX_ENTRY_SIZE);
+
+        if (mid_seq <= seq) {
+            *entry_seq = mid_seq;
+            offset = unpack_u64(idx.data + mid * INDEX_ENTRY_SIZE + 16);
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    unmap_file(&idx);
+    return offset;
+}
+
+/* Returns the length of the complete record at offset, or 0 if there is none. */
+static size_t record_length(const struct Mapped_File *seg, uint64_t offset)
+{
+    if (offset + RECORD_HEADER_SIZE > seg->size) {
+        return 0;
+    }
+
+    size_t length = 2 + unpack_u16(seg->data + offset);
+
+    if (length < RECORD_HEADER_SIZE || offset + length > seg->size
+            || RECORD_HEADER_SIZE + seg->data[offset + 11] > length) {
+        return 0;
+    }
+
+    return length;
+}
+
+/*
+ * Counts the records of segment base and puts the length of its complete records in *valid_len.
+ *
+ * Returns the sequence number following the segment's last complete record.
+ */
+static uint64_t segment_end(const char *dir, uint64_t base, uint64_t *valid_len)
+{
+    char path[PATH_MAX];
+    struct Mapped_File seg;
+    uint64_t seq;
+    uint64_t offset = index_lookup(dir, base, UINT64_MAX, &seq);
+
+    *valid_len = 0;
+
+    if (segment_path(path, sizeof(path), dir, base, "seg") == -1 || map_file(path, &seg) == -1) {
+        return base;
+    }
+
+    if (offset > seg.size) {    /* index is ahead of a truncated segment */
+        offset = 0;
+        seq = base;
+    }
+
+    size_t length;
+
+    while ((length = record_length(&seg, offset)) > 0) {
+        offset += length;
+        ++seq;
+    }
+
+    unmap_file(&seg);
+    *valid_len = offset;
+    return seq;
+}
+
+static int write_all(int fd, const uint8_t *data, size_t length)
+{
+    while (length > 0) {
+        ssize_t ret = write(fd, data, length);
+
+        if (ret == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            return -1;
+        }
+
+        data += ret;
+        length -= ret;
+    }
+
+    return 0;
+}
+
+/* Deletes the oldest segments of dir, except active_base, while they exceed the retention limits. */
+static void apply_retention(const char *dir, uint64_t active_base)
+{
+    uint64_t *bases;
+    int count = list_segments(dir, &bases);
+
+    if (count <= 0) {
+        return;
+    }
+
+    uint64_t sizes[count];
+    time_t mtimes[count];
+    uint64_t total = 0;
+    char seg_path[PATH_MAX];
+    char idx_path[PATH_MAX];
+    int i;
+
+    for (i = 0; i < count; ++i) {
+        struct stat st;
+        sizes[i] = 0;
+        mtimes[i] = 0;
+
+        if (segment_path(seg_path, sizeof(seg_path), dir, bases[i], "seg") == -1
+                || segment_path(idx_path, sizeof(idx_path), dir, bases[i], "idx") == -1) {
+            continue;
+        }
+
+        if (stat(seg_path, &st) == 0) {
+            sizes[i] += st.st_size;
+            mtimes[i] = st.st_mtime;
+        }
+
+        if (stat(idx_path, &st) == 0) {
+            sizes[i] += st.st_size;
+        }
+
+        total += sizes[i];
+    }
+
+    time_t cutoff = History_Max_Age ? time(NULL) - (time_t) History_Max_Age : 0;
+
+    for (i = 0; i < count && bases[i] != active_base; ++i) {
+        if (total <= History_Max_Bytes && mtimes[i] >= cutoff) {
+            break;
+        }
+
+        if (segment_path(seg_path, sizeof(seg_path), dir, bases[i], "seg") == -1
+                || segment_path(idx_path, sizeof(idx_path), dir, bases[i], "idx") == -1) {
+            continue;
+        }
+
+        unlink(seg_path);
+        unlink(idx_path);
+        total -= sizes[i];
+
+        log_write(LOG_LEVEL_DEBUG, "History: removed segment %s\n", seg_path);
+    }
+
+    free(bases);
+}
+
+static void close_segment(struct History_Log *log)
+{
+    if (log->seg_fd != -1) {
+        close(log->seg_fd);
+        log->seg_fd = -1;
+    }
+
+    if (log->idx_fd != -1) {
+        close(log->idx_fd);
+        log->idx_fd = -1;
+    }
+}
+
+static int open_segment(struct History_Log *log, uint64_t base, uint64_t valid_len)
+{
+    char path[PATH_MAX];
+
+    if (segment_path(path, sizeof(path), log->dir, base, "seg") == -1) {
+        return -1;
+    }
+
+    log->seg_fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0600);
+
+    if (segment_path(path, sizeof(path), log->dir, base, "idx") == -1) {
+        close_segment(log);
+        return -1;
+    }
+
+    /* an empty segment must not inherit the entries of an earlier one with the same base */
+    log->idx_fd = open(path, O_WRONLY | O_CREAT | O_APPEND | (valid_len == 0 ? O_TRUNC : 0), 0600);
+
+    if (log->seg_fd == -1 || log->idx_fd == -1) {
+        close_segment(log);
+        return -1;
+    }
+
+    /* drop a record torn by a crash */
+    if (ftruncate(log->seg_fd, valid_len) == -1) {
+        close_segment(log);
+        return -1;
+    }
+
+    log->seg_size = valid_len;
+    return 0;
+}
+
+/* Opens the newest segment of the log's directory, creating the directory if needed. */
+static int open_log(struct History_Log *log)
+{
+    mkdir(HISTORY_DIR, 0700);
+
+    if (mkdir(log->dir, 0700) == -1 && errno != EEXIST) {
+        return -1;
+    }
+
+    uint64_t *bases;
+    int count = list_segments(log->dir, &bases);
+
+    if (count == -1) {
+        return -1;
+    }
+
+    uint64_t base = 0;
+    uint64_t valid_len = 0;
+    log->next_seq = 0;
+
+    if (count > 0) {
+        base = bases[count - 1];
+        log->next_seq = segment_end(log->dir, base, &valid_len);
+    }
+
+    free(bases);
+    return open_segment(log, base, valid_len);
+}
+
+static int rotate_segment(struct History_Log *log)
+{
+    close_segment(log);
+
+    if (open_segment(log, log->next_seq, 0) == -1) {
+        return -1;
+    }
+
+    apply_retention(log->dir, log->next_seq);
+    return 0;
+}
+
+/* Appends batch[start, end) to the current segment along with its index entries. */
+static int write_range(struct History_Log *log, size_t start, size_t end, const uint8_t *idx, size_t idx_len)
+{
+    if (write_all(log->seg_fd, log->batch + start, end - start) == -1) {
+        return -1;
+    }
+
+    log->seg_size += end - start;
+
+    return write_all(log->idx_fd, idx, idx_len);
+}
+
+static void flush_run(void *arg)
+{
+    struct History_Log *log = arg;
+
+    if (log->seg_fd == -1 && open_log(log) == -1) {
+        log_write(LOG_LEVEL_WARNING, "History: failed to open %s\n", log->dir);
+        log->batch_len = 0;
+        return;
+    }
+
+    uint8_t idx[(HISTORY_MAX_PENDING / RECORD_HEADER_SIZE / HISTORY_INDEX_INTERVAL + 2) * INDEX_ENTRY_SIZE];
+    size_t idx_len = 0;
+    size_t start = 0;
+    size_t offset = 0;
+
+    while (offset < log->batch_len) {
+        size_t length = 2 + unpack_u16(log->batch + offset);
+
+        if (log->seg_size > 0 && log->seg_size + (offset - start) + length > HISTORY_SEGMENT_SIZE) {
+            if (write_range(log, start, offset, idx, idx_len) == -1 || rotate_segment(log) == -1) {
+                goto on_error;
+            }
+
+            start = offset;
+            idx_len = 0;
+        }
+
+        uint64_t seg_offset = log->seg_size + (offset - start);
+
+        if (seg_offset == 0 || log->next_seq % HISTORY_INDEX_INTERVAL == 0) {
+            pack_u64(idx + idx_len, log->next_seq);
+            memcpy(idx + idx_len + 8, log->batch + offset + 2, 8);    /* timestamp is already packed */
+            pack_u64(idx + idx_len + 16, seg_offset);
+            idx_len += INDEX_ENTRY_SIZE;
+        }
+
+        offset += length;
+        ++log->next_seq;
+    }
+
+    if (write_range(log, start, offset, idx, idx_len) == -1) {
+        goto on_error;
+    }
+
+    log->batch_len = 0;
+    return;
+
+on_error:
+    log_write(LOG_LEVEL_WARNING, "History: failed to write %s: %s\n", log->dir, strerror(errno));
+    close_segment(log);    /* reopened and repaired by the next flush */
+    log->batch_len = 0;
+}
+
+static void flush_done(Tox *m, void *arg)
+{
+    struct History_Log *log = arg;
+    log->flush_in_flight = false;
+}
+
+static int start_flush(struct History_Log *log)
+{
+    uint8_t *tmp = log->batch;
+    log->batch = log->pending;
+    log->batch_len = log->pending_len;
+    log->pending = tmp;
+    log->pending_len = 0;
+    log->flush_in_flight = true;
+
+    if (worker_submit(flush_run, flush_done, log) == -1) {
+        /* swap back and retry on the next iteration */
+        log->pending = log->batch;
+        log->pending_len = log->batch_len;
+        log->batch = tmp;
+        log->batch_len = 0;
+        log->flush_in_flight = false;
+        return -1;
+    }
+
+    return 0;
+}
+
+static void free_log(struct History_Log *log)
+{
+    close_segment(log);
+    free(log->pending);
+    free(log->batch);
+    free(log);
+}
+
+static struct History_Log *get_log(Tox *m, uint32_t groupnum)
+{
+    int i;
+
+    for (i = 0; i < Num_Logs; ++i) {
+        if (Logs[i]->groupnum == groupnum && !Logs[i]->closed) {
+            return Logs[i];
+        }
+    }
+
+    struct History_Log *log = calloc(1, sizeof(struct History_Log));
+
+    if (log == NULL) {
+        exit(EXIT_FAILURE);
+    }
+
+    if (group_dir(m, groupnum, log->dir, sizeof(log->dir)) == -1) {
+        free(log);
+        return NULL;
+    }
+
+    log->pending = malloc(HISTORY_MAX_PENDING);
+    log->batch = malloc(HISTORY_MAX_PENDING);
+
+    if (log->pending == NULL || log->batch == NULL) {
+        exit(EXIT_FAILURE);
+    }
+
+    log->groupnum = groupnum;
+    log->seg_fd = -1;
+    log->idx_fd = -1;
+
+    struct History_Log **tmp = realloc(Logs, (Num_Logs + 1) * sizeof(struct History_Log *));
+
+    if (tmp == NULL) {
+        exit(EXIT_FAILURE);
+    }
+
+    Logs = tmp;
+    Logs[Num_Logs++] = log;
+    return log;
+}
+
+void history_on_message(Tox *m, uint32_t groupnum, uint32_t peernum, TOX_MESSAGE_TYPE type,
+                        const uint8_t *message, size_t length)
+{
+    if (History_Max_Bytes == 0) {
+        return;
+    }
+
+    struct History_Log *log = get_log(m, groupnum);
+
+    if (log == NULL) {
+        return;
+    }
+
+    const struct Group_Peer *peer = group_peer(groupnum, peernum);
+    const char *name = peer ? peer->name : "";
+    size_t name_len = peer ? peer->name_len : 0;
+
+    length = MIN(length, TOX_MAX_MESSAGE_LENGTH);
+    size_t rec_len = RECORD_HEADER_SIZE + name_len + length;
+
+    if (log->pending_len + rec_len > HISTORY_MAX_PENDING) {
+        metrics_inc(METRIC_HISTORY_DROPPED);
+        return;
+    }
+
+    uint8_t *rec = log->pending + log->pending_len;
+    pack_u16(rec, rec_len - 2);
+    pack_u64(rec + 2, (uint64_t) time(NULL));
+    rec[10] = type;
+    rec[11] = name_len;
+    memcpy(rec + RECORD_HEADER_SIZE, name, name_len);
+    memcpy(rec + RECORD_HEADER_SIZE + name_len, message, length);
+    log->pending_len += rec_len;
+
+    metrics_inc(METRIC_HISTORY_RECORDS);
+}
+
+void history_do(Tox *m)
+{
+    int i = 0;
+
+    while (i < Num_Logs) {
+        struct History_Log *log = Logs[i];
+
+        if (log->flush_in_flight) {
+            ++i;
+            continue;
+        }
+
+        if (log->pending_len > 0) {
+            start_flush(log);
+            ++i;
+            continue;
+        }
+
+        if (log->closed) {
+            free_log(log);
+            Logs[i] = Logs[--Num_Logs];
+            continue;
+        }
+
+        ++i;
+    }
+}
+
+void history_group_removed(uint32_t groupnum)
+{
+    int i;
+
+    for (i = 0; i < Num_Logs; ++i) {
+        if (Logs[i]->groupnum == groupnum) {
+            Logs[i]->closed = true;
+        }
+    }
+}
+
+static void query_append(struct History_Query *query, const char *line, size_t length)
+{
+    if (query->out_len + length > query->out_size) {
+        size_t size = MAX(query->out_size * 2, query->out_len + length);
+        char *tmp = realloc(query->out, size);
+
+        if (tmp == NULL) {
+            exit(EXIT_FAILURE);
+        }
+
+        query->out = tmp;
+        query->out_size = size;
+    }
+
+    memcpy(query->out + query->out_len, line, length);
+    query->out_len += length;
+}
+
+static void query_format(struct History_Query *query, const uint8_t *rec, size_t length)
+{
+    char line[TOX_MAX_MESSAGE_LENGTH];
+    char stamp[32];
+    struct tm tm;
+    time_t t = (time_t) unpack_u64(rec + 2);
+
+    localtime_r(&t, &tm);
+    strftime(stamp, sizeof(stamp), "%m-%d %H:%M", &tm);
+
+    int name_len = rec[11];
+    int msg_len = length - RECORD_HEADER_SIZE - name_len;
+    const char *name = (const char *) rec + RECORD_HEADER_SIZE;
+    const char *msg = name + name_len;
+    int ret;
+
+    if (rec[10] == TOX_MESSAGE_TYPE_ACTION) {
+        ret = snprintf(line, sizeof(line), "[%s] * %.*s %.*s\n", stamp, name_len, name, msg_len, msg);
+    } else {
+        ret = snprintf(line, sizeof(line), "[%s] <%.*s> %.*s\n", stamp, name_len, name, msg_len, msg);
+    }
+
+    if (ret < 0) {
+        return;
+    }
+
+    if (ret >= sizeof(line)) {
+        ret = sizeof(line) - 1;
+        line[ret - 1] = '\n';
+    }
+
+    query_append(query, line, ret);
+    ++query->found;
+}
+
+static void query_run(void *arg)
+{
+    struct History_Query *query = arg;
+    uint64_t *bases;
+    int count = list_segments(query->dir, &bases);
+
+    if (count <= 0) {
+        return;
+    }
+
+    uint64_t valid_len;
+    uint64_t end = segment_end(query->dir, bases[count - 1], &valid_len);
+    uint64_t start = end > query->count ? end - query->count : 0;
+    start = MAX(start, bases[0]);
+
+    int i = count - 1;
+
+    while (i > 0 && bases[i] > start) {
+        --i;
+    }
+
+    uint64_t seq;
+    uint64_t offset = index_lookup(query->dir, bases[i], start, &seq);
+
+    for (; i < count && seq < end; ++i) {
+        char path[PATH_MAX];
+        struct Mapped_File seg;
+
+        if (segment_path(path, sizeof(path), query->dir, bases[i], "seg") == -1 || map_file(path, &seg) == -1) {    /* removed by retention while we were reading */
+            offset = 0;
+            seq = i + 1 < count ? bases[i + 1] : end;
+            continue;
+        }
+
+        size_t length;
+
+        while (seq < end && (length = record_length(&seg, offset)) > 0) {
+            if (seq >= start) {
+                query_format(query, seg.data + offset, length);
+            }
+
+            offset += length;
+            ++seq;
+        }
+
+        unmap_file(&seg);
+        offset = 0;
+
+        if (i + 1 < count) {
+            seq = bases[i + 1];
+        }
+    }
+
+    free(bases);
+}
+
+static void query_done(Tox *m, void *arg)
+{
+    struct History_Query *query = arg;
+
+    if (query->found == 0) {
+        char msg[64];
+        snprintf(msg, sizeof(msg), "No history for group %u", query->groupnum);
+        reply(m, query->friendnum, msg, strlen(msg));
+        goto done;
+    }
+
+    size_t length = query->out_len;
+
+    if (query->out[length - 1] == '\n') {
+        --length;
+    }
+
+    reply_send_packed(m, query->friendnum, query->out, length);
+
+done:
+    free(query->out);
+    free(query);
+}
+
+int history_query(Tox *m, uint32_t friendnum, uint32_t groupnum, uint32_t count)
+{
+    struct History_Query *query = calloc(1, sizeof(struct History_Query));
+
+    if (query == NULL) {
+        return -1;
+    }
+
+    if (group_dir(m, groupnum, query->dir, sizeof(query->dir)) == -1) {
+        free(query);
+        return -1;
+    }
+
+    query->friendnum = friendnum;
+    query->groupnum = groupnum;
+    query->count = MIN(count, HISTORY_MAX_COUNT);
+
+    if (worker_submit(query_run, query_done, query) == -1) {
+        free(query);
+        return -1;
+    }
+
+    return 0;
+}
+
+void history_free(void)
+{
+    int i;
+
+    for (i = 0; i < Num_Logs; ++i) {
+        struct History_Log *log = Logs[i];
+
+        if (log->pending_len > 0) {
+            uint8_t *tmp = log->batch;
+            log->batch = log->pending;
+            log->batch_len = log->pending_len;
+            log->pending = tmp;
+            flush_run(log);
+        }
+
+        free_log(log);
+    }
+
+    free(Logs);
+    Logs = NULL;
+    Num_Logs = 0;
+}
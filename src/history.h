@@ -0,0 +1,65 @@
+/*  history.h
+ *
+ *
+ *  Copyright (C) 2014 toxbot All Rights Reserved.
+ *
+ *  This file is part of toxbot.
+ *
+ *  toxbot is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  toxbot is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with toxbot. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef HISTORY_H
+#define HISTORY_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <tox/tox.h>
+
+#define HISTORY_DIR                "toxbot_history"
+#define HISTORY_SEGMENT_SIZE       (1024 * 1024)
+#define HISTORY_DEFAULT_MAX_BYTES  (64ULL * 1024 * 1024)    /* per group */
+#define HISTORY_DEFAULT_COUNT      20
+#define HISTORY_MAX_COUNT          100
+
+/*
+ * Sets the retention limits applied to each group's log when a segment is rotated.
+ * A max_bytes of 0 disables history logging; a max_age (seconds) of 0 keeps segments
+ * regardless of age. Must be called before any shard starts.
+ */
+void history_set_retention(uint64_t max_bytes, uint64_t max_age);
+
+/* Buffers a conference message for the group's log. */
+void history_on_message(Tox *m, uint32_t groupnum, uint32_t peernum, TOX_MESSAGE_TYPE type,
+                        const uint8_t *message, size_t length);
+
+/* Hands buffered messages to the worker pool. Call once per loop iteration. */
+void history_do(Tox *m);
+
+/* Stops logging groupnum once its buffered messages are written. */
+void history_group_removed(uint32_t groupnum);
+
+/*
+ * Sends the last count logged messages of groupnum to friendnum. The segments are read
+ * on a worker thread.
+ *
+ * Returns 0 if the query was started.
+ * Returns -1 on failure.
+ */
+int history_query(Tox *m, uint32_t friendnum, uint32_t groupnum, uint32_t count);
+
+/* Writes out buffered messages and closes every log. Call after worker_thread_cleanup(). */
+void history_free(void);
+
+#endif /* HISTORY_H */
@@ -0,0 +1,229 @@
+/*  invitequeue.c
+ *
+ *
+ *  Copyright (C) 2014 toxbot All Rights Reserved.
+ *
+ *  This file is part of toxbot.
+ *
+ *  toxbot is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  toxbot is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with toxbot. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+
+#include <tox/tox.h>
+
+#include "toxbot.h"
+#include "invitequeue.h"
+#include "friends.h"
+#include "metrics.h"
+#include "misc.h"
+#include "log.h"
+
+struct Pending_Invite {
+    uint32_t friendnum;
+    uint32_t groupnum;
+    uint8_t public_key[TOX_PUBLIC_KEY_SIZE];    /* to notice a friend number given to someone else */
+    uint64_t expires;       /* unix time */
+    uint64_t next_retry;    /* milliseconds */
+    uint32_t backoff;       /* milliseconds */
+};
+
+static __thread struct Pending_Invite Pending[INVITE_QUEUE_SIZE];
+static __thread uint32_t Num_Pending;
+static __thread uint64_t Next_Due;    /* earliest next_retry, so idle iterations skip the scan */
+
+static uint64_t get_time_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static int find_pending(uint32_t friendnum, uint32_t groupnum)
+{
+    uint32_t i;
+
+    for (i = 0; i < Num_Pending; ++i) {
+        if (Pending[i].friendnum == friendnum && Pending[i].groupnum == groupnum) {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+static void remove_pending(uint32_t idx)
+{
+    Pending[idx] = Pending[--Num_Pending];
+    metrics_add(METRIC_INVITES_PENDING, (uint64_t) -1);
+}
+
+int invite_queue_add(Tox *m, uint32_t friendnum, uint32_t groupnum)
+{
+    const struct Friend_Info *f = friends_get(m, friendnum);
+
+    if (f == NULL) {
+        return -1;
+    }
+
+    uint64_t now = get_time_ms();
+    int idx = find_pending(friendnum, groupnum);
+
+    if (idx == -1) {
+        if (Num_Pending == INVITE_QUEUE_SIZE) {
+            return -1;
+        }
+
+        idx = Num_Pending++;
+        memset(&Pending[idx], 0, sizeof(struct Pending_Invite));
+        Pending[idx].friendnum = friendnum;
+        Pending[idx].groupnum = groupnum;
+        Pending[idx].backoff = INVITE_RETRY_MIN_BACKOFF;
+        Pending[idx].next_retry = now + INVITE_RETRY_MIN_BACKOFF;
+        metrics_inc(METRIC_INVITES_PENDING);
+    }
+
+    memcpy(Pending[idx].public_key, f->public_key, TOX_PUBLIC_KEY_SIZE);
+    Pending[idx].expires = (uint64_t) time(NULL) + INVITE_QUEUE_TTL;
+    Next_Due = MIN(Next_Due, Pending[idx].next_retry);
+    return 0;
+}
+
+void invite_queue_remove(uint32_t friendnum, uint32_t groupnum)
+{
+    int idx = find_pending(friendnum, groupnum);
+
+    if (idx != -1) {
+        remove_pending(idx);
+    }
+}
+
+void invite_queue_friend_online(uint32_t friendnum)
+{
+    uint32_t i;
+
+    for (i = 0; i < Num_Pending; ++i) {
+        if (Pending[i].friendnum == friendnum) {
+            Pending[i].next_retry = 0;
+            Next_Due = 0;
+        }
+    }
+}
+
+void invite_queue_group_removed(uint32_t groupnum)
+{
+    uint32_t i = 0;
+
+    while (i < Num_Pending) {
+        if (Pending[i].groupnum == groupnum) {
+            remove_pending(i);
+            continue;
+        }
+
+        ++i;
+    }
+}
+
+/* Returns true if the invite is finished with, sent or not. */
+static bool retry_invite(Tox *m, struct Pending_Invite *invite)
+{
+    const struct Friend_Info *f = friends_get(m, invite->friendnum);
+
+    if (f == NULL || memcmp(f->public_key, invite->public_key, TOX_PUBLIC_KEY_SIZE) != 0) {
+        return true;
+    }
+
+    /* toxcore can't send to an offline friend; wait for the connection callback instead */
+    if (!friends_flag(invite->friendnum, FRIEND_FLAG_ONLINE)) {
+        invite->next_retry = UINT64_MAX;
+        return false;
+    }
+
+    metrics_inc(METRIC_INVITE_RETRIES);
+
+    TOX_ERR_CONFERENCE_INVITE err;
+
+    if (tox_conference_invite(m, invite->friendnum, invite->groupnum, &err)) {
+        metrics_inc(METRIC_INVITES_SENT);
+        log_write(LOG_LEVEL_INFO, "Sent deferred invite of friend %u to group %u\n", invite->friendnum,
+                  invite->groupnum);
+        return true;
+    }
+
+    if (err != TOX_ERR_CONFERENCE_INVITE_FAIL_SEND && err != TOX_ERR_CONFERENCE_INVITE_NO_CONNECTION) {
+        return true;
+    }
+
+    invite->next_retry = get_time_ms() + invite->backoff;
+    invite->backoff = MIN(invite->backoff * 2, INVITE_RETRY_MAX_BACKOFF);
+    return false;
+}
+
+void invite_queue_do(Tox *m)
+{
+    if (Num_Pending == 0) {
+        return;
+    }
+
+    uint64_t now = get_time_ms();
+    uint64_t cur_time = (uint64_t) time(NULL);
+
+    /* expiry is checked along with the retries; both wait for the earliest due entry or a minute */
+    if (now < Next_Due) {
+        return;
+    }
+
+    uint64_t next_due = now + INVITE_RETRY_MAX_BACKOFF;
+    uint32_t i = 0;
+
+    while (i < Num_Pending) {
+        struct Pending_Invite *invite = &Pending[i];
+
+        if (cur_time >= invite->expires) {
+            metrics_inc(METRIC_INVITES_EXPIRED);
+            log_write(LOG_LEVEL_INFO, "Deferred invite of friend %u to group %u expired\n", invite->friendnum,
+                      invite->groupnum);
+            remove_pending(i);
+            continue;
+        }
+
+        if (invite->next_retry <= now && retry_invite(m, invite)) {
+            remove_pending(i);
+            continue;
+        }
+
+        next_due = MIN(next_due, invite->next_retry);
+        ++i;
+    }
+
+    Next_Due = next_due;
+}
+
+uint32_t invite_queue_count(void)
+{
+    return Num_Pending;
+}
+
+void invite_queue_free(void)
+{
+    metrics_add(METRIC_INVITES_PENDING, (uint64_t) -(int64_t) Num_Pending);
+    Num_Pending = 0;
+    Next_Due = 0;
+}
@@ -0,0 +1,61 @@
+/*  invitequeue.h
+ *
+ *
+ *  Copyright (C) 2014 toxbot All Rights Reserved.
+ *
+ *  This file is part of toxbot.
+ *
+ *  toxbot is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  toxbot is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with toxbot. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef INVITEQUEUE_H
+#define INVITEQUEUE_H
+
+#include <stdint.h>
+#include <tox/tox.h>
+
+#define INVITE_QUEUE_SIZE         256    /* pending invites per shard */
+#define INVITE_QUEUE_TTL          (10 * 60)    /* seconds */
+#define INVITE_RETRY_MIN_BACKOFF  1000         /* milliseconds */
+#define INVITE_RETRY_MAX_BACKOFF  60000
+
+/*
+ * Queues an invite of friendnum to groupnum that toxcore could not send. It is retried
+ * when the friend comes online and otherwise with exponential backoff, until it is sent
+ * or INVITE_QUEUE_TTL passes. Queueing an invite that is already pending only renews it.
+ *
+ * Returns 0 on success.
+ * Returns -1 if the queue is full.
+ */
+int invite_queue_add(Tox *m, uint32_t friendnum, uint32_t groupnum);
+
+/* Forgets the pending invite of friendnum to groupnum, e.g. after it was sent directly. */
+void invite_queue_remove(uint32_t friendnum, uint32_t groupnum);
+
+/* Makes the pending invites of friendnum due now. Call when the friend comes online. */
+void invite_queue_friend_online(uint32_t friendnum);
+
+/* Drops every pending invite to groupnum. Call when the bot leaves a group. */
+void invite_queue_group_removed(uint32_t groupnum);
+
+/* Retries the invites that are due and drops the expired ones. Call once per loop iteration. */
+void invite_queue_do(Tox *m);
+
+/* Returns the number of pending invites of this shard. */
+uint32_t invite_queue_count(void);
+
+void invite_queue_free(void);
+
+#endif /* INVITEQUEUE_H */
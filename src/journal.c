@@ -0,0 +1,594 @@
+/*  journal.c
+ *
+ *
+ *  Copyright (C) 2014 toxbot All Rights Reserved.
+ *
+ *  This file is part of toxbot.
+ *
+ *  toxbot is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  toxbot is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with toxbot. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#include <sys/stat.h>
+
+#include <tox/tox.h>
+
+#include "toxbot.h"
+#include "journal.h"
+#include "groupchats.h"
+#include "keylist.h"
+#include "worker.h"
+#include "metrics.h"
+#include "misc.h"
+#include "log.h"
+
+#define JOURNAL_MAGIC "TBJL"
+#define JOURNAL_VERSION 1
+#define JOURNAL_HEADER_SIZE 8
+#define JOURNAL_RECORD_HEADER_SIZE (4 + 2 + 1)
+#define JOURNAL_RETRY_INTERVAL 10    /* seconds between snapshots while the file is unusable */
+
+extern __thread char *DATA_FILE;
+extern __thread struct Tox_Bot Tox_Bot;
+extern struct Key_List Master_Keys;
+extern struct Key_List Blocked_Keys;
+
+struct Journal_Job {
+    char path[PATH_MAX];
+    int fd;               /* the open journal; replaced when the file is rewritten */
+    bool rewrite;         /* replace the file with the kept records followed by data */
+    uint64_t keep_from;   /* kept records, as offsets past the file header */
+    uint64_t keep_to;
+    uint8_t *data;        /* records to append */
+    size_t length;
+    uint64_t start;       /* logical offset of the first record in a rewritten file */
+    uint64_t end;         /* logical offset past data */
+    int ret;
+};
+
+/*
+ * Offsets are logical: they count the record bytes appended since the shard started. The
+ * file holds [File_Start, Durable_End), a job in flight holds the bytes up to the buffer,
+ * and the buffer holds [Appended_End - Buffer_Len, Appended_End).
+ */
+static __thread char Path[PATH_MAX];
+static __thread int Fd = -1;
+static __thread uint8_t *Buffer;
+static __thread size_t Buffer_Len;
+static __thread size_t Buffer_Size;
+static __thread uint64_t Buffer_Since;    /* milliseconds; when the oldest buffered record was added */
+static __thread uint64_t File_Start;
+static __thread uint64_t Durable_End;
+static __thread uint64_t Appended_End;
+static __thread uint64_t Trim_To;         /* records before this are covered by a snapshot */
+static __thread bool Io_In_Flight;
+
+/* a failed write leaves the file in an unknown state; a snapshot taken after it lets us start over */
+static __thread bool Broken;
+static __thread uint64_t Broken_At;
+static __thread bool Reset_Ready;
+
+static __thread bool Snapshot_Requested;
+static __thread uint64_t Last_Snapshot;    /* unix time */
+static __thread uint64_t Last_Request;
+
+static uint64_t get_time_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* CRC-32 (IEEE 802.3). Records are a few dozen bytes, so a bitwise loop is plenty. */
+static uint32_t crc32(const uint8_t *data, size_t length)
+{
+    uint32_t crc = 0xFFFFFFFF;
+    size_t i;
+
+    for (i = 0; i < length; ++i) {
+        crc ^= data[i];
+
+        int k;
+
+        for (k = 0; k < 8; ++k) {
+            crc = (crc >> 1) ^ (0xEDB88320 & -(crc & 1));
+        }
+    }
+
+    return ~crc;
+}
+
+static void write_header(uint8_t *buf)
+{
+    memcpy(buf, JOURNAL_MAGIC, 4);
+    pack_u16(buf + 4, JOURNAL_VERSION);
+    pack_u16(buf + 6, 0);
+}
+
+static int write_all(int fd, const uint8_t *data, size_t length)
+{
+    size_t written = 0;
+
+    while (written < length) {
+        ssize_t ret = write(fd, data + written, length - written);
+
+        if (ret <= 0) {
+            return -1;
+        }
+
+        written += ret;
+    }
+
+    return 0;
+}
+
+static void append_record(Journal_Record_Type type, const uint8_t *payload, size_t length)
+{
+    size_t size = JOURNAL_RECORD_HEADER_SIZE + length;
+
+    if (Buffer_Len + size > Buffer_Size) {
+        size_t new_size = MAX(MAX(Buffer_Size * 2, Buffer_Len + size), 1024);
+        uint8_t *buffer = realloc(Buffer, new_size);
+
+        if (buffer == NULL) {
+            exit(EXIT_FAILURE);
+        }
+
+        Buffer = buffer;
+        Buffer_Size = new_size;
+    }
+
+    uint8_t *p = Buffer + Buffer_Len;
+    pack_u16(p + 4, (uint16_t) length);
+    p[6] = (uint8_t) type;
+    memcpy(p + JOURNAL_RECORD_HEADER_SIZE, payload, length);
+    pack_u32(p, crc32(p + 4, size - 4));
+
+    if (Buffer_Len == 0) {
+        Buffer_Since = get_time_ms();
+    }
+
+    Buffer_Len += size;
+    Appended_End += size;
+    metrics_inc(METRIC_JOURNAL_RECORDS);
+}
+
+void journal_log_key(Journal_Record_Type type, const uint8_t *public_key)
+{
+    append_record(type, public_key, TOX_PUBLIC_KEY_SIZE);
+}
+
+void journal_log_group(Tox *m, Journal_Record_Type type, uint32_t groupnum, const char *value, size_t length)
+{
+    uint8_t payload[TOX_CONFERENCE_ID_SIZE + TOX_MAX_NAME_LENGTH];
+
+    if (!tox_conference_get_id(m, groupnum, payload)) {
+        return;
+    }
+
+    length = MIN(length, TOX_MAX_NAME_LENGTH);
+    memcpy(payload + TOX_CONFERENCE_ID_SIZE, value, length);
+    append_record(type, payload, TOX_CONFERENCE_ID_SIZE + length);
+}
+
+static void replay_group(Tox *m, uint8_t type, const uint8_t *payload, size_t length)
+{
+    TOX_ERR_CONFERENCE_BY_ID err;
+    uint32_t groupnum = tox_conference_by_id(m, payload, &err);
+    int idx = err == TOX_ERR_CONFERENCE_BY_ID_OK ? group_index(groupnum) : -1;
+
+    /* the bot has left the group since */
+    if (idx == -1) {
+        return;
+    }
+
+    struct Group_Chat *chat = &Tox_Bot.g_chats[idx];
+    const char *value = (const char *) payload + TOX_CONFERENCE_ID_SIZE;
+    size_t value_len = length - TOX_CONFERENCE_ID_SIZE;
+
+    if (type == JOURNAL_GROUP_TITLE) {
+        chat->title_len = copy_tox_str(chat->title, sizeof(chat->title), value, value_len);
+        tox_conference_set_title(m, groupnum, (const uint8_t *) chat->title, chat->title_len, NULL);
+        return;
+    }
+
+    memset(chat->password, 0, sizeof(chat->password));
+    copy_tox_str(chat->password, sizeof(chat->password), value, value_len);
+    chat->has_pass = value_len > 0;
+}
+
+static void replay_record(Tox *m, uint8_t type, const uint8_t *payload, size_t length)
+{
+    if (type == JOURNAL_GROUP_TITLE || type == JOURNAL_GROUP_PASSWORD) {
+        if (length >= TOX_CONFERENCE_ID_SIZE) {
+            replay_group(m, type, payload, length);
+        }
+
+        return;
+    }
+
+    if (length != TOX_PUBLIC_KEY_SIZE) {
+        return;
+    }
+
+    uint32_t friendnum;
+
+    switch (type) {
+        case JOURNAL_FRIEND_ADD:
+            if (tox_friend_by_public_key(m, payload, NULL) == UINT32_MAX) {
+                tox_friend_add_norequest(m, payload, NULL);
+            }
+
+            break;
+
+        case JOURNAL_FRIEND_REMOVE:
+            friendnum = tox_friend_by_public_key(m, payload, NULL);
+
+            if (friendnum != UINT32_MAX) {
+                tox_friend_delete(m, friendnum, NULL);
+            }
+
+            break;
+
+        /* only in journals left by versions that journaled the shared key lists */
+        case JOURNAL_MASTER_ADD:
+            if (keylist_insert(&Master_Keys, payload)) {
+                keylist_persist(&Master_Keys);
+            }
+
+            break;
+
+        case JOURNAL_MASTER_REMOVE:
+            if (keylist_remove(&Master_Keys, payload)) {
+                keylist_persist(&Master_Keys);
+            }
+
+            break;
+
+        case JOURNAL_BLOCK_ADD:
+            if (keylist_insert(&Blocked_Keys, payload)) {
+                keylist_persist(&Blocked_Keys);
+            }
+
+            break;
+
+        case JOURNAL_BLOCK_REMOVE:
+            if (keylist_remove(&Blocked_Keys, payload)) {
+                keylist_persist(&Blocked_Keys);
+            }
+
+            break;
+
+        default:
+            break;    /* written by a newer version */
+    }
+}
+
+static void mark_broken(uint64_t offset)
+{
+    Broken = true;
+    Broken_At = offset;
+    Reset_Ready = false;
+}
+
+int journal_init(Tox *m, const char *path)
+{
+    snprintf(Path, sizeof(Path), "%s", path);
+    Last_Snapshot = (uint64_t) time(NULL);
+
+    int fd = open(path, O_RDWR | O_CREAT | O_APPEND, 0600);
+    struct stat st;
+
+    if (fd == -1 || fstat(fd, &st) == -1) {
+        log_write(LOG_LEVEL_WARNING, "Can't open journal %s; changes are saved by snapshots only\n", path);
+
+        if (fd != -1) {
+            close(fd);
+        }
+
+        mark_broken(0);
+        return 0;
+    }
+
+    if (st.st_size == 0) {
+        uint8_t header[JOURNAL_HEADER_SIZE];
+        write_header(header);
+
+        if (write_all(fd, header, sizeof(header)) == -1 || fdatasync(fd) == -1) {
+            mark_broken(0);
+        }
+
+        Fd = fd;
+        return 0;
+    }
+
+    uint8_t *data = malloc(st.st_size);
+
+    if (data == NULL) {
+        exit(EXIT_FAILURE);
+    }
+
+    if (pread(fd, data, st.st_size, 0) != st.st_size || st.st_size < JOURNAL_HEADER_SIZE
+            || memcmp(data, JOURNAL_MAGIC, 4) != 0 || unpack_u16(data + 4) != JOURNAL_VERSION) {
+        log_write(LOG_LEVEL_WARNING, "%s is not a journal this version can read; the next snapshot replaces it\n",
+                  path);
+        free(data);
+        Fd = fd;
+        mark_broken(0);
+        return 0;
+    }
+
+    size_t off = JOURNAL_HEADER_SIZE;
+    int count = 0;
+
+    while (off + JOURNAL_RECORD_HEADER_SIZE <= (size_t) st.st_size) {
+        const uint8_t *p = data + off;
+        size_t length = unpack_u16(p + 4);
+        size_t size = JOURNAL_RECORD_HEADER_SIZE + length;
+
+        if (off + size > (size_t) st.st_size || crc32(p + 4, size - 4) != unpack_u32(p)) {
+            break;
+        }
+
+        replay_record(m, p[6], p + JOURNAL_RECORD_HEADER_SIZE, length);
+        off += size;
+        ++count;
+    }
+
+    free(data);
+    Fd = fd;
+
+    /* a crash in the middle of an append leaves a partial record; appending after it would hide the rest */
+    if (off < (size_t) st.st_size) {
+        log_write(LOG_LEVEL_WARNING, "Dropping the damaged end of journal %s after %d records\n", path, count);
+
+        if (ftruncate(fd, off) == -1) {
+            mark_broken(0);
+        }
+    }
+
+    Durable_End = off - JOURNAL_HEADER_SIZE;
+    Appended_End = Durable_End;
+
+    if (count > 0) {
+        log_write(LOG_LEVEL_INFO, "Replayed %d journal records from %s\n", count, path);
+    }
+
+    return count;
+}
+
+static void journal_job_run(void *arg)
+{
+    struct Journal_Job *job = arg;
+
+    job->ret = 0;
+
+    if (!job->rewrite) {
+        if (write_all(job->fd, job->data, job->length) == -1 || fdatasync(job->fd) == -1) {
+            job->ret = -1;
+        }
+
+        return;
+    }
+
+    size_t kept = job->keep_to - job->keep_from;
+    size_t size = JOURNAL_HEADER_SIZE + kept + job->length;
+    uint8_t *file = malloc(size);
+
+    if (file == NULL) {
+        job->ret = -1;
+        return;
+    }
+
+    write_header(file);
+
+    if (kept > 0 && pread(job->fd, file + JOURNAL_HEADER_SIZE, kept, JOURNAL_HEADER_SIZE + job->keep_from)
+            != (ssize_t) kept) {
+        free(file);
+        job->ret = -1;
+        return;
+    }
+
+    if (job->length > 0) {
+        memcpy(file + JOURNAL_HEADER_SIZE + kept, job->data, job->length);
+    }
+
+    if (write_file_atomic(job->path, file, size) == -1) {
+        free(file);
+        job->ret = -1;
+        return;
+    }
+
+    free(file);
+
+    if (job->fd != -1) {
+        close(job->fd);
+    }
+
+    job->fd = open(job->path, O_RDWR | O_APPEND);
+
+    if (job->fd == -1) {
+        job->ret = -1;
+    }
+}
+
+static void journal_job_done(Tox *m, void *arg)
+{
+    struct Journal_Job *job = arg;
+
+    Io_In_Flight = false;
+    Fd = job->fd;
+
+    if (job->ret == 0) {
+        metrics_inc(METRIC_JOURNAL_COMMITS);
+
+        if (job->rewrite) {
+            File_Start = job->start;
+            Broken = false;
+        }
+
+        Durable_End = job->end;
+    } else {
+        log_write(LOG_LEVEL_WARNING, "Failed to write journal %s; falling back to a snapshot\n", job->path);
+        mark_broken(job->end);
+    }
+
+    free(job->data);
+    free(job);
+}
+
+static void submit_job(bool rewrite)
+{
+    struct Journal_Job *job = calloc(1, sizeof(struct Journal_Job));
+
+    if (job == NULL) {
+        exit(EXIT_FAILURE);
+    }
+
+    snprintf(job->path, sizeof(job->path), "%s", Path);
+    job->fd = Fd;
+    job->rewrite = rewrite;
+
+    if (rewrite && Broken) {
+        /* everything up to the buffer is in the snapshot */
+        job->start = Appended_End - Buffer_Len;
+    } else if (rewrite) {
+        /* nothing is in flight, so the buffer starts at Durable_End */
+        uint64_t from = MIN(Trim_To, Appended_End);
+
+        if (from <= Durable_End) {
+            job->keep_from = from - File_Start;
+            job->keep_to = Durable_End - File_Start;
+        } else {
+            size_t skip = from - Durable_End;
+            memmove(Buffer, Buffer + skip, Buffer_Len - skip);
+            Buffer_Len -= skip;
+        }
+
+        job->start = from;
+    }
+
+    job->data = Buffer;
+    job->length = Buffer_Len;
+    job->end = Appended_End;
+
+    Buffer = NULL;
+    Buffer_Len = 0;
+    Buffer_Size = 0;
+    Io_In_Flight = true;
+
+    if (worker_submit(journal_job_run, journal_job_done, job) == -1) {
+        journal_job_run(job);
+        journal_job_done(NULL, job);
+    }
+}
+
+/* Starts the write that is due, if any. Only one write is in flight, so records stay in order. */
+static void start_io(bool force)
+{
+    if (Io_In_Flight) {
+        return;
+    }
+
+    if (Broken) {
+        if (Reset_Ready) {
+            submit_job(true);
+        }
+
+        return;
+    }
+
+    if (MIN(Trim_To, Appended_End) > File_Start) {
+        submit_job(true);
+        return;
+    }
+
+    if (Buffer_Len > 0 && (force || get_time_ms() - Buffer_Since >= JOURNAL_COMMIT_INTERVAL)) {
+        submit_job(false);
+    }
+}
+
+void journal_do(Tox *m)
+{
+    start_io(false);
+
+    if (Snapshot_Requested) {
+        return;
+    }
+
+    uint64_t cur_time = (uint64_t) time(NULL);
+    uint64_t size = Appended_End - MAX(File_Start, MIN(Trim_To, Appended_End));
+    bool snapshot;
+
+    if (Broken) {
+        snapshot = !Reset_Ready && timed_out(Last_Request, cur_time, JOURNAL_RETRY_INTERVAL);
+    } else {
+        snapshot = size >= JOURNAL_COMPACT_SIZE
+                   || (size > 0 && timed_out(Last_Snapshot, cur_time, JOURNAL_COMPACT_INTERVAL));
+    }
+
+    if (snapshot) {
+        Snapshot_Requested = true;
+        Last_Request = cur_time;
+        save_data(m, DATA_FILE);
+    }
+}
+
+void journal_mark(struct Journal_Mark *mark)
+{
+    mark->offset = Appended_End;
+}
+
+void journal_snapshot_done(const struct Journal_Mark *mark, bool success)
+{
+    Snapshot_Requested = false;
+
+    if (!success) {
+        return;
+    }
+
+    Trim_To = MAX(Trim_To, mark->offset);
+    Last_Snapshot = (uint64_t) time(NULL);
+
+    if (Broken && mark->offset >= Broken_At) {
+        Reset_Ready = true;
+    }
+}
+
+void journal_free(void)
+{
+    /* the final save has run by now and workers are done with this shard, so this is synchronous */
+    start_io(true);
+
+    if (Fd != -1) {
+        close(Fd);
+    }
+
+    free(Buffer);
+    Buffer = NULL;
+    Buffer_Len = 0;
+    Buffer_Size = 0;
+    Fd = -1;
+    File_Start = Durable_End = Appended_End = Trim_To = 0;
+    Broken = Reset_Ready = Snapshot_Requested = false;
+}
@@ -0,0 +1,99 @@
+/*  journal.h
+ *
+ *
+ *  Copyright (C) 2014 toxbot All Rights Reserved.
+ *
+ *  This file is part of toxbot.
+ *
+ *  toxbot is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  toxbot is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with toxbot. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <tox/tox.h>
+
+/*
+ * Append-only log of small state changes, so a change costs one record instead of a full
+ * save. Records are applied on top of the last snapshot (toxbot_save and toxbot_groups)
+ * when the bot starts. Every record sets or clears a single item, so
+ * replaying records that a snapshot already contains is harmless, and any completed
+ * save_data() serves as a compaction point.
+ *
+ * File format:
+ *     "TBJL" | u16 version | u16 reserved
+ *     records: u32 crc32 | u16 payload length | u8 type | payload
+ *
+ * The crc covers the length, type and payload. Replay stops at the first damaged record,
+ * which is where a crash during an append leaves the file.
+ */
+
+#define JOURNAL_COMMIT_INTERVAL   100            /* milliseconds; records are fsynced in groups */
+#define JOURNAL_COMPACT_SIZE      (256 * 1024)   /* bytes of records that trigger a snapshot */
+#define JOURNAL_COMPACT_INTERVAL  (60 * 60)      /* seconds */
+
+typedef enum {
+    JOURNAL_FRIEND_ADD = 1,    /* public key */
+    JOURNAL_FRIEND_REMOVE,     /* public key */
+    JOURNAL_GROUP_TITLE,       /* conference id | title */
+    JOURNAL_GROUP_PASSWORD,    /* conference id | password, empty for none */
+    /* the key lists are shared by all shards, whose journals replay independently, so changes
+       to them are written straight to their files; these are only replayed from old journals */
+    JOURNAL_MASTER_ADD,        /* public key */
+    JOURNAL_MASTER_REMOVE,     /* public key */
+    JOURNAL_BLOCK_ADD,         /* public key */
+    JOURNAL_BLOCK_REMOVE,      /* public key */
+} Journal_Record_Type;
+
+/* Snapshot point taken by save_data(); see journal_mark(). */
+struct Journal_Mark {
+    uint64_t offset;
+};
+
+/*
+ * Replays the journal at path on top of the state loaded from the snapshot and opens it
+ * for appending. Call once per shard after the savedata and groups are loaded and before
+ * the friend tables are built. A journal that can't be opened is recreated by the next
+ * snapshot; until then changes are only saved by snapshots.
+ *
+ * Returns the number of records replayed.
+ */
+int journal_init(Tox *m, const char *path);
+
+/* Records a change to the item identified by public_key. */
+void journal_log_key(Journal_Record_Type type, const uint8_t *public_key);
+
+/* Records the new title or password of groupnum. */
+void journal_log_group(Tox *m, Journal_Record_Type type, uint32_t groupnum, const char *value, size_t length);
+
+/*
+ * Commits buffered records once JOURNAL_COMMIT_INTERVAL has passed, drops records that a
+ * snapshot has made redundant, and takes a snapshot when the journal grows too large or
+ * too old. Call once per loop iteration.
+ */
+void journal_do(Tox *m);
+
+/* Fills mark with the point up to which a snapshot taken now covers the journal. */
+void journal_mark(struct Journal_Mark *mark);
+
+/* Tells the journal whether the snapshot taken at mark has been written. */
+void journal_snapshot_done(const struct Journal_Mark *mark, bool success);
+
+/* Commits what is left and closes the journal. Call after the final save. */
+void journal_free(void);
+
+#endif /* JOURNAL_H */
@@ -0,0 +1,342 @@
+/*  keylist.c
+ *
+ *
+ *  Copyright (C) 2014 toxbot All Rights Reserved.
+ *
+ *  This file is part of toxbot.
+ *
+ *  toxbot is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  toxbot is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with toxbot. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <tox/tox.h>
+
+#include "keylist.h"
+#include "misc.h"
+#include "log.h"
+
+static int key_cmp(const void *a, const void *b)
+{
+    return memcmp(a, b, TOX_PUBLIC_KEY_SIZE);
+}
+
+/* Reads every key in path into a freshly allocated sorted array. Returns -1 on failure. */
+static int keylist_read(const char *path, uint8_t **keys_out, size_t *num_out, time_t *mtime_out)
+{
+    struct stat st;
+
+    if (stat(path, &st) != 0) {
+        FILE *fp = fopen(path, "w");
+
+        if (fp == NULL) {
+            log_write(LOG_LEVEL_WARNING, "Warning: failed to create '%s' file\n", path);
+            return -1;
+        }
+
+        log_write(LOG_LEVEL_WARNING, "Warning: creating new '%s' file. Did you lose the old one?\n", path);
+        fclose(fp);
+        *keys_out = NULL;
+        *num_out = 0;
+        *mtime_out = 0;
+        return 0;
+    }
+
+    FILE *fp = fopen(path, "r");
+
+    if (fp == NULL) {
+        log_write(LOG_LEVEL_WARNING, "Warning: failed to read '%s' file\n", path);
+        return -1;
+    }
+
+    uint8_t *keys = NULL;
+    size_t num_keys = 0;
+    size_t max_keys = 0;
+    char id[256];
+
+    while (fgets(id, sizeof(id), fp)) {
+        int len = strlen(id);
+
+        if (--len < TOX_PUBLIC_KEY_SIZE) {
+            continue;
+        }
+
+        if (num_keys == max_keys) {
+            max_keys = max_keys ? max_keys * 2 : 16;
+            uint8_t *tmp = realloc(keys, max_keys * TOX_PUBLIC_KEY_SIZE);
+
+            if (tmp == NULL) {
+                exit(EXIT_FAILURE);
+            }
+
+            keys = tmp;
+        }
+
+        char *key_bin = hex_string_to_bin(id);
+        memcpy(keys + num_keys * TOX_PUBLIC_KEY_SIZE, key_bin, TOX_PUBLIC_KEY_SIZE);
+        free(key_bin);
+        ++num_keys;
+    }
+
+    fclose(fp);
+
+    if (num_keys > 0) {
+        qsort(keys, num_keys, TOX_PUBLIC_KEY_SIZE, key_cmp);
+    }
+
+    *keys_out = keys;
+    *num_out = num_keys;
+    *mtime_out = st.st_mtime;
+    return 0;
+}
+
+int keylist_init(struct Key_List *list, const char *path)
+{
+    memset(list, 0, sizeof(struct Key_List));
+    pthread_rwlock_init(&list->lock, NULL);
+    pthread_mutex_init(&list->file_lock, NULL);
+    list->path = path;
+
+    return keylist_read(path, &list->keys, &list->num_keys, &list->mtime);
+}
+
+void keylist_free(struct Key_List *list)
+{
+    pthread_rwlock_wrlock(&list->lock);
+    free(list->keys);
+    list->keys = NULL;
+    list->num_keys = 0;
+    blockdb_close(&list->db);
+    pthread_rwlock_unlock(&list->lock);
+    pthread_rwlock_destroy(&list->lock);
+    pthread_mutex_destroy(&list->file_lock);
+}
+
+void keylist_attach_db(struct Key_List *list, const char *db_path)
+{
+    list->db_path = db_path;
+
+    if (blockdb_open(&list->db, db_path) == 0) {
+        log_write(LOG_LEVEL_INFO, "Loaded %llu keys from '%s'\n", (unsigned long long) list->db.num_keys, db_path);
+    }
+}
+
+/* Call with file_lock held. */
+static void keylist_reload_db(struct Key_List *list)
+{
+    struct stat st;
+
+    if (list->db_path == NULL || stat(list->db_path, &st) != 0 || st.st_mtime == list->db.mtime) {
+        return;
+    }
+
+    struct Block_DB db;
+
+    /* keytool replaces the file atomically, so a failed open means it is genuinely bad */
+    if (blockdb_open(&db, list->db_path) == -1) {
+        log_write(LOG_LEVEL_WARNING, "Warning: '%s' is not a valid compiled blocklist\n", list->db_path);
+        return;
+    }
+
+    pthread_rwlock_wrlock(&list->lock);
+    struct Block_DB old = list->db;
+    list->db = db;
+    __atomic_add_fetch(&list->generation, 1, __ATOMIC_RELEASE);
+    pthread_rwlock_unlock(&list->lock);
+
+    blockdb_close(&old);
+}
+
+void keylist_reload_if_changed(struct Key_List *list)
+{
+    struct stat st;
+
+    /* the check and the reload must not be split, or two callers may both reload or one may miss a change */
+    pthread_mutex_lock(&list->file_lock);
+    keylist_reload_db(list);
+
+    if (stat(list->path, &st) == 0 && st.st_mtime == list->mtime) {
+        pthread_mutex_unlock(&list->file_lock);
+        return;
+    }
+
+    uint8_t *keys;
+    size_t num_keys;
+    time_t mtime;
+
+    if (keylist_read(list->path, &keys, &num_keys, &mtime) == -1) {
+        pthread_mutex_unlock(&list->file_lock);
+        return;
+    }
+
+    pthread_rwlock_wrlock(&list->lock);
+    uint8_t *old = list->keys;
+    list->keys = keys;
+    list->num_keys = num_keys;
+    list->mtime = mtime;
+    __atomic_add_fetch(&list->generation, 1, __ATOMIC_RELEASE);
+    pthread_rwlock_unlock(&list->lock);
+    pthread_mutex_unlock(&list->file_lock);
+
+    free(old);
+}
+
+/* Returns the index of public_key in list->keys, or where it would go in *pos and -1. Call with the lock held. */
+static ssize_t key_search(const struct Key_List *list, const uint8_t *public_key, size_t *pos)
+{
+    size_t lo = 0, hi = list->num_keys;
+
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        int cmp = memcmp(list->keys + mid * TOX_PUBLIC_KEY_SIZE, public_key, TOX_PUBLIC_KEY_SIZE);
+
+        if (cmp == 0) {
+            *pos = mid;
+            return mid;
+        }
+
+        if (cmp < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    *pos = lo;
+    return -1;
+}
+
+bool keylist_insert(struct Key_List *list, const uint8_t *public_key)
+{
+    pthread_rwlock_wrlock(&list->lock);
+
+    size_t lo;
+
+    if (key_search(list, public_key, &lo) != -1) {
+        pthread_rwlock_unlock(&list->lock);
+        return false;
+    }
+
+    uint8_t *tmp = realloc(list->keys, (list->num_keys + 1) * TOX_PUBLIC_KEY_SIZE);
+
+    if (tmp == NULL) {
+        exit(EXIT_FAILURE);
+    }
+
+    list->keys = tmp;
+    memmove(list->keys + (lo + 1) * TOX_PUBLIC_KEY_SIZE, list->keys + lo * TOX_PUBLIC_KEY_SIZE,
+            (list->num_keys - lo) * TOX_PUBLIC_KEY_SIZE);
+    memcpy(list->keys + lo * TOX_PUBLIC_KEY_SIZE, public_key, TOX_PUBLIC_KEY_SIZE);
+    ++list->num_keys;
+    __atomic_add_fetch(&list->generation, 1, __ATOMIC_RELEASE);
+
+    pthread_rwlock_unlock(&list->lock);
+    return true;
+}
+
+bool keylist_remove(struct Key_List *list, const uint8_t *public_key)
+{
+    pthread_rwlock_wrlock(&list->lock);
+
+    size_t idx;
+
+    if (key_search(list, public_key, &idx) == -1) {
+        pthread_rwlock_unlock(&list->lock);
+        return false;
+    }
+
+    memmove(list->keys + idx * TOX_PUBLIC_KEY_SIZE, list->keys + (idx + 1) * TOX_PUBLIC_KEY_SIZE,
+            (list->num_keys - idx - 1) * TOX_PUBLIC_KEY_SIZE);
+    --list->num_keys;
+    __atomic_add_fetch(&list->generation, 1, __ATOMIC_RELEASE);
+
+    pthread_rwlock_unlock(&list->lock);
+    return true;
+}
+
+bool keylist_db_contains(struct Key_List *list, const uint8_t *public_key)
+{
+    pthread_rwlock_rdlock(&list->lock);
+    bool found = blockdb_contains(&list->db, public_key);
+    pthread_rwlock_unlock(&list->lock);
+
+    return found;
+}
+
+uint32_t keylist_generation(struct Key_List *list)
+{
+    return __atomic_load_n(&list->generation, __ATOMIC_ACQUIRE);
+}
+
+int keylist_save(struct Key_List *list)
+{
+    /* saves are serialized and each one snapshots the list, so the last to finish is the newest */
+    pthread_mutex_lock(&list->file_lock);
+
+    pthread_rwlock_rdlock(&list->lock);
+    size_t length = list->num_keys * (TOX_PUBLIC_KEY_SIZE * 2 + 1);
+    char *text = malloc(length + 1);
+
+    if (text == NULL) {
+        exit(EXIT_FAILURE);
+    }
+
+    size_t i;
+
+    for (i = 0; i < list->num_keys; ++i) {
+        char *line = text + i * (TOX_PUBLIC_KEY_SIZE * 2 + 1);
+        bin_to_hex_string(list->keys + i * TOX_PUBLIC_KEY_SIZE, TOX_PUBLIC_KEY_SIZE, line);
+        line[TOX_PUBLIC_KEY_SIZE * 2] = '\n';
+    }
+
+    pthread_rwlock_unlock(&list->lock);
+
+    int ret = write_file_atomic(list->path, (uint8_t *) text, length);
+    free(text);
+
+    struct stat st;
+
+    if (ret == 0 && stat(list->path, &st) == 0) {
+        /* the file now matches memory; don't let the reload check read it back */
+        pthread_rwlock_wrlock(&list->lock);
+        list->mtime = st.st_mtime;
+        pthread_rwlock_unlock(&list->lock);
+    }
+
+    pthread_mutex_unlock(&list->file_lock);
+
+    if (ret == -1) {
+        log_write(LOG_LEVEL_WARNING, "Warning: failed to write '%s' file\n", list->path);
+    }
+
+    return ret;
+}
+
+bool keylist_contains(struct Key_List *list, const uint8_t *public_key)
+{
+    pthread_rwlock_rdlock(&list->lock);
+    bool found = blockdb_contains(&list->db, public_key)
+                 || (list->num_keys > 0
+                     && bsearch(public_key, list->keys, list->num_keys, TOX_PUBLIC_KEY_SIZE, key_cmp) != NULL);
+    pthread_rwlock_unlock(&list->lock);
+
+    return found;
+}
@@ -0,0 +1,93 @@
+/*  keylist.h
+ *
+ *
+ *  Copyright (C) 2014 toxbot All Rights Reserved.
+ *
+ *  This file is part of toxbot.
+ *
+ *  toxbot is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  toxbot is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with toxbot. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef KEYLIST_H
+#define KEYLIST_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "blockdb.h"
+
+/*
+ * In-memory copy of a plain text key file (masterkeys, blockedkeys), kept sorted for
+ * binary search. A Key_List is shared by every shard so lookups take a read lock.
+ * It may also be backed by a compiled blocklist (see blockdb.h), which is checked first.
+ */
+struct Key_List {
+    pthread_rwlock_t lock;
+    pthread_mutex_t file_lock;    /* serializes saves and reloads; mtime and db.mtime are checked under it */
+    const char *path;
+    uint8_t *keys;      /* num_keys * TOX_PUBLIC_KEY_SIZE bytes, sorted */
+    size_t num_keys;
+    time_t mtime;
+    const char *db_path;
+    struct Block_DB db;
+    uint32_t generation;    /* bumped on every change; read with keylist_generation() */
+};
+
+/*
+ * Initializes list and loads the keys in path. A missing file is created empty.
+ *
+ * Returns 0 on success.
+ * Returns -1 on file operation failure.
+ */
+int keylist_init(struct Key_List *list, const char *path);
+
+void keylist_free(struct Key_List *list);
+
+/* Backs list with the compiled blocklist at db_path, if that file exists. Call before any lookup. */
+void keylist_attach_db(struct Key_List *list, const char *db_path);
+
+/* Re-reads the key file and remaps the compiled blocklist if either has been modified since it was last loaded. */
+void keylist_reload_if_changed(struct Key_List *list);
+
+/* Adds the binary public_key to the in-memory list. Returns false if it was already there. */
+bool keylist_insert(struct Key_List *list, const uint8_t *public_key);
+
+/*
+ * Removes the binary public_key from the in-memory list. Returns false if it was not there.
+ * Keys in the compiled blocklist can't be removed at runtime.
+ */
+bool keylist_remove(struct Key_List *list, const uint8_t *public_key);
+
+/* Returns true if public_key is in the compiled blocklist backing list. */
+bool keylist_db_contains(struct Key_List *list, const uint8_t *public_key);
+
+/*
+ * Replaces the list's file with the in-memory keys, one hex public key per line, through
+ * an atomic rename. This does blocking I/O and is meant to be run on a worker thread.
+ *
+ * Returns 0 on success.
+ * Returns -1 on failure.
+ */
+int keylist_save(struct Key_List *list);
+
+/* Returns a counter that changes whenever the contents of list change. */
+uint32_t keylist_generation(struct Key_List *list);
+
+/* Returns true if the binary public_key is in list. */
+bool keylist_contains(struct Key_List *list, const uint8_t *public_key);
+
+#endif /* KEYLIST_H */
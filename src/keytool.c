@@ -0,0 +1,252 @@
+/*  keytool.c
+ *
+ *
+ *  Copyright (C) 2014 toxbot All Rights Reserved.
+ *
+ *  This file is part of toxbot.
+ *
+ *  toxbot is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  toxbot is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with toxbot. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * toxbot-keytool: builds and inspects the compiled blocklist read by toxbot (see blockdb.h).
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <ctype.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <sys/stat.h>
+
+#include <tox/tox.h>
+
+#include "blockdb.h"
+#include "misc.h"
+
+struct Key_Buffer {
+    uint8_t *keys;
+    size_t num_keys;
+    size_t max_keys;
+};
+
+static void print_usage(const char *name)
+{
+    fprintf(stderr, "usage: %s compile <keys file> <db file>\n"
+                    "       %s merge <db file> <keys file> [keys file ...]\n"
+                    "       %s lookup <db file> <public key>\n"
+                    "       %s info <db file>\n", name, name, name, name);
+}
+
+static void add_key(struct Key_Buffer *buf, const uint8_t *public_key)
+{
+    if (buf->num_keys == buf->max_keys) {
+        buf->max_keys = buf->max_keys ? buf->max_keys * 2 : 1024;
+        uint8_t *tmp = realloc(buf->keys, buf->max_keys * TOX_PUBLIC_KEY_SIZE);
+
+        if (tmp == NULL) {
+            fprintf(stderr, "Out of memory\n");
+            exit(EXIT_FAILURE);
+        }
+
+        buf->keys = tmp;
+    }
+
+    memcpy(buf->keys + buf->num_keys * TOX_PUBLIC_KEY_SIZE, public_key, TOX_PUBLIC_KEY_SIZE);
+    ++buf->num_keys;
+}
+
+/* Parses the public key at the start of s (a public key or a full Tox ID). Returns -1 if there is none. */
+static int parse_key(const char *s, uint8_t *public_key)
+{
+    int i;
+
+    for (i = 0; i < TOX_PUBLIC_KEY_SIZE * 2; ++i) {
+        if (!isxdigit((unsigned char) s[i])) {
+            return -1;
+        }
+    }
+
+    for (i = 0; i < TOX_PUBLIC_KEY_SIZE; ++i) {
+        sscanf(s + i * 2, "%2hhx", &public_key[i]);
+    }
+
+    return 0;
+}
+
+/* Reads every key in the blockedkeys style text file at path. Returns -1 on failure. */
+static int read_text_keys(const char *path, struct Key_Buffer *buf)
+{
+    FILE *fp = fopen(path, "r");
+
+    if (fp == NULL) {
+        fprintf(stderr, "Failed to open '%s'\n", path);
+        return -1;
+    }
+
+    char line[256];
+    unsigned long skipped = 0;
+
+    while (fgets(line, sizeof(line), fp)) {
+        uint8_t public_key[TOX_PUBLIC_KEY_SIZE];
+
+        if (line[0] == '\n' || line[0] == '#') {
+            continue;
+        }
+
+        if (parse_key(line, public_key) == -1) {
+            ++skipped;
+            continue;
+        }
+
+        add_key(buf, public_key);
+    }
+
+    fclose(fp);
+
+    if (skipped > 0) {
+        fprintf(stderr, "%s: skipped %lu invalid lines\n", path, skipped);
+    }
+
+    return 0;
+}
+
+static int write_db(const char *path, struct Key_Buffer *buf)
+{
+    int64_t written = blockdb_write(path, buf->keys, buf->num_keys);
+
+    if (written == -1) {
+        fprintf(stderr, "Failed to write '%s'\n", path);
+        return -1;
+    }
+
+    printf("Wrote %"PRId64" keys to %s\n", written, path);
+    return 0;
+}
+
+static int cmd_compile(int argc, char **argv)
+{
+    struct Key_Buffer buf = {0};
+
+    if (read_text_keys(argv[2], &buf) == -1) {
+        return -1;
+    }
+
+    int ret = write_db(argv[3], &buf);
+    free(buf.keys);
+    return ret;
+}
+
+static int cmd_merge(int argc, char **argv)
+{
+    struct Key_Buffer buf = {0};
+    struct Block_DB db;
+    int i;
+
+    struct stat st;
+
+    /* a missing db is created; any other problem must not replace the existing file */
+    if (stat(argv[2], &st) == -1) {
+        if (errno != ENOENT) {
+            fprintf(stderr, "Failed to stat '%s': %s\n", argv[2], strerror(errno));
+            return -1;
+        }
+    } else {
+        if (blockdb_open(&db, argv[2]) == -1) {
+            fprintf(stderr, "'%s' is not a valid compiled blocklist; leaving it untouched\n", argv[2]);
+            return -1;
+        }
+
+        uint64_t k;
+
+        for (k = 0; k < db.num_keys; ++k) {
+            add_key(&buf, db.keys + k * TOX_PUBLIC_KEY_SIZE);
+        }
+
+        blockdb_close(&db);
+    }
+
+    for (i = 3; i < argc; ++i) {
+        if (read_text_keys(argv[i], &buf) == -1) {
+            free(buf.keys);
+            return -1;
+        }
+    }
+
+    int ret = write_db(argv[2], &buf);
+    free(buf.keys);
+    return ret;
+}
+
+static int cmd_lookup(int argc, char **argv)
+{
+    struct Block_DB db;
+    uint8_t public_key[TOX_PUBLIC_KEY_SIZE];
+
+    if (parse_key(argv[3], public_key) == -1) {
+        fprintf(stderr, "Invalid public key\n");
+        return -1;
+    }
+
+    if (blockdb_open(&db, argv[2]) == -1) {
+        fprintf(stderr, "'%s' is not a valid compiled blocklist\n", argv[2]);
+        return -1;
+    }
+
+    bool found = blockdb_contains(&db, public_key);
+    blockdb_close(&db);
+
+    printf("%s\n", found ? "blocked" : "not blocked");
+    return found ? 0 : 1;
+}
+
+static int cmd_info(int argc, char **argv)
+{
+    struct Block_DB db;
+
+    if (blockdb_open(&db, argv[2]) == -1) {
+        fprintf(stderr, "'%s' is not a valid compiled blocklist\n", argv[2]);
+        return -1;
+    }
+
+    printf("keys: %"PRIu64"\nbloom filter: %"PRIu64" bytes, %u hashes\nbuckets: %u\nfile size: %zu bytes\n",
+           db.num_keys, (db.bloom_mask + 1) / 8, db.num_hashes, 1u << db.bucket_bits, db.map_size);
+
+    blockdb_close(&db);
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    int ret;
+
+    if (argc >= 4 && strcmp(argv[1], "compile") == 0) {
+        ret = cmd_compile(argc, argv);
+    } else if (argc >= 4 && strcmp(argv[1], "merge") == 0) {
+        ret = cmd_merge(argc, argv);
+    } else if (argc >= 4 && strcmp(argv[1], "lookup") == 0) {
+        ret = cmd_lookup(argc, argv);
+    } else if (argc >= 3 && strcmp(argv[1], "info") == 0) {
+        ret = cmd_info(argc, argv);
+    } else {
+        print_usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    return ret == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,481 @@
+/*  log.c
+ *
+ *
+ *  Copyright (C) 2014 toxbot All Rights Reserved.
+ *
+ *  This file is part of toxbot.
+ *
+ *  toxbot is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  toxbot is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with toxbot. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/time.h>
+
+#include "log.h"
+#include "queue.h"
+#include "misc.h"
+
+#define LOG_RING_SIZE 4096
+#define LOG_STRING_SPACE 256
+#define LOG_LINE_SIZE 2048
+#define LOG_IDLE_SLEEP 10000    /* microseconds */
+
+typedef enum {
+    LOG_ARG_INT,
+    LOG_ARG_UINT,
+    LOG_ARG_DOUBLE,
+    LOG_ARG_STRING,
+    LOG_ARG_POINTER,
+} Log_Arg_Type;
+
+/* A log call in binary form; the format string is only referenced, never copied. */
+struct Log_Record {
+    uint64_t timestamp;    /* microseconds since the epoch */
+    const char *fmt;
+    uint8_t level;
+    uint8_t num_args;
+    uint16_t strings_len;
+    uint8_t types[LOG_MAX_ARGS];
+    union {
+        long long i;
+        unsigned long long u;
+        double d;
+        const void *p;
+        struct {
+            uint16_t offset;
+            uint16_t length;
+        } s;
+    } args[LOG_MAX_ARGS];
+    char strings[LOG_STRING_SPACE];
+};
+
+static struct {
+    struct Queue ring;
+    pthread_t thread;
+    bool running;
+    int level;
+    unsigned long long dropped;
+} Log;
+
+static const char *level_names[] = {
+    [LOG_LEVEL_DEBUG]   = "debug",
+    [LOG_LEVEL_INFO]    = "info",
+    [LOG_LEVEL_WARNING] = "warning",
+    [LOG_LEVEL_ERROR]   = "error",
+};
+
+/*
+ * Finds the next conversion in fmt starting at idx. On return *start and *end delimit the
+ * specification (from '%' up to and including the conversion character).
+ *
+ * Returns the conversion character, or '\0' if there are none left.
+ */
+static char next_conversion(const char *fmt, size_t idx, size_t *start, size_t *end)
+{
+    while (fmt[idx]) {
+        if (fmt[idx] != '%') {
+            ++idx;
+            continue;
+        }
+
+        if (fmt[idx + 1] == '%') {
+            idx += 2;
+            continue;
+        }
+
+        *start = idx++;
+
+        while (fmt[idx] && strchr("-+ #0123456789.*hlLqjzt", fmt[idx])) {
+            ++idx;
+        }
+
+        if (fmt[idx] == '\0') {
+            return '\0';
+        }
+
+        *end = idx;
+        return fmt[idx];
+    }
+
+    return '\0';
+}
+
+/* Returns the length modifier of the specification, e.g. "ll", or "" if there is none. */
+static int length_modifier(const char *fmt, size_t start, size_t end)
+{
+    size_t i = end;
+
+    while (i > start && strchr("hlLqjzt", fmt[i - 1])) {
+        --i;
+    }
+
+    return end - i;
+}
+
+void log_write(Log_Level level, const char *fmt, ...)
+{
+    if (!log_enabled(level)) {
+        return;
+    }
+
+    struct Log_Record rec;
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+
+    rec.timestamp = (uint64_t) tv.tv_sec * 1000000 + tv.tv_usec;
+    rec.fmt = fmt;
+    rec.level = level;
+    rec.num_args = 0;
+    rec.strings_len = 0;
+
+    va_list ap;
+    va_start(ap, fmt);
+
+    size_t idx = 0, start, end;
+    char conv;
+
+    while (rec.num_args < LOG_MAX_ARGS && (conv = next_conversion(fmt, idx, &start, &end)) != '\0') {
+        int mod_len = length_modifier(fmt, start, end);
+        const char *mod = fmt + end - mod_len;
+        int precision = -1;
+        int stars = 0;
+        size_t i;
+
+        for (i = start; i < end; ++i) {
+            stars += fmt[i] == '*';
+        }
+
+        if (rec.num_args + stars >= LOG_MAX_ARGS) {
+            break;
+        }
+
+        /* '*' widths and precisions come first, each as an int argument of its own */
+        for (i = start; i < end; ++i) {
+            if (fmt[i] == '*') {
+                int value = va_arg(ap, int);
+                rec.types[rec.num_args] = LOG_ARG_INT;
+                rec.args[rec.num_args++].i = value;
+
+                if (fmt[i - 1] == '.') {
+                    precision = value;
+                }
+            } else if (fmt[i] == '.' && fmt[i + 1] != '*') {
+                precision = atoi(fmt + i + 1);
+            }
+        }
+
+        int n = rec.num_args;
+
+        switch (conv) {
+            case 'd':
+            case 'i':
+                rec.types[n] = LOG_ARG_INT;
+
+                if (mod_len == 2 && mod[0] == 'l' && mod[1] == 'l') {
+                    rec.args[n].i = va_arg(ap, long long);
+                } else if (mod_len == 1 && mod[0] == 'l') {
+                    rec.args[n].i = va_arg(ap, long);
+                } else if (mod_len == 1 && mod[0] == 'z') {
+                    rec.args[n].i = va_arg(ap, ssize_t);
+                } else if (mod_len == 1 && mod[0] == 't') {
+                    rec.args[n].i = va_arg(ap, ptrdiff_t);
+                } else if (mod_len == 1 && mod[0] == 'j') {
+                    rec.args[n].i = va_arg(ap, intmax_t);
+                } else {
+                    rec.args[n].i = va_arg(ap, int);
+                }
+
+                break;
+
+            case 'u':
+            case 'x':
+            case 'X':
+            case 'o':
+            case 'c':
+                rec.types[n] = LOG_ARG_UINT;
+
+                if (mod_len == 2 && mod[0] == 'l' && mod[1] == 'l') {
+                    rec.args[n].u = va_arg(ap, unsigned long long);
+                } else if (mod_len == 1 && mod[0] == 'l') {
+                    rec.args[n].u = va_arg(ap, unsigned long);
+                } else if (mod_len == 1 && mod[0] == 'z') {
+                    rec.args[n].u = va_arg(ap, size_t);
+                } else if (mod_len == 1 && mod[0] == 't') {
+                    rec.args[n].u = (unsigned long long) va_arg(ap, ptrdiff_t);
+                } else if (mod_len == 1 && mod[0] == 'j') {
+                    rec.args[n].u = va_arg(ap, uintmax_t);
+                } else {
+                    rec.args[n].u = va_arg(ap, unsigned int);
+                }
+
+                break;
+
+            case 'f':
+            case 'F':
+            case 'e':
+            case 'E':
+            case 'g':
+            case 'G':
+                rec.types[n] = LOG_ARG_DOUBLE;
+                rec.args[n].d = va_arg(ap, double);
+                break;
+
+            case 's': {
+                const char *str = va_arg(ap, const char *);
+                size_t len = 0;
+
+                if (str && precision >= 0) {
+                    const char *nul = memchr(str, '\0', precision);
+                    len = nul ? (size_t) (nul - str) : (size_t) precision;
+                } else if (str) {
+                    len = strlen(str);
+                }
+
+                len = MIN(len, LOG_STRING_SPACE - rec.strings_len);
+
+                rec.types[n] = LOG_ARG_STRING;
+                rec.args[n].s.offset = rec.strings_len;
+                rec.args[n].s.length = len;
+                memcpy(rec.strings + rec.strings_len, str, len);
+                rec.strings_len += len;
+                break;
+            }
+
+            default:
+                rec.types[n] = LOG_ARG_POINTER;
+                rec.args[n].p = va_arg(ap, const void *);
+                break;
+        }
+
+        ++rec.num_args;
+        idx = end + 1;
+    }
+
+    va_end(ap);
+
+    if (!queue_push(&Log.ring, &rec)) {
+        __atomic_fetch_add(&Log.dropped, 1, __ATOMIC_RELAXED);
+    }
+}
+
+/* Formats rec into buf as one line without a trailing newline. */
+static void log_format(const struct Log_Record *rec, char *buf, size_t size)
+{
+    time_t secs = rec->timestamp / 1000000;
+    struct tm tm;
+    localtime_r(&secs, &tm);
+
+    size_t len = strftime(buf, size, "[%Y-%m-%d %H:%M:%S] ", &tm);
+    const char *fmt = rec->fmt;
+    size_t idx = 0, start, end;
+    int n = 0;
+    char conv;
+
+    while (len < size - 1) {
+        conv = n < rec->num_args ? next_conversion(fmt, idx, &start, &end) : '\0';
+        size_t lit_end = conv ? start : strlen(fmt);
+
+        /* literal text, collapsing %% */
+        while (idx < lit_end && len < size - 1) {
+            if (fmt[idx] == '%' && fmt[idx + 1] == '%') {
+                ++idx;
+            }
+
+            buf[len++] = fmt[idx++];
+        }
+
+        if (!conv || len >= size - 1) {
+            break;
+        }
+
+        /* rebuild the specification with '*' filled in and a length modifier matching the stored type */
+        char spec[64];
+        int mod_len = length_modifier(fmt, start, end);
+        size_t base_len = 0;
+        size_t i;
+
+        for (i = start; i < end - mod_len && base_len < sizeof(spec) - 4; ++i) {
+            if (fmt[i] != '*') {
+                spec[base_len++] = fmt[i];
+                continue;
+            }
+
+            long long value = rec->args[n++].i;
+
+            /* a negative precision means none at all */
+            if (fmt[i - 1] == '.' && value < 0) {
+                --base_len;
+                continue;
+            }
+
+            int ret = snprintf(spec + base_len, sizeof(spec) - 4 - base_len, "%lld", value);
+            base_len = MIN(base_len + MAX(ret, 0), sizeof(spec) - 4);
+        }
+
+        int ret;
+
+        switch (rec->types[n]) {
+            case LOG_ARG_INT:
+                snprintf(spec + base_len, sizeof(spec) - base_len, "ll%c", conv);
+                ret = snprintf(buf + len, size - len, spec, rec->args[n].i);
+                break;
+
+            case LOG_ARG_UINT:
+                if (conv == 'c') {
+                    snprintf(spec + base_len, sizeof(spec) - base_len, "%c", conv);
+                    ret = snprintf(buf + len, size - len, spec, (int) rec->args[n].u);
+                } else {
+                    snprintf(spec + base_len, sizeof(spec) - base_len, "ll%c", conv);
+                    ret = snprintf(buf + len, size - len, spec, rec->args[n].u);
+                }
+
+                break;
+
+            case LOG_ARG_DOUBLE:
+                snprintf(spec + base_len, sizeof(spec) - base_len, "%c", conv);
+                ret = snprintf(buf + len, size - len, spec, rec->args[n].d);
+                break;
+
+            case LOG_ARG_STRING: {
+                char str[LOG_STRING_SPACE + 1];
+                memcpy(str, rec->strings + rec->args[n].s.offset, rec->args[n].s.length);
+                str[rec->args[n].s.length] = '\0';
+                snprintf(spec + base_len, sizeof(spec) - base_len, "s");
+                ret = snprintf(buf + len, size - len, spec, str);
+                break;
+            }
+
+            default:
+                snprintf(spec + base_len, sizeof(spec) - base_len, "%c", conv);
+                ret = snprintf(buf + len, size - len, spec, rec->args[n].p);
+                break;
+        }
+
+        if (ret > 0) {
+            len = MIN(len + ret, size - 1);
+        }
+
+        idx = end + 1;
+        ++n;
+    }
+
+    while (len > 0 && buf[len - 1] == '\n') {
+        --len;
+    }
+
+    buf[len] = '\0';
+}
+
+static void *log_loop(void *arg)
+{
+    unsigned long long reported_dropped = 0;
+    struct Log_Record rec;
+    char line[LOG_LINE_SIZE];
+
+    for (;;) {
+        bool idle = true;
+
+        while (queue_pop(&Log.ring, &rec)) {
+            idle = false;
+            log_format(&rec, line, sizeof(line));
+            fprintf(rec.level >= LOG_LEVEL_WARNING ? stderr : stdout, "%s\n", line);
+        }
+
+        unsigned long long dropped = log_dropped();
+
+        if (dropped != reported_dropped) {
+            fprintf(stderr, "Warning: %llu log records dropped\n", dropped - reported_dropped);
+            reported_dropped = dropped;
+        }
+
+        if (idle) {
+            fflush(stdout);
+
+            if (!__atomic_load_n(&Log.running, __ATOMIC_ACQUIRE)) {
+                break;
+            }
+
+            usleep(LOG_IDLE_SLEEP);
+        }
+    }
+
+    return NULL;
+}
+
+int log_init(Log_Level level)
+{
+    if (queue_init(&Log.ring, LOG_RING_SIZE, sizeof(struct Log_Record)) == -1) {
+        return -1;
+    }
+
+    Log.level = level;
+    Log.running = true;
+
+    if (pthread_create(&Log.thread, NULL, log_loop, NULL) != 0) {
+        queue_free(&Log.ring);
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Safe to call more than once; main registers it with atexit() as well. */
+void log_shutdown(void)
+{
+    if (!__atomic_exchange_n(&Log.running, false, __ATOMIC_ACQ_REL)) {
+        return;
+    }
+
+    pthread_join(Log.thread, NULL);
+    queue_free(&Log.ring);
+}
+
+void log_set_level(Log_Level level)
+{
+    __atomic_store_n(&Log.level, level, __ATOMIC_RELAXED);
+}
+
+bool log_enabled(Log_Level level)
+{
+    return Log.running && level >= __atomic_load_n(&Log.level, __ATOMIC_RELAXED);
+}
+
+int log_level_from_name(const char *name)
+{
+    int i;
+
+    for (i = LOG_LEVEL_DEBUG; i <= LOG_LEVEL_ERROR; ++i) {
+        if (strcasecmp(name, level_names[i]) == 0) {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+unsigned long long log_dropped(void)
+{
+    return __atomic_load_n(&Log.dropped, __ATOMIC_RELAXED);
+}
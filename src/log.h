@@ -0,0 +1,72 @@
+/*  log.h
+ *
+ *
+ *  Copyright (C) 2014 toxbot All Rights Reserved.
+ *
+ *  This file is part of toxbot.
+ *
+ *  toxbot is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  toxbot is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with toxbot. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef LOG_H
+#define LOG_H
+
+#include <stdbool.h>
+
+typedef enum {
+    LOG_LEVEL_DEBUG,
+    LOG_LEVEL_INFO,
+    LOG_LEVEL_WARNING,
+    LOG_LEVEL_ERROR,
+} Log_Level;
+
+/*
+ * Starts the logging thread. Records at level or above are written; info and below go to
+ * stdout, warnings and errors to stderr.
+ *
+ * Returns 0 on success.
+ * Returns -1 on failure.
+ */
+int log_init(Log_Level level);
+
+/* Writes out every queued record and stops the logging thread. */
+void log_shutdown(void);
+
+void log_set_level(Log_Level level);
+
+/* Returns true if records at level are currently being written. Use this to skip work
+ * that is only needed to build a log message. */
+bool log_enabled(Log_Level level);
+
+/* Parses a level name (debug, info, warning, error). Returns -1 if name is invalid. */
+int log_level_from_name(const char *name);
+
+/* Returns the number of records dropped because the ring was full. */
+unsigned long long log_dropped(void);
+
+/*
+ * Queues a record for the logging thread. Never blocks; the record is dropped and counted
+ * if the ring is full.
+ *
+ * fmt must be a string literal: only the pointer is stored and it is formatted later.
+ * Supported conversions are those of printf, including '*' widths and precisions, which
+ * count as arguments. At most LOG_MAX_ARGS arguments are recorded and string arguments are
+ * truncated to fit the record; a precision bounds how much of a string is read.
+ */
+void log_write(Log_Level level, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+#define LOG_MAX_ARGS 8
+
+#endif /* LOG_H */
@@ -0,0 +1,114 @@
+/*  logtest.c
+ *
+ *
+ *  Copyright (C) 2014 toxbot All Rights Reserved.
+ *
+ *  This file is part of toxbot.
+ *
+ *  toxbot is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  toxbot is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with toxbot. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * toxbot-logtest: logs a set of formats through the asynchronous logger and checks that
+ * every line comes out exactly as snprintf formats it. Run with `make check`.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <sys/types.h>
+
+#include "log.h"
+
+#define MAX_CASES 64
+#define LINE_SIZE 1024
+
+static char expected[MAX_CASES][LINE_SIZE];
+static int num_cases;
+
+/* logs a format and keeps what printf makes of the same arguments */
+#define CHECK(fmt, ...) do { \
+    log_write(LOG_LEVEL_INFO, fmt "\n", __VA_ARGS__); \
+    snprintf(expected[num_cases++], LINE_SIZE, fmt, __VA_ARGS__); \
+} while (0)
+
+int main(void)
+{
+    FILE *out = tmpfile();
+
+    if (out == NULL || dup2(fileno(out), STDOUT_FILENO) == -1) {
+        fprintf(stderr, "Failed to redirect stdout\n");
+        return EXIT_FAILURE;
+    }
+
+    if (log_init(LOG_LEVEL_DEBUG) == -1) {
+        fprintf(stderr, "Failed to start logging thread\n");
+        return EXIT_FAILURE;
+    }
+
+    const char unterminated[] = {'f', 'l', 'a', 'g', 'g', 'e', 'd'};
+    char long_string[300];
+    memset(long_string, 'x', sizeof(long_string) - 1);
+    long_string[sizeof(long_string) - 1] = '\0';
+
+    CHECK("%d %i %u", -42, 7, 4000000000u);
+    CHECK("%ld %lu %lld %llu", -5L, 5UL, -1LL << 40, 1ULL << 63);
+    CHECK("%zd %zu %td %jd %ju", (ssize_t) -3, (size_t) 1 << 40, (ptrdiff_t) -9, (intmax_t) -11, UINTMAX_MAX);
+    CHECK("%hd %hhu", (short) -2, (unsigned char) 200);
+    CHECK("%x %X %o %#x %08X", 255u, 255u, 8u, 16u, 0xBEEFu);
+    CHECK("%c%c %5d|%-5d|", 'o', 'k', 12, 34);
+    CHECK("%.2f %e %g", 3.14159, 12345.678, 0.0001);
+    CHECK("%s and %s", "one", "two");
+    CHECK("%.3s|%10s|%-6s|", "abcdef", "right", "left");
+    CHECK("%.*s", (int) sizeof(unterminated), unterminated);
+    CHECK("%*d|%-*d|%.*f", 6, 42, 6, 42, 2, 2.71828);
+    CHECK("%.*s|%*s", -1, "negative precision", 8, "width");
+    CHECK("100%% %s", "done");
+    CHECK("%.250s", long_string);
+
+    log_shutdown();
+    fflush(stdout);
+    rewind(out);
+
+    char line[LINE_SIZE + 64];
+    int i = 0, failed = 0;
+
+    while (i < num_cases && fgets(line, sizeof(line), out)) {
+        line[strcspn(line, "\n")] = '\0';
+
+        /* skip the "[date time] " prefix */
+        const char *text = strchr(line, ']');
+        text = text ? text + 2 : line;
+
+        if (strcmp(text, expected[i]) != 0) {
+            fprintf(stderr, "case %d: expected \"%s\", logged \"%s\"\n", i + 1, expected[i], text);
+            ++failed;
+        }
+
+        ++i;
+    }
+
+    if (i < num_cases) {
+        fprintf(stderr, "only %d of %d lines were logged\n", i, num_cases);
+        ++failed;
+    }
+
+    fprintf(stderr, "%d of %d log formats round-trip\n", num_cases - failed, num_cases);
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,351 @@
+/*  mapi.c
+ *
+ *
+ *  Copyright (C) 2014 toxbot All Rights Reserved.
+ *
+ *  This file is part of toxbot.
+ *
+ *  toxbot is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  toxbot is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with toxbot. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+
+#include <tox/tox.h>
+
+#include "mapi.h"
+#include "toxbot.h"
+#include "commands.h"
+#include "groupchats.h"
+#include "friends.h"
+#include "reply.h"
+#include "metrics.h"
+#include "misc.h"
+#include "log.h"
+
+extern __thread struct Tox_Bot Tox_Bot;
+
+/* response packet being filled; sent when the next op doesn't fit or the request is done */
+struct Mapi_Response {
+    Tox *m;
+    uint32_t friendnumber;
+    uint8_t data[MAPI_MAX_PACKET_SIZE];
+    size_t length;
+    uint8_t num_ops;
+};
+
+static void response_reset(struct Mapi_Response *resp)
+{
+    resp->data[0] = MAPI_PACKET_ID;
+    resp->data[1] = MAPI_VERSION;
+    resp->data[2] = MAPI_KIND_RESPONSE;
+    resp->data[3] = 0;
+    resp->length = MAPI_HEADER_SIZE;
+    resp->num_ops = 0;
+}
+
+static void response_flush(struct Mapi_Response *resp)
+{
+    if (resp->num_ops == 0) {
+        return;
+    }
+
+    resp->data[3] = resp->num_ops;
+    tox_friend_send_lossless_packet(resp->m, resp->friendnumber, resp->data, resp->length, NULL);
+    response_reset(resp);
+}
+
+static void response_add(struct Mapi_Response *resp, uint32_t request_id, Mapi_Status status,
+                         const uint8_t *payload, size_t length)
+{
+    do {
+        if (resp->length + MAPI_RESPONSE_OP_SIZE >= MAPI_MAX_PACKET_SIZE || resp->num_ops == UINT8_MAX) {
+            response_flush(resp);
+        }
+
+        size_t room = MAPI_MAX_PACKET_SIZE - resp->length - MAPI_RESPONSE_OP_SIZE;
+
+        /* start a fresh packet rather than split a payload that would fit in one */
+        if (length > room && resp->num_ops > 0 && length <= MAPI_MAX_PACKET_SIZE - MAPI_HEADER_SIZE
+                - MAPI_RESPONSE_OP_SIZE) {
+            response_flush(resp);
+            room = MAPI_MAX_PACKET_SIZE - resp->length - MAPI_RESPONSE_OP_SIZE;
+        }
+
+        size_t chunk = MIN(length, room);
+        uint8_t *op = resp->data + resp->length;
+
+        pack_u32(op, request_id);
+        op[4] = status;
+        op[5] = chunk < length ? MAPI_FLAG_MORE : 0;
+        pack_u16(op + 6, chunk);
+
+        if (chunk > 0) {
+            memcpy(op + MAPI_RESPONSE_OP_SIZE, payload, chunk);
+        }
+
+        resp->length += MAPI_RESPONSE_OP_SIZE + chunk;
+        ++resp->num_ops;
+
+        payload += chunk;
+        length -= chunk;
+    } while (length > 0);
+}
+
+static void op_info(struct Mapi_Response *resp, uint32_t request_id)
+{
+    uint8_t out[MAPI_INFO_SIZE];
+    uint32_t num_groups = 0;
+    int i;
+
+    for (i = 0; i < Tox_Bot.chats_idx; ++i) {
+        if (Tox_Bot.g_chats[i].active) {
+            ++num_groups;
+        }
+    }
+
+    pack_u64(out, (uint64_t) time(NULL) - Tox_Bot.start_time);
+    pack_u32(out + 8, tox_self_get_friend_list_size(resp->m));
+    pack_u32(out + 12, Tox_Bot.num_online_friends);
+    pack_u32(out + 16, num_groups);
+    pack_u32(out + 20, Tox_Bot.default_groupnum);
+    response_add(resp, request_id, MAPI_STATUS_OK, out, sizeof(out));
+}
+
+static void op_get_address(struct Mapi_Response *resp, uint32_t request_id)
+{
+    uint8_t address[TOX_ADDRESS_SIZE];
+    shard_get_address(least_loaded_shard(), address);
+    response_add(resp, request_id, MAPI_STATUS_OK, address, sizeof(address));
+}
+
+static void op_list_groups(struct Mapi_Response *resp, uint32_t request_id, const uint8_t *payload,
+                           uint16_t length)
+{
+    if (length < 2) {
+        response_add(resp, request_id, MAPI_STATUS_BAD_REQUEST, NULL, 0);
+        return;
+    }
+
+    uint16_t first = unpack_u16(payload);
+
+    /* one packet's worth of entries; the client asks again from where this ends */
+    uint8_t out[MAPI_MAX_PACKET_SIZE - MAPI_HEADER_SIZE - MAPI_RESPONSE_OP_SIZE];
+    size_t out_len = 4;
+    uint16_t total = 0, count = 0;
+    int i;
+
+    for (i = 0; i < Tox_Bot.chats_idx; ++i) {
+        const struct Group_Chat *g = &Tox_Bot.g_chats[i];
+
+        if (!g->active) {
+            continue;
+        }
+
+        if (total++ < first || out_len + MAPI_GROUP_ENTRY_SIZE > sizeof(out)) {
+            continue;
+        }
+
+        uint8_t *entry = out + out_len;
+        pack_u32(entry, g->groupnum);
+        entry[4] = g->type;
+        entry[5] = g->has_pass;
+        pack_u16(entry + 6, MIN(g->num_peers, UINT16_MAX));
+
+        if (!tox_conference_get_id(resp->m, g->groupnum, entry + 8)) {
+            memset(entry + 8, 0, TOX_CONFERENCE_ID_SIZE);
+        }
+
+        out_len += MAPI_GROUP_ENTRY_SIZE;
+        ++count;
+    }
+
+    pack_u16(out, total);
+    pack_u16(out + 2, count);
+    response_add(resp, request_id, MAPI_STATUS_OK, out, out_len);
+}
+
+static void op_invite(struct Mapi_Response *resp, uint32_t request_id, const uint8_t *payload, uint16_t length)
+{
+    if (length < 5 || length < 5 + payload[4]) {
+        response_add(resp, request_id, MAPI_STATUS_BAD_REQUEST, NULL, 0);
+        return;
+    }
+
+    uint32_t groupnum = unpack_u32(payload);
+    uint8_t pass_len = payload[4];
+    char password[UINT8_MAX + 1];
+
+    memcpy(password, payload + 5, pass_len);
+    password[pass_len] = '\0';
+
+    TOX_ERR_CONFERENCE_INVITE err;
+    Mapi_Status status = MAPI_STATUS_FAILED;
+
+    switch (invite_friend(resp->m, resp->friendnumber, groupnum, pass_len ? password : NULL, &err)) {
+        case INVITE_OK:
+        case INVITE_DEFERRED:
+            status = MAPI_STATUS_OK;
+            break;
+
+        case INVITE_NO_GROUP:
+            status = MAPI_STATUS_NOT_FOUND;
+            break;
+
+        case INVITE_BAD_PASSWORD:
+            status = MAPI_STATUS_DENIED;
+            break;
+
+        case INVITE_FAILED:
+            status = MAPI_STATUS_FAILED;
+            break;
+    }
+
+    response_add(resp, request_id, status, NULL, 0);
+}
+
+static void op_group_message(struct Mapi_Response *resp, uint32_t request_id, const uint8_t *payload,
+                             uint16_t length)
+{
+    if (!friend_is_master(resp->m, resp->friendnumber)) {
+        response_add(resp, request_id, MAPI_STATUS_DENIED, NULL, 0);
+        return;
+    }
+
+    if (length <= 4 || length - 4 > TOX_MAX_MESSAGE_LENGTH) {
+        response_add(resp, request_id, MAPI_STATUS_BAD_REQUEST, NULL, 0);
+        return;
+    }
+
+    uint32_t groupnum = unpack_u32(payload);
+
+    if (group_index(groupnum) == -1) {
+        response_add(resp, request_id, MAPI_STATUS_NOT_FOUND, NULL, 0);
+        return;
+    }
+
+    if (!tox_conference_send_message(resp->m, groupnum, TOX_MESSAGE_TYPE_NORMAL, payload + 4, length - 4, NULL)) {
+        response_add(resp, request_id, MAPI_STATUS_FAILED, NULL, 0);
+        return;
+    }
+
+    char name[TOX_MAX_NAME_LENGTH];
+    get_friend_log_name(resp->m, resp->friendnumber, name, LOG_LEVEL_INFO);
+    log_write(LOG_LEVEL_INFO, "%s sent a message to group %u\n", name, groupnum);
+
+    response_add(resp, request_id, MAPI_STATUS_OK, NULL, 0);
+}
+
+static void op_command(struct Mapi_Response *resp, uint32_t request_id, const uint8_t *payload, uint16_t length)
+{
+    if (length == 0 || length >= MAX_COMMAND_LENGTH) {
+        response_add(resp, request_id, MAPI_STATUS_BAD_REQUEST, NULL, 0);
+        return;
+    }
+
+    char text[MAX_COMMAND_LENGTH];
+    memcpy(text, payload, length);
+    text[length] = '\0';
+
+    struct Reply_Sink sink;
+    int ret = execute_into_sink(resp->m, resp->friendnumber, text, length, &sink);
+
+    response_add(resp, request_id, ret == -1 ? MAPI_STATUS_FAILED : MAPI_STATUS_OK, (uint8_t *) sink.buf, sink.len);
+    reply_sink_free(&sink);
+}
+
+static void run_op(struct Mapi_Response *resp, uint32_t request_id, uint8_t opcode, const uint8_t *payload,
+                   uint16_t length)
+{
+    metrics_inc(METRIC_MAPI_REQUESTS);
+
+    switch (opcode) {
+        case MAPI_OP_PING:
+            response_add(resp, request_id, MAPI_STATUS_OK, NULL, 0);
+            break;
+
+        case MAPI_OP_INFO:
+            op_info(resp, request_id);
+            break;
+
+        case MAPI_OP_GET_ADDRESS:
+            op_get_address(resp, request_id);
+            break;
+
+        case MAPI_OP_LIST_GROUPS:
+            op_list_groups(resp, request_id, payload, length);
+            break;
+
+        case MAPI_OP_INVITE:
+            op_invite(resp, request_id, payload, length);
+            break;
+
+        case MAPI_OP_GROUP_MESSAGE:
+            op_group_message(resp, request_id, payload, length);
+            break;
+
+        case MAPI_OP_COMMAND:
+            op_command(resp, request_id, payload, length);
+            break;
+
+        default:
+            response_add(resp, request_id, MAPI_STATUS_UNKNOWN_OP, NULL, 0);
+            break;
+    }
+}
+
+void mapi_handle_packet(Tox *m, uint32_t friendnumber, const uint8_t *data, size_t length)
+{
+    /* data starts after the packet id byte */
+    if (length < MAPI_HEADER_SIZE - 1 || data[0] != MAPI_VERSION || data[1] != MAPI_KIND_REQUEST) {
+        metrics_inc(METRIC_MAPI_BAD_PACKETS);
+        return;
+    }
+
+    struct Mapi_Response resp;
+    resp.m = m;
+    resp.friendnumber = friendnumber;
+    response_reset(&resp);
+
+    uint8_t num_ops = data[2];
+    size_t pos = MAPI_HEADER_SIZE - 1;
+    int i;
+
+    for (i = 0; i < num_ops; ++i) {
+        if (length - pos < MAPI_REQUEST_OP_SIZE) {
+            metrics_inc(METRIC_MAPI_BAD_PACKETS);
+            break;
+        }
+
+        uint32_t request_id = unpack_u32(data + pos);
+        uint8_t opcode = data[pos + 4];
+        uint16_t op_len = unpack_u16(data + pos + 5);
+        pos += MAPI_REQUEST_OP_SIZE;
+
+        if (op_len > length - pos) {
+            response_add(&resp, request_id, MAPI_STATUS_BAD_REQUEST, NULL, 0);
+            metrics_inc(METRIC_MAPI_BAD_PACKETS);
+            break;
+        }
+
+        run_op(&resp, request_id, opcode, data + pos, op_len);
+        pos += op_len;
+    }
+
+    response_flush(&resp);
+}
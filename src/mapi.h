@@ -0,0 +1,88 @@
+/*  mapi.h
+ *
+ *
+ *  Copyright (C) 2014 toxbot All Rights Reserved.
+ *
+ *  This file is part of toxbot.
+ *
+ *  toxbot is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  toxbot is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with toxbot. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef MAPI_H
+#define MAPI_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <tox/tox.h>
+
+/*
+ * Binary machine API, carried in lossless custom packets. A client sends request packets
+ * and the bot answers each request with one or more response ops, in request order.
+ * Integers are little-endian (see pack_u16() and friends).
+ *
+ * Packet:       u8 packet id | u8 version | u8 kind | u8 number of ops | ops
+ * Request op:   u32 request id | u8 opcode | u16 length | payload
+ * Response op:  u32 request id | u8 status | u8 flags | u16 length | payload
+ *
+ * A response payload too big for one packet is split over several response ops with the
+ * same request id, all but the last carrying MAPI_FLAG_MORE.
+ */
+
+#define MAPI_PACKET_ID        170    /* lossless custom packet ids are 160-191 */
+#define MAPI_VERSION          1
+#define MAPI_HEADER_SIZE      4
+#define MAPI_REQUEST_OP_SIZE  7
+#define MAPI_RESPONSE_OP_SIZE 8
+#define MAPI_MAX_PACKET_SIZE  TOX_MAX_CUSTOM_PACKET_SIZE
+
+typedef enum {
+    MAPI_KIND_REQUEST,
+    MAPI_KIND_RESPONSE,
+} Mapi_Kind;
+
+#define MAPI_FLAG_MORE 0x01
+
+typedef enum {
+    MAPI_OP_PING,             /* -> nothing */
+    MAPI_OP_INFO,             /* -> Mapi_Info layout below */
+    MAPI_OP_GET_ADDRESS,      /* -> TOX_ADDRESS_SIZE bytes */
+    MAPI_OP_LIST_GROUPS,      /* u16 first entry -> u16 total | u16 count | count group entries */
+    MAPI_OP_INVITE,           /* u32 group | u8 password length | password -> nothing */
+    MAPI_OP_GROUP_MESSAGE,    /* u32 group | message (rest of payload); masters only -> nothing */
+    MAPI_OP_COMMAND,          /* text command(s) as sent in a message -> reply text */
+} Mapi_Opcode;
+
+typedef enum {
+    MAPI_STATUS_OK,
+    MAPI_STATUS_FAILED,          /* the operation ran and failed; payload may explain */
+    MAPI_STATUS_DENIED,          /* masters only, or wrong password */
+    MAPI_STATUS_BAD_REQUEST,     /* malformed payload */
+    MAPI_STATUS_UNKNOWN_OP,
+    MAPI_STATUS_NOT_FOUND,       /* no such group */
+} Mapi_Status;
+
+/* MAPI_OP_INFO response: u64 uptime | u32 friends | u32 online | u32 groups | u32 default group */
+#define MAPI_INFO_SIZE 24
+
+/* MAPI_OP_LIST_GROUPS entry: u32 group | u8 type | u8 has password | u16 peers | conference id */
+#define MAPI_GROUP_ENTRY_SIZE (8 + TOX_CONFERENCE_ID_SIZE)
+
+/*
+ * Runs the requests in a packet received from friendnumber (without its packet id byte)
+ * and sends the responses. Privileges are checked as for text commands.
+ */
+void mapi_handle_packet(Tox *m, uint32_t friendnumber, const uint8_t *data, size_t length);
+
+#endif /* MAPI_H */
@@ -0,0 +1,241 @@
+/*  mapi_client.c
+ *
+ *
+ *  Copyright (C) 2014 toxbot All Rights Reserved.
+ *
+ *  This file is part of toxbot.
+ *
+ *  toxbot is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  toxbot is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with toxbot. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/types.h>
+
+#include <tox/tox.h>
+
+#include "mapi_client.h"
+#include "misc.h"
+
+void mapi_request_init(struct Mapi_Request *req)
+{
+    req->data[0] = MAPI_PACKET_ID;
+    req->data[1] = MAPI_VERSION;
+    req->data[2] = MAPI_KIND_REQUEST;
+    req->data[3] = 0;
+    req->length = MAPI_HEADER_SIZE;
+}
+
+/* Reserves room for an op with a payload of length bytes. Returns NULL if it doesn't fit. */
+static uint8_t *request_op(struct Mapi_Request *req, uint32_t request_id, uint8_t opcode, size_t length)
+{
+    if (req->data[3] == UINT8_MAX || length > UINT16_MAX
+            || req->length + MAPI_REQUEST_OP_SIZE + length > sizeof(req->data)) {
+        return NULL;
+    }
+
+    uint8_t *op = req->data + req->length;
+    pack_u32(op, request_id);
+    op[4] = opcode;
+    pack_u16(op + 5, length);
+
+    req->length += MAPI_REQUEST_OP_SIZE + length;
+    ++req->data[3];
+    return op + MAPI_REQUEST_OP_SIZE;
+}
+
+int mapi_request_add(struct Mapi_Request *req, uint32_t request_id, uint8_t opcode, const uint8_t *payload,
+                     uint16_t length)
+{
+    uint8_t *dest = request_op(req, request_id, opcode, length);
+
+    if (dest == NULL) {
+        return -1;
+    }
+
+    if (length > 0) {
+        memcpy(dest, payload, length);
+    }
+
+    return 0;
+}
+
+int mapi_add_ping(struct Mapi_Request *req, uint32_t request_id)
+{
+    return mapi_request_add(req, request_id, MAPI_OP_PING, NULL, 0);
+}
+
+int mapi_add_info(struct Mapi_Request *req, uint32_t request_id)
+{
+    return mapi_request_add(req, request_id, MAPI_OP_INFO, NULL, 0);
+}
+
+int mapi_add_get_address(struct Mapi_Request *req, uint32_t request_id)
+{
+    return mapi_request_add(req, request_id, MAPI_OP_GET_ADDRESS, NULL, 0);
+}
+
+int mapi_add_list_groups(struct Mapi_Request *req, uint32_t request_id, uint16_t first)
+{
+    uint8_t *dest = request_op(req, request_id, MAPI_OP_LIST_GROUPS, 2);
+
+    if (dest == NULL) {
+        return -1;
+    }
+
+    pack_u16(dest, first);
+    return 0;
+}
+
+int mapi_add_invite(struct Mapi_Request *req, uint32_t request_id, uint32_t groupnum, const char *password)
+{
+    size_t pass_len = password ? strlen(password) : 0;
+
+    if (pass_len > UINT8_MAX) {
+        return -1;
+    }
+
+    uint8_t *dest = request_op(req, request_id, MAPI_OP_INVITE, 5 + pass_len);
+
+    if (dest == NULL) {
+        return -1;
+    }
+
+    pack_u32(dest, groupnum);
+    dest[4] = pass_len;
+    memcpy(dest + 5, password, pass_len);
+    return 0;
+}
+
+int mapi_add_group_message(struct Mapi_Request *req, uint32_t request_id, uint32_t groupnum, const char *message,
+                           size_t length)
+{
+    uint8_t *dest = request_op(req, request_id, MAPI_OP_GROUP_MESSAGE, 4 + length);
+
+    if (dest == NULL) {
+        return -1;
+    }
+
+    pack_u32(dest, groupnum);
+    memcpy(dest + 4, message, length);
+    return 0;
+}
+
+int mapi_add_command(struct Mapi_Request *req, uint32_t request_id, const char *command, size_t length)
+{
+    if (length > UINT16_MAX) {
+        return -1;
+    }
+
+    return mapi_request_add(req, request_id, MAPI_OP_COMMAND, (const uint8_t *) command, length);
+}
+
+int mapi_request_num_ops(const struct Mapi_Request *req)
+{
+    return req->data[3];
+}
+
+int mapi_request_send(Tox *m, uint32_t friendnumber, const struct Mapi_Request *req)
+{
+    return tox_friend_send_lossless_packet(m, friendnumber, req->data, req->length, NULL) ? 0 : -1;
+}
+
+int mapi_response_begin(struct Mapi_Response_Iter *iter, const uint8_t *data, size_t length)
+{
+    if (length < MAPI_HEADER_SIZE || data[0] != MAPI_PACKET_ID || data[1] != MAPI_VERSION
+            || data[2] != MAPI_KIND_RESPONSE) {
+        return -1;
+    }
+
+    iter->data = data;
+    iter->length = length;
+    iter->pos = MAPI_HEADER_SIZE;
+    iter->remaining = data[3];
+    return 0;
+}
+
+int mapi_response_next(struct Mapi_Response_Iter *iter, struct Mapi_Response_Op *op)
+{
+    if (iter->remaining == 0) {
+        return 0;
+    }
+
+    if (iter->length - iter->pos < MAPI_RESPONSE_OP_SIZE) {
+        return -1;
+    }
+
+    const uint8_t *p = iter->data + iter->pos;
+    op->request_id = unpack_u32(p);
+    op->status = p[4];
+    op->more = p[5] & MAPI_FLAG_MORE;
+    op->length = unpack_u16(p + 6);
+
+    if (op->length > iter->length - iter->pos - MAPI_RESPONSE_OP_SIZE) {
+        return -1;
+    }
+
+    op->payload = p + MAPI_RESPONSE_OP_SIZE;
+    iter->pos += MAPI_RESPONSE_OP_SIZE + op->length;
+    --iter->remaining;
+    return 1;
+}
+
+int mapi_decode_info(const struct Mapi_Response_Op *op, struct Mapi_Info *info)
+{
+    if (op->length < MAPI_INFO_SIZE) {
+        return -1;
+    }
+
+    info->uptime = unpack_u64(op->payload);
+    info->num_friends = unpack_u32(op->payload + 8);
+    info->num_online = unpack_u32(op->payload + 12);
+    info->num_groups = unpack_u32(op->payload + 16);
+    info->default_group = unpack_u32(op->payload + 20);
+    return 0;
+}
+
+int mapi_decode_group_list(const struct Mapi_Response_Op *op, uint16_t *total, uint16_t *count)
+{
+    if (op->length < 4) {
+        return -1;
+    }
+
+    *total = unpack_u16(op->payload);
+    *count = unpack_u16(op->payload + 2);
+
+    if (4 + (size_t) *count * MAPI_GROUP_ENTRY_SIZE > op->length) {
+        return -1;
+    }
+
+    return 0;
+}
+
+int mapi_decode_group(const struct Mapi_Response_Op *op, uint16_t index, struct Mapi_Group *group)
+{
+    size_t offset = 4 + (size_t) index * MAPI_GROUP_ENTRY_SIZE;
+
+    if (offset + MAPI_GROUP_ENTRY_SIZE > op->length) {
+        return -1;
+    }
+
+    const uint8_t *entry = op->payload + offset;
+    group->groupnum = unpack_u32(entry);
+    group->type = entry[4];
+    group->has_pass = entry[5];
+    group->num_peers = unpack_u16(entry + 6);
+    memcpy(group->id, entry + 8, TOX_CONFERENCE_ID_SIZE);
+    return 0;
+}
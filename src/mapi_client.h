@@ -0,0 +1,126 @@
+/*  mapi_client.h
+ *
+ *
+ *  Copyright (C) 2014 toxbot All Rights Reserved.
+ *
+ *  This file is part of toxbot.
+ *
+ *  toxbot is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  toxbot is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with toxbot. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef MAPI_CLIENT_H
+#define MAPI_CLIENT_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <tox/tox.h>
+
+#include "mapi.h"
+
+/*
+ * Client side of the binary machine API (see mapi.h). Build a request packet with
+ * mapi_request_init() and the mapi_add_*() functions, send it with mapi_request_send(),
+ * and feed the lossless packets that come back to mapi_response_begin().
+ */
+
+struct Mapi_Request {
+    uint8_t data[MAPI_MAX_PACKET_SIZE];
+    size_t length;
+};
+
+struct Mapi_Response_Op {
+    uint32_t request_id;
+    uint8_t status;     /* Mapi_Status */
+    bool more;          /* the payload continues in the next op with the same request id */
+    uint16_t length;
+    const uint8_t *payload;
+};
+
+struct Mapi_Response_Iter {
+    const uint8_t *data;
+    size_t length;
+    size_t pos;
+    uint8_t remaining;
+};
+
+struct Mapi_Info {
+    uint64_t uptime;
+    uint32_t num_friends;
+    uint32_t num_online;
+    uint32_t num_groups;
+    uint32_t default_group;
+};
+
+struct Mapi_Group {
+    uint32_t groupnum;
+    uint8_t type;    /* TOX_CONFERENCE_TYPE */
+    bool has_pass;
+    uint16_t num_peers;
+    uint8_t id[TOX_CONFERENCE_ID_SIZE];
+};
+
+void mapi_request_init(struct Mapi_Request *req);
+
+/*
+ * Appends an op to req. The mapi_add_*() functions below encode the payload for each opcode.
+ *
+ * Returns 0 on success.
+ * Returns -1 if the op doesn't fit; send req and start a new one.
+ */
+int mapi_request_add(struct Mapi_Request *req, uint32_t request_id, uint8_t opcode, const uint8_t *payload,
+                     uint16_t length);
+
+int mapi_add_ping(struct Mapi_Request *req, uint32_t request_id);
+int mapi_add_info(struct Mapi_Request *req, uint32_t request_id);
+int mapi_add_get_address(struct Mapi_Request *req, uint32_t request_id);
+int mapi_add_list_groups(struct Mapi_Request *req, uint32_t request_id, uint16_t first);
+int mapi_add_invite(struct Mapi_Request *req, uint32_t request_id, uint32_t groupnum, const char *password);
+int mapi_add_group_message(struct Mapi_Request *req, uint32_t request_id, uint32_t groupnum, const char *message,
+                           size_t length);
+int mapi_add_command(struct Mapi_Request *req, uint32_t request_id, const char *command, size_t length);
+
+/* Returns the number of ops in req. */
+int mapi_request_num_ops(const struct Mapi_Request *req);
+
+/* Sends req to the bot at friendnumber. Returns 0 on success, -1 on failure. */
+int mapi_request_send(Tox *m, uint32_t friendnumber, const struct Mapi_Request *req);
+
+/*
+ * Starts reading a received lossless packet, including its packet id byte.
+ *
+ * Returns 0 on success.
+ * Returns -1 if data is not a machine API response.
+ */
+int mapi_response_begin(struct Mapi_Response_Iter *iter, const uint8_t *data, size_t length);
+
+/*
+ * Reads the next response op. op->payload points into the packet.
+ *
+ * Returns 1 if an op was read, 0 at the end of the packet, -1 if the packet is malformed.
+ */
+int mapi_response_next(struct Mapi_Response_Iter *iter, struct Mapi_Response_Op *op);
+
+/* Decode the payloads of MAPI_OP_INFO and MAPI_OP_LIST_GROUPS responses. Return -1 if malformed. */
+int mapi_decode_info(const struct Mapi_Response_Op *op, struct Mapi_Info *info);
+
+/*
+ * Puts the total number of groups and the number in this response in total and count.
+ * Read the entries with mapi_decode_group().
+ */
+int mapi_decode_group_list(const struct Mapi_Response_Op *op, uint16_t *total, uint16_t *count);
+int mapi_decode_group(const struct Mapi_Response_Op *op, uint16_t index, struct Mapi_Group *group);
+
+#endif /* MAPI_CLIENT_H */
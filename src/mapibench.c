@@ -0,0 +1,281 @@
+/*  mapibench.c
+ *
+ *
+ *  Copyright (C) 2014 toxbot All Rights Reserved.
+ *
+ *  This file is part of toxbot.
+ *
+ *  toxbot is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  toxbot is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with toxbot. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * toxbot-mapibench: compares the binary machine API (see mapi.h) with text commands for the
+ * same requests. It times the client encoding a request, the bot decoding and dispatching it
+ * through mapi_handle_packet(), and the client decoding the response. For text, it times
+ * execute_batch() on the equivalent command.
+ *
+ * The bench links every object of the bot except toxbot.o and supplies the few toxbot.c
+ * globals and helpers that the command handlers use. It uses an offline Tox instance with
+ * one friend. tox_friend_send_message() and tox_friend_send_lossless_packet() are replaced
+ * below, so nothing goes on the wire. The lossless one keeps the last packet so that the
+ * response can be decoded. This relies on the executable's definitions taking precedence
+ * over the shared libtoxcore.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+
+#include <tox/tox.h>
+
+#include "toxbot.h"
+#include "keylist.h"
+#include "friends.h"
+#include "commands.h"
+#include "mapi.h"
+#include "mapi_client.h"
+
+#define BENCH_ITERATIONS 200000
+#define BENCH_BATCH      8
+
+/* the parts of toxbot.c that the rest of the bot reaches */
+__thread char *DATA_FILE = "toxbot_mapibench_save";
+__thread struct Tox_Bot Tox_Bot;
+struct Shard Shards[MAX_NUM_SHARDS];
+int Num_Shards = 1;
+struct Key_List Master_Keys;
+struct Key_List Blocked_Keys;
+
+int least_loaded_shard(void)
+{
+    return 0;
+}
+
+void shard_get_address(int shard, uint8_t *address)
+{
+    memset(address, 0, TOX_ADDRESS_SIZE);
+}
+
+void shard_kick_key(const uint8_t *public_key)
+{
+}
+
+int save_data(Tox *m, const char *path)
+{
+    return 0;
+}
+
+bool friend_is_master(Tox *m, uint32_t friendnumber)
+{
+    return false;
+}
+
+void keylist_persist(struct Key_List *list)
+{
+}
+
+bool block_key(Tox *m, const uint8_t *public_key)
+{
+    return false;
+}
+
+int block_friend(Tox *m, uint32_t friendnumber)
+{
+    return -1;
+}
+
+void get_friend_log_name(Tox *m, uint32_t friendnumber, char *name, Log_Level level)
+{
+    name[0] = '\0';
+}
+
+/* the stubbed send path */
+static uint64_t sent_messages;
+static uint64_t sent_bytes;
+static uint8_t last_packet[MAPI_MAX_PACKET_SIZE];
+static size_t last_packet_len;
+
+uint32_t tox_friend_send_message(Tox *tox, uint32_t friend_number, TOX_MESSAGE_TYPE type, const uint8_t *message,
+                                 size_t length, TOX_ERR_FRIEND_SEND_MESSAGE *error)
+{
+    ++sent_messages;
+    sent_bytes += length;
+    return 0;
+}
+
+bool tox_friend_send_lossless_packet(Tox *tox, uint32_t friend_number, const uint8_t *data, size_t length,
+                                     TOX_ERR_FRIEND_CUSTOM_PACKET *error)
+{
+    ++sent_messages;
+    sent_bytes += length;
+    last_packet_len = length < sizeof(last_packet) ? length : sizeof(last_packet);
+    memcpy(last_packet, data, last_packet_len);
+    return true;
+}
+
+static uint64_t get_time_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+struct Bench_Case {
+    const char *name;
+    uint8_t opcode;
+    const char *text;    /* the equivalent text command */
+};
+
+static const struct Bench_Case cases[] = {
+    { "info",    MAPI_OP_INFO,        "info" },
+    { "address", MAPI_OP_GET_ADDRESS, "id"   },
+};
+
+static void build_request(struct Mapi_Request *req, uint8_t opcode, int num_ops)
+{
+    int i;
+
+    mapi_request_init(req);
+
+    for (i = 0; i < num_ops; ++i) {
+        mapi_request_add(req, i, opcode, NULL, 0);
+    }
+}
+
+static double ops_per_sec(uint64_t ops, uint64_t elapsed_us)
+{
+    return elapsed_us ? ops * 1e6 / elapsed_us : 0.0;
+}
+
+static void run_case(Tox *m, const struct Bench_Case *c, int num_ops)
+{
+    struct Mapi_Request req;
+    uint64_t n, start;
+    int iterations = BENCH_ITERATIONS / num_ops;
+
+    /* encode */
+    start = get_time_us();
+
+    for (n = 0; n < iterations; ++n) {
+        build_request(&req, c->opcode, num_ops);
+    }
+
+    double encode = ops_per_sec((uint64_t) iterations * num_ops, get_time_us() - start);
+
+    /* decode and dispatch on the bot's side; the packet id byte is stripped as in cb_friend_lossless_packet */
+    sent_bytes = sent_messages = 0;
+    start = get_time_us();
+
+    for (n = 0; n < iterations; ++n) {
+        mapi_handle_packet(m, 0, req.data + 1, req.length - 1);
+    }
+
+    double dispatch = ops_per_sec((uint64_t) iterations * num_ops, get_time_us() - start);
+    double mapi_bytes = (double) sent_bytes / ((uint64_t) iterations * num_ops);
+
+    /* decode the response on the client's side */
+    uint64_t decoded = 0;
+    start = get_time_us();
+
+    for (n = 0; n < iterations; ++n) {
+        struct Mapi_Response_Iter iter;
+        struct Mapi_Response_Op op;
+        struct Mapi_Info info;
+
+        if (mapi_response_begin(&iter, last_packet, last_packet_len) == -1) {
+            fprintf(stderr, "The bot sent no valid response for %s\n", c->name);
+            exit(EXIT_FAILURE);
+        }
+
+        while (mapi_response_next(&iter, &op) == 1) {
+            if (op.status == MAPI_STATUS_OK && (c->opcode != MAPI_OP_INFO || mapi_decode_info(&op, &info) == 0)) {
+                ++decoded;
+            }
+        }
+    }
+
+    double decode = ops_per_sec(decoded, get_time_us() - start);
+
+    /* the same requests as text, several to a message when batched */
+    char text[MAX_COMMAND_LENGTH];
+    size_t text_len = 0;
+    int i;
+
+    for (i = 0; i < num_ops; ++i) {
+        text_len += snprintf(text + text_len, sizeof(text) - text_len, "%s%s", i ? ";" : "", c->text);
+    }
+
+    sent_bytes = sent_messages = 0;
+    start = get_time_us();
+
+    for (n = 0; n < iterations; ++n) {
+        execute_batch(m, 0, text, text_len);
+    }
+
+    double text_dispatch = ops_per_sec((uint64_t) iterations * num_ops, get_time_us() - start);
+    double text_bytes = (double) sent_bytes / ((uint64_t) iterations * num_ops);
+
+    char label[32];
+    snprintf(label, sizeof(label), "%s x%d", c->name, num_ops);
+    printf("%-12s %12.0f %12.0f %12.0f %8.1f %14.0f %8.1f\n", label, encode, dispatch, decode, mapi_bytes,
+           text_dispatch, text_bytes);
+}
+
+int main(void)
+{
+    struct Tox_Options tox_opts;
+    memset(&tox_opts, 0, sizeof(struct Tox_Options));
+    tox_options_default(&tox_opts);
+
+    /* no sockets; the bench never goes online */
+    tox_opts.udp_enabled = false;
+    tox_opts.local_discovery_enabled = false;
+
+    Tox *m = tox_new(&tox_opts, NULL);
+
+    if (m == NULL) {
+        fprintf(stderr, "tox_new failed\n");
+        exit(EXIT_FAILURE);
+    }
+
+    uint8_t friend_key[TOX_PUBLIC_KEY_SIZE];
+    memset(friend_key, 0x5a, sizeof(friend_key));
+
+    if (tox_friend_add_norequest(m, friend_key, NULL) != 0) {
+        fprintf(stderr, "Failed to add the bench friend\n");
+        exit(EXIT_FAILURE);
+    }
+
+    Tox_Bot.start_time = (uint64_t) time(NULL);
+    Tox_Bot.inactive_limit = 315360000;
+    friends_init(m);
+
+    printf("%d requests per row, ops/s; bytes are sent per request\n\n", BENCH_ITERATIONS);
+    printf("%-12s %12s %12s %12s %8s %14s %8s\n", "request", "mapi encode", "mapi handle", "mapi decode",
+           "bytes", "text execute", "bytes");
+
+    size_t c;
+
+    for (c = 0; c < sizeof(cases) / sizeof(cases[0]); ++c) {
+        run_case(m, &cases[c], 1);
+        run_case(m, &cases[c], BENCH_BATCH);
+    }
+
+    tox_kill(m);
+    return 0;
+}
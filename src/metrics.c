@@ -0,0 +1,94 @@
+/*  metrics.c
+ *
+ *
+ *  Copyright (C) 2014 toxbot All Rights Reserved.
+ *
+ *  This file is part of toxbot.
+ *
+ *  toxbot is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  toxbot is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with toxbot. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdint.h>
+
+#include "metrics.h"
+
+static uint64_t metric_values[NUM_METRICS];
+
+static const char *metric_names[NUM_METRICS] = {
+    [METRIC_FRIEND_REQUESTS]   = "friend_requests",
+    [METRIC_FRIENDS_ADDED]     = "friends_added",
+    [METRIC_MESSAGES_RECEIVED] = "messages_received",
+    [METRIC_COMMANDS_EXECUTED] = "commands_executed",
+    [METRIC_INVALID_COMMANDS]  = "invalid_commands",
+    [METRIC_INVITES_SENT]      = "invites_sent",
+    [METRIC_SAVES]             = "saves",
+    [METRIC_RATE_ALLOWED]      = "rate_allowed",
+    [METRIC_RATE_LIMITED]      = "rate_limited",
+    [METRIC_RATE_MUTED_DROPS]  = "rate_muted_drops",
+    [METRIC_RATE_MUTES]        = "rate_mutes",
+    [METRIC_RATE_BLOCKS]       = "rate_blocks",
+    [METRIC_FRIEND_REQUEST_QUEUE_DEPTH] = "friend_request_queue_depth",
+    [METRIC_FRIEND_REQUESTS_REJECTED]   = "friend_requests_rejected",
+    [METRIC_FRIEND_REQUESTS_DROPPED]    = "friend_requests_dropped",
+    [METRIC_BRIDGE_RELAYED]     = "bridge_relayed",
+    [METRIC_BRIDGE_DROPPED]     = "bridge_dropped",
+    [METRIC_BRIDGE_QUEUE_DEPTH] = "bridge_queue_depth",
+    [METRIC_BRIDGE_LATENCY_US]  = "bridge_latency_us_total",
+    [METRIC_HISTORY_RECORDS]    = "history_records",
+    [METRIC_HISTORY_DROPPED]    = "history_dropped",
+    [METRIC_COMMAND_QUEUE_DEPTH]       = "command_queue_depth",
+    [METRIC_COMMAND_QUEUE_DROPPED]     = "command_queue_dropped",
+    [METRIC_COMMAND_QUEUE_RUN]         = "command_queue_run",
+    [METRIC_COMMAND_QUEUE_LATENCY_US]  = "command_queue_latency_us_total",
+    [METRIC_COMMAND_QUEUE_OVER_BUDGET] = "command_queue_over_budget",
+    [METRIC_ADMIN_REQUESTS]            = "admin_requests",
+    [METRIC_EVENTS_PUBLISHED]          = "events_published",
+    [METRIC_MAPI_REQUESTS]             = "mapi_requests",
+    [METRIC_MAPI_BAD_PACKETS]          = "mapi_bad_packets",
+    [METRIC_POOL_SHARDS_OPENED]        = "pool_shards_opened",
+    [METRIC_TRIGGER_MATCHES]           = "trigger_matches",
+    [METRIC_TRIGGER_RATE_LIMITED]      = "trigger_rate_limited",
+    [METRIC_FRIENDS_IMPORTED]          = "friends_imported",
+    [METRIC_INVITES_PENDING]           = "invites_pending",
+    [METRIC_INVITE_RETRIES]            = "invite_retries",
+    [METRIC_INVITES_EXPIRED]           = "invites_expired",
+    [METRIC_JOURNAL_RECORDS]           = "journal_records",
+    [METRIC_JOURNAL_COMMITS]           = "journal_commits",
+};
+
+void metrics_add(Metric metric, uint64_t value)
+{
+    __atomic_fetch_add(&metric_values[metric], value, __ATOMIC_RELAXED);
+}
+
+void metrics_inc(Metric metric)
+{
+    metrics_add(metric, 1);
+}
+
+void metrics_set(Metric metric, uint64_t value)
+{
+    __atomic_store_n(&metric_values[metric], value, __ATOMIC_RELAXED);
+}
+
+uint64_t metrics_get(Metric metric)
+{
+    return __atomic_load_n(&metric_values[metric], __ATOMIC_RELAXED);
+}
+
+const char *metrics_name(Metric metric)
+{
+    return metric_names[metric];
+}
@@ -0,0 +1,81 @@
+/*  metrics.h
+ *
+ *
+ *  Copyright (C) 2014 toxbot All Rights Reserved.
+ *
+ *  This file is part of toxbot.
+ *
+ *  toxbot is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  toxbot is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with toxbot. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdint.h>
+
+/* Process-wide counters shared by all shards. Add new metrics before NUM_METRICS. */
+typedef enum {
+    METRIC_FRIEND_REQUESTS,
+    METRIC_FRIENDS_ADDED,
+    METRIC_MESSAGES_RECEIVED,
+    METRIC_COMMANDS_EXECUTED,
+    METRIC_INVALID_COMMANDS,
+    METRIC_INVITES_SENT,
+    METRIC_SAVES,
+    METRIC_RATE_ALLOWED,
+    METRIC_RATE_LIMITED,
+    METRIC_RATE_MUTED_DROPS,
+    METRIC_RATE_MUTES,
+    METRIC_RATE_BLOCKS,
+    METRIC_FRIEND_REQUEST_QUEUE_DEPTH,
+    METRIC_FRIEND_REQUESTS_REJECTED,
+    METRIC_FRIEND_REQUESTS_DROPPED,
+    METRIC_BRIDGE_RELAYED,
+    METRIC_BRIDGE_DROPPED,
+    METRIC_BRIDGE_QUEUE_DEPTH,
+    METRIC_BRIDGE_LATENCY_US,
+    METRIC_HISTORY_RECORDS,
+    METRIC_HISTORY_DROPPED,
+    METRIC_COMMAND_QUEUE_DEPTH,
+    METRIC_COMMAND_QUEUE_DROPPED,
+    METRIC_COMMAND_QUEUE_RUN,
+    METRIC_COMMAND_QUEUE_LATENCY_US,
+    METRIC_COMMAND_QUEUE_OVER_BUDGET,
+    METRIC_ADMIN_REQUESTS,
+    METRIC_EVENTS_PUBLISHED,
+    METRIC_MAPI_REQUESTS,
+    METRIC_MAPI_BAD_PACKETS,
+    METRIC_POOL_SHARDS_OPENED,
+    METRIC_TRIGGER_MATCHES,
+    METRIC_TRIGGER_RATE_LIMITED,
+    METRIC_FRIENDS_IMPORTED,
+    METRIC_INVITES_PENDING,
+    METRIC_INVITE_RETRIES,
+    METRIC_INVITES_EXPIRED,
+    METRIC_JOURNAL_RECORDS,
+    METRIC_JOURNAL_COMMITS,
+    NUM_METRICS
+} Metric;
+
+void metrics_add(Metric metric, uint64_t value);
+void metrics_inc(Metric metric);
+
+/* Overwrites the value of a gauge-like metric. */
+void metrics_set(Metric metric, uint64_t value);
+
+uint64_t metrics_get(Metric metric);
+const char *metrics_name(Metric metric);
+
+#endif /* METRICS_H */
@@ -28,6 +28,9 @@
 #include <stdio.h>
 #include <stdbool.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <ctype.h>
 
 #include <tox/tox.h>
 
@@ -49,13 +52,45 @@ char *hex_string_to_bin(const char *hex_string)
 
     size_t i;
 
-    for (i = 0; i < len; ++i, hex_string += 2) {
+    for (i = 0; i < len / 2; ++i, hex_string += 2) {
         sscanf(hex_string, "%2hhx", &val[i]);
     }
 
     return val;
 }
 
+void bin_to_hex_string(const uint8_t *bin, size_t length, char *hex)
+{
+    size_t i;
+
+    for (i = 0; i < length; ++i) {
+        snprintf(hex + i * 2, 3, "%02X", bin[i]);
+    }
+
+    hex[length * 2] = '\0';
+}
+
+int parse_public_key(const char *s, uint8_t *public_key)
+{
+    size_t len = strlen(s);
+    size_t i;
+
+    if (len != TOX_PUBLIC_KEY_SIZE * 2 && len != TOX_ADDRESS_SIZE * 2) {
+        return -1;
+    }
+
+    for (i = 0; i < len; ++i) {
+        if (!isxdigit((unsigned char) s[i])) {
+            return -1;
+        }
+    }
+
+    char *bin = hex_string_to_bin(s);
+    memcpy(public_key, bin, TOX_PUBLIC_KEY_SIZE);
+    free(bin);
+    return 0;
+}
+
 off_t file_size(const char *path)
 {
     struct stat st;
@@ -75,6 +110,22 @@ uint16_t copy_tox_str(char *msg, size_t size, const char *data, uint16_t length)
     return len;
 }
 
+size_t utf8_cut(const char *s, size_t length, size_t max_length)
+{
+    if (max_length >= length) {
+        return length;
+    }
+
+    size_t cut = max_length;
+
+    /* s[cut] starts the part that's dropped; it must not be a continuation byte */
+    while (cut > 0 && ((uint8_t) s[cut] & 0xC0) == 0x80) {
+        --cut;
+    }
+
+    return cut;
+}
+
 int char_find(int idx, const char *s, char ch)
 {
     int i = idx;
@@ -97,61 +148,76 @@ void get_elapsed_time_str(char *buf, int bufsize, uint64_t secs)
     snprintf(buf, bufsize, "%lud %luh %lum", days, hours, minutes);
 }
 
-/*
- * Searches plain text file pointed to by path for lines that match public_key.
- *
- * Returns 1 if a match is found.
- * Returns 0 if a match is not found.
- * Returns -1 on file operation failure.
- *
- * public_key must be a binary representation of a Tox public key.
- */
-int file_contains_key(const char *public_key, const char *path)
+void pack_u16(uint8_t *buf, uint16_t val)
 {
-    FILE *fp = NULL;
+    buf[0] = val & 0xff;
+    buf[1] = (val >> 8) & 0xff;
+}
 
-    struct stat s;
+void pack_u32(uint8_t *buf, uint32_t val)
+{
+    pack_u16(buf, val & 0xffff);
+    pack_u16(buf + 2, (val >> 16) & 0xffff);
+}
 
-    if (stat(path, &s) != 0) {
-        FILE *fp = fopen(path, "w");
+void pack_u64(uint8_t *buf, uint64_t val)
+{
+    pack_u32(buf, val & 0xffffffff);
+    pack_u32(buf + 4, (val >> 32) & 0xffffffff);
+}
 
-        if (fp == NULL) {
-            fprintf(stderr, "Warning: failed to create '%s' file\n", path);
-            return -1;
-        }
+uint16_t unpack_u16(const uint8_t *buf)
+{
+    return (uint16_t) (buf[0] | (buf[1] << 8));
+}
 
-        fprintf(stderr, "Warning: creating new '%s' file. Did you lose the old one?\n", path);
-        fclose(fp);
-        return 0;
-    }
+uint32_t unpack_u32(const uint8_t *buf)
+{
+    return (uint32_t) unpack_u16(buf) | ((uint32_t) unpack_u16(buf + 2) << 16);
+}
+
+uint64_t unpack_u64(const uint8_t *buf)
+{
+    return (uint64_t) unpack_u32(buf) | ((uint64_t) unpack_u32(buf + 4) << 32);
+}
+
+int write_file_atomic(const char *path, const uint8_t *data, size_t length)
+{
+    char tmp_path[PATH_MAX];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
 
-    fp = fopen(path, "r");
+    int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
 
-    if (fp == NULL) {
-        fprintf(stderr, "Warning: failed to read '%s' file\n", path);
+    if (fd == -1) {
         return -1;
     }
 
-    char id[256];
+    size_t written = 0;
 
-    while (fgets(id, sizeof(id), fp)) {
-        int len = strlen(id);
+    while (written < length) {
+        ssize_t ret = write(fd, data + written, length - written);
 
-        if (--len < TOX_PUBLIC_KEY_SIZE) {
-            continue;
+        if (ret <= 0) {
+            close(fd);
+            unlink(tmp_path);
+            return -1;
         }
 
-        char *key_bin = hex_string_to_bin(id);
+        written += ret;
+    }
 
-        if (memcmp(key_bin, public_key, TOX_PUBLIC_KEY_SIZE) == 0) {
-            free(key_bin);
-            fclose(fp);
-            return 1;
-        }
+    if (fsync(fd) == -1) {
+        close(fd);
+        unlink(tmp_path);
+        return -1;
+    }
+
+    close(fd);
 
-        free(key_bin);
+    if (rename(tmp_path, path) == -1) {
+        unlink(tmp_path);
+        return -1;
     }
 
-    fclose(fp);
     return 0;
 }
@@ -36,6 +36,12 @@ bool timed_out(uint64_t timestamp, uint64_t curtime, uint64_t timeout);
 /* converts hexidecimal string to binary */
 char *hex_string_to_bin(const char *hex_string);
 
+/* converts length bytes of bin to an upper case hex string; hex must hold length * 2 + 1 bytes */
+void bin_to_hex_string(const uint8_t *bin, size_t length, char *hex);
+
+/* Reads a public key, or the key part of a full Tox ID, in hex. Returns -1 if s is neither. */
+int parse_public_key(const char *s, uint8_t *public_key);
+
 /* returns file size or 0 on error */
 off_t file_size(const char *path);
 
@@ -43,6 +49,10 @@ off_t file_size(const char *path);
    returns length of msg, which will be no larger than size-1 */
 uint16_t copy_tox_str(char *msg, size_t size, const char *data, uint16_t length);
 
+/* Returns the longest prefix of the length bytes at s, up to max_length, that does not
+   split a UTF-8 character. */
+size_t utf8_cut(const char *s, size_t length, size_t max_length);
+
 /* returns index of the first instance of ch in s starting at idx.
    returns length of s if char not found */
 int char_find(int idx, const char *s, char ch);
@@ -50,15 +60,21 @@ int char_find(int idx, const char *s, char ch);
 /* Converts seconds to string in format days hours minutes */
 void get_elapsed_time_str(char *buf, int bufsize, uint64_t secs);
 
+/* Little-endian integer packing for the bot's binary side files. */
+void pack_u16(uint8_t *buf, uint16_t val);
+void pack_u32(uint8_t *buf, uint32_t val);
+void pack_u64(uint8_t *buf, uint64_t val);
+uint16_t unpack_u16(const uint8_t *buf);
+uint32_t unpack_u32(const uint8_t *buf);
+uint64_t unpack_u64(const uint8_t *buf);
+
 /*
- * Searches plain text file pointed to by path for lines that match public_key.
- *
- * Returns 1 if a match is found.
- * Returns 0 if a match is not found.
- * Returns -1 on file operation failure.
+ * Writes length bytes of data to path by way of a temporary file which is synced and then
+ * renamed over path, so a crash never leaves a truncated file behind.
  *
- * public_key must be a binary representation of a Tox public key.
+ * Returns 0 on success.
+ * Returns -1 on failure.
  */
-int file_contains_key(const char *public_key, const char *path);
+int write_file_atomic(const char *path, const uint8_t *data, size_t length);
 
 #endif /* MISC_H */
@@ -0,0 +1,269 @@
+/*  nospam.c
+ *
+ *
+ *  Copyright (C) 2014 toxbot All Rights Reserved.
+ *
+ *  This file is part of toxbot.
+ *
+ *  toxbot is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  toxbot is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with toxbot. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <tox/tox.h>
+
+#include "nospam.h"
+#include "toxbot.h"
+#include "worker.h"
+#include "friends.h"
+#include "misc.h"
+#include "log.h"
+
+extern __thread char *DATA_FILE;
+
+struct Nospam_State {
+    uint32_t counts[NOSPAM_WINDOW];
+    uint64_t count_times[NOSPAM_WINDOW];
+
+    char address_path[PATH_MAX];
+    char nospam_path[PATH_MAX];
+    bool restore;
+    bool rotated;
+    uint32_t original_nospam;
+    uint64_t last_rotation;
+    uint64_t last_flood;
+    uint64_t last_check;
+};
+
+static __thread struct Nospam_State Nospam;
+
+struct Address_Job {
+    char path[PATH_MAX];
+    char hex[TOX_ADDRESS_SIZE * 2 + 2];
+};
+
+/* An empty hex string removes the file. */
+static void address_job_run(void *arg)
+{
+    struct Address_Job *job = arg;
+
+    if (job->hex[0] == '\0') {
+        unlink(job->path);
+    } else if (write_file_atomic(job->path, (uint8_t *) job->hex, strlen(job->hex)) == -1) {
+        log_write(LOG_LEVEL_WARNING, "Warning: failed to write '%s'", job->path);
+    }
+
+    free(job);
+}
+
+static void submit_file_job(const char *path, const char *hex)
+{
+    struct Address_Job *job = malloc(sizeof(struct Address_Job));
+
+    if (job == NULL) {
+        return;
+    }
+
+    snprintf(job->path, sizeof(job->path), "%s", path);
+    snprintf(job->hex, sizeof(job->hex), "%s", hex);
+
+    if (worker_submit(address_job_run, NULL, job) == -1) {
+        address_job_run(job);
+    }
+}
+
+/* Records the original nospam while a rotated one is in use, or forgets it once it is back. */
+static void save_original_nospam(void)
+{
+    char hex[16] = "";
+
+    if (Nospam.rotated) {
+        snprintf(hex, sizeof(hex), "%08X\n", Nospam.original_nospam);
+    }
+
+    submit_file_job(Nospam.nospam_path, hex);
+}
+
+static void load_original_nospam(void)
+{
+    FILE *fp = fopen(Nospam.nospam_path, "r");
+
+    if (fp == NULL) {
+        return;
+    }
+
+    char line[16];
+
+    if (fgets(line, sizeof(line), fp) != NULL) {
+        char *end;
+        unsigned long value = strtoul(line, &end, 16);
+
+        if (end != line && (*end == '\n' || *end == '\0') && value <= UINT32_MAX) {
+            Nospam.original_nospam = (uint32_t) value;
+            Nospam.rotated = true;
+        }
+    }
+
+    fclose(fp);
+}
+
+/* Writes our address to the address file and sends it to every online master. */
+static void publish_address(Tox *m, bool notify_masters)
+{
+    uint8_t address[TOX_ADDRESS_SIZE];
+    tox_self_get_address(m, address);
+
+    char address_hex[TOX_ADDRESS_SIZE * 2 + 2];
+    bin_to_hex_string(address, TOX_ADDRESS_SIZE, address_hex);
+    strcat(address_hex, "\n");
+    submit_file_job(Nospam.address_path, address_hex);
+
+    if (!notify_masters) {
+        return;
+    }
+
+    size_t i, numfriends = tox_self_get_friend_list_size(m);
+
+    if (numfriends == 0) {
+        return;
+    }
+
+    uint32_t friend_list[numfriends];
+    tox_self_get_friend_list(m, friend_list);
+
+    char hex[TOX_ADDRESS_SIZE * 2 + 1];
+    bin_to_hex_string(address, TOX_ADDRESS_SIZE, hex);
+
+    char msg[TOX_MAX_MESSAGE_LENGTH];
+    snprintf(msg, sizeof(msg), "%s: %s", Nospam.rotated ? "Friend request flood; new Tox ID" : "Tox ID restored", hex);
+
+    for (i = 0; i < numfriends; ++i) {
+        if (friends_flag(friend_list[i], FRIEND_FLAG_ONLINE) && friends_flag(friend_list[i], FRIEND_FLAG_MASTER)) {
+            tox_friend_send_message(m, friend_list[i], TOX_MESSAGE_TYPE_NORMAL, (uint8_t *) msg, strlen(msg), NULL);
+        }
+    }
+}
+
+static uint32_t random_nospam(void)
+{
+    uint32_t nospam = 0;
+    FILE *fp = fopen("/dev/urandom", "rb");
+
+    if (fp != NULL) {
+        if (fread(&nospam, sizeof(nospam), 1, fp) != 1) {
+            nospam = 0;
+        }
+
+        fclose(fp);
+    }
+
+    if (nospam == 0) {
+        nospam = (uint32_t) random() ^ (uint32_t) time(NULL);
+    }
+
+    return nospam;
+}
+
+void nospam_init(Tox *m, const char *address_path, const char *nospam_path, bool restore)
+{
+    memset(&Nospam, 0, sizeof(struct Nospam_State));
+    snprintf(Nospam.address_path, sizeof(Nospam.address_path), "%s", address_path);
+    snprintf(Nospam.nospam_path, sizeof(Nospam.nospam_path), "%s", nospam_path);
+    Nospam.restore = restore;
+
+    /* a rotation from before the restart; the bot doesn't know how long ago the flood ended */
+    load_original_nospam();
+
+    if (Nospam.rotated) {
+        Nospam.last_flood = (uint64_t) time(NULL);
+    }
+
+    publish_address(m, false);
+}
+
+void nospam_record_request(void)
+{
+    uint64_t now = (uint64_t) time(NULL);
+    int idx = now % NOSPAM_WINDOW;
+
+    if (Nospam.count_times[idx] != now) {
+        Nospam.count_times[idx] = now;
+        Nospam.counts[idx] = 0;
+    }
+
+    ++Nospam.counts[idx];
+}
+
+void nospam_do(Tox *m)
+{
+    uint64_t now = (uint64_t) time(NULL);
+
+    if (now == Nospam.last_check) {
+        return;
+    }
+
+    Nospam.last_check = now;
+
+    uint32_t recent = 0;
+    int i;
+
+    for (i = 0; i < NOSPAM_WINDOW; ++i) {
+        if (Nospam.count_times[i] + NOSPAM_WINDOW > now) {
+            recent += Nospam.counts[i];
+        }
+    }
+
+    if (recent >= NOSPAM_ROTATE_THRESHOLD) {
+        Nospam.last_flood = now;
+
+        if (!timed_out(Nospam.last_rotation, now, NOSPAM_MIN_INTERVAL)) {
+            return;
+        }
+
+        if (!Nospam.rotated) {
+            Nospam.original_nospam = tox_self_get_nospam(m);
+            Nospam.rotated = true;
+            save_original_nospam();
+        }
+
+        tox_self_set_nospam(m, random_nospam());
+        Nospam.last_rotation = now;
+
+        log_write(LOG_LEVEL_WARNING, "Friend request flood (%u requests in %d seconds); nospam rotated",
+                  recent, NOSPAM_WINDOW);
+
+        publish_address(m, true);
+        save_data(m, DATA_FILE);
+        return;
+    }
+
+    if (Nospam.restore && Nospam.rotated && timed_out(Nospam.last_flood, now, NOSPAM_RESTORE_COOLDOWN)) {
+        tox_self_set_nospam(m, Nospam.original_nospam);
+        Nospam.rotated = false;
+        save_original_nospam();
+
+        log_write(LOG_LEVEL_INFO, "Friend request flood is over; original nospam restored");
+
+        publish_address(m, true);
+        save_data(m, DATA_FILE);
+    }
+}
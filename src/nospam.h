@@ -0,0 +1,50 @@
+/*  nospam.h
+ *
+ *
+ *  Copyright (C) 2014 toxbot All Rights Reserved.
+ *
+ *  This file is part of toxbot.
+ *
+ *  toxbot is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  toxbot is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with toxbot. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef NOSPAM_H
+#define NOSPAM_H
+
+#include <stdbool.h>
+#include <tox/tox.h>
+
+#define NOSPAM_WINDOW            10       /* seconds of friend request history considered */
+#define NOSPAM_ROTATE_THRESHOLD  50       /* requests within the window that trigger a rotation */
+#define NOSPAM_MIN_INTERVAL      60       /* minimum seconds between rotations */
+#define NOSPAM_RESTORE_COOLDOWN  (60 * 60)    /* calm seconds before the original nospam returns */
+
+/*
+ * Prepares nospam rotation for the calling shard and publishes its current address to
+ * address_path. If restore is true, the original nospam is restored once requests have
+ * been calm for NOSPAM_RESTORE_COOLDOWN seconds.
+ *
+ * The original nospam is kept in nospam_path while a rotated one is in use, so a restart
+ * doesn't lose it. The cooldown starts over when the bot starts.
+ */
+void nospam_init(Tox *m, const char *address_path, const char *nospam_path, bool restore);
+
+/* Counts one incoming friend request. */
+void nospam_record_request(void);
+
+/* Rotates or restores the nospam if needed. Call once per loop iteration. */
+void nospam_do(Tox *m);
+
+#endif /* NOSPAM_H */
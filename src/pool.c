@@ -0,0 +1,446 @@
+/*  pool.c
+ *
+ *
+ *  Copyright (C) 2014 toxbot All Rights Reserved.
+ *
+ *  This file is part of toxbot.
+ *
+ *  toxbot is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  toxbot is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with toxbot. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+
+#include <tox/tox.h>
+#include <tox/toxav.h>
+
+#include "toxbot.h"
+#include "pool.h"
+#include "groupchats.h"
+#include "friends.h"
+#include "bridge.h"
+#include "events.h"
+#include "metrics.h"
+#include "misc.h"
+#include "log.h"
+
+extern __thread struct Tox_Bot Tox_Bot;
+extern __thread char *DATA_FILE;
+
+struct Group_Pool {
+    bool active;
+    bool relay;
+    uint16_t max_peers;
+};
+
+/* indexed by pool id; id 0 means "no pool" */
+static __thread struct Group_Pool Pools[MAX_GROUP_POOLS + 1];
+
+static uint8_t group_pool(uint32_t groupnum)
+{
+    int idx = group_index(groupnum);
+    return idx == -1 ? 0 : Tox_Bot.g_chats[idx].pool;
+}
+
+/* Puts the group numbers of pool's shards in shards and returns how many there are. */
+static int pool_shards(uint8_t pool, uint32_t *shards)
+{
+    int i, n = 0;
+
+    for (i = 0; i < Tox_Bot.chats_idx && n < POOL_MAX_SHARDS; ++i) {
+        if (Tox_Bot.g_chats[i].active && Tox_Bot.g_chats[i].pool == pool) {
+            shards[n++] = Tox_Bot.g_chats[i].groupnum;
+        }
+    }
+
+    return n;
+}
+
+/* Links or unlinks every pair of shards in pool. */
+static void pool_link_all(uint8_t pool, bool link)
+{
+    uint32_t shards[POOL_MAX_SHARDS];
+    int n = pool_shards(pool, shards);
+    int i, j;
+
+    for (i = 0; i < n; ++i) {
+        for (j = i + 1; j < n; ++j) {
+            if (!link) {
+                bridge_unlink(shards[i], shards[j]);
+            } else if (bridge_link(shards[i], shards[j]) == -1) {
+                log_write(LOG_LEVEL_WARNING, "Pool %u: can't link shards %u and %u (too many links)\n", pool,
+                          shards[i], shards[j]);
+            }
+        }
+    }
+}
+
+/* Peers in the shard plus invites sent to it that have not been answered yet. */
+static uint32_t shard_load(struct Group_Chat *chat, uint64_t now)
+{
+    if (chat->pool_pending && timed_out(chat->pool_pending_since, now, POOL_INVITE_WINDOW)) {
+        chat->pool_pending = 0;
+    }
+
+    return chat->num_peers + chat->pool_pending;
+}
+
+static bool shard_has_peer(const struct Group_Chat *chat, const uint8_t *public_key)
+{
+    uint32_t i;
+
+    for (i = 0; i < chat->num_peers; ++i) {
+        if (memcmp(chat->peers[i].public_key, public_key, TOX_PUBLIC_KEY_SIZE) == 0) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/*
+ * Opens a new shard in pool with the type, title and password of the shard at index tmpl.
+ *
+ * Returns the new group number on success.
+ * Returns -1 on failure.
+ */
+static int pool_open_shard(Tox *m, uint8_t pool, int tmpl)
+{
+    struct Group_Chat *chat = &Tox_Bot.g_chats[tmpl];
+    uint8_t type = chat->type;
+    char title[TOX_MAX_NAME_LENGTH];
+    char password[MAX_PASSWORD_SIZE];
+    int title_len = chat->title_len;
+    bool has_pass = chat->has_pass;
+
+    memcpy(title, chat->title, title_len);
+    snprintf(password, sizeof(password), "%s", chat->password);
+
+    int groupnum = -1;
+
+    if (type == TOX_CONFERENCE_TYPE_AV) {
+        groupnum = toxav_add_av_groupchat(m, NULL, NULL);
+    } else {
+        TOX_ERR_CONFERENCE_NEW err;
+        groupnum = tox_conference_new(m, &err);
+
+        if (err != TOX_ERR_CONFERENCE_NEW_OK) {
+            groupnum = -1;
+        }
+    }
+
+    if (groupnum == -1) {
+        log_write(LOG_LEVEL_WARNING, "Pool %u: failed to create a new shard\n", pool);
+        return -1;
+    }
+
+    /* group_add() may move the group table, so chat is not used past this point */
+    if (group_add(groupnum, type, has_pass ? password : NULL) == -1) {
+        log_write(LOG_LEVEL_WARNING, "Pool %u: failed to add a new shard (group_add failed)\n", pool);
+        tox_conference_delete(m, groupnum, NULL);
+        return -1;
+    }
+
+    int idx = group_index(groupnum);
+    Tox_Bot.g_chats[idx].pool = pool;
+
+    if (title_len > 0) {
+        tox_conference_set_title(m, groupnum, (const uint8_t *) title, title_len, NULL);
+        memcpy(Tox_Bot.g_chats[idx].title, title, title_len);
+        Tox_Bot.g_chats[idx].title[title_len] = '\0';
+        Tox_Bot.g_chats[idx].title_len = title_len;
+    }
+
+    group_roster_update(m, groupnum);
+
+    if (Pools[pool].relay) {
+        pool_link_all(pool, true);
+    }
+
+    events_publish(EVENT_GROUP_JOIN, groupnum, NULL, NULL, 0);
+    metrics_inc(METRIC_POOL_SHARDS_OPENED);
+    log_write(LOG_LEVEL_INFO, "Pool %u: opened shard %d\n", pool, groupnum);
+    save_data(m, DATA_FILE);
+    return groupnum;
+}
+
+int pool_configure(Tox *m, uint32_t groupnum, uint16_t max_peers, bool relay)
+{
+    int idx = group_index(groupnum);
+
+    if (idx == -1) {
+        return -1;
+    }
+
+    uint8_t pool = Tox_Bot.g_chats[idx].pool;
+
+    if (pool == 0) {
+        for (pool = 1; pool <= MAX_GROUP_POOLS; ++pool) {
+            if (!Pools[pool].active) {
+                break;
+            }
+        }
+
+        if (pool > MAX_GROUP_POOLS) {
+            return -1;
+        }
+
+        memset(&Pools[pool], 0, sizeof(struct Group_Pool));
+        Pools[pool].active = true;
+        Tox_Bot.g_chats[idx].pool = pool;
+    }
+
+    if (Pools[pool].relay != relay) {
+        pool_link_all(pool, relay);
+    }
+
+    Pools[pool].relay = relay;
+    Pools[pool].max_peers = max_peers;
+    return pool;
+}
+
+int pool_dissolve(uint32_t groupnum)
+{
+    uint8_t pool = group_pool(groupnum);
+
+    if (pool == 0) {
+        return -1;
+    }
+
+    if (Pools[pool].relay) {
+        pool_link_all(pool, false);
+    }
+
+    int i;
+
+    for (i = 0; i < Tox_Bot.chats_idx; ++i) {
+        if (Tox_Bot.g_chats[i].pool == pool) {
+            Tox_Bot.g_chats[i].pool = 0;
+            Tox_Bot.g_chats[i].pool_pending = 0;
+        }
+    }
+
+    memset(&Pools[pool], 0, sizeof(struct Group_Pool));
+    return 0;
+}
+
+uint32_t pool_route(Tox *m, uint32_t friendnum, uint32_t groupnum)
+{
+    uint8_t pool = group_pool(groupnum);
+
+    if (pool == 0) {
+        return groupnum;
+    }
+
+    const struct Friend_Info *f = friends_get(m, friendnum);
+    uint64_t now = (uint64_t) time(NULL);
+    uint32_t best_load = UINT32_MAX;
+    int best = -1, num_shards = 0;
+    int i;
+
+    for (i = 0; i < Tox_Bot.chats_idx; ++i) {
+        struct Group_Chat *chat = &Tox_Bot.g_chats[i];
+
+        if (!chat->active || chat->pool != pool) {
+            continue;
+        }
+
+        /* a friend who is already in a shard gets the same one again */
+        if (f && shard_has_peer(chat, f->public_key)) {
+            return chat->groupnum;
+        }
+
+        uint32_t load = shard_load(chat, now);
+
+        if (load < best_load) {
+            best_load = load;
+            best = i;
+        }
+
+        ++num_shards;
+    }
+
+    if (best_load >= Pools[pool].max_peers && num_shards < POOL_MAX_SHARDS && Tox_Bot.chats_idx < MAX_NUM_GROUPS) {
+        int new_group = pool_open_shard(m, pool, best);
+
+        if (new_group != -1) {
+            best = group_index(new_group);
+        }
+    }
+
+    struct Group_Chat *chat = &Tox_Bot.g_chats[best];
+
+    if (chat->pool_pending == 0) {
+        chat->pool_pending_since = now;
+    }
+
+    ++chat->pool_pending;
+    return chat->groupnum;
+}
+
+void pool_shard_removed(uint8_t pool)
+{
+    if (pool == 0 || pool > MAX_GROUP_POOLS) {
+        return;
+    }
+
+    uint32_t shards[POOL_MAX_SHARDS];
+
+    if (pool_shards(pool, shards) == 0) {
+        memset(&Pools[pool], 0, sizeof(struct Group_Pool));
+    }
+}
+
+void pool_describe(uint8_t pool, char *buf, size_t size)
+{
+    uint64_t now = (uint64_t) time(NULL);
+    const struct Group_Chat *first = NULL;
+    uint32_t total_peers = 0;
+    int i, num_shards = 0;
+    size_t len = 0;
+    char loads[TOX_MAX_MESSAGE_LENGTH];
+
+    loads[0] = '\0';
+
+    for (i = 0; i < Tox_Bot.chats_idx; ++i) {
+        struct Group_Chat *chat = &Tox_Bot.g_chats[i];
+
+        if (!chat->active || chat->pool != pool) {
+            continue;
+        }
+
+        if (first == NULL) {
+            first = chat;
+        }
+
+        int ret = snprintf(loads + len, sizeof(loads) - len, "%s%u: %u/%u", num_shards ? ", " : "", chat->groupnum,
+                           shard_load(chat, now), Pools[pool].max_peers);
+
+        if (ret > 0 && len + ret < sizeof(loads)) {
+            len += ret;
+        }
+
+        total_peers += chat->num_peers;
+        ++num_shards;
+    }
+
+    if (first == NULL) {
+        snprintf(buf, size, "群池 %u: 没有群", pool);
+        return;
+    }
+
+    const char *title = first->title_len ? first->title : "未设置群名称";
+    const char *type = first->type == TOX_CONFERENCE_TYPE_AV ? "Audio" : "Text";
+    snprintf(buf, size, "群池 %u | %s | 分片: %d%s | 在线人数: %u | 群名称: %s | 负载: %s", pool, type, num_shards,
+             Pools[pool].relay ? " (relay)" : "", total_peers, title, loads);
+}
+
+size_t pools_packed_size(void)
+{
+    size_t size = 1;
+    int i;
+
+    for (i = 1; i <= MAX_GROUP_POOLS; ++i) {
+        if (Pools[i].active) {
+            size += POOL_RECORD_SIZE;
+        }
+    }
+
+    return size;
+}
+
+uint8_t *pools_pack(uint8_t *p)
+{
+    uint8_t *count = p++;
+    int i;
+
+    *count = 0;
+
+    for (i = 1; i <= MAX_GROUP_POOLS; ++i) {
+        if (!Pools[i].active) {
+            continue;
+        }
+
+        p[0] = i;
+        p[1] = Pools[i].relay;
+        pack_u16(p + 2, Pools[i].max_peers);
+        p += POOL_RECORD_SIZE;
+        ++*count;
+    }
+
+    return p;
+}
+
+int pools_unpack(Tox *m, const uint8_t *p, size_t length)
+{
+    memset(Pools, 0, sizeof(Pools));
+
+    int ret = 0;
+
+    if (length >= 1) {
+        uint8_t count = p[0];
+        uint8_t i;
+
+        ++p;
+        --length;
+
+        for (i = 0; i < count; ++i, p += POOL_RECORD_SIZE, length -= POOL_RECORD_SIZE) {
+            if (length < POOL_RECORD_SIZE) {
+                ret = -1;
+                break;
+            }
+
+            uint8_t id = p[0];
+
+            if (id == 0 || id > MAX_GROUP_POOLS) {
+                continue;
+            }
+
+            Pools[id].active = true;
+            Pools[id].relay = p[1] != 0;
+            Pools[id].max_peers = unpack_u16(p + 2);
+        }
+    }
+
+    /* shards of pools missing from the table become ordinary groups */
+    int i;
+
+    for (i = 0; i < Tox_Bot.chats_idx; ++i) {
+        struct Group_Chat *chat = &Tox_Bot.g_chats[i];
+
+        if (chat->active && chat->pool && (chat->pool > MAX_GROUP_POOLS || !Pools[chat->pool].active)) {
+            chat->pool = 0;
+        }
+    }
+
+    for (i = 1; i <= MAX_GROUP_POOLS; ++i) {
+        pool_shard_removed(i);
+
+        if (Pools[i].active && Pools[i].relay) {
+            pool_link_all(i, true);
+        }
+    }
+
+    return ret;
+}
+
+void pools_free(void)
+{
+    memset(Pools, 0, sizeof(Pools));
+}
@@ -0,0 +1,89 @@
+/*  pool.h
+ *
+ *
+ *  Copyright (C) 2014 toxbot All Rights Reserved.
+ *
+ *  This file is part of toxbot.
+ *
+ *  toxbot is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  toxbot is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with toxbot. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef POOL_H
+#define POOL_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <tox/tox.h>
+
+#define MAX_GROUP_POOLS     16
+#define POOL_MAX_SHARDS     8
+#define POOL_INVITE_WINDOW  60    /* seconds an unanswered invite counts towards a shard's load */
+#define POOL_RECORD_SIZE    4
+
+/*
+ * A pool is one logical group backed by several conferences (shards). Invites to any shard
+ * go to the least loaded one, and a new shard is opened once every shard has at least
+ * max_peers peers. With relay set, messages are bridged between all shards of the pool.
+ */
+
+/*
+ * Makes groupnum the first shard of a new pool, or changes the settings of the pool it
+ * already belongs to.
+ *
+ * Returns the pool id on success.
+ * Returns -1 if the pool table is full.
+ */
+int pool_configure(Tox *m, uint32_t groupnum, uint16_t max_peers, bool relay);
+
+/*
+ * Dissolves the pool groupnum belongs to. Its shards remain as ordinary groups.
+ *
+ * Returns 0 on success.
+ * Returns -1 if groupnum is not in a pool.
+ */
+int pool_dissolve(uint32_t groupnum);
+
+/*
+ * Returns the group friendnum should be invited to when asking for groupnum. For a pooled
+ * group this is the shard the friend is already in, or else the least loaded shard, which
+ * may be newly opened. Other groups are returned unchanged.
+ */
+uint32_t pool_route(Tox *m, uint32_t friendnum, uint32_t groupnum);
+
+/* Forgets pool if groupnum was its last shard. Called by group_leave(). */
+void pool_shard_removed(uint8_t pool);
+
+/* Writes a one line summary of pool with the load of each shard to buf. */
+void pool_describe(uint8_t pool, char *buf, size_t size);
+
+/* Returns the size of the pool table written by pools_pack(). */
+size_t pools_packed_size(void);
+
+/* Writes the pool table to p and returns the first byte after it. */
+uint8_t *pools_pack(uint8_t *p);
+
+/*
+ * Restores the pool table written by pools_pack() once the groups have been loaded, drops
+ * pools without shards and relinks relaying pools.
+ *
+ * Returns 0 on success.
+ * Returns -1 if the table is truncated.
+ */
+int pools_unpack(Tox *m, const uint8_t *p, size_t length);
+
+void pools_free(void);
+
+#endif /* POOL_H */
@@ -0,0 +1,124 @@
+/*  queue.c
+ *
+ *
+ *  Copyright (C) 2014 toxbot All Rights Reserved.
+ *
+ *  This file is part of toxbot.
+ *
+ *  toxbot is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  toxbot is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with toxbot. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "queue.h"
+
+/* every cell starts with its sequence number, followed by the element */
+#define CELL_SEQ(q, pos) ((size_t *) ((q)->cells + ((pos) & (q)->mask) * (q)->cell_size))
+#define CELL_DATA(q, pos) ((q)->cells + ((pos) & (q)->mask) * (q)->cell_size + sizeof(size_t))
+
+int queue_init(struct Queue *q, size_t capacity, size_t elem_size)
+{
+    memset(q, 0, sizeof(struct Queue));
+
+    size_t size = 2;
+
+    while (size < capacity) {
+        size <<= 1;
+    }
+
+    q->elem_size = elem_size;
+    q->cell_size = (sizeof(size_t) + elem_size + sizeof(size_t) - 1) & ~(sizeof(size_t) - 1);
+    q->mask = size - 1;
+    q->cells = calloc(size, q->cell_size);
+
+    if (q->cells == NULL) {
+        return -1;
+    }
+
+    size_t i;
+
+    for (i = 0; i < size; ++i) {
+        *CELL_SEQ(q, i) = i;
+    }
+
+    return 0;
+}
+
+void queue_free(struct Queue *q)
+{
+    free(q->cells);
+    q->cells = NULL;
+}
+
+bool queue_push(struct Queue *q, const void *elem)
+{
+    size_t pos = __atomic_load_n(&q->enqueue_pos, __ATOMIC_RELAXED);
+
+    for (;;) {
+        size_t seq = __atomic_load_n(CELL_SEQ(q, pos), __ATOMIC_ACQUIRE);
+        intptr_t diff = (intptr_t) seq - (intptr_t) pos;
+
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&q->enqueue_pos, &pos, pos + 1, true, __ATOMIC_RELAXED,
+                                            __ATOMIC_RELAXED)) {
+                break;
+            }
+        } else if (diff < 0) {
+            return false;
+        } else {
+            pos = __atomic_load_n(&q->enqueue_pos, __ATOMIC_RELAXED);
+        }
+    }
+
+    memcpy(CELL_DATA(q, pos), elem, q->elem_size);
+    __atomic_store_n(CELL_SEQ(q, pos), pos + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+bool queue_pop(struct Queue *q, void *elem)
+{
+    size_t pos = __atomic_load_n(&q->dequeue_pos, __ATOMIC_RELAXED);
+
+    for (;;) {
+        size_t seq = __atomic_load_n(CELL_SEQ(q, pos), __ATOMIC_ACQUIRE);
+        intptr_t diff = (intptr_t) seq - (intptr_t) (pos + 1);
+
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&q->dequeue_pos, &pos, pos + 1, true, __ATOMIC_RELAXED,
+                                            __ATOMIC_RELAXED)) {
+                break;
+            }
+        } else if (diff < 0) {
+            return false;
+        } else {
+            pos = __atomic_load_n(&q->dequeue_pos, __ATOMIC_RELAXED);
+        }
+    }
+
+    memcpy(elem, CELL_DATA(q, pos), q->elem_size);
+    __atomic_store_n(CELL_SEQ(q, pos), pos + q->mask + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+size_t queue_size(struct Queue *q)
+{
+    size_t head = __atomic_load_n(&q->dequeue_pos, __ATOMIC_RELAXED);
+    size_t tail = __atomic_load_n(&q->enqueue_pos, __ATOMIC_RELAXED);
+
+    return tail > head ? tail - head : 0;
+}
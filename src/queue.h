@@ -0,0 +1,69 @@
+/*  queue.h
+ *
+ *
+ *  Copyright (C) 2014 toxbot All Rights Reserved.
+ *
+ *  This file is part of toxbot.
+ *
+ *  toxbot is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  toxbot is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with toxbot. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef QUEUE_H
+#define QUEUE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#define QUEUE_CACHE_LINE 64
+
+/*
+ * Bounded lock-free queue with fixed size elements stored inline (Vyukov's MPMC ring).
+ * Any number of threads may push and pop concurrently, so the same structure serves as an
+ * SPSC, MPSC or MPMC channel. Neither push nor pop ever blocks or allocates.
+ */
+struct Queue {
+    uint8_t *cells;
+    size_t cell_size;
+    size_t elem_size;
+    size_t mask;
+
+    char pad0[QUEUE_CACHE_LINE];
+    size_t enqueue_pos;
+    char pad1[QUEUE_CACHE_LINE];
+    size_t dequeue_pos;
+    char pad2[QUEUE_CACHE_LINE];
+};
+
+/*
+ * Initializes a queue holding up to capacity elements of elem_size bytes.
+ * capacity is rounded up to a power of two.
+ *
+ * Returns 0 on success.
+ * Returns -1 on allocation failure.
+ */
+int queue_init(struct Queue *q, size_t capacity, size_t elem_size);
+void queue_free(struct Queue *q);
+
+/* Copies elem into the queue. Returns false if the queue is full. */
+bool queue_push(struct Queue *q, const void *elem);
+
+/* Copies the oldest element into elem and removes it. Returns false if the queue is empty. */
+bool queue_pop(struct Queue *q, void *elem);
+
+/* Returns the approximate number of queued elements. */
+size_t queue_size(struct Queue *q);
+
+#endif /* QUEUE_H */
@@ -0,0 +1,152 @@
+/*  ratelimit.c
+ *
+ *
+ *  Copyright (C) 2014 toxbot All Rights Reserved.
+ *
+ *  This file is part of toxbot.
+ *
+ *  toxbot is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  toxbot is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with toxbot. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+
+#include "ratelimit.h"
+#include "metrics.h"
+#include "friends.h"
+#include "misc.h"
+
+#define TOKEN_SCALE 1000    /* tokens are stored in thousandths */
+
+struct Rate_Limit {
+    uint64_t last_refill;    /* milliseconds */
+    uint64_t muted_until;    /* milliseconds */
+    uint64_t last_mute;      /* milliseconds */
+    uint32_t tokens;
+    uint16_t violations;
+    uint16_t mutes;
+};
+
+/* per-shard table indexed by friend number */
+static __thread struct Rate_Limit *Limits;
+static __thread uint32_t Num_Limits;
+
+static uint64_t get_time_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+void rate_limit_ensure(uint32_t friendnumber)
+{
+    if (friendnumber < Num_Limits) {
+        return;
+    }
+
+    uint32_t n = MAX(friendnumber + 1, Num_Limits * 2);
+    struct Rate_Limit *tmp = realloc(Limits, n * sizeof(struct Rate_Limit));
+
+    if (tmp == NULL) {
+        exit(EXIT_FAILURE);
+    }
+
+    memset(&tmp[Num_Limits], 0, (n - Num_Limits) * sizeof(struct Rate_Limit));
+    Limits = tmp;
+    Num_Limits = n;
+}
+
+void rate_limit_reset(uint32_t friendnumber)
+{
+    rate_limit_ensure(friendnumber);
+    memset(&Limits[friendnumber], 0, sizeof(struct Rate_Limit));
+}
+
+Rate_Limit_Result rate_limit_check(uint32_t friendnumber, bool is_master)
+{
+    rate_limit_ensure(friendnumber);
+
+    struct Rate_Limit *rl = &Limits[friendnumber];
+    uint64_t now = get_time_ms();
+    uint32_t burst = (is_master ? RATE_LIMIT_MASTER_BURST : RATE_LIMIT_BURST) * TOKEN_SCALE;
+    uint32_t rate = is_master ? RATE_LIMIT_MASTER_RATE : RATE_LIMIT_RATE;
+
+    if (rl->last_refill == 0) {
+        rl->tokens = burst;
+    } else {
+        uint64_t refill = (now - rl->last_refill) * rate;    /* ms * msgs/s == thousandths of a token */
+        rl->tokens = (uint32_t) MIN((uint64_t) rl->tokens + refill, burst);
+    }
+
+    rl->last_refill = now;
+
+    if (rl->muted_until > now) {
+        metrics_inc(METRIC_RATE_MUTED_DROPS);
+        return RATE_LIMIT_DROP;
+    }
+
+    if (rl->muted_until != 0) {
+        rl->muted_until = 0;
+        friends_set_flag(friendnumber, FRIEND_FLAG_MUTED, false);
+    }
+
+    if (rl->tokens >= TOKEN_SCALE) {
+        rl->tokens -= TOKEN_SCALE;
+        rl->violations = 0;
+        metrics_inc(METRIC_RATE_ALLOWED);
+        return RATE_LIMIT_ALLOW;
+    }
+
+    metrics_inc(METRIC_RATE_LIMITED);
+
+    if (++rl->violations < RATE_LIMIT_MUTE_VIOLATIONS) {
+        return RATE_LIMIT_DROP;
+    }
+
+    rl->violations = 0;
+
+    /* masters are throttled but never muted or blocked */
+    if (is_master) {
+        return RATE_LIMIT_DROP;
+    }
+
+    /* forgive one earlier mute for every quiet period since the last one */
+    if (rl->mutes > 0) {
+        uint64_t forgiven = (now - rl->last_mute) / (RATE_LIMIT_FORGIVE * 1000);
+        rl->mutes -= MIN(forgiven, rl->mutes);
+    }
+
+    rl->last_mute = now;
+
+    if (++rl->mutes >= RATE_LIMIT_BLOCK_MUTES) {
+        metrics_inc(METRIC_RATE_BLOCKS);
+        return RATE_LIMIT_BLOCK;
+    }
+
+    rl->muted_until = now + RATE_LIMIT_MUTE_DURATION * 1000;
+    friends_set_flag(friendnumber, FRIEND_FLAG_MUTED, true);
+    metrics_inc(METRIC_RATE_MUTES);
+    return RATE_LIMIT_DROP;
+}
+
+void rate_limit_free(void)
+{
+    free(Limits);
+    Limits = NULL;
+    Num_Limits = 0;
+}
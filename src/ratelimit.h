@@ -0,0 +1,63 @@
+/*  ratelimit.h
+ *
+ *
+ *  Copyright (C) 2014 toxbot All Rights Reserved.
+ *
+ *  This file is part of toxbot.
+ *
+ *  toxbot is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  toxbot is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with toxbot. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef RATELIMIT_H
+#define RATELIMIT_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <tox/tox.h>
+
+/* token bucket parameters; rates are in messages per second */
+#define RATE_LIMIT_BURST          5
+#define RATE_LIMIT_RATE           1
+#define RATE_LIMIT_MASTER_BURST   30
+#define RATE_LIMIT_MASTER_RATE    10
+
+/* this many dropped messages in a row mutes a friend, and this many mutes blocks them */
+#define RATE_LIMIT_MUTE_VIOLATIONS 10
+#define RATE_LIMIT_MUTE_DURATION   (5 * 60)    /* seconds */
+#define RATE_LIMIT_BLOCK_MUTES     3
+#define RATE_LIMIT_FORGIVE         (60 * 60)    /* seconds without a new mute that forgive one old mute */
+
+typedef enum {
+    RATE_LIMIT_ALLOW,
+    RATE_LIMIT_DROP,     /* over the limit or muted */
+    RATE_LIMIT_BLOCK,    /* repeat offender; the caller should block the friend */
+} Rate_Limit_Result;
+
+/* Makes sure the per-friend table covers friendnumber. Call whenever a friend is added. */
+void rate_limit_ensure(uint32_t friendnumber);
+
+/* Clears the state of friendnumber, e.g. when the number is given to a new friend. */
+void rate_limit_reset(uint32_t friendnumber);
+
+/*
+ * Takes one token from friendnumber's bucket. Constant time and allocation free unless
+ * the table has to grow.
+ */
+Rate_Limit_Result rate_limit_check(uint32_t friendnumber, bool is_master);
+
+/* Frees the calling shard's table. */
+void rate_limit_free(void);
+
+#endif /* RATELIMIT_H */
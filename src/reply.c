@@ -0,0 +1,145 @@
+/*  reply.c
+ *
+ *
+ *  Copyright (C) 2014 toxbot All Rights Reserved.
+ *
+ *  This file is part of toxbot.
+ *
+ *  toxbot is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  toxbot is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with toxbot. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include <tox/tox.h>
+
+#include "reply.h"
+#include "admin.h"
+#include "misc.h"
+
+static __thread struct Reply_Sink *Active_Sink;
+
+void reply_sink_begin(struct Reply_Sink *sink)
+{
+    memset(sink, 0, sizeof(struct Reply_Sink));
+    Active_Sink = sink;
+}
+
+void reply_sink_end(void)
+{
+    Active_Sink = NULL;
+}
+
+void reply_sink_free(struct Reply_Sink *sink)
+{
+    free(sink->buf);
+    sink->buf = NULL;
+    sink->len = 0;
+    sink->size = 0;
+}
+
+static void sink_append(struct Reply_Sink *sink, const char *message, size_t length)
+{
+    size_t needed = sink->len + length + 1;
+
+    if (needed > sink->size) {
+        size_t size = MAX(needed, sink->size * 2);
+        char *tmp = realloc(sink->buf, size);
+
+        if (tmp == NULL) {
+            exit(EXIT_FAILURE);
+        }
+
+        sink->buf = tmp;
+        sink->size = size;
+    }
+
+    if (sink->num_replies > 0) {
+        sink->buf[sink->len++] = '\n';
+    }
+
+    memcpy(sink->buf + sink->len, message, length);
+    sink->len += length;
+    ++sink->num_replies;
+}
+
+void reply(Tox *m, uint32_t friendnum, const char *message, size_t length)
+{
+    if (Active_Sink) {
+        sink_append(Active_Sink, message, length);
+        return;
+    }
+
+    if (friendnum == ADMIN_FRIENDNUM) {
+        admin_async_reply(message, length);
+        return;
+    }
+
+    tox_friend_send_message(m, friendnum, TOX_MESSAGE_TYPE_NORMAL, (const uint8_t *) message, length, NULL);
+}
+
+void reply_error(Tox *m, uint32_t friendnum, const char *message, size_t length)
+{
+    if (Active_Sink) {
+        Active_Sink->failed = true;
+    }
+
+    reply(m, friendnum, message, length);
+}
+
+void reply_send_packed(Tox *m, uint32_t friendnum, const char *text, size_t length)
+{
+    if (friendnum == ADMIN_FRIENDNUM) {
+        admin_async_reply(text, length);
+        return;
+    }
+
+    size_t start = 0;
+
+    while (start < length) {
+        size_t end = MIN(length, start + TOX_MAX_MESSAGE_LENGTH);
+
+        if (end < length) {
+            /* back up to the last newline that fits */
+            size_t nl = end;
+
+            while (nl > start && text[nl] != '\n') {
+                --nl;
+            }
+
+            if (nl > start) {
+                end = nl;
+            } else {
+                /* one long line; at least don't split a character */
+                size_t cut = utf8_cut(text + start, length - start, end - start);
+
+                if (cut > 0) {
+                    end = start + cut;
+                }
+            }
+        }
+
+        tox_friend_send_message(m, friendnum, TOX_MESSAGE_TYPE_NORMAL, (const uint8_t *) text + start, end - start,
+                                NULL);
+
+        start = end;
+
+        if (start < length && text[start] == '\n') {
+            ++start;
+        }
+    }
+}
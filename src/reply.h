@@ -0,0 +1,64 @@
+/*  reply.h
+ *
+ *
+ *  Copyright (C) 2014 toxbot All Rights Reserved.
+ *
+ *  This file is part of toxbot.
+ *
+ *  toxbot is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  toxbot is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with toxbot. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef REPLY_H
+#define REPLY_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <tox/tox.h>
+
+/*
+ * Collects command replies instead of sending them, so that a caller can pack the replies
+ * of several commands into one message or hand them to a transport other than a friend
+ * message. Only one sink can be active per thread.
+ */
+struct Reply_Sink {
+    char *buf;
+    size_t len;
+    size_t size;
+    int num_replies;
+    bool failed;    /* set by reply_error() */
+};
+
+/* Routes replies made on this thread into sink until reply_sink_end(). */
+void reply_sink_begin(struct Reply_Sink *sink);
+
+/* Stops collecting. The caller still owns sink and must free its buffer with reply_sink_free(). */
+void reply_sink_end(void);
+
+void reply_sink_free(struct Reply_Sink *sink);
+
+/* Sends message to friendnum, or adds it to the active sink. */
+void reply(Tox *m, uint32_t friendnum, const char *message, size_t length);
+
+/* Like reply(), for a message that reports a failed command. */
+void reply_error(Tox *m, uint32_t friendnum, const char *message, size_t length);
+
+/*
+ * Sends text to friendnum in as few messages as possible, splitting only at newlines
+ * unless a single line is too long for one message.
+ */
+void reply_send_packed(Tox *m, uint32_t friendnum, const char *text, size_t length);
+
+#endif /* REPLY_H */
@@ -0,0 +1,163 @@
+/*  savebench.c
+ *
+ *
+ *  Copyright (C) 2014 toxbot All Rights Reserved.
+ *
+ *  This file is part of toxbot.
+ *
+ *  toxbot is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  toxbot is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with toxbot. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * toxbot-savebench: measures what an encrypted save costs with the key cached by savecrypt
+ * (see savecrypt.h) against deriving the key from the passphrase on every save, as
+ * tox_pass_encrypt() does.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <tox/toxencryptsave.h>
+
+#include "savecrypt.h"
+
+#define BENCH_SAVE_SIZE       (64 * 1024)
+#define BENCH_CACHED_SAVES    2000
+#define BENCH_DERIVED_SAVES   20
+#define BENCH_PASSPHRASE      "toxbot benchmark passphrase"
+
+static uint64_t get_time_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void print_usage(const char *name)
+{
+    fprintf(stderr, "usage: %s [-s save size in bytes] [-n saves with the cached key]\n", name);
+}
+
+static void print_result(const char *name, uint64_t elapsed_us, int saves, size_t size)
+{
+    double per_save = (double) elapsed_us / saves;
+    printf("%-16s %8d saves %12.1f us/save %10.1f MB/s\n", name, saves, per_save,
+           per_save > 0 ? size / per_save : 0.0);
+}
+
+int main(int argc, char **argv)
+{
+    size_t size = BENCH_SAVE_SIZE;
+    int cached_saves = BENCH_CACHED_SAVES;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "s:n:")) != -1) {
+        switch (opt) {
+            case 's':
+                size = strtoul(optarg, NULL, 10);
+                break;
+
+            case 'n':
+                cached_saves = atoi(optarg);
+                break;
+
+            default:
+                print_usage(argv[0]);
+                exit(EXIT_FAILURE);
+        }
+    }
+
+    if (size == 0 || cached_saves <= 0) {
+        print_usage(argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    setenv(SAVECRYPT_PASSPHRASE_ENV, BENCH_PASSPHRASE, 1);
+
+    if (savecrypt_set_passphrase(NULL) == -1) {
+        exit(EXIT_FAILURE);
+    }
+
+    uint8_t *data = malloc(size);
+    uint8_t *sealed = malloc(size + TOX_PASS_ENCRYPTION_EXTRA_LENGTH);
+
+    if (data == NULL || sealed == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+
+    size_t i;
+
+    for (i = 0; i < size; ++i) {
+        data[i] = i * 2654435761u >> 24;
+    }
+
+    printf("%zu byte saves\n\n", size);
+
+    /* the first save derives the shard key; it is timed on its own */
+    uint64_t start = get_time_us();
+    const Tox_Pass_Key *key = savecrypt_key();
+
+    if (key == NULL) {
+        fprintf(stderr, "Key derivation failed\n");
+        exit(EXIT_FAILURE);
+    }
+
+    uint64_t derive_us = get_time_us() - start;
+    printf("%-16s %21.1f us\n", "first derivation", (double) derive_us);
+
+    start = get_time_us();
+    int n;
+
+    for (n = 0; n < cached_saves; ++n) {
+        size_t sealed_len;
+        uint8_t *buf = savecrypt_seal(key, data, size, &sealed_len);
+
+        if (buf == NULL) {
+            fprintf(stderr, "Encryption failed\n");
+            exit(EXIT_FAILURE);
+        }
+
+        free(buf);
+    }
+
+    uint64_t cached_us = get_time_us() - start;
+    print_result("cached key", cached_us, cached_saves, size);
+
+    start = get_time_us();
+
+    for (n = 0; n < BENCH_DERIVED_SAVES; ++n) {
+        TOX_ERR_ENCRYPTION err;
+
+        if (!tox_pass_encrypt(data, size, (const uint8_t *) BENCH_PASSPHRASE, strlen(BENCH_PASSPHRASE), sealed, &err)) {
+            fprintf(stderr, "Encryption failed (error %d)\n", err);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    uint64_t derived_us = get_time_us() - start;
+    print_result("derive per save", derived_us, BENCH_DERIVED_SAVES, size);
+
+    printf("\nspeedup %.0fx\n", ((double) derived_us / BENCH_DERIVED_SAVES) / ((double) cached_us / cached_saves));
+
+    free(data);
+    free(sealed);
+    savecrypt_free();
+    return 0;
+}
@@ -0,0 +1,260 @@
+/*  savecrypt.c
+ *
+ *
+ *  Copyright (C) 2014 toxbot All Rights Reserved.
+ *
+ *  This file is part of toxbot.
+ *
+ *  toxbot is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  toxbot is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with toxbot. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+#include <tox/toxencryptsave.h>
+
+#include "savecrypt.h"
+#include "log.h"
+
+struct Derived_Key {
+    uint8_t salt[TOX_PASS_SALT_LENGTH];
+    Tox_Pass_Key *key;
+};
+
+static uint8_t Passphrase[SAVECRYPT_MAX_PASSPHRASE];
+static size_t Passphrase_Len;
+
+/* keys derived so far; the lock is held across derivation so concurrent shards wait for and reuse a key */
+static struct Derived_Key *Keys;
+static size_t Num_Keys;
+static pthread_mutex_t Keys_Lock = PTHREAD_MUTEX_INITIALIZER;
+
+static __thread const Tox_Pass_Key *Shard_Key;
+
+int savecrypt_set_passphrase(const char *path)
+{
+    const char *pass = NULL;
+    char buf[SAVECRYPT_MAX_PASSPHRASE + 2];
+
+    if (path) {
+        FILE *fp = fopen(path, "r");
+
+        if (fp == NULL) {
+            log_write(LOG_LEVEL_ERROR, "Can't read passphrase file %s\n", path);
+            return -1;
+        }
+
+        if (fgets(buf, sizeof(buf), fp) == NULL) {
+            buf[0] = '\0';
+        }
+
+        fclose(fp);
+        buf[strcspn(buf, "\r\n")] = '\0';
+        pass = buf;
+    } else {
+        pass = getenv(SAVECRYPT_PASSPHRASE_ENV);
+
+        if (pass == NULL) {
+            return 0;
+        }
+    }
+
+    size_t len = strlen(pass);
+
+    if (len == 0 || len > SAVECRYPT_MAX_PASSPHRASE) {
+        log_write(LOG_LEVEL_ERROR, "The savedata passphrase must be 1 to %d bytes long\n", SAVECRYPT_MAX_PASSPHRASE);
+        memset(buf, 0, sizeof(buf));
+        return -1;
+    }
+
+    memcpy(Passphrase, pass, len);
+    Passphrase_Len = len;
+    memset(buf, 0, sizeof(buf));
+    return 0;
+}
+
+bool savecrypt_enabled(void)
+{
+    return Passphrase_Len > 0;
+}
+
+/* Returns the cached key for salt, or derives it. Keys_Lock must be held. */
+static const Tox_Pass_Key *key_for_salt(const uint8_t *salt)
+{
+    size_t i;
+
+    for (i = 0; i < Num_Keys; ++i) {
+        if (memcmp(Keys[i].salt, salt, TOX_PASS_SALT_LENGTH) == 0) {
+            return Keys[i].key;
+        }
+    }
+
+    struct Derived_Key *keys = realloc(Keys, (Num_Keys + 1) * sizeof(struct Derived_Key));
+
+    if (keys == NULL) {
+        exit(EXIT_FAILURE);
+    }
+
+    Keys = keys;
+
+    TOX_ERR_KEY_DERIVATION err;
+    Tox_Pass_Key *key = tox_pass_key_derive_with_salt(Passphrase, Passphrase_Len, salt, &err);
+
+    if (key == NULL) {
+        log_write(LOG_LEVEL_ERROR, "Savedata key derivation failed (error %d)\n", err);
+        return NULL;
+    }
+
+    memcpy(Keys[Num_Keys].salt, salt, TOX_PASS_SALT_LENGTH);
+    Keys[Num_Keys].key = key;
+    ++Num_Keys;
+    return key;
+}
+
+int savecrypt_open(const uint8_t *data, size_t length, uint8_t **plain, size_t *plain_len)
+{
+    if (length < TOX_PASS_ENCRYPTION_EXTRA_LENGTH || !tox_is_data_encrypted(data)) {
+        if (Passphrase_Len > 0) {
+            log_write(LOG_LEVEL_INFO, "Savedata is not encrypted yet; it will be on the next save\n");
+        }
+
+        return 0;
+    }
+
+    if (Passphrase_Len == 0) {
+        log_write(LOG_LEVEL_ERROR, "Savedata is encrypted; set the passphrase with -P or %s\n",
+                  SAVECRYPT_PASSPHRASE_ENV);
+        return -1;
+    }
+
+    uint8_t salt[TOX_PASS_SALT_LENGTH];
+
+    if (!tox_get_salt(data, salt, NULL)) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&Keys_Lock);
+    const Tox_Pass_Key *key = key_for_salt(salt);
+    pthread_mutex_unlock(&Keys_Lock);
+
+    if (key == NULL) {
+        return -1;
+    }
+
+    *plain_len = length - TOX_PASS_ENCRYPTION_EXTRA_LENGTH;
+    *plain = malloc(*plain_len);
+
+    if (*plain == NULL) {
+        exit(EXIT_FAILURE);
+    }
+
+    TOX_ERR_DECRYPTION err;
+
+    if (!tox_pass_key_decrypt(key, data, length, *plain, &err)) {
+        log_write(LOG_LEVEL_ERROR, "Failed to decrypt savedata (error %d); wrong passphrase?\n", err);
+        free(*plain);
+        *plain = NULL;
+        return -1;
+    }
+
+    Shard_Key = key;
+    return 1;
+}
+
+const Tox_Pass_Key *savecrypt_key(void)
+{
+    if (Passphrase_Len == 0) {
+        return NULL;
+    }
+
+    if (Shard_Key) {
+        return Shard_Key;
+    }
+
+    pthread_mutex_lock(&Keys_Lock);
+
+    /* shards without encrypted savedata share whichever key was derived first */
+    if (Num_Keys > 0) {
+        Shard_Key = Keys[0].key;
+        pthread_mutex_unlock(&Keys_Lock);
+        return Shard_Key;
+    }
+
+    /* toxencryptsave doesn't hand out the salt of a fresh key, but every ciphertext carries it */
+    TOX_ERR_KEY_DERIVATION err;
+    Tox_Pass_Key *key = tox_pass_key_derive(Passphrase, Passphrase_Len, &err);
+    uint8_t probe[1 + TOX_PASS_ENCRYPTION_EXTRA_LENGTH];
+    uint8_t salt[TOX_PASS_SALT_LENGTH];
+
+    if (key == NULL || !tox_pass_key_encrypt(key, (const uint8_t *) "", 1, probe, NULL)
+            || !tox_get_salt(probe, salt, NULL)) {
+        log_write(LOG_LEVEL_ERROR, "Savedata key derivation failed (error %d)\n", err);
+        tox_pass_key_free(key);
+        pthread_mutex_unlock(&Keys_Lock);
+        return NULL;
+    }
+
+    struct Derived_Key *keys = realloc(Keys, sizeof(struct Derived_Key));
+
+    if (keys == NULL) {
+        exit(EXIT_FAILURE);
+    }
+
+    Keys = keys;
+    memcpy(Keys[0].salt, salt, TOX_PASS_SALT_LENGTH);
+    Keys[0].key = key;
+    Num_Keys = 1;
+    Shard_Key = key;
+
+    pthread_mutex_unlock(&Keys_Lock);
+    return Shard_Key;
+}
+
+uint8_t *savecrypt_seal(const Tox_Pass_Key *key, const uint8_t *data, size_t length, size_t *sealed_len)
+{
+    uint8_t *sealed = malloc(length + TOX_PASS_ENCRYPTION_EXTRA_LENGTH);
+
+    if (sealed == NULL) {
+        return NULL;
+    }
+
+    if (!tox_pass_key_encrypt(key, data, length, sealed, NULL)) {
+        free(sealed);
+        return NULL;
+    }
+
+    *sealed_len = length + TOX_PASS_ENCRYPTION_EXTRA_LENGTH;
+    return sealed;
+}
+
+void savecrypt_free(void)
+{
+    size_t i;
+
+    for (i = 0; i < Num_Keys; ++i) {
+        tox_pass_key_free(Keys[i].key);
+    }
+
+    free(Keys);
+    Keys = NULL;
+    Num_Keys = 0;
+
+    memset(Passphrase, 0, sizeof(Passphrase));
+    Passphrase_Len = 0;
+}
@@ -0,0 +1,74 @@
+/*  savecrypt.h
+ *
+ *
+ *  Copyright (C) 2014 toxbot All Rights Reserved.
+ *
+ *  This file is part of toxbot.
+ *
+ *  toxbot is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  toxbot is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with toxbot. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef SAVECRYPT_H
+#define SAVECRYPT_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <tox/toxencryptsave.h>
+
+#define SAVECRYPT_PASSPHRASE_ENV "TOXBOT_PASSPHRASE"
+#define SAVECRYPT_MAX_PASSPHRASE 1024
+
+/*
+ * Reads the savedata passphrase from the first line of path, or from the environment
+ * variable SAVECRYPT_PASSPHRASE_ENV if path is NULL. Without a passphrase savedata is
+ * written in plain text. Call once from main before any shard starts.
+ *
+ * Returns 0 on success, including when no passphrase is set.
+ * Returns -1 if path can't be read or holds an empty passphrase.
+ */
+int savecrypt_set_passphrase(const char *path);
+
+/* Returns true if a passphrase is set and saves are encrypted. */
+bool savecrypt_enabled(void);
+
+/*
+ * Decrypts savedata read from disk if it is encrypted, and remembers its key for the
+ * calling shard's saves. Key derivation is slow, so keys are cached by salt and shards
+ * whose files were written with the same key derive it only once.
+ *
+ * Returns 1 and sets *plain to a malloc'd buffer of *plain_len bytes if data was decrypted.
+ * Returns 0 if data is not encrypted.
+ * Returns -1 if data is encrypted and there is no passphrase or it is wrong.
+ */
+int savecrypt_open(const uint8_t *data, size_t length, uint8_t **plain, size_t *plain_len);
+
+/*
+ * Returns the key the calling shard encrypts its saves with, deriving one on first use,
+ * or NULL if no passphrase is set. The key stays valid until savecrypt_free().
+ */
+const Tox_Pass_Key *savecrypt_key(void);
+
+/*
+ * Encrypts length bytes of data with key. Cheap enough to run for every save, and safe
+ * to call from worker threads.
+ *
+ * Returns a malloc'd buffer of *sealed_len bytes, or NULL on failure.
+ */
+uint8_t *savecrypt_seal(const Tox_Pass_Key *key, const uint8_t *data, size_t length, size_t *sealed_len);
+
+/* Frees every derived key and wipes the passphrase. Call after all shards and workers have stopped. */
+void savecrypt_free(void);
+
+#endif /* SAVECRYPT_H */
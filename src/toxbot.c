@@ -33,6 +33,7 @@
 #include <limits.h>
 #include <signal.h>
 #include <inttypes.h>
+#include <pthread.h>
 
 #include <tox/tox.h>
 #include <tox/toxav.h>
@@ -41,17 +42,57 @@
 #include "commands.h"
 #include "toxbot.h"
 #include "groupchats.h"
+#include "keylist.h"
+#include "metrics.h"
+#include "worker.h"
+#include "log.h"
+#include "ratelimit.h"
+#include "admission.h"
+#include "nospam.h"
+#include "bridge.h"
+#include "history.h"
+#include "friends.h"
+#include "cmdqueue.h"
+#include "admin.h"
+#include "events.h"
+#include "mapi.h"
+#include "pool.h"
+#include "trigger.h"
+#include "friendlist.h"
+#include "invitequeue.h"
+#include "savecrypt.h"
+#include "journal.h"
 
 #define VERSION "0.0.3"
 #define FRIEND_PURGE_INTERVAL (60 * 60)
 #define GROUP_PURGE_INTERVAL (60 * 10)
+#define KEYLIST_RELOAD_INTERVAL 5
 
-bool FLAG_EXIT = false;    /* set on SIGINT */
-char *DATA_FILE        = "toxbot_save";
+/* set on SIGINT and read by every shard; the __atomic builtins make it safe from both */
+volatile sig_atomic_t FLAG_EXIT = 0;
 char *MASTERLIST_FILE  = "masterkeys";
 char *BLOCKLIST_FILE   = "blockedkeys";
-
-struct Tox_Bot Tox_Bot;
+char *BLOCKLIST_DB_FILE = "blockedkeys.db";
+char *REQUEST_RULES_FILE = "requestrules";
+char *TRIGGERS_FILE = "triggers";
+char *ADMIN_SOCKET_FILE = "toxbot_admin";
+char *EVENTS_FILE = "/dev/shm/toxbot_events";
+
+/* per-shard state; every shard thread has its own copy */
+__thread char *DATA_FILE        = "toxbot_save";
+__thread char *GROUPS_FILE      = "toxbot_groups";
+__thread char *JOURNAL_FILE     = "toxbot_journal";
+__thread char *ADDRESS_FILE     = "toxbot_address";
+__thread char *NOSPAM_FILE      = "toxbot_nospam";
+__thread struct Tox_Bot Tox_Bot;
+__thread struct Shard *Self_Shard;
+
+/* shared by all shards */
+struct Shard Shards[MAX_NUM_SHARDS];
+int Num_Shards = 1;
+bool Restore_Nospam = false;
+struct Key_List Master_Keys;
+struct Key_List Blocked_Keys;
 
 static void init_toxbot_state(void)
 {
@@ -66,13 +107,12 @@ static void init_toxbot_state(void)
 
 static void catch_SIGINT(int sig)
 {
-    FLAG_EXIT = true;
+    __atomic_store_n(&FLAG_EXIT, 1, __ATOMIC_RELAXED);
 }
 
 static void exit_groupchats(Tox *m, size_t numchats)
 {
-    memset(Tox_Bot.g_chats, 0, Tox_Bot.chats_idx * sizeof(struct Group_Chat));
-    realloc_groupchats(0);
+    groups_free();
 
     uint32_t chatlist[numchats];
     tox_conference_get_chatlist(m, chatlist);
@@ -84,35 +124,206 @@ static void exit_groupchats(Tox *m, size_t numchats)
     }
 }
 
+/* Saves, leaves all groups and kills the Tox instance. Does not exit the process. */
 static void exit_toxbot(Tox *m)
 {
     size_t numchats = tox_conference_get_chatlist_size(m);
 
+    /* let outstanding saves land first; with no completion queue left the final save is synchronous */
+    worker_thread_cleanup(m);
+
+    /* save before leaving so toxcore can restore our conferences on the next start */
+    save_data(m, DATA_FILE);
+
     if (numchats) {
         exit_groupchats(m, numchats);
     }
 
-    save_data(m, DATA_FILE);
     tox_kill(m);
-    exit(EXIT_SUCCESS);
 }
 
-/* Returns true if friendnumber's Tox ID is in the masterkeys list. */
-bool friend_is_master(Tox *m, uint32_t friendnumber)
+int least_loaded_shard(void)
 {
-    char public_key[TOX_PUBLIC_KEY_SIZE];
+    int i, best = 0;
+    uint32_t best_load = UINT32_MAX;
 
-    if (tox_friend_get_public_key(m, friendnumber, (uint8_t *) public_key, NULL) == 0) {
-        return false;
+    for (i = 0; i < Num_Shards; ++i) {
+        uint32_t load = __atomic_load_n(&Shards[i].num_friends, __ATOMIC_RELAXED);
+
+        if (load < best_load) {
+            best_load = load;
+            best = i;
+        }
+    }
+
+    return best;
+}
+
+void shard_get_address(int shard, uint8_t *address)
+{
+    pthread_mutex_lock(&Shards[shard].address_lock);
+    memcpy(address, Shards[shard].address, TOX_ADDRESS_SIZE);
+    pthread_mutex_unlock(&Shards[shard].address_lock);
+}
+
+void shard_kick_key(const uint8_t *public_key)
+{
+    int i;
+
+    for (i = 0; i < Num_Shards; ++i) {
+        struct Shard *shard = &Shards[i];
+
+        if (shard == Self_Shard) {
+            continue;
+        }
+
+        pthread_mutex_lock(&shard->kick_lock);
+
+        uint8_t *tmp = realloc(shard->kicks, (shard->num_kicks + 1) * TOX_PUBLIC_KEY_SIZE);
+
+        if (tmp == NULL) {
+            exit(EXIT_FAILURE);
+        }
+
+        shard->kicks = tmp;
+        memcpy(shard->kicks + shard->num_kicks * TOX_PUBLIC_KEY_SIZE, public_key, TOX_PUBLIC_KEY_SIZE);
+        __atomic_store_n(&shard->num_kicks, shard->num_kicks + 1, __ATOMIC_RELAXED);
+
+        pthread_mutex_unlock(&shard->kick_lock);
+    }
+}
+
+/* Deletes the friends whose keys other shards have kicked. */
+static void do_kicks(Tox *m)
+{
+    if (__atomic_load_n(&Self_Shard->num_kicks, __ATOMIC_RELAXED) == 0) {
+        return;
+    }
+
+    pthread_mutex_lock(&Self_Shard->kick_lock);
+    uint8_t *kicks = Self_Shard->kicks;
+    uint32_t num_kicks = Self_Shard->num_kicks;
+    Self_Shard->kicks = NULL;
+    __atomic_store_n(&Self_Shard->num_kicks, 0, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&Self_Shard->kick_lock);
+
+    uint32_t i;
+
+    for (i = 0; i < num_kicks; ++i) {
+        uint32_t friendnumber = friends_find(kicks + i * TOX_PUBLIC_KEY_SIZE);
+
+        if (friendnumber != UINT32_MAX) {
+            log_write(LOG_LEVEL_INFO, "Removed friend %u, kicked on another shard\n", friendnumber);
+            friends_delete(m, friendnumber);
+        }
+    }
+
+    free(kicks);
+}
+
+/* Publishes this shard's load figures and address for the other shards. */
+static void update_shard_info(Tox *m)
+{
+    uint32_t num_groups = 0;
+    int i;
+
+    for (i = 0; i < Tox_Bot.chats_idx; ++i) {
+        if (Tox_Bot.g_chats[i].active) {
+            ++num_groups;
+        }
+    }
+
+    __atomic_store_n(&Self_Shard->num_friends, (uint32_t) tox_self_get_friend_list_size(m), __ATOMIC_RELAXED);
+    __atomic_store_n(&Self_Shard->num_online, (uint32_t) Tox_Bot.num_online_friends, __ATOMIC_RELAXED);
+    __atomic_store_n(&Self_Shard->num_groups, num_groups, __ATOMIC_RELAXED);
+
+    pthread_mutex_lock(&Self_Shard->address_lock);
+    tox_self_get_address(m, Self_Shard->address);
+    pthread_mutex_unlock(&Self_Shard->address_lock);
+}
+
+void get_friend_log_name(Tox *m, uint32_t friendnumber, char *name, Log_Level level)
+{
+    name[0] = '\0';
+
+    if (!log_enabled(level)) {
+        return;
+    }
+
+    if (friendnumber == ADMIN_FRIENDNUM) {
+        snprintf(name, TOX_MAX_NAME_LENGTH, "admin socket");
+        return;
+    }
+
+    const struct Friend_Info *f = friends_get(m, friendnumber);
+
+    if (f != NULL) {
+        memcpy(name, f->name, MIN(f->name_len, TOX_MAX_NAME_LENGTH - 1));
+        name[MIN(f->name_len, TOX_MAX_NAME_LENGTH - 1)] = '\0';
+    }
+}
+
+static void keylist_save_job(void *arg)
+{
+    keylist_save(arg);
+}
+
+void keylist_persist(struct Key_List *list)
+{
+    if (worker_submit(keylist_save_job, NULL, list) == -1) {
+        keylist_save(list);
+    }
+}
+
+bool block_key(Tox *m, const uint8_t *public_key)
+{
+    bool added = keylist_insert(&Blocked_Keys, public_key);
+
+    if (added) {
+        keylist_persist(&Blocked_Keys);
+    }
+
+    uint32_t friendnumber = friends_find(public_key);
+
+    if (friendnumber != UINT32_MAX) {
+        friends_delete(m, friendnumber);
+    }
+
+    return added;
+}
+
+int block_friend(Tox *m, uint32_t friendnumber)
+{
+    const struct Friend_Info *f = friends_get(m, friendnumber);
+
+    if (f == NULL) {
+        return -1;
     }
 
-    return file_contains_key(public_key, MASTERLIST_FILE) == 1;
+    uint8_t public_key[TOX_PUBLIC_KEY_SIZE];
+    memcpy(public_key, f->public_key, TOX_PUBLIC_KEY_SIZE);
+    block_key(m, public_key);
+    return 0;
+}
+
+static void reload_keylists(void *arg)
+{
+    keylist_reload_if_changed(&Master_Keys);
+    keylist_reload_if_changed(&Blocked_Keys);
 }
 
-/* Returns true if public_key is in the blockedkeys list. */
-static bool public_key_is_blocked(const char *public_key)
+/* Returns true if friendnumber's Tox ID is in the masterkeys list, or if the command came from the admin socket. */
+bool friend_is_master(Tox *m, uint32_t friendnumber)
 {
-    return file_contains_key(public_key, BLOCKLIST_FILE) == 1;
+    if (friendnumber == ADMIN_FRIENDNUM) {
+        return true;
+    }
+
+    if (friends_get(m, friendnumber) == NULL) {
+        return false;
+    }
+
+    return friends_flag(friendnumber, FRIEND_FLAG_MASTER);
 }
 
 /* START CALLBACKS */
@@ -120,54 +331,79 @@ static void cb_self_connection_change(Tox *m, TOX_CONNECTION connection_status,
 {
     switch (connection_status) {
         case TOX_CONNECTION_NONE:
-            fprintf(stderr, "Connection to Tox network has been lost\n");
+            log_write(LOG_LEVEL_WARNING, "Connection to Tox network has been lost\n");
             break;
 
         case TOX_CONNECTION_TCP:
-            fprintf(stderr, "Connection to Tox network is weak (using TCP)\n");
+            log_write(LOG_LEVEL_INFO, "Connection to Tox network is weak (using TCP)\n");
             break;
 
         case TOX_CONNECTION_UDP:
-            fprintf(stderr, "Connection to Tox network is strong (using UDP)\n");
+            log_write(LOG_LEVEL_INFO, "Connection to Tox network is strong (using UDP)\n");
             break;
     }
 }
 
 static void cb_friend_connection_change(Tox *m, uint32_t friendnumber, TOX_CONNECTION connection_status, void *userdata)
 {
-    Tox_Bot.num_online_friends = 0;
-
-    size_t i, size = tox_self_get_friend_list_size(m);
+    friends_set_connection(friendnumber, connection_status);
+    Tox_Bot.num_online_friends = friends_num_online();
 
-    if (size == 0) {
-        return;
+    if (connection_status != TOX_CONNECTION_NONE) {
+        invite_queue_friend_online(friendnumber);
     }
+}
 
-    uint32_t list[size];
-    tox_self_get_friend_list(m, list);
-
-    for (i = 0; i < size; ++i) {
-        if (tox_friend_get_connection_status(m, list[i], NULL) != TOX_CONNECTION_NONE) {
-            ++Tox_Bot.num_online_friends;
-        }
-    }
+static void cb_friend_name(Tox *m, uint32_t friendnumber, const uint8_t *name, size_t length, void *userdata)
+{
+    friends_set_name(friendnumber, name, length);
 }
 
 static void cb_friend_request(Tox *m, const uint8_t *public_key, const uint8_t *data, size_t length,
                               void *userdata)
 {
-    if (public_key_is_blocked((char *) public_key)) {
-        return;
+    metrics_inc(METRIC_FRIEND_REQUESTS);
+    nospam_record_request();
+    events_publish(EVENT_FRIEND_REQUEST, 0, public_key, (const char *) data, length);
+
+    /* requests are accepted in rate limited batches by admission_process() */
+    admission_enqueue(m, public_key, data, length);
+}
+
+/*
+ * Applies the rate limit and blocklist to a message or packet from friendnumber and puts
+ * whether the friend is a master in is_master. Returns false if it must be dropped.
+ */
+static bool friend_input_allowed(Tox *m, uint32_t friendnumber, bool *is_master)
+{
+    if (friends_get(m, friendnumber) == NULL) {
+        return false;
     }
 
-    TOX_ERR_FRIEND_ADD err;
-    tox_friend_add_norequest(m, public_key, &err);
+    /* throttle before doing any work on the message; dropped messages get no reply */
+    *is_master = friends_flag(friendnumber, FRIEND_FLAG_MASTER);
 
-    if (err != TOX_ERR_FRIEND_ADD_OK) {
-        fprintf(stderr, "tox_friend_add_norequest failed (error %d)\n", err);
+    switch (rate_limit_check(friendnumber, *is_master)) {
+        case RATE_LIMIT_ALLOW:
+            break;
+
+        case RATE_LIMIT_DROP:
+            return false;
+
+        case RATE_LIMIT_BLOCK:
+            log_write(LOG_LEVEL_WARNING, "Blocking friend %u for repeatedly exceeding the message rate limit",
+                      friendnumber);
+            block_friend(m, friendnumber);
+            return false;
     }
 
-    save_data(m, DATA_FILE);
+    if (friends_flag(friendnumber, FRIEND_FLAG_BLOCKED)) {
+        friends_delete(m, friendnumber);
+        return false;
+    }
+
+    friends_touch(friendnumber);
+    return true;
 }
 
 static void cb_friend_message(Tox *m, uint32_t friendnumber, TOX_MESSAGE_TYPE type, const uint8_t *string,
@@ -177,26 +413,39 @@ static void cb_friend_message(Tox *m, uint32_t friendnumber, TOX_MESSAGE_TYPE ty
         return;
     }
 
-    char public_key[TOX_PUBLIC_KEY_SIZE];
+    metrics_inc(METRIC_MESSAGES_RECEIVED);
 
-    if (tox_friend_get_public_key(m, friendnumber, (uint8_t *) public_key, NULL) == 0) {
-        return;
-    }
+    bool is_master;
 
-    if (public_key_is_blocked(public_key)) {
-        tox_friend_delete(m, friendnumber, NULL);
+    if (!friend_input_allowed(m, friendnumber, &is_master)) {
         return;
     }
 
-    const char *outmsg;
     char message[TOX_MAX_MESSAGE_LENGTH];
     length = copy_tox_str(message, sizeof(message), (const char *) string, length);
     message[length] = '\0';
 
-    if (length && execute(m, friendnumber, message, length) == -1) {
-        outmsg = "命令无效。 请发送help以获取命令列表";
-        tox_friend_send_message(m, friendnumber, TOX_MESSAGE_TYPE_NORMAL, (uint8_t *) outmsg, strlen(outmsg), NULL);
+    /* run by cmdqueue_do() once tox_iterate() returns, so commands never stall the iteration */
+    if (length) {
+        cmdqueue_push(m, friendnumber, is_master, message, length);
+    }
+}
+
+static void cb_friend_lossless_packet(Tox *m, uint32_t friendnumber, const uint8_t *data, size_t length,
+                                      void *userdata)
+{
+    if (length < 1 || data[0] != MAPI_PACKET_ID) {
+        return;
+    }
+
+    bool is_master;
+
+    if (!friend_input_allowed(m, friendnumber, &is_master)) {
+        return;
     }
+
+    /* answered from the command queue, like text commands */
+    cmdqueue_push_packet(m, friendnumber, is_master, data + 1, length - 1);
 }
 
 static void cb_group_invite(Tox *m, uint32_t friendnumber, TOX_CONFERENCE_TYPE type,
@@ -207,9 +456,7 @@ static void cb_group_invite(Tox *m, uint32_t friendnumber, TOX_CONFERENCE_TYPE t
     }
 
     char name[TOX_MAX_NAME_LENGTH];
-    tox_friend_get_name(m, friendnumber, (uint8_t *) name, NULL);
-    size_t len = tox_friend_get_name_size(m, friendnumber, NULL);
-    name[len] = '\0';
+    get_friend_log_name(m, friendnumber, name, LOG_LEVEL_WARNING);
 
     int groupnum = -1;
 
@@ -229,16 +476,18 @@ static void cb_group_invite(Tox *m, uint32_t friendnumber, TOX_CONFERENCE_TYPE t
     }
 
     if (group_add(groupnum, type, NULL) == -1) {
-        fprintf(stderr, "Invite from %s failed (group_add failed)\n", name);
+        log_write(LOG_LEVEL_WARNING, "Invite from %s failed (group_add failed)\n", name);
         tox_conference_delete(m, groupnum, NULL);
         return;
     }
 
-    printf("Accepted groupchat invite from %s [%d]\n", name, groupnum);
+    group_roster_update(m, groupnum);
+    events_publish(EVENT_GROUP_JOIN, groupnum, friends_get(m, friendnumber)->public_key, NULL, 0);
+    log_write(LOG_LEVEL_INFO, "Accepted groupchat invite from %s [%d]\n", name, groupnum);
     return;
 
 on_error:
-    fprintf(stderr, "Invite from %s failed (core failure)\n", name);
+    log_write(LOG_LEVEL_WARNING, "Invite from %s failed (core failure)\n", name);
 }
 
 static void cb_group_titlechange(Tox *m, uint32_t groupnumber, uint32_t peernumber, const uint8_t *title,
@@ -255,42 +504,148 @@ static void cb_group_titlechange(Tox *m, uint32_t groupnumber, uint32_t peernumb
 
     memcpy(Tox_Bot.g_chats[idx].title, message, length + 1);
     Tox_Bot.g_chats[idx].title_len = length;
+
+    events_publish(EVENT_GROUP_TITLE, groupnumber, NULL, message, length);
+}
+static void cb_group_message(Tox *m, uint32_t groupnumber, uint32_t peernumber, TOX_MESSAGE_TYPE type,
+                             const uint8_t *message, size_t length, void *userdata)
+{
+    history_on_message(m, groupnumber, peernumber, type, message, length);
+
+    if (type == TOX_MESSAGE_TYPE_NORMAL) {
+        bridge_on_message(m, groupnumber, peernumber, message, length);
+        triggers_on_message(m, groupnumber, peernumber, message, length);
+    }
+}
+static void cb_group_peer_list_changed(Tox *m, uint32_t groupnumber, void *userdata)
+{
+    group_roster_update(m, groupnumber);
+}
+
+static void cb_group_peer_name(Tox *m, uint32_t groupnumber, uint32_t peernumber, const uint8_t *name,
+                               size_t length, void *userdata)
+{
+    group_peer_name_update(groupnumber, peernumber, name, length);
 }
 /* END CALLBACKS */
 
+/* A snapshot of the bot's state, written to disk by a worker thread. */
+struct Save_Job {
+    char data_path[PATH_MAX];
+    char groups_path[PATH_MAX];
+    uint8_t *data;
+    size_t data_len;
+    uint8_t *groups;
+    size_t groups_len;
+    const Tox_Pass_Key *key;    /* data is encrypted with this on the worker if set */
+    struct Journal_Mark mark;   /* journal records this snapshot covers */
+    int ret;
+};
+
+/* at most one save per shard is in flight; requests made meanwhile are coalesced into one */
+static __thread bool save_in_flight;
+static __thread bool save_pending;
+
+static void save_job_free(struct Save_Job *job)
+{
+    free(job->data);
+    free(job->groups);
+    free(job);
+}
+
+static void save_job_run(void *arg)
+{
+    struct Save_Job *job = arg;
+
+    job->ret = 0;
+
+    if (job->key) {
+        size_t sealed_len;
+        uint8_t *sealed = savecrypt_seal(job->key, job->data, job->data_len, &sealed_len);
+
+        memset(job->data, 0, job->data_len);
+        free(job->data);
+        job->data = sealed;
+        job->data_len = sealed_len;
+
+        if (sealed == NULL) {
+            job->ret = -1;
+            return;
+        }
+    }
+
+    if (write_file_atomic(job->data_path, job->data, job->data_len) == -1
+            || write_file_atomic(job->groups_path, job->groups, job->groups_len) == -1) {
+        job->ret = -1;
+    }
+}
+
+static void save_job_done(Tox *m, void *arg)
+{
+    struct Save_Job *job = arg;
+
+    if (job->ret == 0) {
+        metrics_inc(METRIC_SAVES);
+    } else {
+        log_write(LOG_LEVEL_WARNING, "Warning: save_data failed\n");
+    }
+
+    journal_snapshot_done(&job->mark, job->ret == 0);
+    save_job_free(job);
+    save_in_flight = false;
+
+    if (save_pending) {
+        save_pending = false;
+        save_data(m, DATA_FILE);
+    }
+}
+
+/* Saves are written by a worker thread when possible, so this only blocks for the snapshot. */
 int save_data(Tox *m, const char *path)
 {
     if (path == NULL) {
         goto on_error;
     }
 
-    FILE *fp = fopen(path, "wb");
-
-    if (fp == NULL) {
-        return -1;
+    if (save_in_flight) {
+        save_pending = true;
+        return 0;
     }
 
-    size_t data_len = tox_get_savedata_size(m);
-    char *data = malloc(data_len);
+    struct Save_Job *job = calloc(1, sizeof(struct Save_Job));
 
-    if (data == NULL) {
+    if (job == NULL) {
         goto on_error;
     }
 
-    tox_get_savedata(m, (uint8_t *) data);
+    snprintf(job->data_path, sizeof(job->data_path), "%s", path);
+    snprintf(job->groups_path, sizeof(job->groups_path), "%s", GROUPS_FILE);
 
-    if (fwrite(data, data_len, 1, fp) != 1) {
-        free(data);
-        fclose(fp);
+    job->data_len = tox_get_savedata_size(m);
+    job->data = malloc(job->data_len);
+    job->groups = groups_pack(m, &job->groups_len);
+
+    if (job->data == NULL || job->groups == NULL) {
+        save_job_free(job);
         goto on_error;
     }
 
-    free(data);
-    fclose(fp);
+    tox_get_savedata(m, job->data);
+    job->key = savecrypt_key();
+    journal_mark(&job->mark);
+    save_in_flight = true;
+
+    if (worker_submit(save_job_run, save_job_done, job) == -1) {
+        save_job_run(job);
+        int ret = job->ret;
+        save_job_done(m, job);
+        return ret;
+    }
+
     return 0;
 
 on_error:
-    fprintf(stderr, "Warning: save_data failed\n");
+    log_write(LOG_LEVEL_WARNING, "Warning: save_data failed\n");
     return -1;
 }
 
@@ -300,11 +655,16 @@ static Tox *load_tox(struct Tox_Options *options, char *path)
     Tox *m = NULL;
 
     if (fp == NULL) {
+        /* derive the key now rather than on the first save, so a failure stops the bot */
+        if (savecrypt_enabled() && savecrypt_key() == NULL) {
+            return NULL;
+        }
+
         TOX_ERR_NEW err;
         m = tox_new(options, &err);
 
         if (err != TOX_ERR_NEW_OK) {
-            fprintf(stderr, "tox_new failed with error %d\n", err);
+            log_write(LOG_LEVEL_ERROR, "tox_new failed with error %d\n", err);
             return NULL;
         }
 
@@ -326,22 +686,65 @@ static Tox *load_tox(struct Tox_Options *options, char *path)
         return NULL;
     }
 
+    fclose(fp);
+
+    uint8_t *plain = NULL;
+    size_t plain_len = 0;
+    int opened = savecrypt_open((const uint8_t *) data, data_len, &plain, &plain_len);
+
+    if (opened == -1 || (savecrypt_enabled() && savecrypt_key() == NULL)) {
+        free(plain);
+        return NULL;
+    }
+
     TOX_ERR_NEW err;
     options->savedata_type = TOX_SAVEDATA_TYPE_TOX_SAVE;
-    options->savedata_data = (uint8_t *) data;
-    options->savedata_length = data_len;
+    options->savedata_data = opened == 1 ? plain : (uint8_t *) data;
+    options->savedata_length = opened == 1 ? plain_len : (size_t) data_len;
 
     m = tox_new(options, &err);
 
+    if (plain) {
+        memset(plain, 0, plain_len);
+        free(plain);
+    }
+
     if (err != TOX_ERR_NEW_OK) {
-        fprintf(stderr, "tox_new failed with error %d\n", err);
+        log_write(LOG_LEVEL_ERROR, "tox_new failed with error %d\n", err);
         return NULL;
     }
 
-    fclose(fp);
     return m;
 }
 
+/* Creates the default text group used on first start, or when no saved group could be restored. */
+static void create_default_group(Tox *m)
+{
+    const char *title = "group name A";
+
+    TOX_ERR_CONFERENCE_NEW err;
+    uint32_t groupnum = tox_conference_new(m, &err);
+
+    if (err != TOX_ERR_CONFERENCE_NEW_OK) {
+        log_write(LOG_LEVEL_WARNING, "Failed to create default group (error %d)\n", err);
+        return;
+    }
+
+    if (group_add(groupnum, TOX_CONFERENCE_TYPE_TEXT, NULL) == -1) {
+        log_write(LOG_LEVEL_WARNING, "Failed to create default group (group_add failed)\n");
+        tox_conference_delete(m, groupnum, NULL);
+        return;
+    }
+
+    tox_conference_set_title(m, groupnum, (const uint8_t *) title, strlen(title), NULL);
+
+    int idx = group_index(groupnum);
+    snprintf(Tox_Bot.g_chats[idx].title, sizeof(Tox_Bot.g_chats[idx].title), "%s", title);
+    Tox_Bot.g_chats[idx].title_len = strlen(title);
+    Tox_Bot.default_groupnum = groupnum;
+    group_roster_update(m, groupnum);
+}
+
 static Tox *init_tox(void)
 {
     struct Tox_Options tox_opts;
@@ -356,10 +759,15 @@ static Tox *init_tox(void)
 
     tox_callback_self_connection_status(m, cb_self_connection_change);
     tox_callback_friend_connection_status(m, cb_friend_connection_change);
+    tox_callback_friend_name(m, cb_friend_name);
     tox_callback_friend_request(m, cb_friend_request);
     tox_callback_friend_message(m, cb_friend_message);
+    tox_callback_friend_lossless_packet(m, cb_friend_lossless_packet);
     tox_callback_conference_invite(m, cb_group_invite);
     tox_callback_conference_title(m, cb_group_titlechange);
+    tox_callback_conference_message(m, cb_group_message);
+    tox_callback_conference_peer_list_changed(m, cb_group_peer_list_changed);
+    tox_callback_conference_peer_name(m, cb_group_peer_name);
 
     size_t s_len = tox_self_get_status_message_size(m);
 
@@ -374,14 +782,12 @@ static Tox *init_tox(void)
         tox_self_set_name(m, (uint8_t *) "妮斯卡", strlen("妮斯卡"), NULL);
     }
 
-    //创建默认群
-    char *myargv[2]={"programname","text"};
-    cmd_group(m, 100, 1, myargv);
-
-    //设置默认群名称
-    char *myargvtitle[3]={"programname","1","\"group name A\""};
-    cmd_title_set(m, 100, 3, myargvtitle);
+    /* only a bot with no conferences at all gets a new default group */
+    if (groups_load(m, GROUPS_FILE) == 0) {
+        create_default_group(m);
+    }
 
+    journal_init(m, JOURNAL_FILE);
     return m;
 }
 
@@ -414,13 +820,17 @@ static void bootstrap_DHT(Tox *m)
         free(key);
 
         if (err != TOX_ERR_BOOTSTRAP_OK) {
-            fprintf(stderr, "Failed to bootstrap DHT via: %s %d (error %d)\n", nodes[i].ip, nodes[i].port, err);
+            log_write(LOG_LEVEL_WARNING, "Failed to bootstrap DHT via: %s %d (error %d)\n", nodes[i].ip, nodes[i].port, err);
         }
     }
 }
 
 static void print_profile_info(Tox *m)
 {
+    if (Num_Shards > 1) {
+        printf("Shard %d:\n", Self_Shard->index);
+    }
+
     printf("ToxBot version %s\n", VERSION);
     printf("Toxcore version %d.%d.%d\n", tox_version_major(), tox_version_minor(), tox_version_patch());
     printf("ID: ");
@@ -475,28 +885,47 @@ static void purge_inactive_friends(Tox *m)
             continue;
         }
 
+        /* friends who were never online, such as imported ones, age from when we added them */
+        if (last_online == 0) {
+            const struct Friend_Info *f = friends_get(m, friendnum);
+            last_online = f ? f->first_seen : 0;
+        }
+
         if (((uint64_t) time(NULL)) - last_online > Tox_Bot.inactive_limit) {
-            tox_friend_delete(m, friendnum, NULL);
+            friends_delete(m, friendnum);
         }
     }
 }
 
 static void purge_empty_groups(Tox *m)
 {
+    uint64_t cur_time = (uint64_t) time(NULL);
     uint32_t i;
 
     for (i = 0; i < Tox_Bot.chats_idx; ++i) {
-        if (!Tox_Bot.g_chats[i].active) {
+        const struct Group_Chat *chat = &Tox_Bot.g_chats[i];
+
+        if (!chat->active) {
             continue;
         }
 
-        TOX_ERR_CONFERENCE_PEER_QUERY err;
-        uint32_t num_peers = tox_conference_peer_count(m, Tox_Bot.g_chats[i].groupnum, &err);
+        /* peers of a group that was just restored or joined have not connected yet */
+        if (!timed_out(chat->added_time, cur_time, GROUP_PURGE_INTERVAL)) {
+            continue;
+        }
+
+        /* a pool shard that was just opened waits for the friends invited to it */
+        if (chat->num_peers == 1 && chat->pool_pending
+                && !timed_out(chat->pool_pending_since, cur_time, POOL_INVITE_WINDOW)) {
+            continue;
+        }
 
-        if (err != TOX_ERR_CONFERENCE_PEER_QUERY_OK || num_peers <= 1) {
-            fprintf(stderr, "Deleting empty group %i\n", Tox_Bot.g_chats[i].groupnum);
-            tox_conference_delete(m, Tox_Bot.g_chats[i].groupnum, NULL);
-            group_leave(i);
+        /* the roster is refreshed by the peer list callback; 0 means toxcore no longer has the group */
+        if (chat->num_peers <= 1) {
+            uint32_t groupnum = chat->groupnum;
+            log_write(LOG_LEVEL_WARNING, "Deleting empty group %i\n", groupnum);
+            tox_conference_delete(m, groupnum, NULL);
+            group_leave(groupnum);
 
             if (i >= Tox_Bot.chats_idx) {   // group_leave modifies chats_idx
                 return;
@@ -505,25 +934,68 @@ static void purge_empty_groups(Tox *m)
     }
 }
 
-int main(int argc, char **argv)
+/* Fills the friend cache and sizes the per-friend tables for the friends restored from savedata. */
+static void init_friend_tables(Tox *m)
 {
-    signal(SIGINT, catch_SIGINT);
-    umask(S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH);
+    friends_init(m);
+
+    size_t i, numfriends = tox_self_get_friend_list_size(m);
+
+    if (numfriends == 0) {
+        return;
+    }
+
+    uint32_t friend_list[numfriends];
+    tox_self_get_friend_list(m, friend_list);
+
+    for (i = 0; i < numfriends; ++i) {
+        rate_limit_ensure(friend_list[i]);
+    }
+}
+
+/* Runs one Tox identity until FLAG_EXIT is set. Returns NULL on clean exit. */
+static void *run_shard(void *arg)
+{
+    Self_Shard = arg;
+
+    if (Self_Shard->index > 0) {
+        DATA_FILE = Self_Shard->data_file;
+        GROUPS_FILE = Self_Shard->groups_file;
+        JOURNAL_FILE = Self_Shard->journal_file;
+        ADDRESS_FILE = Self_Shard->address_file;
+        NOSPAM_FILE = Self_Shard->nospam_file;
+    }
+
+    init_toxbot_state();
+
+    if (worker_thread_init() == -1) {
+        log_write(LOG_LEVEL_ERROR, "Shard %d failed to initialize\n", Self_Shard->index);
+        __atomic_store_n(&FLAG_EXIT, 1, __ATOMIC_RELAXED);
+        return (void *) -1;
+    }
 
     Tox *m = init_tox();
 
     if (m == NULL) {
-        exit(EXIT_FAILURE);
+        log_write(LOG_LEVEL_ERROR, "Shard %d failed to initialize\n", Self_Shard->index);
+        worker_thread_cleanup(NULL);
+        __atomic_store_n(&FLAG_EXIT, 1, __ATOMIC_RELAXED);
+        return (void *) -1;
     }
 
-    init_toxbot_state();
     print_profile_info(m);
+    init_friend_tables(m);
+    nospam_init(m, ADDRESS_FILE, NOSPAM_FILE, Restore_Nospam);
     bootstrap_DHT(m);
+    admin_init(Self_Shard->admin_file);
+    events_init(Self_Shard->events_file);
+    triggers_init(TRIGGERS_FILE);
 
     uint64_t last_friend_purge = 0;
-    uint64_t last_group_purge = 0;
+    uint64_t last_group_purge = (uint64_t) time(NULL);    /* restored groups start out with only the bot */
+    uint64_t last_keylist_reload = 0;
 
-    while (!FLAG_EXIT) {
+    while (!__atomic_load_n(&FLAG_EXIT, __ATOMIC_RELAXED)) {
         uint64_t cur_time = (uint64_t) time(NULL);
 
         if (timed_out(last_friend_purge, cur_time, FRIEND_PURGE_INTERVAL)) {
@@ -537,10 +1009,293 @@ int main(int argc, char **argv)
             last_group_purge = cur_time;
         }
 
+        /* the key lists are shared, so only the first shard needs to watch the files */
+        if (Self_Shard->index == 0 && timed_out(last_keylist_reload, cur_time, KEYLIST_RELOAD_INTERVAL)) {
+            worker_submit(reload_keylists, NULL, NULL);
+            last_keylist_reload = cur_time;
+        }
+
+        friends_sync_keylists(m);
+        do_kicks(m);
         tox_iterate(m, NULL);
-        usleep(tox_iteration_interval(m) * 1000);;
+        cmdqueue_do(m);
+        nospam_do(m);
+        admission_process(m);
+        bridge_do(m);
+        history_do(m);
+        triggers_do(m);
+        friendlist_do(m);
+        invite_queue_do(m);
+        journal_do(m);
+        worker_do_completions(m, MAX_COMPLETIONS_PER_ITERATION);
+        update_shard_info(m);
+        admin_wait(m, tox_iteration_interval(m));
     }
 
+    admin_free();
     exit_toxbot(m);
-    return 0;
+    journal_free();
+    events_free();
+    rate_limit_free();
+    bridge_free();
+    pools_free();
+    triggers_free();
+    friendlist_free();
+    invite_queue_free();
+    history_free();
+    cmdqueue_free();
+    friends_free();
+    return NULL;
+}
+
+/*
+ * Imports or exports the friend list of the first identity without going online, then
+ * saves and returns. Returns 0 on success.
+ */
+static int run_friend_tool(const char *import_path, const char *export_path)
+{
+    Self_Shard = &Shards[0];
+    init_toxbot_state();
+
+    if (worker_thread_init() == -1) {
+        return -1;
+    }
+
+    Tox *m = init_tox();
+
+    if (m == NULL) {
+        worker_thread_cleanup(NULL);
+        return -1;
+    }
+
+    init_friend_tables(m);
+
+    int ret = 0;
+
+    if (export_path) {
+        int count = friendlist_export_now(m, export_path);
+
+        if (count == -1) {
+            fprintf(stderr, "Failed to write %s\n", export_path);
+            ret = -1;
+        } else {
+            printf("Exported %d friends to %s\n", count, export_path);
+        }
+    }
+
+    if (import_path) {
+        char summary[TOX_MAX_MESSAGE_LENGTH];
+
+        if (friendlist_import_now(m, import_path, summary, sizeof(summary)) == -1) {
+            fprintf(stderr, "Can't read %s\n", import_path);
+            ret = -1;
+        } else {
+            printf("%s\n", summary);
+        }
+    }
+
+    exit_toxbot(m);
+    journal_free();
+    friends_free();
+    return ret;
+}
+
+static void print_usage(const char *name)
+{
+    fprintf(stderr, "usage: %s [-s <num shards>] [-w <num workers>] [-l <debug|info|warning|error>] [-r]\n"
+                    "          [-H <history MB per group>] [-A <history days>] [-S <admin socket path>]\n"
+                    "          [-E <event ring path>] [-I <import file>] [-X <export file>]\n"
+                    "          [-P <passphrase file>]\n", name);
+}
+
+int main(int argc, char **argv)
+{
+    signal(SIGINT, catch_SIGINT);
+    signal(SIGPIPE, SIG_IGN);    /* peers that hang up show up as EPIPE */
+    umask(S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH);
+
+    int num_workers = DEFAULT_NUM_WORKERS;
+    int log_level = LOG_LEVEL_INFO;
+    int history_max_mb = HISTORY_DEFAULT_MAX_BYTES / (1024 * 1024);
+    int history_max_days = 0;
+    const char *import_path = NULL;
+    const char *export_path = NULL;
+    const char *passphrase_path = NULL;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "s:w:l:rH:A:S:E:I:X:P:")) != -1) {
+        switch (opt) {
+            case 's':
+                Num_Shards = atoi(optarg);
+
+                if (Num_Shards < 1 || Num_Shards > MAX_NUM_SHARDS) {
+                    fprintf(stderr, "Number of shards must be between 1 and %d\n", MAX_NUM_SHARDS);
+                    exit(EXIT_FAILURE);
+                }
+
+                break;
+
+            case 'w':
+                num_workers = atoi(optarg);
+
+                if (num_workers < 1 || num_workers > MAX_NUM_WORKERS) {
+                    fprintf(stderr, "Number of workers must be between 1 and %d\n", MAX_NUM_WORKERS);
+                    exit(EXIT_FAILURE);
+                }
+
+                break;
+
+            case 'l':
+                log_level = log_level_from_name(optarg);
+
+                if (log_level == -1) {
+                    print_usage(argv[0]);
+                    exit(EXIT_FAILURE);
+                }
+
+                break;
+
+            case 'r':
+                Restore_Nospam = true;
+                break;
+
+            case 'H':
+                history_max_mb = atoi(optarg);
+
+                if (history_max_mb < 0) {
+                    print_usage(argv[0]);
+                    exit(EXIT_FAILURE);
+                }
+
+                break;
+
+            case 'A':
+                history_max_days = atoi(optarg);
+
+                if (history_max_days < 0) {
+                    print_usage(argv[0]);
+                    exit(EXIT_FAILURE);
+                }
+
+                break;
+
+            case 'S':
+                ADMIN_SOCKET_FILE = optarg;
+                break;
+
+            case 'E':
+                EVENTS_FILE = optarg;
+                break;
+
+            case 'I':
+                import_path = optarg;
+                break;
+
+            case 'X':
+                export_path = optarg;
+                break;
+
+            case 'P':
+                passphrase_path = optarg;
+                break;
+
+            default:
+                print_usage(argv[0]);
+                exit(EXIT_FAILURE);
+        }
+    }
+
+    history_set_retention((uint64_t) history_max_mb * 1024 * 1024, (uint64_t) history_max_days * SECONDS_IN_DAY);
+
+    if (log_init(log_level) == -1) {
+        fprintf(stderr, "Failed to start logging thread\n");
+        exit(EXIT_FAILURE);
+    }
+
+    /* exit() from any later failure path must still drain the log ring */
+    atexit(log_shutdown);
+
+    if (keylist_init(&Master_Keys, MASTERLIST_FILE) == -1 || keylist_init(&Blocked_Keys, BLOCKLIST_FILE) == -1) {
+        exit(EXIT_FAILURE);
+    }
+
+    if (savecrypt_set_passphrase(passphrase_path) == -1) {
+        exit(EXIT_FAILURE);
+    }
+
+    keylist_attach_db(&Blocked_Keys, BLOCKLIST_DB_FILE);
+
+    admission_load_rules(REQUEST_RULES_FILE);
+
+    if (worker_pool_init(num_workers) == -1) {
+        exit(EXIT_FAILURE);
+    }
+
+    int i;
+
+    for (i = 0; i < Num_Shards; ++i) {
+        Shards[i].index = i;
+        pthread_mutex_init(&Shards[i].address_lock, NULL);
+        pthread_mutex_init(&Shards[i].kick_lock, NULL);
+        snprintf(Shards[i].data_file, sizeof(Shards[i].data_file), "%s.%d", DATA_FILE, i);
+        snprintf(Shards[i].groups_file, sizeof(Shards[i].groups_file), "%s.%d", GROUPS_FILE, i);
+        snprintf(Shards[i].journal_file, sizeof(Shards[i].journal_file), "%s.%d", JOURNAL_FILE, i);
+        snprintf(Shards[i].address_file, sizeof(Shards[i].address_file), "%s.%d", ADDRESS_FILE, i);
+        snprintf(Shards[i].nospam_file, sizeof(Shards[i].nospam_file), "%s.%d", NOSPAM_FILE, i);
+
+        if (i == 0 || ADMIN_SOCKET_FILE[0] == '\0') {
+            snprintf(Shards[i].admin_file, sizeof(Shards[i].admin_file), "%s", ADMIN_SOCKET_FILE);
+        } else {
+            snprintf(Shards[i].admin_file, sizeof(Shards[i].admin_file), "%s.%d", ADMIN_SOCKET_FILE, i);
+        }
+
+        if (i == 0 || EVENTS_FILE[0] == '\0') {
+            snprintf(Shards[i].events_file, sizeof(Shards[i].events_file), "%s", EVENTS_FILE);
+        } else {
+            snprintf(Shards[i].events_file, sizeof(Shards[i].events_file), "%s.%d", EVENTS_FILE, i);
+        }
+    }
+
+    int ret = EXIT_SUCCESS;
+
+    if (import_path || export_path) {
+        if (run_friend_tool(import_path, export_path) == -1) {
+            ret = EXIT_FAILURE;
+        }
+    } else if (Num_Shards == 1) {
+        if (run_shard(&Shards[0]) != NULL) {
+            ret = EXIT_FAILURE;
+        }
+    } else {
+        for (i = 0; i < Num_Shards; ++i) {
+            if (pthread_create(&Shards[i].thread, NULL, run_shard, &Shards[i]) != 0) {
+                log_write(LOG_LEVEL_ERROR, "Failed to start shard %d", i);
+                __atomic_store_n(&FLAG_EXIT, 1, __ATOMIC_RELAXED);
+                Num_Shards = i;
+                ret = EXIT_FAILURE;
+                break;
+            }
+        }
+
+        for (i = 0; i < Num_Shards; ++i) {
+            void *shard_ret;
+            pthread_join(Shards[i].thread, &shard_ret);
+
+            if (shard_ret != NULL) {
+                ret = EXIT_FAILURE;
+            }
+        }
+    }
+
+    for (i = 0; i < Num_Shards; ++i) {
+        free(Shards[i].kicks);
+    }
+
+    worker_pool_shutdown();
+    savecrypt_free();
+    keylist_free(&Master_Keys);
+    keylist_free(&Blocked_Keys);
+    admission_free_rules();
+    log_shutdown();
+    return ret;
 }
@@ -24,10 +24,14 @@
 #define TOXBOT_H
 
 #include <stdint.h>
+#include <limits.h>
+#include <pthread.h>
 #include <tox/tox.h>
 #include "groupchats.h"
+#include "log.h"
 
 #define MAX_NUM_GROUPS 256
+#define MAX_NUM_SHARDS 16
 
 struct Tox_Bot {
     uint64_t start_time;
@@ -39,8 +43,70 @@ struct Tox_Bot {
     int chats_idx;
 };
 
-int load_Masters(const char *path);
+/* One Tox identity with its own thread, savedata file and event loop. */
+struct Shard {
+    int index;
+    pthread_t thread;
+    char data_file[PATH_MAX];
+    char groups_file[PATH_MAX];
+    char journal_file[PATH_MAX];
+    char address_file[PATH_MAX];
+    char nospam_file[PATH_MAX];
+    char admin_file[PATH_MAX];
+    char events_file[PATH_MAX];
+
+    /* load figures are published by the owning thread and may be read by any shard */
+    uint32_t num_friends;
+    uint32_t num_online;
+    uint32_t num_groups;
+
+    pthread_mutex_t address_lock;
+    uint8_t address[TOX_ADDRESS_SIZE];
+
+    /* keys kicked on other shards, waiting for the owning thread to delete their friends */
+    pthread_mutex_t kick_lock;
+    uint8_t *kicks;    /* num_kicks * TOX_PUBLIC_KEY_SIZE */
+    uint32_t num_kicks;
+};
+
+extern struct Shard Shards[MAX_NUM_SHARDS];
+extern int Num_Shards;
+
+/* Returns the index of the shard with the fewest friends. */
+int least_loaded_shard(void);
+
+/* Copies the Tox address of shard into address. */
+void shard_get_address(int shard, uint8_t *address);
+
+/* Asks every other shard to delete its friend with public_key on its next loop iteration. */
+void shard_kick_key(const uint8_t *public_key);
+
 int save_data(Tox *m, const char *path);
 bool friend_is_master(Tox *m, uint32_t friendnumber);
 
+/*
+ * Saves list to its file on a worker thread, after an in-memory change. The key lists are
+ * shared by every shard, so their changes are not journaled.
+ */
+struct Key_List;
+void keylist_persist(struct Key_List *list);
+
+/*
+ * Adds public_key to the blocklist, saves it, and deletes the friend with that key if
+ * there is one. Returns false if the key was already blocked.
+ */
+bool block_key(Tox *m, const uint8_t *public_key);
+
+/*
+ * Adds friendnumber's public key to the blocklist and deletes the friend.
+ *
+ * Returns 0 on success.
+ * Returns -1 on failure.
+ */
+int block_friend(Tox *m, uint32_t friendnumber);
+
+/* Puts friendnumber's name in name, which must hold TOX_MAX_NAME_LENGTH bytes. The name is
+ * only looked up when records at level are being logged; otherwise it is left empty. */
+void get_friend_log_name(Tox *m, uint32_t friendnumber, char *name, Log_Level level);
+
 #endif /* TOXBOT_H */
@@ -0,0 +1,513 @@
+/*  trigger.c
+ *
+ *
+ *  Copyright (C) 2014 toxbot All Rights Reserved.
+ *
+ *  This file is part of toxbot.
+ *
+ *  toxbot is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  toxbot is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with toxbot. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <limits.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <tox/tox.h>
+
+#include "toxbot.h"
+#include "trigger.h"
+#include "acmatch.h"
+#include "groupchats.h"
+#include "commands.h"
+#include "friends.h"
+#include "bridge.h"
+#include "worker.h"
+#include "metrics.h"
+#include "misc.h"
+#include "log.h"
+
+extern __thread struct Tox_Bot Tox_Bot;
+
+typedef enum {
+    TRIGGER_REPLY,
+    TRIGGER_INVITE,
+    TRIGGER_FLAG,
+} Trigger_Action;
+
+struct Trigger {
+    Trigger_Action action;
+    char *response;    /* NULL if there is none */
+    uint16_t response_len;
+};
+
+/* The trigger that pattern i of the matcher belongs to is triggers[i]. */
+struct Trigger_Set {
+    struct AC_Matcher *matcher;
+    struct Trigger *triggers;
+    uint16_t num_triggers;
+};
+
+struct Trigger_Job {
+    char path[PATH_MAX];
+    time_t mtime;
+    off_t size;
+    bool changed;
+    struct Trigger_Set *set;    /* NULL if the file is gone or has no triggers */
+};
+
+struct Pending_Pattern {
+    char text[TRIGGER_MAX_PATTERN_LENGTH + 1];
+    size_t length;
+};
+
+static __thread struct Trigger_Set *Triggers;
+static __thread char Triggers_Path[PATH_MAX];
+static __thread time_t Triggers_Mtime;
+static __thread off_t Triggers_Size;
+static __thread bool Reload_In_Flight;
+static __thread uint64_t Last_Check;
+
+static uint64_t get_time_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void trigger_set_free(struct Trigger_Set *set)
+{
+    if (set == NULL) {
+        return;
+    }
+
+    uint16_t i;
+
+    for (i = 0; i < set->num_triggers; ++i) {
+        free(set->triggers[i].response);
+    }
+
+    free(set->triggers);
+    ac_free(set->matcher);
+    free(set);
+}
+
+/*
+ * Parses one line of the trigger file into trigger and pattern.
+ *
+ * Returns 0 on success.
+ * Returns -1 if the line is invalid.
+ */
+static int parse_trigger(const char *line, struct Trigger *trigger, struct Pending_Pattern *pattern)
+{
+    const char *p;
+
+    if (strncmp(line, "reply ", 6) == 0) {
+        trigger->action = TRIGGER_REPLY;
+        p = line + 6;
+    } else if (strncmp(line, "invite ", 7) == 0) {
+        trigger->action = TRIGGER_INVITE;
+        p = line + 7;
+    } else if (strncmp(line, "flag ", 5) == 0) {
+        trigger->action = TRIGGER_FLAG;
+        p = line + 5;
+    } else {
+        return -1;
+    }
+
+    while (*p == ' ') {
+        ++p;
+    }
+
+    const char *start = p;
+    const char *end;
+
+    if (*p == '"') {
+        start = ++p;
+        end = strchr(p, '"');
+
+        if (end == NULL) {
+            return -1;
+        }
+
+        p = end + 1;
+    } else {
+        end = p + strcspn(p, " ");
+        p = end;
+    }
+
+    size_t length = end - start;
+
+    if (length == 0 || length > TRIGGER_MAX_PATTERN_LENGTH) {
+        return -1;
+    }
+
+    memcpy(pattern->text, start, length);
+    pattern->text[length] = '\0';
+    pattern->length = length;
+
+    while (*p == ' ') {
+        ++p;
+    }
+
+    trigger->response = NULL;
+    trigger->response_len = utf8_cut(p, strlen(p), TOX_MAX_MESSAGE_LENGTH);
+
+    if (trigger->response_len > 0 && trigger->action != TRIGGER_FLAG) {
+        trigger->response = malloc(trigger->response_len);
+
+        if (trigger->response == NULL) {
+            exit(EXIT_FAILURE);
+        }
+
+        memcpy(trigger->response, p, trigger->response_len);
+    } else {
+        trigger->response_len = 0;
+    }
+
+    if (trigger->action == TRIGGER_REPLY && trigger->response == NULL) {
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Builds the automaton for patterns. Returns NULL if the patterns are too long in total. */
+static struct Trigger_Set *trigger_set_build(struct Trigger *triggers, const struct Pending_Pattern *patterns,
+        uint16_t num_triggers)
+{
+    struct AC_Pattern *ac_patterns = malloc(num_triggers * sizeof(struct AC_Pattern));
+    struct Trigger_Set *set = calloc(1, sizeof(struct Trigger_Set));
+
+    if (ac_patterns == NULL || set == NULL) {
+        exit(EXIT_FAILURE);
+    }
+
+    uint16_t i;
+
+    for (i = 0; i < num_triggers; ++i) {
+        ac_patterns[i].text = patterns[i].text;
+        ac_patterns[i].length = patterns[i].length;
+    }
+
+    set->triggers = triggers;
+    set->num_triggers = num_triggers;
+    set->matcher = ac_build(ac_patterns, num_triggers);
+    free(ac_patterns);
+
+    if (set->matcher == NULL) {
+        trigger_set_free(set);
+        return NULL;
+    }
+
+    return set;
+}
+
+/* Reads path and builds its automaton. Returns NULL if there are no valid triggers. */
+static struct Trigger_Set *trigger_set_load(const char *path)
+{
+    FILE *fp = fopen(path, "r");
+
+    if (fp == NULL) {
+        return NULL;
+    }
+
+    struct Trigger *triggers = NULL;
+    struct Pending_Pattern *patterns = NULL;
+    uint16_t num_triggers = 0;
+    char line[TOX_MAX_MESSAGE_LENGTH + TRIGGER_MAX_PATTERN_LENGTH + 16];
+
+    while (fgets(line, sizeof(line), fp) && num_triggers < UINT16_MAX) {
+        size_t len = strlen(line);
+
+        while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r')) {
+            line[--len] = '\0';
+        }
+
+        if (len == 0 || line[0] == '#') {
+            continue;
+        }
+
+        struct Trigger trigger;
+        struct Pending_Pattern pattern;
+
+        if (parse_trigger(line, &trigger, &pattern) == -1) {
+            log_write(LOG_LEVEL_WARNING, "Warning: ignoring invalid trigger in '%s': %s\n", path, line);
+            continue;
+        }
+
+        struct Trigger *tmp_triggers = realloc(triggers, (num_triggers + 1) * sizeof(struct Trigger));
+        struct Pending_Pattern *tmp_patterns = realloc(patterns, (num_triggers + 1) * sizeof(struct Pending_Pattern));
+
+        if (tmp_triggers == NULL || tmp_patterns == NULL) {
+            exit(EXIT_FAILURE);
+        }
+
+        triggers = tmp_triggers;
+        patterns = tmp_patterns;
+        triggers[num_triggers] = trigger;
+        patterns[num_triggers] = pattern;
+        ++num_triggers;
+    }
+
+    fclose(fp);
+
+    if (num_triggers == 0) {
+        free(patterns);
+        return NULL;
+    }
+
+    struct Trigger_Set *set = trigger_set_build(triggers, patterns, num_triggers);
+    free(patterns);
+
+    if (set == NULL) {
+        log_write(LOG_LEVEL_WARNING, "Warning: the patterns in '%s' are too long; ignoring the file\n", path);
+    }
+
+    return set;
+}
+
+static void reload_run(void *arg)
+{
+    struct Trigger_Job *job = arg;
+    struct stat st;
+
+    if (stat(job->path, &st) == -1) {
+        /* a deleted file drops the triggers we have */
+        job->changed = job->mtime != 0;
+        job->mtime = 0;
+        job->size = 0;
+        return;
+    }
+
+    if (st.st_mtime == job->mtime && st.st_size == job->size) {
+        return;
+    }
+
+    job->changed = true;
+    job->mtime = st.st_mtime;
+    job->size = st.st_size;
+    job->set = trigger_set_load(job->path);
+}
+
+/* Swaps the new automaton in on the shard thread, so matching never sees a half-built one. */
+static void reload_done(Tox *m, void *arg)
+{
+    struct Trigger_Job *job = arg;
+
+    Reload_In_Flight = false;
+
+    if (job->changed) {
+        trigger_set_free(Triggers);
+        Triggers = job->set;
+        Triggers_Mtime = job->mtime;
+        Triggers_Size = job->size;
+
+        if (Triggers) {
+            log_write(LOG_LEVEL_INFO, "Loaded %u triggers (%u states) from '%s'\n", Triggers->num_triggers,
+                      ac_num_states(Triggers->matcher), job->path);
+        }
+    }
+
+    free(job);
+}
+
+void triggers_init(const char *path)
+{
+    snprintf(Triggers_Path, sizeof(Triggers_Path), "%s", path);
+    Last_Check = 0;
+}
+
+void triggers_do(Tox *m)
+{
+    if (Reload_In_Flight || Triggers_Path[0] == '\0') {
+        return;
+    }
+
+    uint64_t cur_time = (uint64_t) time(NULL);
+
+    if (!timed_out(Last_Check, cur_time, TRIGGER_RELOAD_INTERVAL)) {
+        return;
+    }
+
+    Last_Check = cur_time;
+
+    struct Trigger_Job *job = calloc(1, sizeof(struct Trigger_Job));
+
+    if (job == NULL) {
+        return;
+    }
+
+    snprintf(job->path, sizeof(job->path), "%s", Triggers_Path);
+    job->mtime = Triggers_Mtime;
+    job->size = Triggers_Size;
+
+    if (worker_submit(reload_run, reload_done, job) == -1) {
+        free(job);
+        return;
+    }
+
+    Reload_In_Flight = true;
+}
+
+/* Takes one response from the group's bucket. Returns false if the group is over its rate. */
+static bool group_take_token(struct Group_Chat *chat)
+{
+    uint64_t now = get_time_ms();
+
+    if (chat->trigger_refill == 0) {
+        chat->trigger_tokens = TRIGGER_BURST * 1000;
+    } else {
+        uint64_t refill = (now - chat->trigger_refill) / TRIGGER_RATE_INTERVAL;    /* ms / s == thousandths */
+        chat->trigger_tokens = (uint32_t) MIN((uint64_t) chat->trigger_tokens + refill, TRIGGER_BURST * 1000);
+    }
+
+    chat->trigger_refill = now;
+
+    if (chat->trigger_tokens < 1000) {
+        return false;
+    }
+
+    chat->trigger_tokens -= 1000;
+    return true;
+}
+
+static void send_to_group(Tox *m, uint32_t groupnum, const char *text, size_t length)
+{
+    TOX_ERR_CONFERENCE_SEND_MESSAGE err;
+
+    if (!tox_conference_send_message(m, groupnum, TOX_MESSAGE_TYPE_NORMAL, (const uint8_t *) text, length, &err)) {
+        log_write(LOG_LEVEL_WARNING, "Failed to send trigger response to group %u (error %d)\n", groupnum, err);
+    }
+}
+
+static void notify_masters(Tox *m, const char *text, size_t length)
+{
+    size_t i, numfriends = tox_self_get_friend_list_size(m);
+
+    if (numfriends == 0) {
+        return;
+    }
+
+    uint32_t friend_list[numfriends];
+    tox_self_get_friend_list(m, friend_list);
+
+    for (i = 0; i < numfriends; ++i) {
+        if (friends_flag(friend_list[i], FRIEND_FLAG_ONLINE) && friends_flag(friend_list[i], FRIEND_FLAG_MASTER)) {
+            tox_friend_send_message(m, friend_list[i], TOX_MESSAGE_TYPE_NORMAL, (const uint8_t *) text, length, NULL);
+        }
+    }
+}
+
+static void run_trigger(Tox *m, const struct Trigger *trigger, uint32_t groupnum, uint32_t peernum,
+                        const uint8_t *message, size_t length)
+{
+    const struct Group_Peer *peer = group_peer(groupnum, peernum);
+    const char *name = peer && peer->name_len ? peer->name : "???";
+
+    switch (trigger->action) {
+        case TRIGGER_REPLY:
+            send_to_group(m, groupnum, trigger->response, trigger->response_len);
+            break;
+
+        case TRIGGER_INVITE: {
+            uint32_t friendnum = peer ? friends_find(peer->public_key) : UINT32_MAX;
+            TOX_ERR_CONFERENCE_INVITE err;
+
+            if (friendnum != UINT32_MAX) {
+                Invite_Result result = invite_friend(m, friendnum, Tox_Bot.default_groupnum, NULL, &err);
+
+                if (result == INVITE_OK || result == INVITE_DEFERRED) {
+                    break;
+                }
+            }
+
+            if (trigger->response) {
+                send_to_group(m, groupnum, trigger->response, trigger->response_len);
+            }
+
+            break;
+        }
+
+        case TRIGGER_FLAG: {
+            char text[TOX_MAX_MESSAGE_LENGTH];
+            int ret = snprintf(text, sizeof(text), "Flagged in group %u by %s: ", groupnum, name);
+
+            if (ret < 0 || ret >= sizeof(text)) {
+                break;
+            }
+
+            size_t text_len = ret + utf8_cut((const char *) message, length, sizeof(text) - ret);
+            memcpy(text + ret, message, text_len - ret);
+            notify_masters(m, text, text_len);
+            log_write(LOG_LEVEL_WARNING, "%.*s\n", (int) text_len, text);
+            break;
+        }
+    }
+}
+
+void triggers_on_message(Tox *m, uint32_t groupnum, uint32_t peernum, const uint8_t *message, size_t length)
+{
+    const struct Trigger_Set *set = Triggers;
+
+    if (set == NULL) {
+        return;
+    }
+
+    /* never answer ourselves or another bot's relays */
+    if (tox_conference_peer_number_is_ours(m, groupnum, peernum, NULL) || bridge_is_relayed(message, length)) {
+        return;
+    }
+
+    uint16_t fired[TRIGGER_MAX_ACTIONS];
+    int num_fired = ac_match(set->matcher, message, length, fired, TRIGGER_MAX_ACTIONS);
+
+    if (num_fired == 0) {
+        return;
+    }
+
+    metrics_add(METRIC_TRIGGER_MATCHES, num_fired);
+
+    int idx = group_index(groupnum);
+
+    if (idx == -1) {
+        return;
+    }
+
+    int j;
+
+    for (j = 0; j < num_fired; ++j) {
+        if (!group_take_token(&Tox_Bot.g_chats[idx])) {
+            metrics_inc(METRIC_TRIGGER_RATE_LIMITED);
+            continue;
+        }
+
+        run_trigger(m, &set->triggers[fired[j]], groupnum, peernum, message, length);
+    }
+}
+
+void triggers_free(void)
+{
+    trigger_set_free(Triggers);
+    Triggers = NULL;
+    Triggers_Mtime = 0;
+    Triggers_Size = 0;
+    Reload_In_Flight = false;
+}
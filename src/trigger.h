@@ -0,0 +1,59 @@
+/*  trigger.h
+ *
+ *
+ *  Copyright (C) 2014 toxbot All Rights Reserved.
+ *
+ *  This file is part of toxbot.
+ *
+ *  toxbot is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  toxbot is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with toxbot. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef TRIGGER_H
+#define TRIGGER_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <tox/tox.h>
+
+#define TRIGGER_MAX_PATTERN_LENGTH  128
+#define TRIGGER_RELOAD_INTERVAL     5             /* seconds between checks of the trigger file */
+#define TRIGGER_MAX_ACTIONS         2             /* per message */
+#define TRIGGER_RATE_INTERVAL       10            /* seconds per response, per group */
+#define TRIGGER_BURST               3
+
+/*
+ * Triggers are read from a file with one trigger per line:
+ *
+ *   reply <pattern> <response>     posts response to the group
+ *   invite <pattern> [response]    invites the sender to the default group if they are a
+ *                                  friend, otherwise posts response if there is one
+ *   flag <pattern>                 forwards the message to every online master
+ *
+ * A pattern with spaces must be enclosed in double quotes. Patterns match anywhere in a
+ * message and ignore ASCII case. Lines starting with # are ignored.
+ */
+
+/* Starts watching path. The triggers are loaded on a worker thread shortly after. */
+void triggers_init(const char *path);
+
+/* Checks the trigger file for changes every few seconds. Call once per loop iteration. */
+void triggers_do(Tox *m);
+
+/* Runs the actions of every trigger found in a conference message. */
+void triggers_on_message(Tox *m, uint32_t groupnum, uint32_t peernum, const uint8_t *message, size_t length);
+
+void triggers_free(void);
+
+#endif /* TRIGGER_H */
@@ -0,0 +1,253 @@
+/*  triggerbench.c
+ *
+ *
+ *  Copyright (C) 2014 toxbot All Rights Reserved.
+ *
+ *  This file is part of toxbot.
+ *
+ *  toxbot is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  toxbot is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with toxbot. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * toxbot-triggerbench: compares the Aho-Corasick matcher used for group triggers (see
+ * acmatch.h) with checking every pattern in turn with strstr, on synthetic chat messages.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "acmatch.h"
+
+#define BENCH_NUM_MESSAGES   20000
+#define BENCH_MAX_MESSAGE    256
+#define BENCH_ROUNDS         5
+#define BENCH_MAX_HITS       2    /* TRIGGER_MAX_ACTIONS */
+
+static const uint16_t pattern_counts[] = {1, 10, 100, 1000, 4000};
+
+static uint64_t get_time_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static uint32_t rng_state = 2463534242;
+
+static uint32_t rng(void)
+{
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 17;
+    rng_state ^= rng_state << 5;
+    return rng_state;
+}
+
+/* Writes a random lower case word of 3 to 9 letters to buf. Returns its length. */
+static size_t random_word(char *buf)
+{
+    size_t len = 3 + rng() % 7;
+    size_t i;
+
+    for (i = 0; i < len; ++i) {
+        buf[i] = 'a' + rng() % 26;
+    }
+
+    return len;
+}
+
+static void print_usage(const char *name)
+{
+    fprintf(stderr, "usage: %s [messages]\n", name);
+}
+
+/* Returns the number of messages with at least one match; the naive loop lower-cases each message first. */
+static size_t run_naive(char **patterns, uint16_t num_patterns, char **messages, size_t num_messages)
+{
+    size_t matched = 0;
+    size_t i;
+
+    for (i = 0; i < num_messages; ++i) {
+        char lowered[BENCH_MAX_MESSAGE + 1];
+        size_t j;
+
+        for (j = 0; messages[i][j]; ++j) {
+            char c = messages[i][j];
+            lowered[j] = c >= 'A' && c <= 'Z' ? c + ('a' - 'A') : c;
+        }
+
+        lowered[j] = '\0';
+
+        int hits = 0;
+        uint16_t k;
+
+        for (k = 0; k < num_patterns && hits < BENCH_MAX_HITS; ++k) {
+            if (strstr(lowered, patterns[k])) {
+                ++hits;
+            }
+        }
+
+        matched += hits > 0;
+    }
+
+    return matched;
+}
+
+static size_t run_ac(const struct AC_Matcher *ac, char **messages, const size_t *lengths, size_t num_messages)
+{
+    size_t matched = 0;
+    size_t i;
+
+    for (i = 0; i < num_messages; ++i) {
+        uint16_t hits[BENCH_MAX_HITS];
+        matched += ac_match(ac, (const uint8_t *) messages[i], lengths[i], hits, BENCH_MAX_HITS) > 0;
+    }
+
+    return matched;
+}
+
+int main(int argc, char **argv)
+{
+    size_t num_messages = BENCH_NUM_MESSAGES;
+
+    if (argc > 2 || (argc == 2 && (num_messages = strtoul(argv[1], NULL, 10)) == 0)) {
+        print_usage(argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    uint16_t max_patterns = pattern_counts[sizeof(pattern_counts) / sizeof(pattern_counts[0]) - 1];
+    char **patterns = malloc(max_patterns * sizeof(char *));
+    char **messages = malloc(num_messages * sizeof(char *));
+    size_t *lengths = malloc(num_messages * sizeof(size_t));
+
+    if (patterns == NULL || messages == NULL || lengths == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+
+    uint16_t i;
+
+    for (i = 0; i < max_patterns; ++i) {
+        char word[16];
+        size_t len = random_word(word);
+        word[len] = '\0';
+        patterns[i] = strdup(word);
+
+        if (patterns[i] == NULL) {
+            fprintf(stderr, "Out of memory\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    /* messages of random words in mixed case; about one in ten quotes a pattern */
+    size_t total_bytes = 0;
+    size_t n;
+
+    for (n = 0; n < num_messages; ++n) {
+        char *msg = malloc(BENCH_MAX_MESSAGE + 1);
+
+        if (msg == NULL) {
+            fprintf(stderr, "Out of memory\n");
+            exit(EXIT_FAILURE);
+        }
+
+        size_t target = 16 + rng() % (BENCH_MAX_MESSAGE - 32);
+        size_t len = 0;
+
+        while (len + 11 < target) {
+            if (rng() % 100 == 0) {
+                const char *p = patterns[rng() % max_patterns];
+                size_t plen = strlen(p);
+                memcpy(msg + len, p, plen);
+                len += plen;
+            } else {
+                len += random_word(msg + len);
+            }
+
+            if (rng() % 8 == 0) {
+                msg[len - 1] -= 'a' - 'A';
+            }
+
+            msg[len++] = ' ';
+        }
+
+        msg[len] = '\0';
+        messages[n] = msg;
+        lengths[n] = len;
+        total_bytes += len;
+    }
+
+    printf("%zu messages, %zu bytes, best of %d rounds\n\n", num_messages, total_bytes, BENCH_ROUNDS);
+    printf("%8s %8s %14s %14s %10s\n", "patterns", "states", "strstr MB/s", "ac MB/s", "speedup");
+
+    size_t c;
+
+    for (c = 0; c < sizeof(pattern_counts) / sizeof(pattern_counts[0]); ++c) {
+        uint16_t num_patterns = pattern_counts[c];
+        struct AC_Pattern *ac_patterns = malloc(num_patterns * sizeof(struct AC_Pattern));
+
+        if (ac_patterns == NULL) {
+            fprintf(stderr, "Out of memory\n");
+            exit(EXIT_FAILURE);
+        }
+
+        for (i = 0; i < num_patterns; ++i) {
+            ac_patterns[i].text = patterns[i];
+            ac_patterns[i].length = strlen(patterns[i]);
+        }
+
+        struct AC_Matcher *ac = ac_build(ac_patterns, num_patterns);
+        free(ac_patterns);
+
+        if (ac == NULL) {
+            fprintf(stderr, "%u patterns need too many states\n", num_patterns);
+            continue;
+        }
+
+        uint64_t best_naive = UINT64_MAX, best_ac = UINT64_MAX;
+        size_t matched_naive = 0, matched_ac = 0;
+        int r;
+
+        for (r = 0; r < BENCH_ROUNDS; ++r) {
+            uint64_t start = get_time_us();
+            matched_naive = run_naive(patterns, num_patterns, messages, num_messages);
+            uint64_t mid = get_time_us();
+            matched_ac = run_ac(ac, messages, lengths, num_messages);
+            uint64_t end = get_time_us();
+
+            best_naive = mid - start < best_naive ? mid - start : best_naive;
+            best_ac = end - mid < best_ac ? end - mid : best_ac;
+        }
+
+        if (matched_naive != matched_ac) {
+            fprintf(stderr, "Mismatch with %u patterns: strstr matched %zu messages, ac matched %zu\n",
+                    num_patterns, matched_naive, matched_ac);
+            exit(EXIT_FAILURE);
+        }
+
+        best_naive = best_naive ? best_naive : 1;
+        best_ac = best_ac ? best_ac : 1;
+
+        double mb = total_bytes / 1e6;
+        printf("%8u %8u %14.1f %14.1f %9.1fx\n", num_patterns, ac_num_states(ac), mb / (best_naive / 1e6),
+               mb / (best_ac / 1e6), (double) best_naive / best_ac);
+
+        ac_free(ac);
+    }
+
+    return 0;
+}
@@ -0,0 +1,203 @@
+/*  worker.c
+ *
+ *
+ *  Copyright (C) 2014 toxbot All Rights Reserved.
+ *
+ *  This file is part of toxbot.
+ *
+ *  toxbot is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  toxbot is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with toxbot. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <semaphore.h>
+
+#include <tox/tox.h>
+
+#include "worker.h"
+#include "queue.h"
+#include "log.h"
+
+#define JOB_QUEUE_SIZE 1024
+#define COMPLETION_QUEUE_SIZE 1024
+
+struct Job {
+    worker_run_cb *run;
+    worker_done_cb *done;
+    void *arg;
+    struct Queue *completions;    /* the submitting thread's completion queue */
+};
+
+static struct {
+    pthread_t threads[MAX_NUM_WORKERS];
+    int num_workers;
+    struct Queue jobs;    /* MPMC: every Tox thread submits, every worker takes */
+    sem_t pending;
+    bool running;
+} Pool;
+
+/* MPSC: workers post completed jobs, the owning Tox thread drains them */
+static __thread struct Queue *Completions;
+static __thread size_t Outstanding;
+
+static void *worker_loop(void *arg)
+{
+    for (;;) {
+        sem_wait(&Pool.pending);
+
+        struct Job *job;
+
+        if (!queue_pop(&Pool.jobs, &job)) {
+            if (!__atomic_load_n(&Pool.running, __ATOMIC_ACQUIRE)) {
+                break;
+            }
+
+            continue;
+        }
+
+        job->run(job->arg);
+
+        if (job->done == NULL) {
+            free(job);
+            continue;
+        }
+
+        /* completions are never dropped; wait for the Tox thread to make room */
+        while (!queue_push(job->completions, &job)) {
+            usleep(1000);
+        }
+    }
+
+    return NULL;
+}
+
+int worker_pool_init(int num_workers)
+{
+    if (queue_init(&Pool.jobs, JOB_QUEUE_SIZE, sizeof(struct Job *)) == -1) {
+        return -1;
+    }
+
+    sem_init(&Pool.pending, 0, 0);
+    Pool.running = true;
+
+    for (Pool.num_workers = 0; Pool.num_workers < num_workers; ++Pool.num_workers) {
+        if (pthread_create(&Pool.threads[Pool.num_workers], NULL, worker_loop, NULL) != 0) {
+            log_write(LOG_LEVEL_WARNING, "Failed to start worker thread %d\n", Pool.num_workers);
+            worker_pool_shutdown();
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+void worker_pool_shutdown(void)
+{
+    __atomic_store_n(&Pool.running, false, __ATOMIC_RELEASE);
+
+    int i;
+
+    /* one wakeup per worker beyond the jobs still queued makes each of them exit once idle */
+    for (i = 0; i < Pool.num_workers; ++i) {
+        sem_post(&Pool.pending);
+    }
+
+    for (i = 0; i < Pool.num_workers; ++i) {
+        pthread_join(Pool.threads[i], NULL);
+    }
+
+    Pool.num_workers = 0;
+    sem_destroy(&Pool.pending);
+    queue_free(&Pool.jobs);
+}
+
+int worker_thread_init(void)
+{
+    Completions = malloc(sizeof(struct Queue));
+
+    if (Completions == NULL) {
+        return -1;
+    }
+
+    if (queue_init(Completions, COMPLETION_QUEUE_SIZE, sizeof(struct Job *)) == -1) {
+        free(Completions);
+        Completions = NULL;
+        return -1;
+    }
+
+    Outstanding = 0;
+    return 0;
+}
+
+void worker_thread_cleanup(Tox *m)
+{
+    if (Completions == NULL) {
+        return;
+    }
+
+    while (Outstanding > 0) {
+        worker_do_completions(m, MAX_COMPLETIONS_PER_ITERATION);
+        usleep(1000);
+    }
+
+    queue_free(Completions);
+    free(Completions);
+    Completions = NULL;
+}
+
+int worker_submit(worker_run_cb *run, worker_done_cb *done, void *arg)
+{
+    if (done && Completions == NULL) {
+        return -1;
+    }
+
+    struct Job *job = malloc(sizeof(struct Job));
+
+    if (job == NULL) {
+        return -1;
+    }
+
+    job->run = run;
+    job->done = done;
+    job->arg = arg;
+    job->completions = Completions;
+
+    if (!queue_push(&Pool.jobs, &job)) {
+        free(job);
+        return -1;
+    }
+
+    if (done) {
+        ++Outstanding;
+    }
+
+    sem_post(&Pool.pending);
+    return 0;
+}
+
+void worker_do_completions(Tox *m, int max)
+{
+    struct Job *job;
+
+    while (max-- > 0 && queue_pop(Completions, &job)) {
+        --Outstanding;
+        job->done(m, job->arg);
+        free(job);
+    }
+}
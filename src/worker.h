@@ -0,0 +1,75 @@
+/*  worker.h
+ *
+ *
+ *  Copyright (C) 2014 toxbot All Rights Reserved.
+ *
+ *  This file is part of toxbot.
+ *
+ *  toxbot is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  toxbot is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with toxbot. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef WORKER_H
+#define WORKER_H
+
+#include <tox/tox.h>
+
+#define MAX_NUM_WORKERS 16
+#define DEFAULT_NUM_WORKERS 2
+
+/* Maximum number of completions a Tox thread handles per loop iteration. */
+#define MAX_COMPLETIONS_PER_ITERATION 16
+
+/* Runs on a worker thread. Must not touch the Tox instance. */
+typedef void worker_run_cb(void *arg);
+
+/* Runs on the Tox thread that submitted the job, after run has returned. Owns arg. */
+typedef void worker_done_cb(Tox *m, void *arg);
+
+/*
+ * Starts num_workers background threads for blocking I/O.
+ *
+ * Returns 0 on success.
+ * Returns -1 on failure.
+ */
+int worker_pool_init(int num_workers);
+
+/* Finishes all queued jobs and stops the workers. */
+void worker_pool_shutdown(void);
+
+/*
+ * Prepares the calling Tox thread to submit jobs and receive their completions.
+ *
+ * Returns 0 on success.
+ * Returns -1 on failure.
+ */
+int worker_thread_init(void);
+
+/* Waits for every job submitted by the calling thread to complete, then releases its queue. */
+void worker_thread_cleanup(Tox *m);
+
+/*
+ * Queues run(arg) for a worker thread. If done is non-NULL it is later called with arg
+ * from worker_do_completions() on the submitting thread; otherwise run must free arg.
+ *
+ * Returns 0 on success.
+ * Returns -1 if the job queue is full, or if done is set and the calling thread has no
+ * completion queue; arg is left untouched.
+ */
+int worker_submit(worker_run_cb *run, worker_done_cb *done, void *arg);
+
+/* Handles at most max finished jobs for the calling thread. Never blocks. */
+void worker_do_completions(Tox *m, int max);
+
+#endif /* WORKER_H */